@@ -24,6 +24,7 @@ import sys
 import os
 import stat
 import time
+import hashlib
 
 code = """static int scmp(const char *a, const char *b) {
   while (*a && (*a == *b)) a++, b++;
@@ -97,7 +98,10 @@ def main(argv):
         if argv[i] == "-s":
             i += 1
             continue
-        st = os.stat(argv[i])
+        # mongoose derives the ETag from mtime and size; store a content hash instead of
+        # the file time, so the ETag only changes when the content does
+        with open(argv[i], "rb") as fp:
+            tag = int.from_bytes(hashlib.sha256(fp.read()).digest()[:4], 'big') & 0x7fffffff
         name = argv[i]
         n = len(strip_prefix)
         if argv[i] == "-s":
@@ -105,7 +109,7 @@ def main(argv):
             continue
         if name.startswith(strip_prefix):
             name = name[n:]
-        print("  {\"/%s\", v%d, sizeof(v%d), %lu}," % (name, i + 1, i + 1, st.st_mtime))
+        print("  {\"/%s\", v%d, sizeof(v%d), %lu}," % (name, i + 1, i + 1, tag))
         i += 1
 
     print("  {NULL, NULL, 0, 0}")
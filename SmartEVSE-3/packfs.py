@@ -1,5 +1,5 @@
 #this script will be run by platformio.ini from its native directory
-import os, sys, gzip, shutil, re
+import os, sys, gzip, shutil, re, hashlib
 
 # Asset minification during packing
 # --------------------------------
@@ -50,6 +50,45 @@ def minify_html(content):
         content = content.replace("___HTML_BLOCK_" + str(i) + "___", block)
     return content + "\n"
 
+# Caching
+# -------
+# The gzip streams are written with mtime 0 and pack.py stores a content hash as the
+# file time, so the ETag mongoose sends only changes when an asset changes and a
+# reload of the page is answered with 304 Not Modified.
+# References from index.html to the other static assets get a ?v=<hash> query; the
+# firmware serves such urls as immutable, so the browser does not even revalidate them.
+#
+# Set PACK_BROTLI=1 (needs the python brotli module) to also pack brotli variants of
+# the html/css/js assets. They are served to browsers that accept br; this costs
+# flash space for the extra copies.
+
+def gzip_write(filename, data):
+    with open(filename, 'wb') as f_raw, gzip.GzipFile(fileobj=f_raw, mode='wb', mtime=0) as f_out:
+        f_out.write(data)
+
+def asset_version(filename):
+    with open(filename, 'rb') as f_in:
+        return hashlib.sha256(f_in.read()).hexdigest()[:8]
+
+def version_references(content, versions):
+    # styling.css -> styling.css?v=1a2b3c4d in href/src attributes
+    for name, version in versions.items():
+        content = re.sub(r'((?:href|src)=")' + re.escape(name) + '"', r'\g<1>' + name + '?v=' + version + '"', content)
+    return content
+
+brotli = None
+if os.environ.get("PACK_BROTLI"):
+    try:
+        import brotli
+    except ImportError:
+        print("PACK_BROTLI is set but the python brotli module is missing, packing gzip only")
+
+def brotli_write(filename, data, filelist):
+    if brotli is not None and os.path.splitext(filename)[1] in ('.html', '.css', '.js'):
+        with open('pack.tmp/data/' + filename + '.br', 'wb') as f_out:
+            f_out.write(brotli.compress(data, quality=11))
+        filelist.append('data/' + filename + '.br')
+
 #check for the two files we need to be able to keep updating the firmware by the /update endpoint:
 if not os.path.isfile("data/update2.html"):
     print("Missing file: data/update2.html")
@@ -59,6 +98,11 @@ if os.path.isdir("pack.tmp"):
 try:
     filelist = []
     os.makedirs('pack.tmp/data')
+    versions = {}
+    for file in os.listdir("data"):
+        filename = os.fsdecode(file)
+        if filename.endswith(('.css', '.js', '.webp', '.ico')):
+            versions[filename] = asset_version('data/' + filename)
     # now gzip the stuff except zones.csv since this file is not served by mongoose but directly accessed:
     for file in os.listdir("data"):
         filename = os.fsdecode(file)
@@ -71,17 +115,19 @@ try:
             with open('data/' + filename, 'r', encoding='utf-8') as f_in:
                 content = f_in.read()
             if filename == "index.html":
-                content = minify_html(content)
+                content = version_references(minify_html(content), versions)
             else:
                 content = minify_css(content)
-            with gzip.open('pack.tmp/data/' + filename + '.gz', 'wb') as f_out:
-                f_out.write(content.encode('utf-8'))
+            gzip_write('pack.tmp/data/' + filename + '.gz', content.encode('utf-8'))
             filelist.append('data/' + filename + '.gz')
+            brotli_write(filename, content.encode('utf-8'), filelist)
             continue
         else:
-            with open('data/' + filename, 'rb') as f_in, gzip.open('pack.tmp/data/' + filename + '.gz', 'wb') as f_out:
-                f_out.writelines(f_in)
+            with open('data/' + filename, 'rb') as f_in:
+                data = f_in.read()
+            gzip_write('pack.tmp/data/' + filename + '.gz', data)
             filelist.append('data/' + filename + '.gz')
+            brotli_write(filename, data, filelist)
             continue
     os.chdir('pack.tmp')
     cmdstring = 'python ../pack.py ' + ' '.join(filelist)
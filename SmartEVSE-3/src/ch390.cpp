@@ -21,8 +21,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_timer.h"
 #include "esp_rom_sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
 
 // ---------- Runtime state ----------
 bool EthPresent  = false;
@@ -58,6 +61,35 @@ static esp_err_t ch390_reg_write(uint8_t reg, uint8_t val) {
     return spi_device_polling_transmit(s_spi, &t);
 }
 
+// Read up to 4 bytes from one register address in a single transaction.
+// Used for MRCMDX, where the second byte of the burst is the settled value.
+static esp_err_t ch390_reg_read_n(uint8_t reg, uint8_t *val, uint8_t len) {
+    spi_transaction_t t = {};
+    t.cmd = CH390_SPI_RD;
+    t.addr = reg;
+    t.flags = SPI_TRANS_USE_RXDATA;
+    t.rxlength = len * 8;
+    t.length = 0;
+    esp_err_t ret = spi_device_polling_transmit(s_spi, &t);
+    if (ret == ESP_OK) memcpy(val, t.rx_data, len);
+    return ret;
+}
+
+// Register batch: a plain loop over ch390_reg_write() for a list of writes.
+// It saves nothing by itself; the writes are cheap because the caller holds
+// spi_lock with the bus acquired, so no transaction waits for bus arbitration.
+typedef struct {
+    uint8_t reg;
+    uint8_t val;
+} ch390_reg_val_t;
+
+static esp_err_t ch390_reg_write_batch(const ch390_reg_val_t *regs, size_t n) {
+    esp_err_t ret = ESP_OK;
+    for (size_t i = 0; i < n && ret == ESP_OK; i++)
+        ret = ch390_reg_write(regs[i].reg, regs[i].val);
+    return ret;
+}
+
 static esp_err_t ch390_mem_read(uint8_t *buf, uint32_t len) {
     spi_transaction_t t = {};
     t.cmd = CH390_SPI_RD;
@@ -77,6 +109,20 @@ static esp_err_t ch390_mem_write(const uint8_t *buf, uint32_t len) {
     return spi_device_polling_transmit(s_spi, &t);
 }
 
+// Waits inside a locked section. SPI3 is shared with the LCD and the CH32
+// (etherlcd.cpp), so the bus is released while we wait and acquired again after.
+static void ch390_bus_wait_us(uint32_t us) {
+    spi_device_release_bus(s_spi);
+    esp_rom_delay_us(us);
+    spi_device_acquire_bus(s_spi, portMAX_DELAY);
+}
+
+static void ch390_bus_wait_ms(uint32_t ms) {
+    spi_device_release_bus(s_spi);
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    spi_device_acquire_bus(s_spi, portMAX_DELAY);
+}
+
 // ---------- Internal PHY register access ----------
 
 static esp_err_t ch390_phy_reg_read(uint8_t phy_reg, uint16_t *val) {
@@ -86,7 +132,7 @@ static esp_err_t ch390_phy_reg_read(uint8_t phy_reg, uint16_t *val) {
     uint8_t epcr;
     uint32_t to = 0;
     do {
-        esp_rom_delay_us(100);
+        ch390_bus_wait_us(100);
         ch390_reg_read(CH390_EPCR, &epcr);
         to += 100;
     } while ((epcr & EPCR_ERRE) && to < 1000);
@@ -107,7 +153,7 @@ static esp_err_t ch390_phy_reg_write(uint8_t phy_reg, uint16_t val) {
     uint8_t epcr;
     uint32_t to = 0;
     do {
-        esp_rom_delay_us(100);
+        ch390_bus_wait_us(100);
         ch390_reg_read(CH390_EPCR, &epcr);
         to += 100;
     } while ((epcr & EPCR_ERRE) && to < 1000);
@@ -119,6 +165,24 @@ static esp_err_t ch390_phy_reg_write(uint8_t phy_reg, uint16_t val) {
 // MAC driver (esp_eth_mac_t implementation)
 // =====================================================================
 
+// RX frame buffers are a fixed pool of DMA blocks that the SPI read lands in directly.
+// Larger frames are handed to lwIP in their block (no copy) as a custom pbuf, whose free
+// callback puts the block back on the free list. Short frames are copied into a pbuf of
+// their own size, so they do not pin a whole block. lwIP may hold on to received frames
+// (e.g. out of order TCP segments), so once the free list runs low every frame is copied
+// into a heap pbuf and its block goes back at once; the pool then never runs dry.
+#define CH390_RX_BUF_SIZE   (1536 + CH390_RX_HDR_SIZE)
+#define CH390_RX_POOL_SIZE  8
+#define CH390_RX_POOL_RESERVE 2         // free blocks below which every frame is copied
+#define CH390_RX_COPY_MAX   256         // frames up to this size are copied
+#define CH390_RX_HEAD_READ  64          // minimum frame incl. CRC, read together with the header
+
+// TX pipeline: one frame transmitting, one staged in TX SRAM (3 KB holds two
+// full frames) and a few more waiting in RAM. Completion is signalled by the
+// PT interrupt, so transmit() never waits for the wire.
+#define CH390_TX_QUEUE_LEN  2
+#define CH390_TX_TIMEOUT_US 2000        // re-check TXREQ if PT was not seen after this
+
 typedef struct {
     esp_eth_mac_t parent;
     esp_eth_mediator_t *eth;
@@ -126,15 +190,66 @@ typedef struct {
     SemaphoreHandle_t spi_lock;
     uint8_t addr[6];
     bool flow_ctrl_enabled;
-    uint8_t *rx_buffer;
+    bool tx_busy;                           // a frame was handed to the wire, PT not yet seen
+    int64_t tx_start;                       // esp_timer time the current frame was issued
+    uint16_t tx_staged_len;                 // length of the frame waiting in TX SRAM, 0 if none
+    uint8_t *tx_queue[CH390_TX_QUEUE_LEN];  // frames waiting for room in TX SRAM
+    uint16_t tx_queue_len[CH390_TX_QUEUE_LEN];
+    uint8_t tx_queue_head;
+    uint8_t tx_queue_count;
+    int64_t lock_start;                     // esp_timer time spi_lock was taken
+    ch390_stats_t stats;
+    volatile bool bench_active;             // loopback benchmark running, see ch390_loopback_start()
+    volatile uint32_t bench_rx;
+    uint64_t bench_latency_sum;
+    uint32_t bench_latency_max;
+    SemaphoreHandle_t bench_sem;            // given by the rx task per benchmark frame
 } emac_ch390_t;
 
 static emac_ch390_t *s_emac = NULL;
+
+typedef struct {
+    struct pbuf_custom p;                   // must be first, lwIP hands it back to ch390_rx_buf_free()
+    uint8_t *buf;
+} ch390_rx_buf_t;
+
+// The pool is allocated once and kept when the driver is deleted: lwIP may still hold blocks.
+static ch390_rx_buf_t s_rx_bufs[CH390_RX_POOL_SIZE];
+static QueueHandle_t s_rx_free = NULL;      // free list of s_rx_bufs entries
 static volatile bool s_force_link_down = false;
 
+// Counter updates and ch390_get_stats() share a spinlock of their own, so reading the
+// counters never waits for the SPI bus.
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+#define CH390_STAT(stmt) do { portENTER_CRITICAL(&s_stats_mux); stmt; portEXIT_CRITICAL(&s_stats_mux); } while (0)
 
-#define CH390_LOCK(emac)   xSemaphoreTake((emac)->spi_lock, portMAX_DELAY)
-#define CH390_UNLOCK(emac) xSemaphoreGive((emac)->spi_lock)
+
+// Lock/unlock also track how long spi_lock is held, see ch390_stats_t.
+// The bus is acquired with the lock, so the register accesses of a section run
+// as one burst of polling transactions. Sections that wait (reset, recovery,
+// PHY polls) release the bus meanwhile with ch390_bus_wait_us/ms().
+static inline void ch390_lock(emac_ch390_t *emac) {
+    xSemaphoreTake(emac->spi_lock, portMAX_DELAY);
+    spi_device_acquire_bus(s_spi, portMAX_DELAY);
+    emac->lock_start = esp_timer_get_time();
+}
+
+static inline void ch390_unlock(emac_ch390_t *emac) {
+    uint32_t held = (uint32_t)(esp_timer_get_time() - emac->lock_start);
+    CH390_STAT(emac->stats.lock_total_us += held;
+               if (held > emac->stats.lock_max_us) emac->stats.lock_max_us = held);
+    spi_device_release_bus(s_spi);
+    xSemaphoreGive(emac->spi_lock);
+}
+
+#define CH390_LOCK(emac)   ch390_lock(emac)
+#define CH390_UNLOCK(emac) ch390_unlock(emac)
+
+// Loopback benchmark frames: sent to our own MAC with the IEEE local experimental
+// EtherType, carrying the esp_timer transmit time right after the header.
+#define CH390_BENCH_ETHERTYPE   0x88B5
+#define CH390_BENCH_WINDOW      4           // frames in flight
+#define CH390_BENCH_TIMEOUT_US  5000000
 
 // Internal stop/start helpers — caller must hold spi_lock.
 static void ch390_stop_locked(emac_ch390_t *emac) {
@@ -145,25 +260,71 @@ static void ch390_stop_locked(emac_ch390_t *emac) {
 }
 
 static void ch390_start_locked(emac_ch390_t *emac) {
-    ch390_reg_write(CH390_MPTRCR, MPTRCR_RST_RX);
-    ch390_reg_write(CH390_ISR, ISR_CLR_STATUS);
-    ch390_reg_write(CH390_IMR, IMR_PAR | IMR_ROOI | IMR_ROI | IMR_PRI);
+    static const ch390_reg_val_t start[] = {
+        { CH390_MPTRCR, MPTRCR_RST_RX },
+        { CH390_ISR,    ISR_CLR_STATUS },
+        { CH390_IMR,    IMR_PAR | IMR_ROOI | IMR_ROI | IMR_PTI | IMR_PRI },
+    };
+    ch390_reg_write_batch(start, sizeof(start) / sizeof(start[0]));
     uint8_t rcr;
     ch390_reg_read(CH390_RCR, &rcr);
     ch390_reg_write(CH390_RCR, rcr | RCR_RXEN);
 }
 
+// Start transmission of the frame already written to TX SRAM. Caller must hold spi_lock.
+static void ch390_tx_issue_locked(emac_ch390_t *emac, uint16_t length) {
+    const ch390_reg_val_t issue[] = {
+        { CH390_TXPLL, (uint8_t)(length & 0xFF) },
+        { CH390_TXPLH, (uint8_t)((length >> 8) & 0xFF) },
+        { CH390_TCR,   TCR_TXREQ },
+    };
+    ch390_reg_write_batch(issue, sizeof(issue) / sizeof(issue[0]));
+    emac->tx_busy = true;
+    emac->tx_start = esp_timer_get_time();
+}
+
+// Previous transmit finished: issue the staged frame and stage the next queued
+// one behind it, so the chip always has the next frame ready. Caller must hold spi_lock.
+static void ch390_tx_done_locked(emac_ch390_t *emac) {
+    emac->tx_busy = false;
+    if (!emac->tx_staged_len) return;
+    ch390_tx_issue_locked(emac, emac->tx_staged_len);
+    emac->tx_staged_len = 0;
+    if (emac->tx_queue_count) {
+        uint8_t i = emac->tx_queue_head;
+        ch390_mem_write(emac->tx_queue[i], emac->tx_queue_len[i]);
+        emac->tx_staged_len = emac->tx_queue_len[i];
+        emac->tx_queue_head = (i + 1) % CH390_TX_QUEUE_LEN;
+        emac->tx_queue_count--;
+    }
+}
+
+// Fallback for a missed PT interrupt: if the current frame has been on the wire
+// longer than expected, check TXREQ directly. Caller must hold spi_lock.
+static void ch390_tx_check_locked(emac_ch390_t *emac) {
+    if (!emac->tx_busy || (esp_timer_get_time() - emac->tx_start) < CH390_TX_TIMEOUT_US) return;
+    uint8_t tcr;
+    ch390_reg_read(CH390_TCR, &tcr);
+    if (!(tcr & TCR_TXREQ)) ch390_tx_done_locked(emac);
+}
+
 // Drop a received frame by advancing the RX SRAM read pointer past it.
 // Caller must hold spi_lock.
-static void ch390_drop_frame(uint16_t length) {
+// `length` is relative to the current read pointer and may be negative when
+// more than the frame was already read.
+static void ch390_drop_frame(int32_t length) {
     uint8_t mrrh, mrrl;
     ch390_reg_read(CH390_MRRH, &mrrh);
     ch390_reg_read(CH390_MRRL, &mrrl);
-    uint16_t addr = (mrrh << 8) | mrrl;
+    int32_t addr = (mrrh << 8) | mrrl;
     addr += length;  // includes 4B header already consumed
-    if (addr >= 0x4000) addr -= 0x3400;
-    ch390_reg_write(CH390_MRRH, addr >> 8);
-    ch390_reg_write(CH390_MRRL, addr & 0xFF);
+    if (addr >= 0x4000) addr -= 0x3400;     // RX SRAM is 0x0C00-0x3FFF
+    else if (addr < 0x0C00) addr += 0x3400;
+    const ch390_reg_val_t mrr[] = {
+        { CH390_MRRH, (uint8_t)(addr >> 8) },
+        { CH390_MRRL, (uint8_t)(addr & 0xFF) },
+    };
+    ch390_reg_write_batch(mrr, 2);
 }
 
 // Full software reset + register reinit. Caller must hold spi_lock.
@@ -174,7 +335,7 @@ static bool ch390_reset_and_reinit_locked(emac_ch390_t *emac) {
     ch390_reg_write(CH390_NCR, NCR_RST);
     bool reset_ok = false;
     for (int i = 0; i < 100; i++) {
-        vTaskDelay(pdMS_TO_TICKS(2));
+        ch390_bus_wait_ms(2);
         uint8_t ncr;
         ch390_reg_read(CH390_NCR, &ncr);
         if (!(ncr & NCR_RST)) { reset_ok = true; break; }
@@ -185,35 +346,43 @@ static bool ch390_reset_and_reinit_locked(emac_ch390_t *emac) {
 
     // Power on internal PHY (reset clears GPR back to default)
     ch390_reg_write(CH390_GPR, 0x00);   // Bit 0 = PHYPD, 0 = PHY powered on
-    vTaskDelay(pdMS_TO_TICKS(10));       // mac and phy register won't be accessible within at least 1ms
-
-    ch390_reg_write(CH390_NCR, 0x00);
-    ch390_reg_write(CH390_WCR, 0x00);
-    ch390_reg_write(CH390_TCR, 0x00);
-    ch390_reg_write(CH390_RCR, RCR_DIS_CRC | RCR_ALL);
-    ch390_reg_write(CH390_TCR2, TCR2_RLCP);
-    ch390_reg_write(CH390_TCSCR, TCSCR_IPCSE | TCSCR_TCPCSE | TCSCR_UDPCSE);   // HW TX checksum
-    ch390_reg_write(CH390_RCSCSR, 0x00);
-    ch390_reg_write(CH390_INTCR, 0x00);            // INT pin: push-pull, active high
-    ch390_reg_write(CH390_INTCKCR, 0x00);          // Clear INT pin clock output
-    ch390_reg_write(CH390_RLENCR, RLENCR_RXLEN_EN | RLENCR_RXLEN_DEFAULT);  // RX length limit 1536
-    ch390_reg_write(CH390_NSR, NSR_WAKEST | NSR_TX2END | NSR_TX1END);
-
-    // Hardware flow-control
-    ch390_reg_write(CH390_BPTR, 0x3F);                              // Back pressure threshold
-    ch390_reg_write(CH390_FCTR, FCTR_HWOT(3) | FCTR_LWOT(8));       // High/low water marks
-    ch390_reg_write(CH390_FCR, FCR_FLOW_ENABLE);
-
-    // Clear multicast hash table and enable broadcast reception
-    ch390_reg_write(CH390_BCASTCR, 0x00);
-    for (int i = 0; i < 7; i++)
-        ch390_reg_write(CH390_MAR + i, 0x00);
-    ch390_reg_write(CH390_MAR + 7, 0x80);  // Enable broadcast packet reception
+    ch390_bus_wait_ms(10);               // mac and phy register won't be accessible within at least 1ms
+
+    static const ch390_reg_val_t init[] = {
+        { CH390_NCR,     0x00 },
+        { CH390_WCR,     0x00 },
+        { CH390_TCR,     0x00 },
+        { CH390_RCR,     RCR_DIS_CRC | RCR_ALL },
+        { CH390_TCR2,    TCR2_RLCP },
+        { CH390_TCSCR,   TCSCR_IPCSE | TCSCR_TCPCSE | TCSCR_UDPCSE },   // HW TX checksum
+        { CH390_RCSCSR,  0x00 },
+        { CH390_INTCR,   0x00 },                    // INT pin: push-pull, active high
+        { CH390_INTCKCR, 0x00 },                    // Clear INT pin clock output
+        { CH390_RLENCR,  RLENCR_RXLEN_EN | RLENCR_RXLEN_DEFAULT },  // RX length limit 1536
+        { CH390_NSR,     NSR_WAKEST | NSR_TX2END | NSR_TX1END },
+
+        // Hardware flow-control
+        { CH390_BPTR,    0x3F },                    // Back pressure threshold
+        { CH390_FCTR,    FCTR_HWOT(3) | FCTR_LWOT(8) },     // High/low water marks
+        { CH390_FCR,     FCR_FLOW_ENABLE },
+
+        // Clear multicast hash table and enable broadcast reception
+        { CH390_BCASTCR, 0x00 },
+        { CH390_MAR + 0, 0x00 }, { CH390_MAR + 1, 0x00 }, { CH390_MAR + 2, 0x00 }, { CH390_MAR + 3, 0x00 },
+        { CH390_MAR + 4, 0x00 }, { CH390_MAR + 5, 0x00 }, { CH390_MAR + 6, 0x00 },
+        { CH390_MAR + 7, 0x80 },                    // Enable broadcast packet reception
+    };
+    ch390_reg_write_batch(init, sizeof(init) / sizeof(init[0]));
 
     // Restore MAC address
     for (int i = 0; i < 6; i++)
         ch390_reg_write(CH390_PAR + i, emac->addr[i]);
 
+    // TX SRAM pointers were reset, anything pending is gone
+    emac->tx_busy = false;
+    emac->tx_staged_len = 0;
+    emac->tx_queue_count = 0;
+
     // Verify chip is alive by reading back VID
     uint8_t vid_l = 0;
     ch390_reg_read(CH390_VIDL, &vid_l);
@@ -238,6 +407,74 @@ static bool ch390_reset_and_reinit_locked(emac_ch390_t *emac) {
     return true;
 }
 
+static bool ch390_rx_pool_init(void) {
+    if (s_rx_free) return true;
+    QueueHandle_t q = xQueueCreate(CH390_RX_POOL_SIZE, sizeof(ch390_rx_buf_t *));
+    if (!q) return false;
+    for (int i = 0; i < CH390_RX_POOL_SIZE; i++) {
+        ch390_rx_buf_t *rb = &s_rx_bufs[i];
+        rb->buf = (uint8_t *)heap_caps_malloc(CH390_RX_BUF_SIZE, MALLOC_CAP_DMA);
+        if (!rb->buf) {
+            while (i--) heap_caps_free(s_rx_bufs[i].buf);
+            vQueueDelete(q);
+            return false;
+        }
+        rb->p.custom_free_function = NULL;
+        xQueueSend(q, &rb, 0);
+    }
+    s_rx_free = q;
+    return true;
+}
+
+static inline void ch390_rx_buf_put(ch390_rx_buf_t *rb) {
+    xQueueSend(s_rx_free, &rb, 0);
+}
+
+// pbuf free callback of a frame handed to lwIP in its pool block (any task)
+static void ch390_rx_buf_free(struct pbuf *p) {
+    ch390_rx_buf_put((ch390_rx_buf_t *)p);
+}
+
+// Pass a received frame to lwIP, as esp_netif's ethernetif_input() would, but with our own pbuf
+static void ch390_rx_input(emac_ch390_t *emac, ch390_rx_buf_t *rb, uint32_t frame_len) {
+    struct netif *netif = s_eth_netif ? (struct netif *)esp_netif_get_netif_impl(s_eth_netif) : NULL;
+    struct pbuf *p = NULL;
+
+    if (!netif || !netif_is_up(netif)) {
+        ch390_rx_buf_put(rb);
+        return;
+    }
+    if (frame_len <= CH390_RX_COPY_MAX || uxQueueMessagesWaiting(s_rx_free) < CH390_RX_POOL_RESERVE) {
+        p = pbuf_alloc(PBUF_RAW, frame_len, PBUF_RAM);
+        if (p) pbuf_take(p, rb->buf, frame_len);
+        ch390_rx_buf_put(rb);
+    } else {
+        rb->p.custom_free_function = ch390_rx_buf_free;
+        p = pbuf_alloced_custom(PBUF_RAW, frame_len, PBUF_REF, &rb->p, rb->buf, CH390_RX_BUF_SIZE);
+        if (!p) ch390_rx_buf_put(rb);
+    }
+    if (!p) {
+        CH390_STAT(emac->stats.rx_nomem++);
+        return;
+    }
+    if (netif->input(p, netif) != ERR_OK) pbuf_free(p);
+}
+
+// Consume a frame received while the loopback benchmark runs. Benchmark frames
+// are timed; anything else (e.g. our own looped-back lwIP traffic) is dropped.
+static void ch390_bench_rx(emac_ch390_t *emac, uint8_t *buffer, uint32_t frame_len) {
+    int64_t sent;
+    if (frame_len >= 14 + sizeof(sent) &&
+            buffer[12] == (CH390_BENCH_ETHERTYPE >> 8) && buffer[13] == (CH390_BENCH_ETHERTYPE & 0xFF)) {
+        memcpy(&sent, buffer + 14, sizeof(sent));
+        uint32_t latency = (uint32_t)(esp_timer_get_time() - sent);
+        emac->bench_latency_sum += latency;
+        if (latency > emac->bench_latency_max) emac->bench_latency_max = latency;
+        emac->bench_rx++;
+        xSemaphoreGive(emac->bench_sem);
+    }
+}
+
 // ISR handler — notifies rx task on CH390 interrupt
 static void IRAM_ATTR ch390_isr_handler(void *arg) {
     emac_ch390_t *emac = (emac_ch390_t *)arg;
@@ -246,30 +483,39 @@ static void IRAM_ATTR ch390_isr_handler(void *arg) {
     if (high_task_wakeup) portYIELD_FROM_ISR();
 }
 
-// RX task — matches reference emac_ch390_task structure
+// RX task — matches reference emac_ch390_task structure; also services TX completion
 static void ch390_rx_task(void *arg) {
     emac_ch390_t *emac = (emac_ch390_t *)arg;
     uint8_t status = 0;
-    uint8_t *buffer;
     while (1) {
         // Wait for ISR notification or 1000ms timeout
         if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000)) == 0 &&
                 gpio_get_level((gpio_num_t)CH390_INT) == 0) {
-            continue;   // no notification and no interrupt asserted
+            // no notification and no interrupt asserted; don't let a missed PT stall TX
+            if (emac->tx_busy) {
+                CH390_LOCK(emac);
+                ch390_tx_check_locked(emac);
+                CH390_UNLOCK(emac);
+            }
+            continue;
         }
 
         // read and clear interrupt status
         CH390_LOCK(emac);
         ch390_reg_read(CH390_ISR, &status);
         ch390_reg_write(CH390_ISR, status);
+        // packet transmitted — start the next one
+        if (status & ISR_PT) ch390_tx_done_locked(emac);
+        else ch390_tx_check_locked(emac);
         CH390_UNLOCK(emac);
 
         // RX FIFO overflow — reset RX path
         if (status & (ISR_ROS | ISR_ROO)) {
             _LOG_W("CH390: RX overflow (ISR=0x%02X), resetting RX\n", status);
+            CH390_STAT(emac->stats.rx_overflows++);
             CH390_LOCK(emac);
             ch390_stop_locked(emac);
-            esp_rom_delay_us(1000);
+            ch390_bus_wait_ms(2);                               // at least 1 ms
             ch390_start_locked(emac);
             CH390_UNLOCK(emac);
             continue;
@@ -277,22 +523,35 @@ static void ch390_rx_task(void *arg) {
 
         /* packet received */
         if (status & ISR_PR) {
+            bool pool_warned = false;
             do {
+                // Read straight into a pool buffer; NULL makes receive() drop the frame
+                ch390_rx_buf_t *rb = NULL;
+                xQueueReceive(s_rx_free, &rb, 0);
                 uint32_t frame_len = 0;
-                if (emac->parent.receive(&emac->parent, emac->rx_buffer, &frame_len) == ESP_OK) {
+                esp_err_t ret = emac->parent.receive(&emac->parent, rb ? rb->buf : NULL, &frame_len);
+                if (ret == ESP_OK) {
                     if (frame_len == 0) {
+                        if (rb) ch390_rx_buf_put(rb);
                         break;
                     }
-                    /* allocate memory and check whether allocation failed */
-                    buffer = (uint8_t *)malloc(frame_len);
-                    if (buffer == NULL) {
-                        _LOG_A("CH390: no memory for receive buffer\n");
-                        continue;
+                    if (emac->bench_active) {
+                        ch390_bench_rx(emac, rb->buf, frame_len);
+                        ch390_rx_buf_put(rb);
+                    } else {
+                        CH390_STAT(emac->stats.rx_frames++; emac->stats.rx_bytes += frame_len);
+                        ch390_rx_input(emac, rb, frame_len);        // the block is back now or when lwIP frees it
+                    }
+                } else if (ret == ESP_ERR_NO_MEM) {
+                    CH390_STAT(emac->stats.rx_nomem++);
+                    if (!pool_warned) {
+                        _LOG_A("CH390: all receive buffers in use, frame dropped (%u total)\n",
+                               emac->stats.rx_nomem);
+                        pool_warned = true;
                     }
-                    /* pass the buffer to stack (e.g. TCP/IP layer) */
-                    memcpy(buffer, emac->rx_buffer, frame_len);
-                    emac->eth->stack_input(emac->eth, buffer, frame_len);
                 } else {
+                    if (rb) ch390_rx_buf_put(rb);
+                    CH390_STAT(emac->stats.rx_errors++);
                     _LOG_W("CH390: frame read failed\n");
                     break;
                 }
@@ -363,35 +622,36 @@ static esp_err_t ch390_mac_stop(esp_eth_mac_t *mac) {
     return ESP_OK;
 }
 
+// Queue a frame for transmission. The frame goes straight to the wire if the
+// chip is idle, into TX SRAM behind the current frame, or into the RAM queue;
+// completion is handled from the PT interrupt in ch390_rx_task.
 static esp_err_t ch390_mac_transmit(esp_eth_mac_t *mac, uint8_t *buf, uint32_t length) {
     emac_ch390_t *emac = __containerof(mac, emac_ch390_t, parent);
     if (length > ETH_MAX_PACKET_SIZE) return ESP_ERR_INVALID_SIZE;
 
     CH390_LOCK(emac);
 
-    // Write packet data to TX memory
-    ch390_mem_write(buf, length);
-
-    // Check if last transmit is complete (poll TCR_TXREQ)
-    uint8_t tcr;
-    int64_t wait_time = esp_timer_get_time();
-    do {
-        ch390_reg_read(CH390_TCR, &tcr);
-    } while ((tcr & TCR_TXREQ) && ((esp_timer_get_time() - wait_time) < 1000));
-
-    if (tcr & TCR_TXREQ) {
-        _LOG_W("CH390: last transmit still in progress, cannot send\n");
+    ch390_tx_check_locked(emac);
+
+    int64_t t0 = esp_timer_get_time();
+    if (!emac->tx_busy) {
+        ch390_mem_write(buf, length);
+        ch390_tx_issue_locked(emac, length);
+    } else if (!emac->tx_staged_len) {
+        ch390_mem_write(buf, length);
+        emac->tx_staged_len = length;
+    } else if (emac->tx_queue_count < CH390_TX_QUEUE_LEN) {
+        uint8_t i = (emac->tx_queue_head + emac->tx_queue_count) % CH390_TX_QUEUE_LEN;
+        memcpy(emac->tx_queue[i], buf, length);
+        emac->tx_queue_len[i] = length;
+        emac->tx_queue_count++;
+    } else {
+        CH390_STAT(emac->stats.tx_queue_full++);
         CH390_UNLOCK(emac);
-        return ESP_ERR_INVALID_STATE;
+        return ESP_ERR_NO_MEM;
     }
-
-    // Set TX packet length
-    ch390_reg_write(CH390_TXPLL, length & 0xFF);
-    ch390_reg_write(CH390_TXPLH, (length >> 8) & 0xFF);
-
-    // Issue TX polling command
-    ch390_reg_read(CH390_TCR, &tcr);
-    ch390_reg_write(CH390_TCR, tcr | TCR_TXREQ);
+    uint32_t spi_us = (uint32_t)(esp_timer_get_time() - t0);
+    CH390_STAT(emac->stats.tx_spi_us += spi_us; emac->stats.tx_frames++; emac->stats.tx_bytes += length);
 
     CH390_UNLOCK(emac);
     return ESP_OK;
@@ -399,45 +659,68 @@ static esp_err_t ch390_mac_transmit(esp_eth_mac_t *mac, uint8_t *buf, uint32_t l
 
 // Receive one packet from the CH390 RX SRAM.
 // Matches the Espressif reference emac_ch390_receive pattern.
+// buf must hold CH390_RX_BUF_SIZE bytes; with buf == NULL a pending frame is
+// dropped from the chip and ESP_ERR_NO_MEM is returned.
 static esp_err_t ch390_mac_receive(esp_eth_mac_t *mac, uint8_t *buf, uint32_t *length) {
     emac_ch390_t *emac = __containerof(mac, emac_ch390_t, parent);
 
     CH390_LOCK(emac);
 
-    // Double dummy read to get the most updated data
-    uint8_t rxbyte;
-    ch390_reg_read(CH390_MRCMDX, &rxbyte);
-    ch390_reg_read(CH390_MRCMDX, &rxbyte);
+    // Double dummy read to get the most updated data, as one 2-byte burst
+    uint8_t mrcmdx[2];
+    ch390_reg_read_n(CH390_MRCMDX, mrcmdx, 2);
+    uint8_t rxbyte = mrcmdx[1];
 
     // If rxbyte indicates error state, do stop/start recovery
     if (rxbyte & CH390_PKT_ERR) {
         ch390_stop_locked(emac);
-        esp_rom_delay_us(1000);
+        ch390_bus_wait_ms(2);                                   // at least 1 ms
         ch390_start_locked(emac);
         CH390_UNLOCK(emac);
         return ESP_ERR_INVALID_RESPONSE;
     }
 
     if (rxbyte & CH390_PKT_RDY) {
-        // Read 4-byte RX header: flag, status, length_lo, length_hi
-        __attribute__((aligned(4))) uint8_t rx_header[CH390_RX_HDR_SIZE];
-        ch390_mem_read(rx_header, CH390_RX_HDR_SIZE);
+        // Read the 4-byte RX header (flag, status, length_lo, length_hi) together
+        // with the first CH390_RX_HEAD_READ frame bytes in one transaction; a
+        // minimum-size frame is then complete without a second read.
+        __attribute__((aligned(4))) uint8_t scratch[CH390_RX_HDR_SIZE + CH390_RX_HEAD_READ];
+        uint8_t *head = buf ? buf : scratch;
+        int64_t t0 = esp_timer_get_time();
+        ch390_mem_read(head, CH390_RX_HDR_SIZE + CH390_RX_HEAD_READ);
 
-        uint8_t status = rx_header[1];
-        *length = (rx_header[3] << 8) + rx_header[2];
+        uint8_t status = head[1];
+        *length = (head[3] << 8) + head[2];
 
         if (status & RSR_ERR_MASK) {
-            ch390_drop_frame(*length);
+            ch390_drop_frame((int32_t)*length - CH390_RX_HEAD_READ);
             *length = 0;
             CH390_UNLOCK(emac);
             return ESP_ERR_INVALID_RESPONSE;
-        } else if (*length > ETH_MAX_PACKET_SIZE) {
-            // Reset rx memory pointer
+        } else if (*length > ETH_MAX_PACKET_SIZE || *length < ETH_HEADER_LEN + ETH_CRC_LEN) {
+            // Length cannot be right, so neither can the position of the next frame: reset rx memory pointer
             ch390_reg_write(CH390_MPTRCR, MPTRCR_RST_RX);
+            *length = 0;
             CH390_UNLOCK(emac);
             return ESP_ERR_INVALID_RESPONSE;
+        } else if (*length < CH390_RX_HEAD_READ) {
+            // Runt frame: the head read went past its end, step back to the next frame and drop only this one
+            ch390_drop_frame((int32_t)*length - CH390_RX_HEAD_READ);
+            *length = 0;
+            CH390_UNLOCK(emac);
+            return ESP_ERR_INVALID_RESPONSE;
+        } else if (!buf) {
+            ch390_drop_frame(*length - CH390_RX_HEAD_READ);
+            *length = 0;
+            CH390_UNLOCK(emac);
+            return ESP_ERR_NO_MEM;
         } else {
-            ch390_mem_read(buf, *length);
+            // Shift the frame start over the header, then read the rest in place
+            memmove(buf, buf + CH390_RX_HDR_SIZE, CH390_RX_HEAD_READ);
+            if (*length > CH390_RX_HEAD_READ)
+                ch390_mem_read(buf + CH390_RX_HEAD_READ, *length - CH390_RX_HEAD_READ);
+            uint32_t spi_us = (uint32_t)(esp_timer_get_time() - t0);
+            CH390_STAT(emac->stats.rx_spi_us += spi_us);
             *length -= ETH_CRC_LEN;
         }
     } else {
@@ -557,7 +840,8 @@ static esp_err_t ch390_mac_del(esp_eth_mac_t *mac) {
     emac_ch390_t *emac = __containerof(mac, emac_ch390_t, parent);
     if (emac->rx_task) vTaskDelete(emac->rx_task);
     if (emac->spi_lock) vSemaphoreDelete(emac->spi_lock);
-    heap_caps_free(emac->rx_buffer);
+    if (emac->bench_sem) vSemaphoreDelete(emac->bench_sem);
+    for (int i = 0; i < CH390_TX_QUEUE_LEN; i++) heap_caps_free(emac->tx_queue[i]);
     free(emac);
     return ESP_OK;
 }
@@ -587,14 +871,25 @@ static esp_eth_mac_t *ch390_mac_new(void) {
 
     emac->spi_lock = xSemaphoreCreateMutex();
     if (!emac->spi_lock) { free(emac); return NULL; }
+    emac->bench_sem = xSemaphoreCreateBinary();
+    if (!emac->bench_sem) { vSemaphoreDelete(emac->spi_lock); free(emac); return NULL; }
 
-    emac->rx_buffer = (uint8_t *)heap_caps_malloc(1536 + CH390_RX_HDR_SIZE, MALLOC_CAP_DMA);
-    if (!emac->rx_buffer) { vSemaphoreDelete(emac->spi_lock); free(emac); return NULL; }
+    bool tx_ok = ch390_rx_pool_init();
+    for (int i = 0; i < CH390_TX_QUEUE_LEN; i++) {
+        emac->tx_queue[i] = (uint8_t *)heap_caps_malloc(ETH_MAX_PACKET_SIZE, MALLOC_CAP_DMA);
+        if (!emac->tx_queue[i]) tx_ok = false;
+    }
+    if (!tx_ok) {
+        for (int i = 0; i < CH390_TX_QUEUE_LEN; i++) heap_caps_free(emac->tx_queue[i]);
+        vSemaphoreDelete(emac->bench_sem);
+        vSemaphoreDelete(emac->spi_lock); free(emac); return NULL;
+    }
 
     BaseType_t ret = xTaskCreatePinnedToCore(ch390_rx_task, "ch390_rx", 4096,
                                               emac, 8, &emac->rx_task, 0);
     if (ret != pdPASS) {
-        heap_caps_free(emac->rx_buffer);
+        for (int i = 0; i < CH390_TX_QUEUE_LEN; i++) heap_caps_free(emac->tx_queue[i]);
+        vSemaphoreDelete(emac->bench_sem);
         vSemaphoreDelete(emac->spi_lock);
         free(emac);
         return NULL;
@@ -888,6 +1183,106 @@ static void eth_event_handler(void *arg, esp_event_base_t event_base,
 
 static char eth_ip_str[16] = "";
 
+bool ch390_get_stats(ch390_stats_t *stats) {
+    if (!s_emac) return false;
+    CH390_STAT(*stats = s_emac->stats);
+    return true;
+}
+
+// The benchmark runs in a task of its own: it takes seconds, and while it runs the
+// wired link (possibly the one the request came in on) is down.
+static volatile ch390_bench_state_t s_bench_state = CH390_BENCH_NONE;
+static ch390_bench_t s_bench_result;
+static uint32_t s_bench_frames;
+static uint16_t s_bench_size;
+
+static void ch390_bench_run(emac_ch390_t *emac, uint32_t frames, uint16_t size, ch390_bench_t *result) {
+    memset(result, 0, sizeof(*result));
+    uint8_t *frame = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_DMA);
+    if (!frame) {
+        _LOG_A("CH390: no memory for loopback benchmark\n");
+        return;
+    }
+    memset(frame, 0, size);
+    memcpy(frame, emac->addr, 6);
+    memcpy(frame + 6, emac->addr, 6);
+    frame[12] = CH390_BENCH_ETHERTYPE >> 8;
+    frame[13] = CH390_BENCH_ETHERTYPE & 0xFF;
+
+    emac->bench_rx = 0;
+    emac->bench_latency_sum = 0;
+    emac->bench_latency_max = 0;
+    xSemaphoreTake(emac->bench_sem, 0);
+    emac->bench_active = true;
+
+    bool loopback = true;
+    esp_eth_ioctl(s_eth_handle, ETH_CMD_S_PHY_LOOPBACK, &loopback);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    _LOG_I("CH390: loopback benchmark, %u frames of %u bytes\n", frames, size);
+
+    uint32_t sent = 0, lost = 0;
+    int64_t start = esp_timer_get_time();
+    while (sent < frames && (esp_timer_get_time() - start) < CH390_BENCH_TIMEOUT_US) {
+        // signed: frames written off as lost may still arrive and push bench_rx past sent - lost
+        int32_t in_flight = (int32_t)sent - (int32_t)lost - (int32_t)emac->bench_rx;
+        if (in_flight >= CH390_BENCH_WINDOW) {
+            // window full: wait for the rx task to see a frame, else write the window off as lost
+            if (xSemaphoreTake(emac->bench_sem, pdMS_TO_TICKS(10)) != pdTRUE) lost = sent - emac->bench_rx;
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        memcpy(frame + 14, &now, sizeof(now));
+        if (emac->parent.transmit(&emac->parent, frame, size) == ESP_OK) sent++;
+        else vTaskDelay(1);
+    }
+    int64_t wait = esp_timer_get_time();
+    while (emac->bench_rx < sent && (esp_timer_get_time() - wait) < 100000)
+        xSemaphoreTake(emac->bench_sem, pdMS_TO_TICKS(10));
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+
+    emac->bench_active = false;
+    loopback = false;
+    esp_eth_ioctl(s_eth_handle, ETH_CMD_S_PHY_LOOPBACK, &loopback);
+    free(frame);
+
+    result->sent = sent;
+    result->received = emac->bench_rx;
+    result->elapsed_us = elapsed;
+    result->pps = elapsed ? (uint32_t)((uint64_t)result->received * 1000000 / elapsed) : 0;
+    result->latency_avg_us = result->received ? (uint32_t)(emac->bench_latency_sum / result->received) : 0;
+    result->latency_max_us = emac->bench_latency_max;
+    _LOG_I("CH390: loopback %u/%u frames in %u us, %u pps, latency avg %u max %u us\n",
+           result->received, sent, elapsed, result->pps, result->latency_avg_us, result->latency_max_us);
+}
+
+static void ch390_bench_task(void *arg) {
+    ch390_bench_run((emac_ch390_t *)arg, s_bench_frames, s_bench_size, &s_bench_result);
+    s_bench_state = CH390_BENCH_DONE;
+    vTaskDelete(NULL);
+}
+
+esp_err_t ch390_loopback_start(uint32_t frames, uint16_t size) {
+    emac_ch390_t *emac = s_emac;
+    if (!emac || !s_eth_handle || s_bench_state == CH390_BENCH_RUNNING) return ESP_ERR_INVALID_STATE;
+    if (size < 60) size = 60;
+    if (size > 1514) size = 1514;
+
+    s_bench_frames = frames;
+    s_bench_size = size;
+    s_bench_state = CH390_BENCH_RUNNING;
+    if (xTaskCreate(ch390_bench_task, "ch390_bench", 3072, emac, 5, NULL) != pdPASS) {
+        s_bench_state = CH390_BENCH_NONE;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+ch390_bench_state_t ch390_get_bench(ch390_bench_t *result) {
+    ch390_bench_state_t state = s_bench_state;
+    if (state == CH390_BENCH_DONE) *result = s_bench_result;
+    return state;
+}
+
 const char* ch390_get_ip(void) {
     return eth_ip_str;
 }
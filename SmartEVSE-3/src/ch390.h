@@ -152,6 +152,7 @@
 #define IMR_LNKCHGI     (1 << 5)    // Link change interrupt enable
 #define IMR_ROOI        (1 << 3)    // RX overflow counter overflow interrupt enable
 #define IMR_ROI         (1 << 2)    // RX overflow interrupt enable
+#define IMR_PTI         (1 << 1)    // Packet transmitted interrupt enable
 #define IMR_PRI         (1 << 0)    // Packet received interrupt enable
 
 #define EPCR_EPOS       (1 << 3)    // Select PHY (1) or EEPROM (0)
@@ -204,6 +205,49 @@ esp_err_t ch390_eth_init(void);
 // Get the Ethernet IP address string (empty if no IP).
 const char* ch390_get_ip(void);
 
+// Driver counters, read with ch390_get_stats()
+typedef struct {
+    uint32_t rx_frames;         // frames handed to the TCP/IP stack
+    uint32_t rx_bytes;
+    uint32_t tx_frames;         // frames accepted by transmit()
+    uint32_t tx_bytes;
+    uint32_t rx_overflows;      // RX path resets after an RX SRAM overflow
+    uint32_t rx_errors;         // frames dropped for bad status/length or failed reads
+    uint32_t rx_nomem;          // frames dropped because no RX buffer was available
+    uint32_t tx_queue_full;     // frames rejected because the TX pipeline was full
+    uint64_t rx_spi_us;         // time spent reading frames from the chip
+    uint64_t tx_spi_us;         // time spent writing frames to the chip
+    uint64_t lock_total_us;     // total time the SPI lock was held
+    uint32_t lock_max_us;       // longest single hold of the SPI lock
+} ch390_stats_t;
+
+// Result of ch390_loopback_bench()
+typedef struct {
+    uint32_t sent;
+    uint32_t received;
+    uint32_t elapsed_us;
+    uint32_t pps;               // received frames per second
+    uint32_t latency_avg_us;    // transmit() to rx task, per frame
+    uint32_t latency_max_us;
+} ch390_bench_t;
+
+// Copy the driver counters. Returns false if the driver is not running.
+bool ch390_get_stats(ch390_stats_t *stats);
+
+typedef enum {
+    CH390_BENCH_NONE,           // no benchmark run since boot
+    CH390_BENCH_RUNNING,
+    CH390_BENCH_DONE            // result of the last run available
+} ch390_bench_state_t;
+
+// Start sending `frames` frames of `size` bytes through PHY loopback in a
+// background task, measuring throughput and latency. Takes the wired link
+// offline while it runs. Poll the result with ch390_get_bench().
+esp_err_t ch390_loopback_start(uint32_t frames, uint16_t size);
+
+// Benchmark state; `result` is filled in when it is CH390_BENCH_DONE.
+ch390_bench_state_t ch390_get_bench(ch390_bench_t *result);
+
 // Runtime flags
 extern bool EthPresent;     // true if CH390D chip was detected at boot
 extern bool EthConnected;   // true if Ethernet link is up
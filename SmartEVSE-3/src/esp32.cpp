@@ -22,7 +22,11 @@ char RequiredEVCCID[32] = "";                                               // R
 #include <LittleFS.h>
 
 #include <WiFi.h>
+#include "esp_wifi.h"
 #include "network_common.h"
+#include "http_metrics.h"
+#include "netmeter.h"
+#include "site.h"
 #include "esp_ota_ops.h"
 #include "mbedtls/md_internal.h"
 
@@ -477,272 +481,444 @@ void writeMqttCaCert(const String& cert) {
     _LOG_D("Wrote %d bytes to /mqtt_ca.pem.\n", cert.length());
 }
 
+// Compile time strcmp() < 0, used to static_assert that the dispatch tables are sorted
+static constexpr bool strLess(const char *a, const char *b) {
+    return *a == *b ? (*a != '\0' && strLess(a + 1, b + 1)) : (unsigned char)*a < (unsigned char)*b;
+}
+
 #if MQTT
-void mqtt_receive_callback(const String topic, const String payload) {
-    if (topic == MQTTprefix + "/Set/Mode") {
-        if (payload == "Off") {
-            setAccess(OFF);
-        } else if (payload == "Normal") {
-            setMode(MODE_NORMAL);
-        } else if (payload == "Solar") {
-            setOverrideCurrent(0);
-            setMode(MODE_SOLAR);
-        } else if (payload == "Smart") {
-            setMode(MODE_SMART);
-        } else if (payload == "Pause") {
-            setAccess(PAUSE);
-        }
-    } else if (topic == MQTTprefix + "/Set/CustomButton") {
-        if (payload == "On") {
-            CustomButton = true;
-        } else {
-            CustomButton = false;
-        }
-    } else if (topic == MQTTprefix + "/Set/CurrentOverride") {
-        uint16_t RequestedCurrent = payload.toInt();
-        if (RequestedCurrent == 0) {
-            setOverrideCurrent(0);
-        } else if (LoadBl < 2 && (Mode == MODE_NORMAL || Mode == MODE_SMART)) { // OverrideCurrent not possible on Slave
-            if (RequestedCurrent >= (MinCurrent * 10) && RequestedCurrent <= (MaxCurrent * 10)) {
-                setOverrideCurrent(RequestedCurrent);
-            }
-        }
-    } else if (topic == MQTTprefix + "/Set/CurrentMaxSumMains" && LoadBl < 2) {
-        uint16_t RequestedCurrent = payload.toInt();
-        if (RequestedCurrent == 0) {
-            MaxSumMains = 0;
-        } else if (RequestedCurrent == 0 || (RequestedCurrent >= 10 && RequestedCurrent <= 600)) {
-                MaxSumMains = RequestedCurrent;
-        }
-    } else if (topic == MQTTprefix + "/Set/CPPWMOverride") {
-        int pwm = payload.toInt();
-        if (pwm == -1) {
-            SetCPDuty(1024);
-            PILOT_CONNECTED;
-            CPDutyOverride = false;
-        } else if (pwm == 0) {
-            SetCPDuty(0);
-            PILOT_DISCONNECTED;
-            CPDutyOverride = true;
-        } else if (pwm <= 1024) {
-            SetCPDuty(pwm);
-            PILOT_CONNECTED;
-            CPDutyOverride = true;
-        }
-    } else if (topic == MQTTprefix + "/Set/MainsMeter") {
-        if (MainsMeter.Type != EM_API || LoadBl >= 2)
-            return;
+// MQTT /Set/<command> handlers, the payload is a NUL terminated copy of at
+// most MQTT_SET_PAYLOAD_MAX - 1 bytes.
+#define MQTT_SET_PAYLOAD_MAX 64
 
-        int32_t L1, L2, L3, W, WH;
-        int n = sscanf(payload.c_str(), "%d:%d:%d:%d:%d", &L1, &L2, &L3, &W, &WH);
+static void mqttSetMode(const char *payload) {
+    if (!strcmp(payload, "Off")) {
+        setAccess(OFF);
+    } else if (!strcmp(payload, "Normal")) {
+        setMode(MODE_NORMAL);
+    } else if (!strcmp(payload, "Solar")) {
+        setOverrideCurrent(0);
+        setMode(MODE_SOLAR);
+    } else if (!strcmp(payload, "Smart")) {
+        setMode(MODE_SMART);
+    } else if (!strcmp(payload, "Pause")) {
+        setAccess(PAUSE);
+    }
+}
 
-        // MainsMeter can measure -200A to +200A per phase
-        if ((n == 3 || n == 5) && (L1 > -2000 && L1 < 2000) && (L2 > -2000 && L2 < 2000) && (L3 > -2000 && L3 < 2000)) {
-            // We expect 5 values (and accept -1 for unknown values)
-            if (LoadBl < 2) {
-                MainsMeter.setTimeout(COMM_TIMEOUT);
-                MainsMeter.Irms[0] = L1;
-                MainsMeter.Irms[1] = L2;
-                MainsMeter.Irms[2] = L3;
-                CalcIsum();
-            }
-            if (n == 5) {
-                if (W > -1) {
-                    // Power measurement
-                    MainsMeter.PowerMeasured = W;
-                }
+static void mqttSetCustomButton(const char *payload) {
+    CustomButton = !strcmp(payload, "On");
+}
 
-                if (WH > -1) {
-                    MainsMeter.Import_active_energy = WH;
-                    MainsMeter.Export_active_energy = 0;
-                    MainsMeter.UpdateEnergies();
-                    MainsMeter.UpdateCapacity();
-                    MainsMeter.UpdatePower();
-                }
-            }
+static void mqttSetCurrentOverride(const char *payload) {
+    uint16_t RequestedCurrent = atoi(payload);
+    if (RequestedCurrent == 0) {
+        setOverrideCurrent(0);
+    } else if (LoadBl < 2 && (Mode == MODE_NORMAL || Mode == MODE_SMART)) { // OverrideCurrent not possible on Slave
+        if (RequestedCurrent >= (MinCurrent * 10) && RequestedCurrent <= (MaxCurrent * 10)) {
+            setOverrideCurrent(RequestedCurrent);
         }
-    } else if (topic == MQTTprefix + "/Set/EVMeter") {
-        if (EVMeter.Type != EM_API)
-            return;
+    }
+}
+
+static void mqttSetCurrentMaxSumMains(const char *payload) {
+    if (LoadBl >= 2)
+        return;
+    uint16_t RequestedCurrent = atoi(payload);
+    if (RequestedCurrent == 0) {
+        MaxSumMains = 0;
+    } else if (RequestedCurrent >= 10 && RequestedCurrent <= 600) {
+        MaxSumMains = RequestedCurrent;
+    }
+}
 
-        int32_t L1, L2, L3, W, WH;
-        int n = sscanf(payload.c_str(), "%d:%d:%d:%d:%d", &L1, &L2, &L3, &W, &WH);
+static void mqttSetCPPWMOverride(const char *payload) {
+    int pwm = atoi(payload);
+    if (pwm == -1) {
+        SetCPDuty(1024);
+        PILOT_CONNECTED;
+        CPDutyOverride = false;
+    } else if (pwm == 0) {
+        SetCPDuty(0);
+        PILOT_DISCONNECTED;
+        CPDutyOverride = true;
+    } else if (pwm <= 1024) {
+        SetCPDuty(pwm);
+        PILOT_CONNECTED;
+        CPDutyOverride = true;
+    }
+}
+
+static void mqttSetMainsMeter(const char *payload) {
+    if (MainsMeter.Type != EM_API || LoadBl >= 2)
+        return;
+
+    int32_t L1, L2, L3, W, WH;
+    int n = sscanf(payload, "%d:%d:%d:%d:%d", &L1, &L2, &L3, &W, &WH);
 
+    // MainsMeter can measure -200A to +200A per phase
+    if ((n == 3 || n == 5) && (L1 > -2000 && L1 < 2000) && (L2 > -2000 && L2 < 2000) && (L3 > -2000 && L3 < 2000)) {
         // We expect 5 values (and accept -1 for unknown values)
+        if (LoadBl < 2) {
+            MainsMeter.setTimeout(COMM_TIMEOUT);
+            MainsMeter.Irms[0] = L1;
+            MainsMeter.Irms[1] = L2;
+            MainsMeter.Irms[2] = L3;
+            CalcIsum();
+        }
         if (n == 5) {
-            if ((L1 > -1 && L1 < 1000) && (L2 > -1 && L2 < 1000) && (L3 > -1 && L3 < 1000)) {
-                // RMS currents
-                EVMeter.Irms[0] = L1;
-                EVMeter.Irms[1] = L2;
-                EVMeter.Irms[2] = L3;
-                EVMeter.CalcImeasured();
-                EVMeter.Timeout = COMM_EVTIMEOUT;
-            }
-
             if (W > -1) {
                 // Power measurement
-                EVMeter.PowerMeasured = W;
+                MainsMeter.PowerMeasured = W;
             }
 
             if (WH > -1) {
-                EVMeter.Import_active_energy = WH;
-                EVMeter.Export_active_energy = 0;
-                EVMeter.UpdateEnergies();
+                MainsMeter.Import_active_energy = WH;
+                MainsMeter.Export_active_energy = 0;
+                MainsMeter.UpdateEnergies();
+                MainsMeter.UpdateCapacity();
+                MainsMeter.UpdatePower();
             }
         }
-    } else if (topic == MQTTprefix + "/Set/CircuitMeter") {
-        if (CircuitMeter.Type != EM_API)
-            return;
-
-        int32_t L1, L2, L3;
-        int n = sscanf(payload.c_str(), "%d:%d:%d", &L1, &L2, &L3);
-
-        // We expect 3 values
-        if ((n == 3) && (L1 > -2000 && L1 < 2000) && (L2 > -2000 && L2 < 2000) && (L3 > -2000 && L3 < 2000)) {
-                // RMS currents
-                CircuitMeter.Irms[0] = L1;
-                CircuitMeter.Irms[1] = L2;
-                CircuitMeter.Irms[2] = L3;
-                CircuitMeter.CalcImeasured();
-                CircuitMeter.Timeout = COMM_CIRCTIMEOUT;
-        }
-    } else if (topic == MQTTprefix + "/Set/HomeBatteryCurrent") {
-        if (LoadBl >= 2)
-            return;
-        homeBatteryCurrent = payload.toInt();
-        homeBatteryLastUpdate = time(NULL);
+    }
+}
+
+static void mqttSetEVMeter(const char *payload) {
+    if (EVMeter.Type != EM_API)
+        return;
+
+    int32_t L1, L2, L3, W, WH;
+    int n = sscanf(payload, "%d:%d:%d:%d:%d", &L1, &L2, &L3, &W, &WH);
+
+    // We expect 5 values (and accept -1 for unknown values)
+    if (n == 5) {
+        if ((L1 > -1 && L1 < 1000) && (L2 > -1 && L2 < 1000) && (L3 > -1 && L3 < 1000)) {
+            // RMS currents
+            EVMeter.Irms[0] = L1;
+            EVMeter.Irms[1] = L2;
+            EVMeter.Irms[2] = L3;
+            EVMeter.CalcImeasured();
+            EVMeter.Timeout = COMM_EVTIMEOUT;
+        }
+
+        if (W > -1) {
+            // Power measurement
+            EVMeter.PowerMeasured = W;
+        }
+
+        if (WH > -1) {
+            EVMeter.Import_active_energy = WH;
+            EVMeter.Export_active_energy = 0;
+            EVMeter.UpdateEnergies();
+        }
+    }
+}
+
+static void mqttSetCircuitMeter(const char *payload) {
+    if (CircuitMeter.Type != EM_API)
+        return;
+
+    int32_t L1, L2, L3;
+    int n = sscanf(payload, "%d:%d:%d", &L1, &L2, &L3);
+
+    // We expect 3 values
+    if ((n == 3) && (L1 > -2000 && L1 < 2000) && (L2 > -2000 && L2 < 2000) && (L3 > -2000 && L3 < 2000)) {
+        // RMS currents
+        CircuitMeter.Irms[0] = L1;
+        CircuitMeter.Irms[1] = L2;
+        CircuitMeter.Irms[2] = L3;
+        CircuitMeter.CalcImeasured();
+        CircuitMeter.Timeout = COMM_CIRCTIMEOUT;
+    }
+}
+
+static void mqttSetHomeBatteryCurrent(const char *payload) {
+    if (LoadBl >= 2)
+        return;
+    homeBatteryCurrent = atoi(payload);
+    homeBatteryLastUpdate = time(NULL);
+}
+
 #if MODEM
-    } else if (topic == MQTTprefix + "/Set/RequiredEVCCID") {
-        strncpy(RequiredEVCCID, payload.c_str(), sizeof(RequiredEVCCID));
-        shadowPrefs.markString("RequiredEVCCID", &RequiredEVCCID);
+static void mqttSetRequiredEVCCID(const char *payload) {
+    strncpy(RequiredEVCCID, payload, sizeof(RequiredEVCCID) - 1);
+    RequiredEVCCID[sizeof(RequiredEVCCID) - 1] = '\0';
+    shadowPrefs.markString("RequiredEVCCID", &RequiredEVCCID);
+}
 #endif
-    } else if (topic == MQTTprefix + "/Set/ColorOff") {
-        int32_t R, G, B;
-        int n = sscanf(payload.c_str(), "%d,%d,%d", &R, &G, &B);
-
-        // R,G,B is between 0..255
-        if (n == 3 && (R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
-            ColorOff[0] = R;
-            ColorOff[1] = G;
-            ColorOff[2] = B;
-        }
-    } else if (topic == MQTTprefix + "/Set/ColorNormal") {
-        int32_t R, G, B;
-        int n = sscanf(payload.c_str(), "%d,%d,%d", &R, &G, &B);
-
-        // R,G,B is between 0..255
-        if (n == 3 && (R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
-            ColorNormal[0] = R;
-            ColorNormal[1] = G;
-            ColorNormal[2] = B;
-        }
-    } else if (topic == MQTTprefix + "/Set/ColorSmart") {
-        int32_t R, G, B;
-        int n = sscanf(payload.c_str(), "%d,%d,%d", &R, &G, &B);
-
-        // R,G,B is between 0..255
-        if (n == 3 && (R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
-            ColorSmart[0] = R;
-            ColorSmart[1] = G;
-            ColorSmart[2] = B;
-        }
-    } else if (topic == MQTTprefix + "/Set/ColorSolar") {
-        int32_t R, G, B;
-        int n = sscanf(payload.c_str(), "%d,%d,%d", &R, &G, &B);
-
-        // R,G,B is between 0..255
-        if (n == 3 && (R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
-            ColorSolar[0] = R;
-            ColorSolar[1] = G;
-            ColorSolar[2] = B;
-        }
-    } else if (topic == MQTTprefix + "/Set/ColorCustom") {
-        int32_t R, G, B;
-        int n = sscanf(payload.c_str(), "%d,%d,%d", &R, &G, &B);
-
-        // R,G,B is between 0..255
-        if (n == 3 && (R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
-            ColorCustom[0] = R;
-            ColorCustom[1] = G;
-            ColorCustom[2] = B;
-        }
-    } else if (topic == MQTTprefix + "/Set/CableLock") {
-        if (payload == "1") {
-            CableLock = 1;
-        } else {
-            CableLock = 0;
-        }
-        shadowPrefs.markUChar("CableLock", &CableLock);
-    } else if (topic == MQTTprefix + "/Set/EnableC2") {
-        // for backwards compatibility we accept both 0-4 as string argument:
-        //{ "Not present", "Always Off", "Solar Off", "Always On", "Auto" }
-        uint8_t value;
-        if (isdigit(payload[0])) {
-            value = payload.toInt();
-            if (value <=4) { //value is always >=0 because unsigned
+
+static void mqttSetColor(const char *payload, uint8_t *color) {
+    int32_t R, G, B;
+    int n = sscanf(payload, "%d,%d,%d", &R, &G, &B);
+
+    // R,G,B is between 0..255
+    if (n == 3 && (R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
+        color[0] = R;
+        color[1] = G;
+        color[2] = B;
+    }
+}
+static void mqttSetColorOff(const char *payload)    { mqttSetColor(payload, ColorOff); }
+static void mqttSetColorNormal(const char *payload) { mqttSetColor(payload, ColorNormal); }
+static void mqttSetColorSmart(const char *payload)  { mqttSetColor(payload, ColorSmart); }
+static void mqttSetColorSolar(const char *payload)  { mqttSetColor(payload, ColorSolar); }
+static void mqttSetColorCustom(const char *payload) { mqttSetColor(payload, ColorCustom); }
+
+static void mqttSetCableLock(const char *payload) {
+    CableLock = !strcmp(payload, "1");
+    shadowPrefs.markUChar("CableLock", &CableLock);
+}
+
+static char BalanceWeights[3 * NR_EVSES];                                   // BalanceWeight[] as "1,1,1,1,1,1,1,1", as stored in NVS
+
+static void formatBalanceWeights(void) {
+    size_t len = 0;
+    for (uint8_t n = 0; n < NR_EVSES; n++)
+        len += snprintf(BalanceWeights + len, sizeof(BalanceWeights) - len, "%s%u", n ? "," : "", BalanceWeight[n]);
+}
+
+// Sets the weights / priorities of the Master and the Nodes from a comma separated list.
+// EVSEs missing at the end keep their weight. Nothing is changed when a value is out of range.
+static bool setBalanceWeights(const char *list) {
+    uint8_t Weight[NR_EVSES];
+    uint8_t n;
+
+    memcpy(Weight, BalanceWeight, sizeof(Weight));
+    for (n = 0; n < NR_EVSES && *list; n++) {
+        char *end;
+        long value = strtol(list, &end, 10);
+        if (end == list || value < 1 || value > BALANCE_WEIGHT_MAX || (*end && *end != ',')) return false;
+        Weight[n] = value;
+        list = *end ? end + 1 : end;
+    }
+    if (!n || *list) return false;
+    memcpy(BalanceWeight, Weight, sizeof(Weight));
+    formatBalanceWeights();
+    shadowPrefs.markString("BalanceWeights", &BalanceWeights);
+    return true;
+}
+
+static void mqttSetBalancePolicy(const char *payload) {
+    // accepts both the policy number and its name
+    int value = -1;
+    if (isdigit((unsigned char)payload[0])) {
+        char *end;
+        long number = strtol(payload, &end, 10);
+        if (!*end && number <= POLICY_DEFICIT) value = number;
+    } else {
+        for (uint8_t n = 0; n <= POLICY_DEFICIT; n++)
+            if (!strcmp(payload, StrBalancePolicy[n])) value = n;
+    }
+    if (value < 0) {
+        _LOG_A("Invalid BalancePolicy received via MQTT: %s\n", payload);
+        return;
+    }
+    if (value != BalancePolicy) {
+        BalancePolicy = value;
+        shadowPrefs.markUChar("BalancePolicy", &BalancePolicy);
+    }
+}
+
+static void mqttSetBalanceWeights(const char *payload) {
+    if (!setBalanceWeights(payload)) _LOG_A("Invalid BalanceWeights received via MQTT: %s\n", payload);
+}
+
+static void mqttSetEnableC2(const char *payload) {
+    // for backwards compatibility we accept both 0-4 as string argument:
+    //{ "Not present", "Always Off", "Solar Off", "Always On", "Auto" }
+    uint8_t value;
+    if (isdigit((unsigned char)payload[0])) {
+        value = atoi(payload);
+        if (value <=4) { //value is always >=0 because unsigned
+            EnableC2 = (EnableC2_t) value;
+        }
+    } else {
+        for (value=0; value<5; value++)
+            if (!strcmp(payload, StrEnableC2[value])) {
                 EnableC2 = (EnableC2_t) value;
+                break;
             }
-        } else {
-            bool found=false;
-            for (value=0; value<5; value++)
-                if (payload == StrEnableC2[value]) {
-                    found = true;
-                    break;
-                }
-            if (found)
-                EnableC2 = (EnableC2_t) value;
+    }
+    shadowPrefs.markUShort("EnableC2", &EnableC2);
+}
+
+static void mqttSetRFID(const char *payload) {
+    // Accept RFID card via MQTT to start/stop session
+    // Payload should be hex string: 12 or 14 characters for 6 or 7 byte UID
+    // Examples: "010203040506" (6 bytes) or "01020304050607" (7 bytes)
+    uint8_t RFIDReader = getItemValue(MENU_RFIDREADER);
+    if (!RFIDReader) {
+        _LOG_A("RFID reader not enabled, ignoring MQTT RFID\n");
+        return;
+    }
+    // trim leading and trailing whitespace
+    while (isspace((unsigned char)*payload)) payload++;
+    size_t len = strlen(payload);
+    while (len && isspace((unsigned char)payload[len - 1])) len--;
+
+    // Check if payload is valid hex and correct length
+    bool validHex = true;
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)payload[i])) {
+            validHex = false;
+            break;
         }
-        shadowPrefs.markUShort("EnableC2", &EnableC2);
-    } else if (topic == MQTTprefix + "/Set/RFID") {
-        // Accept RFID card via MQTT to start/stop session
-        // Payload should be hex string: 12 or 14 characters for 6 or 7 byte UID
-        // Examples: "010203040506" (6 bytes) or "01020304050607" (7 bytes)
-        uint8_t RFIDReader = getItemValue(MENU_RFIDREADER);
-        if (!RFIDReader) {
-            _LOG_A("RFID reader not enabled, ignoring MQTT RFID\n");
-        } else {
-            String hexString = payload;
-            hexString.trim();
-
-            // Check if payload is valid hex and correct length
-            bool validHex = true;
-            for (size_t i = 0; i < hexString.length(); i++) {
-                if (!isxdigit(hexString[i])) {
-                    validHex = false;
-                    break;
-                }
-            }
+    }
 
-            if (!validHex) {
-                _LOG_A("Invalid RFID hex string received via MQTT: %s\n", hexString.c_str());
-            } else if (hexString.length() == 12 || hexString.length() == 14) {
-                // Parse hex string into RFID array
-                memset(RFID, 0, 8);
-
-                if (hexString.length() == 12) {
-                    // 6 byte UID (old reader format, starts at RFID[1])
-                    RFID[0] = 0x01; // Family code for old reader
-                    for (int i = 0; i < 6; i++) {
-                        RFID[i + 1] = (uint8_t)strtol(hexString.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
-                    }
-                    RFID[7] = crc8((unsigned char *)RFID, 7);
-                } else {
-                    // 7 byte UID (new reader format)
-                    for (int i = 0; i < 7; i++) {
-                        RFID[i] = (uint8_t)strtol(hexString.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
-                    }
-                    RFID[7] = crc8((unsigned char *)RFID, 7);
-                }
+    if (!validHex) {
+        _LOG_A("Invalid RFID hex string received via MQTT: %.*s\n", (int)len, payload);
+    } else if (len == 12 || len == 14) {
+        // Parse hex string into RFID array
+        // 6 byte UID is the old reader format and starts at RFID[1], 7 byte UID is the new reader format
+        uint8_t offset = (len == 12) ? 1 : 0;
+        memset(RFID, 0, 8);
+        if (offset) RFID[0] = 0x01;                                     // Family code for old reader
+        for (size_t i = 0; i < len / 2; i++) {
+            char hex[3] = { payload[i * 2], payload[i * 2 + 1], '\0' };
+            RFID[i + offset] = (uint8_t)strtol(hex, NULL, 16);
+        }
+        RFID[7] = crc8((unsigned char *)RFID, 7);
 
-                _LOG_A("RFID received via MQTT: %s\n", hexString.c_str());
+        _LOG_A("RFID received via MQTT: %.*s\n", (int)len, payload);
 
-                // Reset RFIDstatus so CheckRFID processes the card as new
-                RFIDstatus = 0;
+        // Reset RFIDstatus so CheckRFID processes the card as new
+        RFIDstatus = 0;
+
+        // Process RFID using existing logic (whitelist check, OCPP, etc.)
+        CheckRFID();
+    } else {
+        _LOG_A("Invalid RFID length received via MQTT (expected 12 or 14 hex chars): %.*s\n", (int)len, payload);
+    }
+}
+
+struct MqttSetRoute {
+    const char *cmd;                                                    // topic suffix after <prefix>/Set/
+    void (*fn)(const char *payload);
+};
+
+static constexpr MqttSetRoute mqttSetRoutes[] = {
+    { "BalancePolicy",         mqttSetBalancePolicy },
+    { "BalanceWeights",        mqttSetBalanceWeights },
+    { "CPPWMOverride",         mqttSetCPPWMOverride },
+    { "CableLock",             mqttSetCableLock },
+    { "CircuitMeter",          mqttSetCircuitMeter },
+    { "ColorCustom",           mqttSetColorCustom },
+    { "ColorNormal",           mqttSetColorNormal },
+    { "ColorOff",              mqttSetColorOff },
+    { "ColorSmart",            mqttSetColorSmart },
+    { "ColorSolar",            mqttSetColorSolar },
+    { "CurrentMaxSumMains",    mqttSetCurrentMaxSumMains },
+    { "CurrentOverride",       mqttSetCurrentOverride },
+    { "CustomButton",          mqttSetCustomButton },
+    { "EVMeter",               mqttSetEVMeter },
+    { "EnableC2",              mqttSetEnableC2 },
+    { "HomeBatteryCurrent",    mqttSetHomeBatteryCurrent },
+    { "MainsMeter",            mqttSetMainsMeter },
+    { "Mode",                  mqttSetMode },
+    { "RFID",                  mqttSetRFID },
+#if MODEM
+    { "RequiredEVCCID",        mqttSetRequiredEVCCID },
+#endif
+};
+static constexpr size_t mqttSetRouteCount = sizeof(mqttSetRoutes) / sizeof(mqttSetRoutes[0]);
+
+static constexpr bool mqttSetRoutesSorted(size_t i) {
+    return i + 1 >= mqttSetRouteCount || (strLess(mqttSetRoutes[i].cmd, mqttSetRoutes[i + 1].cmd) && mqttSetRoutesSorted(i + 1));
+}
+static_assert(mqttSetRoutesSorted(0), "mqttSetRoutes must be sorted by cmd");
 
-                // Process RFID using existing logic (whitelist check, OCPP, etc.)
-                CheckRFID();
+static bool mqttAnnounceEntities(uint8_t section);
+
+// Site balancing: a group Master only hears its own allotment, the coordinator also the demand of every group
+static void siteSubscribe(void) {
+    if (SiteRole == SITE_OFF) return;
+    MQTTclient.subscribe(String(SITE_TOPIC "/Allotment/") + String(serialnr), 0);
+    if (SiteRole == SITE_COORDINATOR) MQTTclient.subscribe(SITE_TOPIC "/Demand/+", 0);
+}
+
+// Drop the site topics the new role no longer listens to
+static void siteUnsubscribe(uint8_t NewRole) {
+    if (SiteRole == SITE_COORDINATOR && NewRole != SITE_COORDINATOR) MQTTclient.unsubscribe(SITE_TOPIC "/Demand/+");
+    if (SiteRole != SITE_OFF && NewRole == SITE_OFF) MQTTclient.unsubscribe(String(SITE_TOPIC "/Allotment/") + String(serialnr));
+}
+
+// Handles SITE_TOPIC/Demand/<serialnr> "min:max" and SITE_TOPIC/Allotment/<serialnr>, in dA per phase
+static bool siteMqttMessage(struct mg_str topic, struct mg_str payload) {
+    const size_t tlen = sizeof(SITE_TOPIC) - 1;
+    char value[24], *end;
+    uint32_t id = 0;
+
+    if (SiteRole == SITE_OFF || topic.len <= tlen || memcmp(topic.buf, SITE_TOPIC "/", tlen + 1)) return false;
+    if (payload.len >= sizeof(value)) return true;
+    memcpy(value, payload.buf, payload.len);
+    value[payload.len] = '\0';
+    struct mg_str sub = mg_str_n(topic.buf + tlen + 1, topic.len - tlen - 1);
+
+    if (SiteRole == SITE_COORDINATOR && sub.len > 7 && !memcmp(sub.buf, "Demand/", 7)) {
+        if (!mg_str_to_num(mg_str_n(sub.buf + 7, sub.len - 7), 10, &id, sizeof(id))) return true;
+        unsigned long Min = strtoul(value, &end, 10);
+        if (*end != ':') return true;
+        unsigned long Max = strtoul(end + 1, NULL, 10);
+        if (id && Max <= UINT16_MAX) SiteGroups.demand(id, Min, Max, millis());
+    } else if (sub.len > 10 && !memcmp(sub.buf, "Allotment/", 10)
+               && mg_str_to_num(mg_str_n(sub.buf + 10, sub.len - 10), 10, &id, sizeof(id)) && id == serialnr) {
+        unsigned long allotment = strtoul(value, &end, 10);
+        if (end != value && allotment <= UINT16_MAX) SiteAllotted.set(allotment, millis());
+    }
+    return true;
+}
+
+// Called every two seconds by Timer1S: send our demand, and as coordinator divide the site current
+void siteUpdate(void) {
+    char topic[48], buf[16];
+    uint16_t Min, Max;
+
+    if (SiteRole == SITE_OFF || LoadBl > 1 || !MQTTclient.connected) return;
+    getSiteDemand(&Min, &Max);
+    snprintf(topic, sizeof(topic), SITE_TOPIC "/Demand/%lu", (unsigned long)serialnr);
+    int n = snprintf(buf, sizeof(buf), "%u:%u", Min, Max);
+    MQTTclient.publish(topic, buf, n, false, 0);
+
+    if (SiteRole != SITE_COORDINATOR) return;
+    SiteCoordinator::Group Groups[SITE_GROUPS_MAX];
+    SiteGroups.divide(SiteMax * 10, millis());
+    uint8_t count = SiteGroups.copy(Groups);                                // demand() may add a group meanwhile
+    for (uint8_t i = 0; i < count; i++) {
+        snprintf(topic, sizeof(topic), SITE_TOPIC "/Allotment/%lu", (unsigned long)Groups[i].Id);
+        n = snprintf(buf, sizeof(buf), "%u", Groups[i].Allotment);
+        MQTTclient.publish(topic, buf, n, false, 0);
+    }
+}
+
+// Handles <MQTTprefix>/Set/<cmd>, homeassistant/status, MQTT meter and site topics; topic and payload are not NUL terminated.
+void mqtt_receive_callback(struct mg_str topic, struct mg_str payload) {
+    size_t plen = MQTTprefix.length();
+
+    if (netMeterMqttMessage(topic, payload)) return;
+    if (siteMqttMessage(topic, payload)) return;
+
+    // Home Assistant (re)started, it may have lost our entities: announce all of them again
+    if (mg_strcmp(topic, mg_str("homeassistant/status")) == 0) {
+        if (mg_strcmp(payload, mg_str("online")) == 0) MQTTclient.discoveryStart(mqttAnnounceEntities, true);
+        return;
+    }
+
+    if (topic.len > plen + 5 && !memcmp(topic.buf, MQTTprefix.c_str(), plen) && !memcmp(topic.buf + plen, "/Set/", 5)) {
+        struct mg_str cmd = mg_str_n(topic.buf + plen + 5, topic.len - plen - 5);
+        size_t lo = 0, hi = mqttSetRouteCount;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (mg_strcmp(mg_str(mqttSetRoutes[mid].cmd), cmd) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < mqttSetRouteCount && mg_strcmp(mg_str(mqttSetRoutes[lo].cmd), cmd) == 0) {
+            if (payload.len < MQTT_SET_PAYLOAD_MAX) {
+                char value[MQTT_SET_PAYLOAD_MAX];
+                memcpy(value, payload.buf, payload.len);
+                value[payload.len] = '\0';
+                mqttSetRoutes[lo].fn(value);
             } else {
-                _LOG_A("Invalid RFID length received via MQTT (expected 12 or 14 hex chars): %s\n", hexString.c_str());
+                _LOG_A("MQTT payload for %.*s too long (%u bytes), ignored.\n", (int)cmd.len, cmd.buf, (unsigned)payload.len);
             }
         }
     }
@@ -762,62 +938,66 @@ void printRFID(char *buf) {
 }
 
 
-void SetupMQTTClient() {
-    // Set up subscriptions
-    MQTTclient.subscribe(MQTTprefix + "/Set/#",1);
-    MQTTclient.publish(MQTTprefix+"/connected", "online", true, 0);
-
+// Home Assistant discovery for all entities, one section per call. Run piecewise by
+// MQTTclient.discoveryLoop(), which only publishes configs that are new or changed since
+// the last time. Returns false when section is past the last one.
+static bool mqttAnnounceEntities(uint8_t section) {
     // Local helper: build a per-call payload buffer when state_topic /
     // command_topic / option lists need MQTTprefix or runtime values.
     char opt[256];
     const char *p = MQTTprefix.c_str();
 
-    // sensors with device class 'current' share a static payload literal.
-    const char *CURRENT = ", \"device_class\":\"current\", \"state_class\":\"measurement\", \"unit_of_measurement\":\"A\", \"value_template\":\"{{ value | int / 10 }}\"";
-    MQTTclient.announce("Charge Current", "sensor", CURRENT);
-    MQTTclient.announce("Max Current",    "sensor", CURRENT);
-    if (MainsMeter.Type) {
-        MQTTclient.announce("Mains Current L1", "sensor", CURRENT);
-        MQTTclient.announce("Mains Current L2", "sensor", CURRENT);
-        MQTTclient.announce("Mains Current L3", "sensor", CURRENT);
-    }
-    if (EVMeter.Type) {
-        MQTTclient.announce("EV Current L1", "sensor", CURRENT);
-        MQTTclient.announce("EV Current L2", "sensor", CURRENT);
-        MQTTclient.announce("EV Current L3", "sensor", CURRENT);
-    }
-    if (CircuitMeter.Type) {
-        MQTTclient.announce("Circuit Current L1", "sensor", CURRENT);
-        MQTTclient.announce("Circuit Current L2", "sensor", CURRENT);
-        MQTTclient.announce("Circuit Current L3", "sensor", CURRENT);
-    }
-    if (homeBatteryLastUpdate) {
-        MQTTclient.announce("Home Battery Current", "sensor", CURRENT);
+    switch (section) {
+    case 0: {
+        // sensors with device class 'current' share a static payload literal.
+        const char *CURRENT = ", \"device_class\":\"current\", \"state_class\":\"measurement\", \"unit_of_measurement\":\"A\", \"value_template\":\"{{ value | int / 10 }}\"";
+        MQTTclient.announce("Charge Current", "sensor", CURRENT);
+        MQTTclient.announce("Max Current",    "sensor", CURRENT);
+        if (MainsMeter.Type) {
+            MQTTclient.announce("Mains Current L1", "sensor", CURRENT);
+            MQTTclient.announce("Mains Current L2", "sensor", CURRENT);
+            MQTTclient.announce("Mains Current L3", "sensor", CURRENT);
+        }
+        if (EVMeter.Type) {
+            MQTTclient.announce("EV Current L1", "sensor", CURRENT);
+            MQTTclient.announce("EV Current L2", "sensor", CURRENT);
+            MQTTclient.announce("EV Current L3", "sensor", CURRENT);
+        }
+        if (CircuitMeter.Type) {
+            MQTTclient.announce("Circuit Current L1", "sensor", CURRENT);
+            MQTTclient.announce("Circuit Current L2", "sensor", CURRENT);
+            MQTTclient.announce("Circuit Current L3", "sensor", CURRENT);
+        }
+        if (homeBatteryLastUpdate) {
+            MQTTclient.announce("Home Battery Current", "sensor", CURRENT);
+        }
+        MQTTclient.announce("Max Sum Mains", "sensor", ", \"device_class\":\"current\", \"state_class\":\"measurement\", \"unit_of_measurement\":\"A\"");
+        break;
     }
-    MQTTclient.announce("Max Sum Mains", "sensor", ", \"device_class\":\"current\", \"state_class\":\"measurement\", \"unit_of_measurement\":\"A\"");
-
+    case 1: {
 #if MODEM
-    {
-        const char *SOC_PCT = ", \"unit_of_measurement\":\"%\", \"value_template\":\"{{ none if (value | int == -1) else (value | int) }}\"";
-        MQTTclient.announce("EV Initial SoC",   "sensor", SOC_PCT);
-        MQTTclient.announce("EV Full SoC",      "sensor", SOC_PCT);
-        MQTTclient.announce("EV Computed SoC",  "sensor", SOC_PCT);
-        MQTTclient.announce("EV Remaining SoC", "sensor", SOC_PCT);
-    }
-    MQTTclient.announce("EV Time Until Full", "sensor",
-        ", \"device_class\":\"duration\", \"unit_of_measurement\":\"m\", \"value_template\":\"{{ none if (value | int == -1) else (value | int / 60) | round }}\"");
-    {
-        const char *EN_OR_NONE = ", \"device_class\":\"energy\", \"unit_of_measurement\":\"Wh\", \"value_template\":\"{{ none if (value | int == -1) else (value | int) }}\"";
-        MQTTclient.announce("EV Energy Capacity", "sensor", EN_OR_NONE);
-        MQTTclient.announce("EV Energy Request",  "sensor", EN_OR_NONE);
-    }
-    MQTTclient.announce("EVCCID", "sensor", ", \"value_template\":\"{{ none if (value == '') else value }}\"");
-    snprintf(opt, sizeof(opt),
-        ", \"state_topic\":\"%s/RequiredEVCCID\", \"command_topic\":\"%s/Set/RequiredEVCCID\"", p, p);
-    MQTTclient.announce("Required EVCCID", "text", opt);
+        {
+            const char *SOC_PCT = ", \"unit_of_measurement\":\"%\", \"value_template\":\"{{ none if (value | int == -1) else (value | int) }}\"";
+            MQTTclient.announce("EV Initial SoC",   "sensor", SOC_PCT);
+            MQTTclient.announce("EV Full SoC",      "sensor", SOC_PCT);
+            MQTTclient.announce("EV Computed SoC",  "sensor", SOC_PCT);
+            MQTTclient.announce("EV Remaining SoC", "sensor", SOC_PCT);
+        }
+        MQTTclient.announce("EV Time Until Full", "sensor",
+            ", \"device_class\":\"duration\", \"unit_of_measurement\":\"m\", \"value_template\":\"{{ none if (value | int == -1) else (value | int / 60) | round }}\"");
+        {
+            const char *EN_OR_NONE = ", \"device_class\":\"energy\", \"unit_of_measurement\":\"Wh\", \"value_template\":\"{{ none if (value | int == -1) else (value | int) }}\"";
+            MQTTclient.announce("EV Energy Capacity", "sensor", EN_OR_NONE);
+            MQTTclient.announce("EV Energy Request",  "sensor", EN_OR_NONE);
+        }
+        MQTTclient.announce("EVCCID", "sensor", ", \"value_template\":\"{{ none if (value == '') else value }}\"");
+        snprintf(opt, sizeof(opt),
+            ", \"state_topic\":\"%s/RequiredEVCCID\", \"command_topic\":\"%s/Set/RequiredEVCCID\"", p, p);
+        MQTTclient.announce("Required EVCCID", "text", opt);
 #endif
-
-    {
+        break;
+    }
+    case 2: {
         const char *EN_TOTAL = ", \"device_class\":\"energy\", \"unit_of_measurement\":\"Wh\", \"state_class\":\"total_increasing\"";
         if (MainsMeter.Type) {
             MQTTclient.announce("Mains Import Active Energy", "sensor", EN_TOTAL);
@@ -831,196 +1011,334 @@ void SetupMQTTClient() {
             MQTTclient.announce("EV Energy Charged",       "sensor", EN_TOTAL);
             MQTTclient.announce("EV Total Energy Charged", "sensor", EN_TOTAL);
         }
+        break;
     }
-
-    // sensor entities without device_class or unit_of_measurement
-    MQTTclient.announce("EV Plug State", "sensor", "");
-    MQTTclient.announce("Access",        "sensor", "");
-    MQTTclient.announce("State",         "sensor", "");
-    MQTTclient.announce("StateID",       "sensor", "");
-    MQTTclient.announce("RFID",          "sensor", "");
-    MQTTclient.announce("RFIDLastRead",  "sensor", "");
-    MQTTclient.announce("NrOfPhases",    "sensor", "");
-    MQTTclient.announce("OCPP",           "sensor", "");
-    MQTTclient.announce("OCPPConnection", "sensor", "");
-
-    // LED color text entities: build state_topic/command_topic with snprintf.
-    #define ANN_LED(label, slug) do { \
-        snprintf(opt, sizeof(opt), \
-            ", \"state_topic\":\"%s/LEDColor" slug "\", \"command_topic\":\"%s/Set/Color" slug "\"", p, p); \
-        MQTTclient.announce("LED Color " label, "text", opt); \
-    } while (0)
-    ANN_LED("Off",    "Off");
-    ANN_LED("Normal", "Normal");
-    ANN_LED("Smart",  "Smart");
-    ANN_LED("Solar",  "Solar");
-    ANN_LED("Custom", "Custom");
-    #undef ANN_LED
-
-    snprintf(opt, sizeof(opt),
-        ", \"state_topic\":\"%s/CustomButton\", \"command_topic\":\"%s/Set/CustomButton\", \"options\":[\"On\", \"Off\"]", p, p);
-    MQTTclient.announce("Custom Button", "select", opt);
-
-    MQTTclient.announce("SolarStopTimer",    "sensor", ", \"device_class\":\"duration\", \"unit_of_measurement\":\"s\"");
-    MQTTclient.announce("Max Sum Mains Time","sensor", ", \"device_class\":\"duration\", \"unit_of_measurement\":\"min\"");
-
-    // diagnostic sensors
-    MQTTclient.announce("Error",      "sensor", ", \"entity_category\":\"diagnostic\"");
-    MQTTclient.announce("WiFi SSID",  "sensor", ", \"entity_category\":\"diagnostic\"");
-    MQTTclient.announce("WiFi BSSID", "sensor", ", \"entity_category\":\"diagnostic\"");
-    MQTTclient.announce("WiFi RSSI",  "sensor",
-        ", \"entity_category\":\"diagnostic\", \"device_class\":\"signal_strength\", \"unit_of_measurement\":\"dBm\", \"state_class\":\"measurement\"");
-    MQTTclient.announce("ESP Temp",   "sensor",
-        ", \"entity_category\":\"diagnostic\", \"device_class\":\"temperature\", \"unit_of_measurement\":\"°C\", \"state_class\":\"measurement\"");
-    MQTTclient.announce("ESP Uptime", "sensor",
-        ", \"entity_category\":\"diagnostic\", \"device_class\":\"duration\", \"unit_of_measurement\":\"s\", \"state_class\":\"measurement\", \"entity_registry_enabled_default\":\"False\"");
-
+    case 3: {
+        // sensor entities without device_class or unit_of_measurement
+        MQTTclient.announce("EV Plug State", "sensor", "");
+        MQTTclient.announce("Access",        "sensor", "");
+        MQTTclient.announce("State",         "sensor", "");
+        MQTTclient.announce("StateID",       "sensor", "");
+        MQTTclient.announce("RFID",          "sensor", "");
+        MQTTclient.announce("RFIDLastRead",  "sensor", "");
+        MQTTclient.announce("NrOfPhases",    "sensor", "");
+        MQTTclient.announce("OCPP",           "sensor", "");
+        MQTTclient.announce("OCPPConnection", "sensor", "");
+        break;
+    }
+    case 4: {
+        // LED color text entities: build state_topic/command_topic with snprintf.
+        #define ANN_LED(label, slug) do { \
+            snprintf(opt, sizeof(opt), \
+                ", \"state_topic\":\"%s/LEDColor" slug "\", \"command_topic\":\"%s/Set/Color" slug "\"", p, p); \
+            MQTTclient.announce("LED Color " label, "text", opt); \
+        } while (0)
+        ANN_LED("Off",    "Off");
+        ANN_LED("Normal", "Normal");
+        ANN_LED("Smart",  "Smart");
+        ANN_LED("Solar",  "Solar");
+        ANN_LED("Custom", "Custom");
+        #undef ANN_LED
+        break;
+    }
+    case 5: {
+        snprintf(opt, sizeof(opt),
+            ", \"state_topic\":\"%s/CustomButton\", \"command_topic\":\"%s/Set/CustomButton\", \"options\":[\"On\", \"Off\"]", p, p);
+        MQTTclient.announce("Custom Button", "select", opt);
+
+        MQTTclient.announce("SolarStopTimer",    "sensor", ", \"device_class\":\"duration\", \"unit_of_measurement\":\"s\"");
+        MQTTclient.announce("Max Sum Mains Time","sensor", ", \"device_class\":\"duration\", \"unit_of_measurement\":\"min\"");
+        break;
+    }
+    case 6: {
+        // diagnostic sensors
+        MQTTclient.announce("Error",      "sensor", ", \"entity_category\":\"diagnostic\"");
+        MQTTclient.announce("WiFi SSID",  "sensor", ", \"entity_category\":\"diagnostic\"");
+        MQTTclient.announce("WiFi BSSID", "sensor", ", \"entity_category\":\"diagnostic\"");
+        MQTTclient.announce("WiFi RSSI",  "sensor",
+            ", \"entity_category\":\"diagnostic\", \"device_class\":\"signal_strength\", \"unit_of_measurement\":\"dBm\", \"state_class\":\"measurement\"");
+        MQTTclient.announce("ESP Temp",   "sensor",
+            ", \"entity_category\":\"diagnostic\", \"device_class\":\"temperature\", \"unit_of_measurement\":\"°C\", \"state_class\":\"measurement\"");
+        MQTTclient.announce("ESP Uptime", "sensor",
+            ", \"entity_category\":\"diagnostic\", \"device_class\":\"duration\", \"unit_of_measurement\":\"s\", \"state_class\":\"measurement\", \"entity_registry_enabled_default\":\"False\"");
+        break;
+    }
+    case 7: {
 #if MODEM
-    MQTTclient.announce("CP PWM", "sensor",
-        ", \"unit_of_measurement\":\"%\", \"value_template\":\"{{ (value | int / 1024 * 100) | round(0) }}\"");
-    snprintf(opt, sizeof(opt),
-        ", \"value_template\":\"{{ none if (value | int == -1) else (value | int / 1024 * 100) | round }}\""
-        ", \"command_topic\":\"%s/Set/CPPWMOverride\", \"min\":\"-1\", \"max\":\"100\", \"mode\":\"slider\""
-        ", \"command_template\":\"{{ (value | int * 1024 / 100) | round }}\"", p);
-    MQTTclient.announce("CP PWM Override", "number", opt);
+        MQTTclient.announce("CP PWM", "sensor",
+            ", \"unit_of_measurement\":\"%\", \"value_template\":\"{{ (value | int / 1024 * 100) | round(0) }}\"");
+        snprintf(opt, sizeof(opt),
+            ", \"value_template\":\"{{ none if (value | int == -1) else (value | int / 1024 * 100) | round }}\""
+            ", \"command_topic\":\"%s/Set/CPPWMOverride\", \"min\":\"-1\", \"max\":\"100\", \"mode\":\"slider\""
+            ", \"command_template\":\"{{ (value | int * 1024 / 100) | round }}\"", p);
+        MQTTclient.announce("CP PWM Override", "number", opt);
 #endif
+        break;
+    }
+    case 8: {
+        // select entities, overriding automatic state_topic:
+        snprintf(opt, sizeof(opt),
+            ", \"state_topic\":\"%s/Mode\", \"command_topic\":\"%s/Set/Mode\""
+            ", \"options\":[\"Off\", \"Normal\", \"Smart\", \"Solar\", \"Pause\"]", p, p);
+        MQTTclient.announce("Mode", "select", opt);
+
+        snprintf(opt, sizeof(opt),
+            ", \"state_topic\":\"%s/EnableC2\", \"command_topic\":\"%s/Set/EnableC2\""
+            ", \"options\":[\"Not present\", \"Always Off\", \"Solar Off\", \"Always On\", \"Auto\"]", p, p);
+        MQTTclient.announce("EnableC2", "select", opt);
+
+        if (LoadBl == 1) {
+            snprintf(opt, sizeof(opt),
+                ", \"state_topic\":\"%s/BalancePolicy\", \"command_topic\":\"%s/Set/BalancePolicy\""
+                ", \"options\":[\"Equal\", \"Weighted\", \"Priority\", \"FCFS\", \"Deficit\"]", p, p);
+            MQTTclient.announce("BalancePolicy", "select", opt);
+        }
+        break;
+    }
+    case 9: {
+        // number entities:
+        snprintf(opt, sizeof(opt),
+            ", \"command_topic\":\"%s/Set/CurrentOverride\", \"min\":\"0\", \"max\":\"%u\", \"mode\":\"slider\""
+            ", \"value_template\":\"{{ value | int / 10 if value | is_number else none }}\""
+            ", \"command_template\":\"{{ value | int * 10 }}\"", p, (unsigned)MaxCurrent);
+        MQTTclient.announce("Charge Current Override", "number", opt);
+
+        // Cable Lock:
+        snprintf(opt, sizeof(opt),
+            ", \"cablelock_topic\":\"%s/CableLock\", \"command_topic\":\"%s/Set/CableLock\""
+            ", \"options\":[\"0\", \"1\"]", p, p);
+        MQTTclient.announce("Cable Lock", "select", opt);
+        break;
+    }
+    default:
+        return false;
+    }
+    return true;
+}
 
-    // select entities, overriding automatic state_topic:
-    snprintf(opt, sizeof(opt),
-        ", \"state_topic\":\"%s/Mode\", \"command_topic\":\"%s/Set/Mode\""
-        ", \"options\":[\"Off\", \"Normal\", \"Smart\", \"Solar\", \"Pause\"]", p, p);
-    MQTTclient.announce("Mode", "select", opt);
+void SetupMQTTClient() {
+    mqttCacheInvalidate();
+    // Set up subscriptions
+    MQTTclient.subscribe(MQTTprefix + "/Set/#",1);
+    MQTTclient.subscribe("homeassistant/status", 0);                    // HA birth message, see mqtt_receive_callback()
+    for (Meter *meter : {&MainsMeter, &CircuitMeter, &EVMeter}) {      // networked meters that publish to the broker
+        if (meter->Transport == METER_MQTT && meter->DevicePath[0]) MQTTclient.subscribe(meter->DevicePath, 0);
+    }
+    siteSubscribe();
+    MQTTclient.publish(MQTTprefix+"/connected", "online", true, 0);
 
-    snprintf(opt, sizeof(opt),
-        ", \"state_topic\":\"%s/EnableC2\", \"command_topic\":\"%s/Set/EnableC2\""
-        ", \"options\":[\"Not present\", \"Always Off\", \"Solar Off\", \"Always On\", \"Auto\"]", p, p);
-    MQTTclient.announce("EnableC2", "select", opt);
+    MQTTclient.discoveryStart(mqttAnnounceEntities);
+}
 
-    // number entities:
-    snprintf(opt, sizeof(opt),
-        ", \"command_topic\":\"%s/Set/CurrentOverride\", \"min\":\"0\", \"max\":\"%u\", \"mode\":\"slider\""
-        ", \"value_template\":\"{{ value | int / 10 if value | is_number else none }}\""
-        ", \"command_template\":\"{{ value | int * 10 }}\"", p, (unsigned)MaxCurrent);
-    MQTTclient.announce("Charge Current Override", "number", opt);
+// Telemetry schema: every value that is published as its own topic, shared by the
+// local MQTT client (mqttPublishData) and the SmartEVSE app client (mqttSmartEVSEPublishData).
+// fmt() writes the value into buf and returns its length, or -1 when the topic is not published now.
+#define TM_LOCAL                0x01                                    // published on the local MQTT broker
+#define TM_APP                  0x02                                    // published on the SmartEVSE app server
+#define TM_RETAIN               0x04
+
+struct TelemetryTopic {
+    const char *suffix;
+    uint8_t flags;
+    int (*fmt)(char *buf, size_t len);
+};
 
-    // Cable Lock:
-    snprintf(opt, sizeof(opt),
-        ", \"cablelock_topic\":\"%s/CableLock\", \"command_topic\":\"%s/Set/CableLock\""
-        ", \"options\":[\"0\", \"1\"]", p, p);
-    MQTTclient.announce("Cable Lock", "select", opt);
+#define TM_INT(cond, v) [](char *b, size_t l) -> int { return (cond) ? snprintf(b, l, "%ld", (long)(v)) : -1; }
+#define TM_STR(cond, v) [](char *b, size_t l) -> int { return (cond) ? snprintf(b, l, "%s", (const char *)(v)) : -1; }
+#define TM_RGB(c)       [](char *b, size_t l) -> int { return snprintf(b, l, "%u,%u,%u", c[0], c[1], c[2]); }
+
+static const TelemetryTopic telemetryTopics[] = {
+    // only export energies when not zero, because after boot it is zero = empty value
+    { "/MainsCurrentL1",          TM_LOCAL | TM_APP,             TM_INT(MainsMeter.Type, MainsMeter.Irms[0]) },
+    { "/MainsCurrentL2",          TM_LOCAL | TM_APP,             TM_INT(MainsMeter.Type, MainsMeter.Irms[1]) },
+    { "/MainsCurrentL3",          TM_LOCAL | TM_APP,             TM_INT(MainsMeter.Type, MainsMeter.Irms[2]) },
+    { "/MainsImportActiveEnergy", TM_LOCAL,                      TM_INT(MainsMeter.Type && MainsMeter.Import_active_energy, MainsMeter.Import_active_energy) },
+    { "/MainsExportActiveEnergy", TM_LOCAL,                      TM_INT(MainsMeter.Type && MainsMeter.Export_active_energy, MainsMeter.Export_active_energy) },
+    { "/EVCurrentL1",             TM_LOCAL,                      TM_INT(EVMeter.Type, EVMeter.Irms[0]) },
+    { "/EVCurrentL2",             TM_LOCAL,                      TM_INT(EVMeter.Type, EVMeter.Irms[1]) },
+    { "/EVCurrentL3",             TM_LOCAL,                      TM_INT(EVMeter.Type, EVMeter.Irms[2]) },
+    { "/EVImportActiveEnergy",    TM_LOCAL | TM_APP,             TM_INT(EVMeter.Type && EVMeter.Import_active_energy, EVMeter.Import_active_energy) },
+    { "/EVExportActiveEnergy",    TM_LOCAL,                      TM_INT(EVMeter.Type && EVMeter.Export_active_energy, EVMeter.Export_active_energy) },
+    { "/CircuitCurrentL1",        TM_LOCAL,                      TM_INT(CircuitMeter.Type, CircuitMeter.Irms[0]) },
+    { "/CircuitCurrentL2",        TM_LOCAL,                      TM_INT(CircuitMeter.Type, CircuitMeter.Irms[1]) },
+    { "/CircuitCurrentL3",        TM_LOCAL,                      TM_INT(CircuitMeter.Type, CircuitMeter.Irms[2]) },
+    { "/ESPTemp",                 TM_LOCAL,                      TM_INT(true, TempEVSE) },
+    { "/Mode",                    TM_LOCAL | TM_APP | TM_RETAIN, TM_STR(true, AccessStatus == OFF ? "Off" : AccessStatus == PAUSE ? "Pause" : Mode > 3 ? "N/A" : StrMode[Mode]) },
+    { "/MaxCurrent",              TM_LOCAL | TM_APP | TM_RETAIN, TM_INT(true, MaxCurrent * 10) },
+    { "/MaxSumMains",             TM_LOCAL | TM_RETAIN,          TM_INT(true, MaxSumMains) },
+    { "/MaxSumMainsTime",         TM_LOCAL | TM_RETAIN,          TM_INT(true, MaxSumMainsTime) },
+    { "/CustomButton",            TM_LOCAL,                      TM_STR(true, CustomButton ? "On" : "Off") },
+    { "/ChargeCurrent",           TM_LOCAL | TM_APP | TM_RETAIN, TM_INT(true, Balanced[0]) },
+    { "/ChargeCurrentOverride",   TM_LOCAL | TM_APP | TM_RETAIN, TM_INT(true, OverrideCurrent) },
+    { "/NrOfPhases",              TM_LOCAL | TM_APP | TM_RETAIN, TM_INT(true, Nr_Of_Phases_Charging) },
+    { "/Access",                  TM_LOCAL | TM_APP | TM_RETAIN, TM_STR(true, AccessStatus == OFF ? "Deny" : AccessStatus == ON ? "Allow" : AccessStatus == PAUSE ? "Pause" : "N/A") },
+    { "/RFID",                    TM_LOCAL | TM_RETAIN,          TM_STR(true, !RFIDReader ? "Not Installed" : RFIDstatus >= 8 ? "NOSTATUS" : StrRFIDStatusWeb[RFIDstatus]) },
+    { "/EnableC2",                TM_LOCAL | TM_RETAIN,          TM_STR(true, StrEnableC2[EnableC2]) },
+    { "/BalancePolicy",           TM_LOCAL | TM_RETAIN,          TM_STR(LoadBl == 1, StrBalancePolicy[BalancePolicy]) },
+    { "/BalanceWeights",          TM_LOCAL | TM_RETAIN,          TM_STR(LoadBl == 1, BalanceWeights) },
+    { "/SiteAllotment",           TM_LOCAL,                      TM_INT(SiteRole != SITE_OFF && LoadBl < 2, SiteAllotted.limit(SiteFallback * 10, millis())) },
+    { "/RFIDLastRead",            TM_LOCAL | TM_RETAIN,          [](char *b, size_t l) -> int { if (!RFIDReader || l < 15) return -1; printRFID(b); return strlen(b); } },
+    { "/State",                   TM_LOCAL | TM_APP | TM_RETAIN, TM_STR(true, getStateNameWeb(State)) },
+    { "/StateID",                 TM_LOCAL | TM_RETAIN,          TM_STR(true, getStateName(State)) },    //try evcc.io
+    { "/Error",                   TM_LOCAL | TM_APP | TM_RETAIN, TM_STR(true, getErrorNameWeb(ErrorFlags)) },
+    { "/EVPlugState",             TM_LOCAL | TM_RETAIN,          TM_STR(true, (pilot != PILOT_12V) ? "Connected" : "Disconnected") },
+    { "/WiFiSSID",                TM_LOCAL | TM_RETAIN,          [](char *b, size_t l) -> int {
+        wifi_config_t conf = {};
+        esp_wifi_get_config(WIFI_IF_STA, &conf);
+        return snprintf(b, l, "%.32s", (const char *)conf.sta.ssid); } },
+    { "/WiFiBSSID",               TM_LOCAL | TM_RETAIN,          [](char *b, size_t l) -> int {
+        wifi_ap_record_t ap = {};
+        esp_wifi_sta_get_ap_info(&ap);
+        return snprintf(b, l, "%02X:%02X:%02X:%02X:%02X:%02X", ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5]); } },
+#if MODEM
+    { "/CPPWM",                   TM_LOCAL,                      TM_INT(true, CurrentPWM) },
+    { "/CPPWMOverride",           TM_LOCAL | TM_RETAIN,          TM_INT(true, CPDutyOverride ? (long)CurrentPWM : -1L) },
+    { "/EVInitialSoC",            TM_LOCAL | TM_RETAIN,          TM_INT(true, InitialSoC) },
+    { "/EVFullSoC",               TM_LOCAL | TM_RETAIN,          TM_INT(true, FullSoC) },
+    { "/EVComputedSoC",           TM_LOCAL | TM_RETAIN,          TM_INT(true, ComputedSoC) },
+    { "/EVRemainingSoC",          TM_LOCAL | TM_RETAIN,          TM_INT(true, RemainingSoC) },
+    { "/EVTimeUntilFull",         TM_LOCAL,                      TM_INT(true, TimeUntilFull) },
+    { "/EVEnergyCapacity",        TM_LOCAL | TM_RETAIN,          TM_INT(true, EnergyCapacity) },
+    { "/EVEnergyRequest",         TM_LOCAL | TM_RETAIN,          TM_INT(true, EnergyRequest) },
+    { "/EVCCID",                  TM_LOCAL | TM_RETAIN,          TM_STR(true, EVCCID) },
+    { "/RequiredEVCCID",          TM_LOCAL | TM_RETAIN,          TM_STR(true, RequiredEVCCID) },
+#endif
+    { "/EVChargePower",           TM_LOCAL | TM_APP,             TM_INT(EVMeter.Type, EVMeter.PowerMeasured) },
+    { "/EVEnergyCharged",         TM_LOCAL | TM_APP | TM_RETAIN, TM_INT(EVMeter.Type, EVMeter.EnergyCharged) },
+    { "/EVTotalEnergyCharged",    TM_LOCAL,                      TM_INT(EVMeter.Type, EVMeter.Energy) },
+    { "/HomeBatteryCurrent",      TM_LOCAL,                      TM_INT(homeBatteryLastUpdate, homeBatteryCurrent) },
+    { "/OCPP",                    TM_LOCAL | TM_RETAIN,          TM_STR(true, OcppMode ? "Enabled" : "Disabled") },
+    { "/OCPPConnection",          TM_LOCAL,                      TM_STR(true, (OcppWsClient && OcppWsClient->isConnected()) ? "Connected" : "Disconnected") },
+    { "/LEDColorOff",             TM_LOCAL | TM_RETAIN,          TM_RGB(ColorOff) },
+    { "/LEDColorNormal",          TM_LOCAL | TM_RETAIN,          TM_RGB(ColorNormal) },
+    { "/LEDColorSmart",           TM_LOCAL | TM_RETAIN,          TM_RGB(ColorSmart) },
+    { "/LEDColorSolar",           TM_LOCAL | TM_RETAIN,          TM_RGB(ColorSolar) },
+    { "/LEDColorCustom",          TM_LOCAL | TM_RETAIN,          TM_RGB(ColorCustom) },
+    { "/CableLock",               TM_LOCAL | TM_RETAIN,          TM_INT(Lock != 0, CableLock) },
+    { "/ESPUptime",               TM_LOCAL,                      TM_INT(true, esp_timer_get_time() / 1000000) },
+    { "/WiFiRSSI",                TM_LOCAL,                      TM_INT(true, WiFi.RSSI()) },
+    { "/LoadBl",                  TM_LOCAL | TM_APP | TM_RETAIN, TM_INT(true, LoadBl) },
+    { "/PairingPin",              TM_LOCAL | TM_APP | TM_RETAIN, TM_STR(true, PairingPin.c_str()) },
+    { "/SolarStopTimer",          TM_LOCAL | TM_APP,             TM_INT(true, SolarStopTimer) },
+    { "/Version",                 TM_APP | TM_RETAIN,            TM_STR(true, VERSION) },
+};
+#define TELEMETRY_TOPICS        (sizeof(telemetryTopics) / sizeof(telemetryTopics[0]))
+
+#undef TM_INT
+#undef TM_STR
+#undef TM_RGB
+
+// Change detection per publisher: a hash of the last value sent for every schema entry and
+// when it was sent. A topic is only published when its value changed or its max-age heartbeat
+// expired. Retained topics live on the broker, so they get a much longer heartbeat.
+#define MQTT_MAXAGE_RETAINED    600                                     // seconds
+#define MQTT_MAXAGE_VOLATILE    60                                      // seconds
+
+struct TelemetryCache {
+    uint32_t hash[TELEMETRY_TOPICS];
+    uint32_t sent[TELEMETRY_TOPICS];                                    // uptime in seconds of the last publish
+    bool valid[TELEMETRY_TOPICS];
+    uint32_t dropped;                                                   // outbox drop count at the last pass
+    volatile bool stale;                                                // set from other tasks: resend everything
+};
+static TelemetryCache mqttCache, appCache;
+
+// Make the next mqttPublishData() send every topic; the publisher clears its own cache.
+// Called on (re)connect from the MQTT task, the broker may have lost our retained topics.
+void mqttCacheInvalidate() {
+    mqttCache.stale = true;
 }
 
-void mqttPublishData() {
-    lastMqttUpdate = 0;
+// Publish the changed schema entries for one target (TM_LOCAL or TM_APP) as <prefix><suffix>.
+// publish() returns false when the message was not queued. An entry only counts as sent once
+// it was queued, and when the outbox dropped messages since the last pass all entries are resent,
+// as the outbox does not tell which topics were lost.
+template<typename P> static void telemetryPublish(uint8_t target, TelemetryCache &cache, const char *prefix, MQTToutbox_t &outbox, P publish) {
+    uint32_t now = (uint32_t)(esp_timer_get_time() / 1000000);
+    char t[96], v[64];
+
+    uint32_t dropped = outbox.stats().dropped;
+    if (cache.stale || dropped != cache.dropped) {
+        cache.stale = false;
+        memset(cache.valid, 0, sizeof(cache.valid));
+        cache.dropped = dropped;
+    }
 
-    // Local helpers: build the prefixed topic on the stack so we don't burn
-    // ~50 String reallocations every MQTT publish cycle. Topic length is
-    // bounded by MQTTprefix (small) + a literal suffix; 96 bytes is plenty.
-    auto mqPub  = [](const char *suffix, const char *value, size_t vlen, bool retain, int qos) {
-        char t[96];
-        int n = snprintf(t, sizeof(t), "%s%s", MQTTprefix.c_str(), suffix);
-        if (n > 0 && n < (int)sizeof(t)) MQTTclient.publish(t, value, vlen, retain, qos);
-    };
-    auto mqPubI = [&](const char *suffix, int32_t v, bool retain, int qos) {
-        char b[12]; int n = snprintf(b, sizeof(b), "%ld", (long)v);
-        if (n > 0) mqPub(suffix, b, (size_t)n, retain, qos);
+    for (size_t i = 0; i < TELEMETRY_TOPICS; i++) {
+        const TelemetryTopic &tt = telemetryTopics[i];
+        if (!(tt.flags & target)) continue;
+        int n = tt.fmt(v, sizeof(v));
+        if (n < 0 || n >= (int)sizeof(v)) continue;
+
+        bool retain = tt.flags & TM_RETAIN;
+        uint32_t hash = fnv1a(v, n);
+        if (cache.valid[i] && cache.hash[i] == hash &&
+            now - cache.sent[i] < (retain ? MQTT_MAXAGE_RETAINED : MQTT_MAXAGE_VOLATILE)) continue;
+
+        int tn = snprintf(t, sizeof(t), "%s%s", prefix, tt.suffix);
+        if (tn <= 0 || tn >= (int)sizeof(t)) continue;
+        cache.valid[i] = publish(t, v, (size_t)n, retain);
+        cache.hash[i] = hash;
+        cache.sent[i] = now;
+    }
+}
+
+// Publish all telemetry as one JSON document on <prefix>/Telemetry.
+// Currents in 0.1A, energies in Wh, power in W, PWM in 1/1024, SoC in %.
+// Built in a fixed stack buffer; a meter that is not configured is left out.
+static void mqttPublishTelemetry() {
+    char buf[640], t[96];
+    size_t n = 0;
+    auto add = [&](const char *fmt, ...) {
+        va_list ap;
+        va_start(ap, fmt);
+        n += mg_vsnprintf(buf + (n < sizeof(buf) ? n : sizeof(buf)), n < sizeof(buf) ? sizeof(buf) - n : 0, fmt, &ap);
+        va_end(ap);
     };
-    auto mqPubS = [&](const char *suffix, const char *v, bool retain, int qos) {
-        mqPub(suffix, v, strlen(v), retain, qos);
+    auto addMeter = [&](const char *name, Meter &m, bool energy) {
+        if (!m.Type) return;
+        add(",%m:{\"irms\":[%d,%d,%d]", MG_ESC(name), m.Irms[0], m.Irms[1], m.Irms[2]);
+        if (energy) add(",\"import_wh\":%ld,\"export_wh\":%ld", (long)m.Import_active_energy, (long)m.Export_active_energy);
+        add("}");
     };
 
-        if (MainsMeter.Type) {
-            mqPubI("/MainsCurrentL1", MainsMeter.Irms[0], false, 0);
-            mqPubI("/MainsCurrentL2", MainsMeter.Irms[1], false, 0);
-            mqPubI("/MainsCurrentL3", MainsMeter.Irms[2], false, 0);
-            if (MainsMeter.Import_active_energy) //only export when not zero, because after boot it is zero = empty value
-                mqPubI("/MainsImportActiveEnergy", MainsMeter.Import_active_energy, false, 0);
-            if (MainsMeter.Export_active_energy) //only export when not zero, because after boot it is zero = empty value
-                mqPubI("/MainsExportActiveEnergy", MainsMeter.Export_active_energy, false, 0);
-        }
-        if (EVMeter.Type) {
-            mqPubI("/EVCurrentL1", EVMeter.Irms[0], false, 0);
-            mqPubI("/EVCurrentL2", EVMeter.Irms[1], false, 0);
-            mqPubI("/EVCurrentL3", EVMeter.Irms[2], false, 0);
-            if (EVMeter.Import_active_energy) //only export when not zero, because after boot it is zero = empty value
-                mqPubI("/EVImportActiveEnergy", EVMeter.Import_active_energy, false, 0);
-            if (EVMeter.Export_active_energy) //only export when not zero, because after boot it is zero = empty value
-                mqPubI("/EVExportActiveEnergy", EVMeter.Export_active_energy, false, 0);
-        }
-        if (CircuitMeter.Type) {
-            mqPubI("/CircuitCurrentL1", CircuitMeter.Irms[0], false, 0);
-            mqPubI("/CircuitCurrentL2", CircuitMeter.Irms[1], false, 0);
-            mqPubI("/CircuitCurrentL3", CircuitMeter.Irms[2], false, 0);
-        }
-        mqPubI("/ESPTemp", TempEVSE, false, 0);
-        mqPubS("/Mode", AccessStatus == OFF ? "Off" : AccessStatus == PAUSE ? "Pause" : Mode > 3 ? "N/A" : StrMode[Mode], true, 0);
-        mqPubI("/MaxCurrent", MaxCurrent * 10, true, 0);
-        mqPubI("/MaxSumMains", MaxSumMains, true, 0);
-        mqPubI("/MaxSumMainsTime", MaxSumMainsTime, true, 0);
-        mqPubS("/CustomButton", CustomButton ? "On" : "Off", false, 0);
-        mqPubI("/ChargeCurrent", Balanced[0], true, 0);
-        mqPubI("/ChargeCurrentOverride", OverrideCurrent, true, 0);
-        mqPubI("/NrOfPhases", Nr_Of_Phases_Charging, true, 0);
-        mqPubS("/Access", AccessStatus == OFF ? "Deny" : AccessStatus == ON ? "Allow" : AccessStatus == PAUSE ? "Pause" : "N/A", true, 0);
-        mqPubS("/RFID", !RFIDReader ? "Not Installed" : RFIDstatus >= 8 ? "NOSTATUS" : StrRFIDStatusWeb[RFIDstatus], true, 0);
-        mqPubS("/EnableC2", StrEnableC2[EnableC2], true, 0);
-        if (RFIDReader) {
-            char buf[15];
-            printRFID(buf);
-            mqPubS("/RFIDLastRead", buf, true, 0);
-        }
-        mqPubS("/State", getStateNameWeb(State), true, 0);
-        //try evcc.io
-        mqPubS("/StateID", getStateName(State), true, 0);
-        mqPubS("/Error", getErrorNameWeb(ErrorFlags), true, 0);
-        mqPubS("/EVPlugState", (pilot != PILOT_12V) ? "Connected" : "Disconnected", true, 0);
-        mqPubS("/WiFiSSID", WiFi.SSID().c_str(), true, 0);
-        mqPubS("/WiFiBSSID", WiFi.BSSIDstr().c_str(), true, 0);
+    add("{\"uptime\":%lu,\"state\":%m,\"state_id\":%u,\"error\":%m,\"error_id\":%u,\"mode\":%m,"
+        "\"charge_current\":%u,\"override_current\":%u,\"phases\":%u,\"temp\":%d",
+        (unsigned long)(esp_timer_get_time() / 1000000), MG_ESC(getStateNameWeb(State)), State,
+        MG_ESC(getErrorNameWeb(ErrorFlags)), ErrorFlags,
+        MG_ESC(AccessStatus == OFF ? "Off" : AccessStatus == PAUSE ? "Pause" : Mode > 3 ? "N/A" : StrMode[Mode]),
+        Balanced[0], OverrideCurrent, Nr_Of_Phases_Charging, TempEVSE);
+    addMeter("mains", MainsMeter, true);
+    addMeter("ev", EVMeter, true);
+    addMeter("circuit", CircuitMeter, false);
+    if (EVMeter.Type)
+        add(",\"ev_power\":%d,\"ev_charged_wh\":%ld", EVMeter.PowerMeasured, (long)EVMeter.EnergyCharged);
 #if MODEM
-        mqPubI("/CPPWM", CurrentPWM, false, 0);
-        if (CPDutyOverride) mqPubI("/CPPWMOverride", CurrentPWM, true, 0);
-        else                mqPubS("/CPPWMOverride", "-1", true, 0);
-        mqPubI("/EVInitialSoC", InitialSoC, true, 0);
-        mqPubI("/EVFullSoC", FullSoC, true, 0);
-        mqPubI("/EVComputedSoC", ComputedSoC, true, 0);
-        mqPubI("/EVRemainingSoC", RemainingSoC, true, 0);
-        mqPubI("/EVTimeUntilFull", TimeUntilFull, false, 0);
-        mqPubI("/EVEnergyCapacity", EnergyCapacity, true, 0);
-        mqPubI("/EVEnergyRequest", EnergyRequest, true, 0);
-        mqPubS("/EVCCID", EVCCID, true, 0);
-        mqPubS("/RequiredEVCCID", RequiredEVCCID, true, 0);
+    add(",\"pwm\":%lu,\"soc\":{\"initial\":%d,\"computed\":%d,\"full\":%d,\"remaining\":%d,\"time_until_full\":%ld}",
+        (unsigned long)CurrentPWM, InitialSoC, ComputedSoC, FullSoC, RemainingSoC, (long)TimeUntilFull);
+#else
+    add(",\"pwm\":%lu", (unsigned long)CurrentPWM);
 #endif
-        if (EVMeter.Type) {
-            mqPubI("/EVChargePower", EVMeter.PowerMeasured, false, 0);
-            mqPubI("/EVEnergyCharged", EVMeter.EnergyCharged, true, 0);
-            mqPubI("/EVTotalEnergyCharged", EVMeter.Energy, false, 0);
-        }
-        if (homeBatteryLastUpdate)
-            mqPubI("/HomeBatteryCurrent", homeBatteryCurrent, false, 0);
-        mqPubS("/OCPP", OcppMode ? "Enabled" : "Disabled", true, 0);
-        mqPubS("/OCPPConnection", (OcppWsClient && OcppWsClient->isConnected()) ? "Connected" : "Disconnected", false, 0);
-        {
-            // RGB values: build "R,G,B" on the stack.
-            char vbuf[16];
-            #define PUB_RGB(name, arr) do { \
-                int vl = snprintf(vbuf, sizeof(vbuf), "%u,%u,%u", arr[0], arr[1], arr[2]); \
-                mqPub(name, vbuf, (size_t)vl, true, 0); \
-            } while (0)
-            PUB_RGB("/LEDColorOff",    ColorOff);
-            PUB_RGB("/LEDColorNormal", ColorNormal);
-            PUB_RGB("/LEDColorSmart",  ColorSmart);
-            PUB_RGB("/LEDColorSolar",  ColorSolar);
-            PUB_RGB("/LEDColorCustom", ColorCustom);
-            #undef PUB_RGB
-        }
-        if (Lock != 0) {
-            mqPubI("/CableLock", CableLock, true, 0);
-        }
-        mqPubI("/ESPUptime", (int32_t)(esp_timer_get_time() / 1000000), false, 0);
-        mqPubI("/WiFiRSSI", WiFi.RSSI(), false, 0);
-        mqPubI("/LoadBl", LoadBl, true, 0);
-        mqPubS("/PairingPin", PairingPin.c_str(), true, 0);
-        mqPubI("/SolarStopTimer", SolarStopTimer, false, 0);
+    add("}");
+
+    if (n + 1 >= sizeof(buf)) {                                         // mg_vsnprintf needs room for the NUL
+        _LOG_A("MQTT telemetry document truncated (%u bytes), not published.\n", (unsigned)n);
+        return;
+    }
+    snprintf(t, sizeof(t), "%s/Telemetry", MQTTprefix.c_str());
+    MQTTclient.publish(t, buf, n, false, 0);
+}
+
+void mqttPublishData() {
+    lastMqttUpdate = 0;
+    if (!MQTTclient.connected) return;                                  // don't mark anything as sent
+
+    if (MQTTtelemetry != MQTT_TELEMETRY_TOPICS) mqttPublishTelemetry();
+    if (MQTTtelemetry == MQTT_TELEMETRY_SNAPSHOT) return;
+
+    telemetryPublish(TM_LOCAL, mqttCache, MQTTprefix.c_str(), MQTTclient.outbox, [](const char *topic, const char *v, size_t n, bool retain) {
+        return MQTTclient.publish(topic, v, n, retain, 0);
+    });
 }
 
 // SmartEVSE server MQTT client setup - subscribe to Set topics
@@ -1030,36 +1348,18 @@ void SetupMQTTClientSmartEVSE() {
     MQTTclientSmartEVSE.subscribe(MQTTSmartEVSEprefix + "/Set/Mode", 1);
     MQTTclientSmartEVSE.subscribe(MQTTSmartEVSEprefix + "/App/Status", 1);
     MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/connected", "online", true, 0);
-    mqttSmartEVSEPublishData();
+    mqttSmartEVSEPublishData(true);
 }
 
-// SmartEVSE server MQTT publish data; this is for the APP
-void mqttSmartEVSEPublishData() {
+// SmartEVSE server MQTT publish data; this is for the APP. full=true resends every topic.
+void mqttSmartEVSEPublishData(bool full) {
     if (!MQTTclientSmartEVSE.connected) return;
-    
+    if (full) appCache.stale = true;
+
     // MQTTSmartEVSEprefix is initialized in MQTTclientSmartEVSE.connect()
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/Version", String(VERSION), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/Access", AccessStatus == OFF ? "Deny" : AccessStatus == ON ? "Allow" : AccessStatus == PAUSE ? "Pause" : "N/A", true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/ChargeCurrent", String(Balanced[0]), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/ChargeCurrentOverride", String(OverrideCurrent), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/Mode", AccessStatus == OFF ? "Off" : AccessStatus == PAUSE ? "Pause" : Mode > 3 ? "N/A" : StrMode[Mode], true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/NrOfPhases", String(Nr_Of_Phases_Charging), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/State", getStateNameWeb(State), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/Error", getErrorNameWeb(ErrorFlags), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/LoadBl", String(LoadBl), true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/SolarStopTimer", String(SolarStopTimer), false, 0);
-    if (MainsMeter.Type) {
-        MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/MainsCurrentL1", String(MainsMeter.Irms[0]), false, 0);
-        MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/MainsCurrentL2", String(MainsMeter.Irms[1]), false, 0);
-        MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/MainsCurrentL3", String(MainsMeter.Irms[2]), false, 0);
-    }
-    if (EVMeter.Type) {
-        MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/EVChargePower", String(EVMeter.PowerMeasured), false, 0);
-        MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/EVEnergyCharged", String(EVMeter.EnergyCharged), true, 0);
-        MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/EVImportActiveEnergy", String(EVMeter.Import_active_energy), false, 0);
-    }
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/PairingPin", PairingPin, true, 0);
-    MQTTclientSmartEVSE.publish(MQTTSmartEVSEprefix + "/MaxCurrent", String(MaxCurrent * 10), true, 0);
+    telemetryPublish(TM_APP, appCache, MQTTSmartEVSEprefix.c_str(), MQTTclientSmartEVSE.outbox, [](const char *topic, const char *v, size_t n, bool retain) {
+        return MQTTclientSmartEVSE.publish(topic, v, n, retain, 0);
+    });
 }
 #endif
 
@@ -1113,7 +1413,7 @@ void validate_settings(void) {
 
     // If the address of the MainsMeter or EVmeter on a Node has changed, we must re-register the Modbus workers.
     if (LoadBl > 1) {
-        if (EVMeter.Type && EVMeter.Type != EM_API && EVMeter.Type != EM_HOMEWIZARD) MBserver.registerWorker(EVMeter.Address, ANY_FUNCTION_CODE, &MBEVMeterResponse);
+        if (EVMeter.onBus()) MBserver.registerWorker(EVMeter.Address, ANY_FUNCTION_CODE, &MBEVMeterResponse);
     }
     MainsMeter.setTimeout(COMM_TIMEOUT);
     EVMeter.setTimeout(COMM_TIMEOUT);                                             // Short Delay, to clear the error message for ~10 seconds.
@@ -1237,16 +1537,46 @@ void read_settings() {
         MainsMeter.Address = preferences.getUChar("MainsMAddress",MAINS_METER_ADDRESS);
         strncpy(MainsMeter.DeviceHostName, preferences.getString("MainsHostName", "").c_str(), sizeof(MainsMeter.DeviceHostName));
         MainsMeter.DeviceHostName[sizeof(MainsMeter.DeviceHostName) - 1] = '\0';
+        strncpy(MainsMeter.DeviceToken, preferences.getString("MainsHwToken", "").c_str(), sizeof(MainsMeter.DeviceToken));
+        MainsMeter.DeviceToken[sizeof(MainsMeter.DeviceToken) - 1] = '\0';
+        strncpy(MainsMeter.DeviceCert, preferences.getString("MainsHwCert", "").c_str(), sizeof(MainsMeter.DeviceCert));
+        MainsMeter.DeviceCert[sizeof(MainsMeter.DeviceCert) - 1] = '\0';
+        MainsMeter.Transport = preferences.getUChar("MainsTransport", METER_RTU);
+        MainsMeter.Interval = preferences.getUShort("MainsInterval", 0);
+        strncpy(MainsMeter.DevicePath, preferences.getString("MainsPath", "").c_str(), sizeof(MainsMeter.DevicePath));
+        MainsMeter.DevicePath[sizeof(MainsMeter.DevicePath) - 1] = '\0';
+        strncpy(MainsMeter.JsonPaths, preferences.getString("MainsJson", "").c_str(), sizeof(MainsMeter.JsonPaths));
+        MainsMeter.JsonPaths[sizeof(MainsMeter.JsonPaths) - 1] = '\0';
         MainsMeter.HostMenuSelection = 1; // Ensure HostMenuSelection is initialized to show the current saved hostname
         EVMeter.Type = preferences.getUChar("EVMeter",EV_METER);
         EVMeter.Address = preferences.getUChar("EVMeterAddress",EV_METER_ADDRESS);
         strncpy(EVMeter.DeviceHostName, preferences.getString("EVMeterHostName", "").c_str(), sizeof(EVMeter.DeviceHostName));
         EVMeter.DeviceHostName[sizeof(EVMeter.DeviceHostName) - 1] = '\0';
+        strncpy(EVMeter.DeviceToken, preferences.getString("EVMeterHwToken", "").c_str(), sizeof(EVMeter.DeviceToken));
+        EVMeter.DeviceToken[sizeof(EVMeter.DeviceToken) - 1] = '\0';
+        strncpy(EVMeter.DeviceCert, preferences.getString("EVMeterHwCert", "").c_str(), sizeof(EVMeter.DeviceCert));
+        EVMeter.DeviceCert[sizeof(EVMeter.DeviceCert) - 1] = '\0';
+        EVMeter.Transport = preferences.getUChar("EVTransport", METER_RTU);
+        EVMeter.Interval = preferences.getUShort("EVInterval", 0);
+        strncpy(EVMeter.DevicePath, preferences.getString("EVPath", "").c_str(), sizeof(EVMeter.DevicePath));
+        EVMeter.DevicePath[sizeof(EVMeter.DevicePath) - 1] = '\0';
+        strncpy(EVMeter.JsonPaths, preferences.getString("EVJson", "").c_str(), sizeof(EVMeter.JsonPaths));
+        EVMeter.JsonPaths[sizeof(EVMeter.JsonPaths) - 1] = '\0';
         EVMeter.HostMenuSelection = 1; // Ensure HostMenuSelection is initialized to show the current saved hostname
         CircuitMeter.Type = preferences.getUChar("CircuitMeter",CIRCUIT_METER);
         CircuitMeter.Address = preferences.getUChar("CircuitMAddress",CIRCUIT_METER_ADDRESS);
         strncpy(CircuitMeter.DeviceHostName, preferences.getString("CircuitHostName", "").c_str(), sizeof(CircuitMeter.DeviceHostName));
         CircuitMeter.DeviceHostName[sizeof(CircuitMeter.DeviceHostName) - 1] = '\0';
+        strncpy(CircuitMeter.DeviceToken, preferences.getString("CircuitHwToken", "").c_str(), sizeof(CircuitMeter.DeviceToken));
+        CircuitMeter.DeviceToken[sizeof(CircuitMeter.DeviceToken) - 1] = '\0';
+        strncpy(CircuitMeter.DeviceCert, preferences.getString("CircuitHwCert", "").c_str(), sizeof(CircuitMeter.DeviceCert));
+        CircuitMeter.DeviceCert[sizeof(CircuitMeter.DeviceCert) - 1] = '\0';
+        CircuitMeter.Transport = preferences.getUChar("CircTransport", METER_RTU);
+        CircuitMeter.Interval = preferences.getUShort("CircInterval", 0);
+        strncpy(CircuitMeter.DevicePath, preferences.getString("CircPath", "").c_str(), sizeof(CircuitMeter.DevicePath));
+        CircuitMeter.DevicePath[sizeof(CircuitMeter.DevicePath) - 1] = '\0';
+        strncpy(CircuitMeter.JsonPaths, preferences.getString("CircJson", "").c_str(), sizeof(CircuitMeter.JsonPaths));
+        CircuitMeter.JsonPaths[sizeof(CircuitMeter.JsonPaths) - 1] = '\0';
         CircuitMeter.HostMenuSelection = 1; // Ensure HostMenuSelection is initialized to show the current saved hostname
         EMConfig[EM_CUSTOM].Endianness = preferences.getUChar("EMEndianness",EMCUSTOM_ENDIANESS);
         EMConfig[EM_CUSTOM].IRegister = preferences.getUShort("EMIRegister",EMCUSTOM_IREGISTER);
@@ -1270,6 +1600,14 @@ void read_settings() {
         MQTTSmartServer = preferences.getBool("MQTTSmartServer", APPSERVER);
 
         EnableC2 = (EnableC2_t) preferences.getUShort("EnableC2", ENABLE_C2);
+        EvsePhase = preferences.getUChar("EvsePhase", EVSE_PHASE);
+        BalancePolicy = preferences.getUChar("BalancePolicy", BALANCE_POLICY);
+        if (BalancePolicy > POLICY_DEFICIT) BalancePolicy = BALANCE_POLICY;
+        if (!setBalanceWeights(preferences.getString("BalanceWeights", "").c_str())) formatBalanceWeights();
+        SiteRole = preferences.getUChar("SiteRole", SITE_ROLE);
+        if (SiteRole > SITE_COORDINATOR) SiteRole = SITE_ROLE;
+        SiteMax = preferences.getUShort("SiteMax", SITE_MAX);
+        SiteFallback = preferences.getUShort("SiteFallback", SITE_FALLBACK);
         String Interval = preferences.getString("intervals_json", "");
         SetIntervalString(Interval);
 #if MODEM
@@ -1321,10 +1659,28 @@ void write_settings(void) {
     PREFS_PUT_UCHAR_IF_CHANGED("MainsMeter", MainsMeter.Type);
     PREFS_PUT_UCHAR_IF_CHANGED("MainsMAddress", MainsMeter.Address);
     PREFS_PUT_STRING_IF_CHANGED("MainsHostName", MainsMeter.DeviceHostName);
+    PREFS_PUT_STRING_IF_CHANGED("MainsHwToken", MainsMeter.DeviceToken);
+    PREFS_PUT_STRING_IF_CHANGED("MainsHwCert", MainsMeter.DeviceCert);
+    PREFS_PUT_UCHAR_IF_CHANGED("MainsTransport", MainsMeter.Transport);
+    PREFS_PUT_USHORT_IF_CHANGED("MainsInterval", MainsMeter.Interval);
+    PREFS_PUT_STRING_IF_CHANGED("MainsPath", MainsMeter.DevicePath);
+    PREFS_PUT_STRING_IF_CHANGED("MainsJson", MainsMeter.JsonPaths);
     PREFS_PUT_UCHAR_IF_CHANGED("EVMeter", EVMeter.Type);
     PREFS_PUT_UCHAR_IF_CHANGED("EVMeterAddress", EVMeter.Address);
     PREFS_PUT_STRING_IF_CHANGED("EVMeterHostName", EVMeter.DeviceHostName);
+    PREFS_PUT_STRING_IF_CHANGED("EVMeterHwToken", EVMeter.DeviceToken);
+    PREFS_PUT_STRING_IF_CHANGED("EVMeterHwCert", EVMeter.DeviceCert);
+    PREFS_PUT_UCHAR_IF_CHANGED("EVTransport", EVMeter.Transport);
+    PREFS_PUT_USHORT_IF_CHANGED("EVInterval", EVMeter.Interval);
+    PREFS_PUT_STRING_IF_CHANGED("EVPath", EVMeter.DevicePath);
+    PREFS_PUT_STRING_IF_CHANGED("EVJson", EVMeter.JsonPaths);
     PREFS_PUT_STRING_IF_CHANGED("CircuitHostName", CircuitMeter.DeviceHostName);
+    PREFS_PUT_STRING_IF_CHANGED("CircuitHwToken", CircuitMeter.DeviceToken);
+    PREFS_PUT_STRING_IF_CHANGED("CircuitHwCert", CircuitMeter.DeviceCert);
+    PREFS_PUT_UCHAR_IF_CHANGED("CircTransport", CircuitMeter.Transport);
+    PREFS_PUT_USHORT_IF_CHANGED("CircInterval", CircuitMeter.Interval);
+    PREFS_PUT_STRING_IF_CHANGED("CircPath", CircuitMeter.DevicePath);
+    PREFS_PUT_STRING_IF_CHANGED("CircJson", CircuitMeter.JsonPaths);
     PREFS_PUT_UCHAR_IF_CHANGED("CircuitMeter", CircuitMeter.Type);
     PREFS_PUT_UCHAR_IF_CHANGED("CircuitMAddress", CircuitMeter.Address);
     PREFS_PUT_UCHAR_IF_CHANGED("EMEndianness", EMConfig[EM_CUSTOM].Endianness);
@@ -1340,6 +1696,12 @@ void write_settings(void) {
     PREFS_PUT_UCHAR_IF_CHANGED("EMFunction", EMConfig[EM_CUSTOM].Function);
     PREFS_PUT_UCHAR_IF_CHANGED("WIFImode", WIFImode);
     PREFS_PUT_USHORT_IF_CHANGED("EnableC2", EnableC2);
+    PREFS_PUT_UCHAR_IF_CHANGED("EvsePhase", EvsePhase);
+    PREFS_PUT_UCHAR_IF_CHANGED("BalancePolicy", BalancePolicy);
+    PREFS_PUT_STRING_IF_CHANGED("BalanceWeights", BalanceWeights);
+    PREFS_PUT_UCHAR_IF_CHANGED("SiteRole", SiteRole);
+    PREFS_PUT_USHORT_IF_CHANGED("SiteMax", SiteMax);
+    PREFS_PUT_USHORT_IF_CHANGED("SiteFallback", SiteFallback);
     PREFS_PUT_USHORT_IF_CHANGED("CapacityMode", CapacityMode);
     static String intervals;
     intervals = GetIntervalString();  // Build once, reuse.
@@ -1467,13 +1829,38 @@ void DisconnectEvent(void){
 #endif //MODEM
 
 
+// Energy the EV still needs to reach its EnergyRequest or FullSoC, in 0.1 kWh. 0 = unknown.
+// Reported to the Master in status register 0x000C, for the Deficit balance policy.
+uint16_t getEnergyNeed(void) {
+#if MODEM
+    int32_t Need = 0;
+    if (EnergyRequest > 0) Need = EnergyRequest - max(EVMeter.EnergyCharged, (int32_t) 0);
+    else if (RemainingSoC > 0 && EnergyCapacity > 0) Need = RemainingSoC * EnergyCapacity / 100;
+    if (Need > 0) return min((Need + 99) / 100, (int32_t) 0xFFFF);
+#endif
+    return 0;
+}
+
+
 //make mongoose 7.14 compatible with 7.13
 #define mg_http_match_uri(X,Y) mg_match(X->uri, mg_str(Y), NULL)
 
+// Print with printf through mongoose's formatter, so JSON strings can be escaped with %m / MG_ESC()
+struct MgPrint : public Print {
+    static void outc(char ch, void *p) { static_cast<MgPrint *>(p)->write((uint8_t)ch); }
+    size_t xprintf(const char *fmt, ...) {
+        va_list ap;
+        va_start(ap, fmt);
+        size_t len = mg_vxprintf(outc, this, fmt, &ap);
+        va_end(ap);
+        return len;
+    }
+};
+
 // Print adapter that streams ArduinoJson output as HTTP chunks, avoiding the
 // intermediate `String json; serializeJson(doc, json);` allocation which
 // otherwise peaks at ~2x the serialized size on the heap.
-struct MgChunkPrint : public Print {
+struct MgChunkPrint : public MgPrint {
     struct mg_connection *c;
     uint8_t buf[256];
     size_t n = 0;
@@ -1497,974 +1884,1381 @@ struct MgChunkPrint : public Print {
     ~MgChunkPrint() { flushBuf(); mg_http_write_chunk(c, "", 0); }
 };
 
-// handles URI, returns true if handled, false if not
-bool handle_URI(struct mg_connection *c, struct mg_http_message *hm,  webServerRequest* request) {
-//    if (mg_match(hm->uri, mg_str("/settings"), NULL)) {               // REST API call?
-    if (mg_http_match_uri(hm, "/settings")) {                            // REST API call?
-      if (!memcmp("GET", hm->method.buf, hm->method.len)) {                     // if GET
-        String mode = "N/A";
-        int modeId = -1;
-        if(AccessStatus == OFF)  {
-            mode = "OFF";
-            modeId=0;
-        } else if(AccessStatus == PAUSE)  {
-            mode = "PAUSE";
-            modeId=4;
-        } else {
-            switch(Mode) {
-                case MODE_NORMAL: mode = "NORMAL"; modeId=1; break;
-                case MODE_SOLAR: mode = "SOLAR"; modeId=2; break;
-                case MODE_SMART: mode = "SMART"; modeId=3; break;
-            }
-        }
-        if (mode == "N/A") { //this should never happen, but it does
-            _LOG_A("ERROR: mode=%s, Mode=%u, modeId=%d, AccessStatus=%u.\n", mode.c_str(), Mode, modeId, AccessStatus);
-        }
-        String backlight = "N/A";
-        switch(BacklightSet) {
-            case 0: backlight = "OFF"; break;
-            case 1: backlight = "ON"; break;
-            case 2: backlight = "DIMMED"; break;
-        }
-        String evstate = StrStateNameWeb[State];
-        String error = getErrorNameWeb(ErrorFlags);
-        int errorId = getErrorId(ErrorFlags);
-
-        if (ErrorFlags & LESS_6A) {
-            evstate += " - " + error;
-            error = "None";
-            errorId = 0;
-        }
+// Print adapter that collects the output in a mongoose iobuf
+struct MgBufPrint : public MgPrint {
+    struct mg_iobuf *io;
+    MgBufPrint(struct mg_iobuf *b) : io(b) {}
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *p, size_t l) override { return mg_iobuf_add(io, io->len, p, l) ? l : 0; }
+};
 
-        boolean evConnected = pilot != PILOT_12V;                    //when access bit = 1, p.ex. in OFF mode, the STATEs are no longer updated
+static inline const char *jbool(bool b) { return b ? "true" : "false"; }
 
-        // Static doc: allocated once on first /settings GET, reused forever.
-        // Avoids ~3 KB heap churn every few seconds when the web statuspage polls.
-        static DynamicJsonDocument doc(3072); // https://arduinojson.org/v6/assistant/
-        doc.clear();
-        doc["version"] = String(VERSION);
-        doc["serialnr"] = serialnr;
-        doc["mode"] = mode;
-        doc["mode_id"] = modeId;
-        doc["car_connected"] = evConnected;
-
-        if(WiFi.isConnected()) {
-            switch(WiFi.status()) {
-                case WL_NO_SHIELD:          doc["wifi"]["status"] = "WL_NO_SHIELD"; break;
-                case WL_IDLE_STATUS:        doc["wifi"]["status"] = "WL_IDLE_STATUS"; break;
-                case WL_NO_SSID_AVAIL:      doc["wifi"]["status"] = "WL_NO_SSID_AVAIL"; break;
-                case WL_SCAN_COMPLETED:     doc["wifi"]["status"] = "WL_SCAN_COMPLETED"; break;
-                case WL_CONNECTED:          doc["wifi"]["status"] = "WL_CONNECTED"; break;
-                case WL_CONNECT_FAILED:     doc["wifi"]["status"] = "WL_CONNECT_FAILED"; break;
-                case WL_CONNECTION_LOST:    doc["wifi"]["status"] = "WL_CONNECTION_LOST"; break;
-                case WL_DISCONNECTED:       doc["wifi"]["status"] = "WL_DISCONNECTED"; break;
-                default:                    doc["wifi"]["status"] = "UNKNOWN"; break;
-            }
+// Transport of a meter that is read over the network, as members of its object in the
+// /settings document. Returns false for meters on the RS485 bus and HomeWizard meters.
+static bool meter_transport_json(MgPrint &out, const char *sep, const Meter &meter) {
+    if (!meter.Type || meter.Type == EM_HOMEWIZARD || meter.Transport == METER_RTU) return false;
+    out.xprintf("%s\"transport\":%m,\"host\":%m,\"path\":%m,\"json\":%m,\"interval\":%u", sep,
+        MG_ESC(meterTransportName(meter.Transport)), MG_ESC(meter.DeviceHostName), MG_ESC(meter.DevicePath),
+        MG_ESC(meter.JsonPaths), meter.Interval ? meter.Interval : NETMETER_POLL_INTERVAL);
+    return true;
+}
 
-            doc["wifi"]["ssid"] = WiFi.SSID();    
-            doc["wifi"]["rssi"] = WiFi.RSSI();    
-            doc["wifi"]["bssid"] = WiFi.BSSIDstr();  
+// The /settings document, served by GET /settings and pushed over /ws/state.
+// Written straight into the Print: no JsonDocument, no String temporaries.
+static void settings_json(MgPrint &out) {
+    const char *mode = "N/A";
+    int modeId = -1;
+    if(AccessStatus == OFF)  {
+        mode = "OFF";
+        modeId=0;
+    } else if(AccessStatus == PAUSE)  {
+        mode = "PAUSE";
+        modeId=4;
+    } else {
+        switch(Mode) {
+            case MODE_NORMAL: mode = "NORMAL"; modeId=1; break;
+            case MODE_SOLAR: mode = "SOLAR"; modeId=2; break;
+            case MODE_SMART: mode = "SMART"; modeId=3; break;
         }
+    }
+    if (modeId == -1) { //this should never happen, but it does
+        _LOG_A("ERROR: mode=%s, Mode=%u, modeId=%d, AccessStatus=%u.\n", mode, Mode, modeId, AccessStatus);
+    }
+    const char *backlight = "N/A";
+    switch(BacklightSet) {
+        case 0: backlight = "OFF"; break;
+        case 1: backlight = "ON"; break;
+        case 2: backlight = "DIMMED"; break;
+    }
+    const char *error = getErrorNameWeb(ErrorFlags);
+    int errorId = getErrorId(ErrorFlags);
+    char evstate[48];
+    if (ErrorFlags & LESS_6A) {
+        snprintf(evstate, sizeof(evstate), "%s - %s", StrStateNameWeb[State], error);
+        error = "None";
+        errorId = 0;
+    } else {
+        snprintf(evstate, sizeof(evstate), "%s", StrStateNameWeb[State]);
+    }
 
-        doc["eth"]["present"] = EthPresent;
-        doc["eth"]["connected"] = EthConnected;
-        doc["eth"]["has_ip"] = EthHasIP;
-        if (EthHasIP) {
-            doc["eth"]["ip"] = ch390_get_ip();
-        }
-        if (EthPresent) {
-            uint8_t eth_mac[6];
-            esp_read_mac(eth_mac, ESP_MAC_ETH);
-            char mac_str[18];
-            snprintf(mac_str, sizeof(mac_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-                     eth_mac[0], eth_mac[1], eth_mac[2], eth_mac[3], eth_mac[4], eth_mac[5]);
-            doc["eth"]["mac"] = mac_str;
+    bool evConnected = pilot != PILOT_12V;                    //when access bit = 1, p.ex. in OFF mode, the STATEs are no longer updated
+
+    out.xprintf("{\"version\":%m,\"serialnr\":%lu,\"mode\":%m,\"mode_id\":%d,\"car_connected\":%s",
+        MG_ESC(VERSION), (unsigned long)serialnr, MG_ESC(mode), modeId, jbool(evConnected));
+
+    if(WiFi.isConnected()) {
+        const char *status;
+        switch(WiFi.status()) {
+            case WL_NO_SHIELD:          status = "WL_NO_SHIELD"; break;
+            case WL_IDLE_STATUS:        status = "WL_IDLE_STATUS"; break;
+            case WL_NO_SSID_AVAIL:      status = "WL_NO_SSID_AVAIL"; break;
+            case WL_SCAN_COMPLETED:     status = "WL_SCAN_COMPLETED"; break;
+            case WL_CONNECTED:          status = "WL_CONNECTED"; break;
+            case WL_CONNECT_FAILED:     status = "WL_CONNECT_FAILED"; break;
+            case WL_CONNECTION_LOST:    status = "WL_CONNECTION_LOST"; break;
+            case WL_DISCONNECTED:       status = "WL_DISCONNECTED"; break;
+            default:                    status = "UNKNOWN"; break;
         }
-        
-        doc["evse"]["temp"] = TempEVSE;
-        doc["evse"]["temp_max"] = maxTemp;
-        doc["evse"]["connected"] = evConnected;
-        doc["evse"]["access"] = AccessStatus;
-        doc["evse"]["mode"] = Mode;
-        doc["evse"]["loadbl"] = LoadBl;
-        doc["evse"]["pwm"] = CurrentPWM;
-        doc["evse"]["custombutton"] = CustomButton;
-        doc["evse"]["solar_stop_timer"] = SolarStopTimer;
-        doc["evse"]["state"] = evstate;
-        doc["evse"]["state_id"] = State;
-        doc["evse"]["error"] = error;
-        doc["evse"]["error_id"] = errorId;
-        doc["evse"]["rfidreader"] = StrRFIDReader[RFIDReader];
-        doc["evse"]["nrofphases"] = Nr_Of_Phases_Charging;
-        doc["evse"]["rfid"] = !RFIDReader ? "Not Installed" : RFIDstatus >= 8 ? "NOSTATUS" : StrRFIDStatusWeb[RFIDstatus];
-        if (RFIDReader) {
-            char buf[15];
-            printRFID(buf);
-            doc["evse"]["rfid_lastread"] = buf;
-        }
-
-        doc["settings"]["charge_current"] = Balanced[0];
-        doc["settings"]["override_current"] = OverrideCurrent;
-        doc["settings"]["current_min"] = MinCurrent;
-        doc["settings"]["current_max"] = MaxCurrent;
-        doc["settings"]["current_main"] = MaxMains;
-        doc["settings"]["current_max_circuit"] = MaxCircuit;
-        doc["settings"]["current_max_sum_mains"] = MaxSumMains;
-        doc["settings"]["max_sum_mains_time"] = MaxSumMainsTime;
-        doc["settings"]["solar_max_import"] = ImportCurrent;
-        doc["settings"]["solar_start_current"] = StartCurrent;
-        doc["settings"]["solar_stop_time"] = StopTime;
-        doc["settings"]["enable_C2"] = StrEnableC2[EnableC2];
-        doc["settings"]["mains_meter"] = EMConfig[MainsMeter.Type].Desc;
-        doc["settings"]["starttime"] = (DelayedStartTime.epoch2 ? DelayedStartTime.epoch2 + EPOCH2_OFFSET : 0);
-        doc["settings"]["stoptime"] = (DelayedStopTime.epoch2 ? DelayedStopTime.epoch2 + EPOCH2_OFFSET : 0);
-        doc["settings"]["repeat"] = DelayedRepeat;
-        doc["settings"]["lcdlock"] = LCDlock;
-        doc["settings"]["lock"] = Lock;
-        doc["settings"]["cablelock"] = CableLock;
-        doc["settings"]["ledmode"] = LedMode;
-        doc["settings"]["capacity_mode"] = CapacityMode;
-        String intervalsStr = GetIntervalString();
-        doc["settings"]["intervals"] = serialized(intervalsStr);   // ArduinoJson magic: parse string as JSON
+        wifi_ap_record_t ap = {};
+        esp_wifi_sta_get_ap_info(&ap);
+        char bssid[18];
+        snprintf(bssid, sizeof(bssid), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5]);
+        out.xprintf(",\"wifi\":{\"status\":%m,\"ssid\":%m,\"rssi\":%d,\"bssid\":%m}",
+            MG_ESC(status), MG_ESC((const char *)ap.ssid), (int)ap.rssi, MG_ESC(bssid));
+    }
+
+    out.xprintf(",\"eth\":{\"present\":%s,\"connected\":%s,\"has_ip\":%s",
+        jbool(EthPresent), jbool(EthConnected), jbool(EthHasIP));
+    if (EthHasIP) {
+        out.xprintf(",\"ip\":%m", MG_ESC(ch390_get_ip()));
+    }
+    if (EthPresent) {
+        uint8_t eth_mac[6];
+        esp_read_mac(eth_mac, ESP_MAC_ETH);
+        char mac_str[18];
+        snprintf(mac_str, sizeof(mac_str), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 eth_mac[0], eth_mac[1], eth_mac[2], eth_mac[3], eth_mac[4], eth_mac[5]);
+        out.xprintf(",\"mac\":%m", MG_ESC(mac_str));
+    }
+
+    out.xprintf("},\"evse\":{\"temp\":%d,\"temp_max\":%u,\"connected\":%s,\"access\":%d,\"mode\":%u,"
+                "\"loadbl\":%u,\"pwm\":%lu,\"custombutton\":%s,\"solar_stop_timer\":%u,",
+        TempEVSE, maxTemp, jbool(evConnected), (int)AccessStatus, Mode,
+        LoadBl, (unsigned long)CurrentPWM, jbool(CustomButton), SolarStopTimer);
+    out.xprintf("\"state\":%m,\"state_id\":%u,\"error\":%m,\"error_id\":%d,\"rfidreader\":%m,\"nrofphases\":%u,\"rfid\":%m",
+        MG_ESC(evstate), State, MG_ESC(error), errorId, MG_ESC(StrRFIDReader[RFIDReader]), Nr_Of_Phases_Charging,
+        MG_ESC(!RFIDReader ? "Not Installed" : RFIDstatus >= 8 ? "NOSTATUS" : StrRFIDStatusWeb[RFIDstatus]));
+    if (RFIDReader) {
+        char buf[15];
+        printRFID(buf);
+        out.xprintf(",\"rfid_lastread\":%m", MG_ESC(buf));
+    }
+
+    out.xprintf("},\"settings\":{\"charge_current\":%u,\"override_current\":%u,\"current_min\":%u,\"current_max\":%u,"
+                "\"current_main\":%u,\"current_max_circuit\":%u,\"current_max_sum_mains\":%u,\"max_sum_mains_time\":%u,",
+        Balanced[0], OverrideCurrent, MinCurrent, MaxCurrent,
+        MaxMains, MaxCircuit, MaxSumMains, MaxSumMainsTime);
+    out.xprintf("\"solar_max_import\":%u,\"solar_start_current\":%u,\"solar_stop_time\":%u,\"enable_C2\":%m,\"evse_phase\":%u,\"mains_meter\":%m,",
+        ImportCurrent, StartCurrent, StopTime, MG_ESC(StrEnableC2[EnableC2]), EvsePhase, MG_ESC(EMConfig[MainsMeter.Type].Desc));
+    out.xprintf("\"balance_policy\":%m,\"balance_weights\":[%s],", MG_ESC(StrBalancePolicy[BalancePolicy]), BalanceWeights);
+    out.xprintf("\"site_role\":%u,\"site_max\":%u,\"site_fallback\":%u,\"site_allotment\":%d,",
+        SiteRole, SiteMax, SiteFallback, SiteRole != SITE_OFF && SiteAllotted.active(millis()) ? SiteAllotted.limit(0, millis()) : -1);
+    out.xprintf("\"starttime\":%lu,\"stoptime\":%lu,\"repeat\":%u,\"lcdlock\":%u,\"lock\":%u,\"cablelock\":%u,"
+                "\"ledmode\":%u,\"capacity_mode\":%d,\"intervals\":[",
+        (unsigned long)(DelayedStartTime.epoch2 ? DelayedStartTime.epoch2 + EPOCH2_OFFSET : 0),
+        (unsigned long)(DelayedStopTime.epoch2 ? DelayedStopTime.epoch2 + EPOCH2_OFFSET : 0),
+        DelayedRepeat, LCDlock, Lock, CableLock, LedMode, (int)CapacityMode);
+    for (CapacityNode *n = first_interval; n; n = n->next) {
+        out.xprintf("%s{\"start\":%u,\"power\":%ld}", n == first_interval ? "" : ",",
+            n->start_minutes, (long)n->max_power_watts);
+    }
+    out.xprintf("]");
 #if MODEM
-            doc["settings"]["required_evccid"] = RequiredEVCCID;
-            doc["settings"]["modem"] = "Experiment";
-            doc["ev_state"]["initial_soc"] = InitialSoC;
-            doc["ev_state"]["remaining_soc"] = RemainingSoC;
-            doc["ev_state"]["full_soc"] = FullSoC;
-            doc["ev_state"]["energy_capacity"] = EnergyCapacity > 0 ? EnergyCapacity : -1; // Wh
-            doc["ev_state"]["energy_request"] = EnergyRequest > 0 ? EnergyRequest : -1; // Wh
-            doc["ev_state"]["computed_soc"] = ComputedSoC;
-            doc["ev_state"]["evccid"] = EVCCID;
-            doc["ev_state"]["time_until_full"] = TimeUntilFull;
+    out.xprintf(",\"required_evccid\":%m,\"modem\":\"Experiment\"},\"ev_state\":{\"initial_soc\":%d,\"remaining_soc\":%d,"
+                "\"full_soc\":%d,\"energy_capacity\":%ld,\"energy_request\":%ld,\"computed_soc\":%d,\"evccid\":%m,\"time_until_full\":%ld",
+        MG_ESC(RequiredEVCCID), InitialSoC, RemainingSoC, FullSoC,
+        (long)(EnergyCapacity > 0 ? EnergyCapacity : -1), (long)(EnergyRequest > 0 ? EnergyRequest : -1), // Wh
+        ComputedSoC, MG_ESC(EVCCID), (long)TimeUntilFull);
 #endif
+    out.xprintf("}");
 
 #if MQTT
-        doc["mqtt"]["host"] = MQTTHost;
-        doc["mqtt"]["port"] = MQTTPort;
-        doc["mqtt"]["topic_prefix"] = MQTTprefix;
-        doc["mqtt"]["username"] = MQTTuser;
-        doc["mqtt"]["password_set"] = MQTTpassword != "";
-        doc["mqtt"]["tls"] = MQTTtls;
-        if (MQTTclient.connected) {
-            doc["mqtt"]["status"] = "Connected";
-        } else {
-            doc["mqtt"]["status"] = "Disconnected";
-        }
-        doc["mqtt"]["smartevse_server"] = MQTTSmartServer;
+    out.xprintf(",\"mqtt\":{\"host\":%m,\"port\":%u,\"topic_prefix\":%m,\"username\":%m,\"password_set\":%s,"
+                "\"tls\":%s,\"status\":%m,\"smartevse_server\":%s,\"telemetry\":%u",
+        MG_ESC(MQTTHost.c_str()), MQTTPort, MG_ESC(MQTTprefix.c_str()), MG_ESC(MQTTuser.c_str()),
+        jbool(MQTTpassword.length() != 0), jbool(MQTTtls),
+        MG_ESC(MQTTclient.connected ? "Connected" : "Disconnected"), jbool(MQTTSmartServer), MQTTtelemetry);
+    {
+        MQTToutbox_t::Stats ob = MQTTclient.outbox.stats();
+        out.xprintf(",\"outbox\":{\"depth\":%u,\"max_depth\":%u,\"bytes\":%lu,\"sent\":%lu,\"dropped\":%lu,"
+                    "\"coalesced\":%lu,\"latency_avg_ms\":%lu,\"latency_max_ms\":%lu}}",
+            ob.depth, ob.maxDepth, (unsigned long)ob.bytes, (unsigned long)ob.sent, (unsigned long)ob.dropped,
+            (unsigned long)ob.coalesced, (unsigned long)ob.latencyAvgMs, (unsigned long)ob.latencyMaxMs);
+    }
 #endif
-        doc["ocpp"]["mode"] = OcppMode ? "Enabled" : "Disabled";
-        doc["ocpp"]["backend_url"] = OcppWsClient ? OcppWsClient->getBackendUrl() : "";
-        doc["ocpp"]["cb_id"] = OcppWsClient ? OcppWsClient->getChargeBoxId() : "";
-        doc["ocpp"]["auth_key"] = OcppWsClient ? OcppWsClient->getAuthKey() : "";
+    out.xprintf(",\"http\":{\"max_connections\":%u,\"max_per_client\":%u,\"idle_timeout\":%u}",
+        HttpMaxConnections, HttpMaxPerClient, HttpIdleTimeout);
+    {
+        auto freevendMode = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendActive");
+        auto freevendIdTag = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendIdTag");
+        out.xprintf(",\"ocpp\":{\"mode\":%m,\"backend_url\":%m,\"cb_id\":%m,\"auth_key\":%m,"
+                    "\"auto_auth\":%m,\"auto_auth_idtag\":%m,\"status\":%m}",
+            MG_ESC(OcppMode ? "Enabled" : "Disabled"),
+            MG_ESC(OcppWsClient ? OcppWsClient->getBackendUrl() : ""),
+            MG_ESC(OcppWsClient ? OcppWsClient->getChargeBoxId() : ""),
+            MG_ESC(OcppWsClient ? OcppWsClient->getAuthKey() : ""),
+            MG_ESC(freevendMode && freevendMode->getBool() ? "Enabled" : "Disabled"),
+            MG_ESC(freevendIdTag ? freevendIdTag->getString() : ""),
+            MG_ESC(OcppWsClient && OcppWsClient->isConnected() ? "Connected" : "Disconnected"));
+    }
 
-        {
-            auto freevendMode = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendActive");
-            doc["ocpp"]["auto_auth"] = freevendMode && freevendMode->getBool() ? "Enabled" : "Disabled";
-            auto freevendIdTag = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendIdTag");
-            doc["ocpp"]["auto_auth_idtag"] = freevendIdTag ? freevendIdTag->getString() : "";
-        }
+    out.xprintf(",\"home_battery\":{\"current\":%d,\"last_update\":%lld}",
+        homeBatteryCurrent, (long long)homeBatteryLastUpdate);
 
-        if (OcppWsClient && OcppWsClient->isConnected()) {
-            doc["ocpp"]["status"] = "Connected";
-        } else {
-            doc["ocpp"]["status"] = "Disconnected";
+    out.xprintf(",\"ev_meter\":{\"description\":%m,\"address\":%u",
+        MG_ESC(EMConfig[EVMeter.Type].Desc), EVMeter.Address);
+    if (EVMeter.Type == EM_HOMEWIZARD) {
+        out.xprintf(",\"host\":%m", MG_ESC(strlen(EVMeter.DeviceHostName) > 0 ? EVMeter.DeviceHostName : "Not Set"));
+        out.xprintf(",\"push\":%m", MG_ESC(homewizardPushState(EVMeter)));
+    }
+    meter_transport_json(out, ",", EVMeter);
+    out.xprintf(",\"import_active_power\":%d,\"total_wh\":%ld,\"charged_wh\":%ld,"          // Watt, Wh, Wh
+                "\"currents\":{\"TOTAL\":%d,\"L1\":%d,\"L2\":%d,\"L3\":%d}",
+        EVMeter.PowerMeasured, (long)EVMeter.Energy, (long)EVMeter.EnergyCharged,
+        EVMeter.Irms[0] + EVMeter.Irms[1] + EVMeter.Irms[2], EVMeter.Irms[0], EVMeter.Irms[1], EVMeter.Irms[2]);
+    if (EVMeter.Import_active_energy) //only export when not zero, because after boot it is zero = empty value
+        out.xprintf(",\"import_active_energy\":%ld", (long)EVMeter.Import_active_energy); // Wh
+    if (EVMeter.Export_active_energy) //only export when not zero, because after boot it is zero = empty value
+        out.xprintf(",\"export_active_energy\":%ld", (long)EVMeter.Export_active_energy); // Wh
+    out.xprintf("}");
+
+    // mains_meter is omitted entirely when none of its members are known yet
+    const char *sep = ",\"mains_meter\":{";
+    if (MainsMeter.Import_active_energy) { //only export when not zero, because after boot it is zero = empty value
+        out.xprintf("%s\"import_active_energy\":%ld", sep, (long)MainsMeter.Import_active_energy); // Wh
+        sep = ",";
+    }
+    if (MainsMeter.Export_active_energy) { //only export when not zero, because after boot it is zero = empty value
+        out.xprintf("%s\"export_active_energy\":%ld", sep, (long)MainsMeter.Export_active_energy); // Wh
+        sep = ",";
+    }
+    if (MainsMeter.Type == EM_HOMEWIZARD) {
+        out.xprintf("%s\"host\":%m", sep, MG_ESC(strlen(MainsMeter.DeviceHostName) > 0 ? MainsMeter.DeviceHostName : "Not Set"));
+        out.xprintf(",\"push\":%m", MG_ESC(homewizardPushState(MainsMeter)));
+        sep = ",";
+    }
+    if (meter_transport_json(out, sep, MainsMeter)) sep = ",";
+    if (sep[1] == '\0') out.xprintf("}");                      // sep is "," once a member was written
+
+    if (CircuitMeter.Type) {
+        out.xprintf(",\"circuit_meter\":{\"description\":%m,\"address\":%u",
+            MG_ESC(EMConfig[CircuitMeter.Type].Desc), CircuitMeter.Address);
+        if (CircuitMeter.Type == EM_HOMEWIZARD) {
+            out.xprintf(",\"host\":%m", MG_ESC(strlen(CircuitMeter.DeviceHostName) > 0 ? CircuitMeter.DeviceHostName : "Not Set"));
+            out.xprintf(",\"push\":%m", MG_ESC(homewizardPushState(CircuitMeter)));
         }
+        meter_transport_json(out, ",", CircuitMeter);
+        out.xprintf(",\"currents\":{\"TOTAL\":%d,\"L1\":%d,\"L2\":%d,\"L3\":%d}}",
+            CircuitMeter.Irms[0] + CircuitMeter.Irms[1] + CircuitMeter.Irms[2],
+            CircuitMeter.Irms[0], CircuitMeter.Irms[1], CircuitMeter.Irms[2]);
+    }
 
-        doc["home_battery"]["current"] = homeBatteryCurrent;
-        doc["home_battery"]["last_update"] = homeBatteryLastUpdate;
+    out.xprintf(",\"phase_currents\":{\"TOTAL\":%d,\"L1\":%d,\"L2\":%d,\"L3\":%d,\"last_data_update\":%d,"
+                "\"original_data\":{\"TOTAL\":%d,\"L1\":%d,\"L2\":%d,\"L3\":%d}}",
+        MainsMeter.Irms[0] + MainsMeter.Irms[1] + MainsMeter.Irms[2],
+        MainsMeter.Irms[0], MainsMeter.Irms[1], MainsMeter.Irms[2], phasesLastUpdate,
+        IrmsOriginal[0] + IrmsOriginal[1] + IrmsOriginal[2], IrmsOriginal[0], IrmsOriginal[1], IrmsOriginal[2]);
 
-        doc["ev_meter"]["description"] = EMConfig[EVMeter.Type].Desc;
-        doc["ev_meter"]["address"] = EVMeter.Address;
-        if (EVMeter.Type == EM_HOMEWIZARD) {
-            doc["ev_meter"]["host"] = strlen(EVMeter.DeviceHostName) > 0 ? EVMeter.DeviceHostName : "Not Set";
-        }
-        doc["ev_meter"]["import_active_power"] = EVMeter.PowerMeasured; // Watt
-        doc["ev_meter"]["total_wh"] = EVMeter.Energy; // Wh
-        doc["ev_meter"]["charged_wh"] = EVMeter.EnergyCharged; // Wh
-        doc["ev_meter"]["currents"]["TOTAL"] = EVMeter.Irms[0] + EVMeter.Irms[1] + EVMeter.Irms[2];
-        doc["ev_meter"]["currents"]["L1"] = EVMeter.Irms[0];
-        doc["ev_meter"]["currents"]["L2"] = EVMeter.Irms[1];
-        doc["ev_meter"]["currents"]["L3"] = EVMeter.Irms[2];
+    out.xprintf(",\"backlight\":{\"timer\":%u,\"status\":%m}", BacklightTimer, MG_ESC(backlight));
 
-        if (EVMeter.Import_active_energy) //only export when not zero, because after boot it is zero = empty value
-            doc["ev_meter"]["import_active_energy"] = EVMeter.Import_active_energy; // Wh
-        if (EVMeter.Export_active_energy) //only export when not zero, because after boot it is zero = empty value
-            doc["ev_meter"]["export_active_energy"] = EVMeter.Export_active_energy; // Wh
+    static const struct { const char *name; const uint8_t *rgb; } colors[] = {
+        { "off", ColorOff }, { "normal", ColorNormal }, { "smart", ColorSmart },
+        { "solar", ColorSolar }, { "custom", ColorCustom },
+    };
+    for (size_t i = 0; i < sizeof(colors) / sizeof(colors[0]); i++) {
+        out.xprintf("%s\"%s\":{\"R\":%u,\"G\":%u,\"B\":%u}", i ? "," : ",\"color\":{",
+            colors[i].name, colors[i].rgb[0], colors[i].rgb[1], colors[i].rgb[2]);
+    }
+    out.xprintf("}}");
+}
 
-        if (MainsMeter.Import_active_energy) //only export when not zero, because after boot it is zero = empty value
-            doc["mains_meter"]["import_active_energy"] = MainsMeter.Import_active_energy; // Wh
-        if (MainsMeter.Export_active_energy) //only export when not zero, because after boot it is zero = empty value
-            doc["mains_meter"]["export_active_energy"] = MainsMeter.Export_active_energy; // Wh
-        if (MainsMeter.Type == EM_HOMEWIZARD) {
-            doc["mains_meter"]["host"] = strlen(MainsMeter.DeviceHostName) > 0 ? MainsMeter.DeviceHostName : "Not Set";
-        }
-        if (CircuitMeter.Type) {
-            doc["circuit_meter"]["description"] = EMConfig[CircuitMeter.Type].Desc;
-            doc["circuit_meter"]["address"] = CircuitMeter.Address;
-            if (CircuitMeter.Type == EM_HOMEWIZARD) {
-                doc["circuit_meter"]["host"] = strlen(CircuitMeter.DeviceHostName) > 0 ? CircuitMeter.DeviceHostName : "Not Set";
-            }
-            doc["circuit_meter"]["currents"]["TOTAL"] = CircuitMeter.Irms[0] + CircuitMeter.Irms[1] + CircuitMeter.Irms[2];
-            doc["circuit_meter"]["currents"]["L1"] = CircuitMeter.Irms[0];
-            doc["circuit_meter"]["currents"]["L2"] = CircuitMeter.Irms[1];
-            doc["circuit_meter"]["currents"]["L3"] = CircuitMeter.Irms[2];
-        }
+// GET /settings, polled every few seconds by the web UI and home-automation
+// systems. Streamed straight into chunks.
+static bool http_settings_get(struct mg_connection *c, struct mg_http_message *, webServerRequest *) {
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    MgChunkPrint out(c);
+    settings_json(out);
+    return true;
+}
 
-          
-        doc["phase_currents"]["TOTAL"] = MainsMeter.Irms[0] + MainsMeter.Irms[1] + MainsMeter.Irms[2];
-        doc["phase_currents"]["L1"] = MainsMeter.Irms[0];
-        doc["phase_currents"]["L2"] = MainsMeter.Irms[1];
-        doc["phase_currents"]["L3"] = MainsMeter.Irms[2];
-        doc["phase_currents"]["last_data_update"] = phasesLastUpdate;
-        doc["phase_currents"]["original_data"]["TOTAL"] = IrmsOriginal[0] + IrmsOriginal[1] + IrmsOriginal[2];
-        doc["phase_currents"]["original_data"]["L1"] = IrmsOriginal[0];
-        doc["phase_currents"]["original_data"]["L2"] = IrmsOriginal[1];
-        doc["phase_currents"]["original_data"]["L3"] = IrmsOriginal[2];
-        
-        doc["backlight"]["timer"] = BacklightTimer;
-        doc["backlight"]["status"] = backlight;
-
-        doc["color"]["off"]["R"] = ColorOff[0];
-        doc["color"]["off"]["G"] = ColorOff[1];
-        doc["color"]["off"]["B"] = ColorOff[2];
-        doc["color"]["normal"]["R"] = ColorNormal[0];
-        doc["color"]["normal"]["G"] = ColorNormal[1];
-        doc["color"]["normal"]["B"] = ColorNormal[2];
-        doc["color"]["smart"]["R"] = ColorSmart[0];
-        doc["color"]["smart"]["G"] = ColorSmart[1];
-        doc["color"]["smart"]["B"] = ColorSmart[2];
-        doc["color"]["solar"]["R"] = ColorSolar[0];
-        doc["color"]["solar"]["G"] = ColorSolar[1];
-        doc["color"]["solar"]["B"] = ColorSolar[2];
-        doc["color"]["custom"]["R"] = ColorCustom[0];
-        doc["color"]["custom"]["G"] = ColorCustom[1];
-        doc["color"]["custom"]["B"] = ColorCustom[2];
-
-        mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        { MgChunkPrint out(c); serializeJson(doc, out); }
-        return true;
-      } else if (!memcmp("POST", hm->method.buf, hm->method.len)) {                     // if POST
-        if(request->hasParam("mqtt_update")) {
-            return false;                                                       // handled in network.cpp
+// GET /ws/state: websocket that pushes the /settings document instead of having
+// clients poll it. A client gets the full document on connect, after that at most
+// once per WS_STATE_INTERVAL a JSON merge patch (RFC 7386) with only the fields
+// that changed. One render and one diff per tick, shared by all clients.
+// The buffers and JsonDocuments are kept while clients are connected and reused every
+// tick; the parsed previous document is kept as well, so a tick parses one document.
+#define WS_STATE_INTERVAL       1000                                    // ms
+#define WS_STATE_MAX_CLIENTS    4
+#define WS_STATE_PATCH_SIZE     1024                                    // JsonDocument capacity for the patch
+#define WS_STATE_SENDBUF        8192                                    // close clients that stop reading
+
+static std::vector<struct mg_connection *> wsStateConnections;
+static struct mg_timer *wsStateTimer = NULL;
+static struct mg_iobuf wsStateLast = { NULL, 0, 0, 256 };              // document the clients have now
+static struct mg_iobuf wsStateCur = { NULL, 0, 0, 256 };
+static struct mg_iobuf wsStatePatchBuf = { NULL, 0, 0, 256 };
+static DynamicJsonDocument *wsStateDoc[2] = { NULL, NULL };             // parsed documents, see wsStateLastDoc
+static DynamicJsonDocument *wsStatePatch = NULL;
+static uint8_t wsStateLastDoc = 0;                                      // index of the parsed wsStateLast
+static bool wsStateLastParsed = false;
+
+// Fill patch with what changes a into b, returns false if nothing changed.
+// Objects are diffed per key; any other changed value is sent as a whole.
+static bool json_merge_patch(JsonObjectConst a, JsonObjectConst b, JsonObject patch) {
+    for (JsonPairConst kv : b) {
+        const char *key = kv.key().c_str();
+        JsonVariantConst old = a[key];
+        if (old.is<JsonObjectConst>() && kv.value().is<JsonObjectConst>()) {
+            if (!json_merge_patch(old.as<JsonObjectConst>(), kv.value().as<JsonObjectConst>(), patch.createNestedObject(key)))
+                patch.remove(key);
+        } else if (!a.containsKey(key) || old != kv.value()) {
+            patch[key] = kv.value();
         }
-        DynamicJsonDocument doc(512); // https://arduinojson.org/v6/assistant/
+    }
+    for (JsonPairConst kv : a) {
+        if (!b.containsKey(kv.key().c_str())) patch[kv.key().c_str()] = nullptr;
+    }
+    return patch.size() > 0;
+}
 
-        if(request->hasParam("backlight")) {
-            int backlight = request->getParam("backlight")->value().toInt();
-            BacklightTimer = backlight * BACKLIGHT;
-            //not saved in NVS
-            doc["Backlight"] = backlight;
-        }
+static void ws_state_send(const void *buf, size_t len) {
+    for (struct mg_connection *c : wsStateConnections) {
+        if (c->send.len > WS_STATE_SENDBUF) {
+            _LOG_W("Closing /ws/state client %lu, not reading\n", c->id);
+            c->is_closing = 1;
+        } else mg_ws_send(c, buf, len, WEBSOCKET_OP_TEXT);
+    }
+}
 
-        if(request->hasParam("current_min")) {
-            int current = request->getParam("current_min")->value().toInt();
-            if(current >= MIN_CURRENT && current <= 16 && LoadBl < 2) {
-                MinCurrent = current;
-                shadowPrefs.markUShort("MinCurrent", &MinCurrent);
-                doc["current_min"] = MinCurrent;
-            } else {
-                doc["current_min"] = "Value not allowed!";
+// (Re)create the documents when a rendered document of len bytes may not fit them
+static bool ws_state_docs(size_t len) {
+    size_t capacity = len * 3;
+    if (wsStateDoc[0] && wsStateDoc[0]->capacity() >= capacity) return true;
+    for (DynamicJsonDocument *&doc : wsStateDoc) {
+        delete doc;
+        doc = new DynamicJsonDocument(capacity + capacity / 2);         // room to grow
+    }
+    if (!wsStatePatch) wsStatePatch = new DynamicJsonDocument(WS_STATE_PATCH_SIZE);
+    wsStateLastParsed = false;
+    return wsStateDoc[0]->capacity() && wsStateDoc[1]->capacity() && wsStatePatch->capacity();
+}
+
+static void ws_state_free(void) {
+    for (DynamicJsonDocument *&doc : wsStateDoc) {
+        delete doc;
+        doc = NULL;
+    }
+    delete wsStatePatch;
+    wsStatePatch = NULL;
+    wsStateLastParsed = false;
+    mg_iobuf_free(&wsStateLast);
+    mg_iobuf_free(&wsStateCur);
+    mg_iobuf_free(&wsStatePatchBuf);
+}
+
+static void ws_state_timer_fn(void *) {
+    wsStateCur.len = 0;
+    MgBufPrint out(&wsStateCur);
+    settings_json(out);
+    if (wsStateCur.len == wsStateLast.len && memcmp(wsStateCur.buf, wsStateLast.buf, wsStateCur.len) == 0) return;
+
+    // Diff the documents; if that runs out of memory, send the full document instead
+    // (a full document is a valid merge patch as well).
+    bool patched = false;
+    uint8_t cur = wsStateLastDoc ^ 1;
+    if (ws_state_docs(wsStateCur.len > wsStateLast.len ? wsStateCur.len : wsStateLast.len)) {
+        DynamicJsonDocument &a = *wsStateDoc[wsStateLastDoc], &b = *wsStateDoc[cur];
+        if (!wsStateLastParsed)
+            wsStateLastParsed = deserializeJson(a, (const char *)wsStateLast.buf, wsStateLast.len) == DeserializationError::Ok;
+        bool parsed = deserializeJson(b, (const char *)wsStateCur.buf, wsStateCur.len) == DeserializationError::Ok;
+        if (wsStateLastParsed && parsed) {
+            wsStatePatch->clear();
+            json_merge_patch(a.as<JsonObjectConst>(), b.as<JsonObjectConst>(), wsStatePatch->to<JsonObject>());
+            if (!wsStatePatch->overflowed()) {
+                wsStatePatchBuf.len = 0;
+                MgBufPrint pout(&wsStatePatchBuf);
+                patched = serializeJson(*wsStatePatch, pout) == wsStatePatchBuf.len && wsStatePatchBuf.len;
             }
         }
+        wsStateLastDoc = cur;
+        wsStateLastParsed = parsed;
+    }
+    if (patched) ws_state_send(wsStatePatchBuf.buf, wsStatePatchBuf.len);
+    else ws_state_send(wsStateCur.buf, wsStateCur.len);
 
-        if(request->hasParam("capacity_mode")) {
-            int val = request->getParam("capacity_mode")->value().toInt();
-            if (val >= 0 && val <= 3) {
-                CapacityMode = (CapacityMode_t)val;
-                shadowPrefs.markUShort("CapacityMode", &CapacityMode);
-                if (CapacityMode == CAP_DISABLED) {
-                    MaxSumMains = 0;
-                    shadowPrefs.markUShort("MaxSumMains", &MaxSumMains);
-                }
-                doc["capacity_mode"] = val;
+    struct mg_iobuf last = wsStateLast;                                 // swap, keeping both buffers
+    wsStateLast = wsStateCur;
+    wsStateCur = last;
+}
+
+static bool http_ws_state(struct mg_connection *c, struct mg_http_message *hm, webServerRequest *) {
+    if (wsStateConnections.size() >= WS_STATE_MAX_CLIENTS) {
+        mg_http_reply(c, 503, "", "Too many /ws/state clients\r\n");
+        return true;
+    }
+    mg_ws_upgrade(c, hm, NULL);
+    if (!wsStateLast.len) {
+        MgBufPrint out(&wsStateLast);
+        settings_json(out);
+    }
+    mg_ws_send(c, wsStateLast.buf, wsStateLast.len, WEBSOCKET_OP_TEXT);
+    wsStateConnections.push_back(c);
+    if (!wsStateTimer) wsStateTimer = mg_timer_add(c->mgr, WS_STATE_INTERVAL, MG_TIMER_REPEAT, ws_state_timer_fn, NULL);
+    return true;
+}
+
+// called on MG_EV_CLOSE of every http connection
+void ws_state_close(struct mg_connection *c) {
+    for (auto it = wsStateConnections.begin(); it != wsStateConnections.end(); ++it) {
+        if (*it == c) {
+            wsStateConnections.erase(it);
+            if (wsStateConnections.empty() && wsStateTimer) {
+                mg_timer_free(&c->mgr->timers, wsStateTimer);
+                free(wsStateTimer);
+                wsStateTimer = NULL;
+                ws_state_free();
             }
+            break;
         }
+    }
+}
+
+// POST /settings
+static bool http_settings_post(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    if(request->hasParam("mqtt_update") || request->hasParam("http_update")) {
+        return false;                                                       // handled in network.cpp
+    }
+    DynamicJsonDocument doc(512); // https://arduinojson.org/v6/assistant/
+
+    if(request->hasParam("backlight")) {
+        int backlight = request->getParam("backlight")->value().toInt();
+        BacklightTimer = backlight * BACKLIGHT;
+        //not saved in NVS
+        doc["Backlight"] = backlight;
+    }
 
-        if (request->hasParam("intervals")) {
-            static String jsonStr;
-            jsonStr = request->getParam("intervals")->value();
-            shadowPrefs.markString("intervals_json", &jsonStr);
-            SetIntervalString(jsonStr);
+    if(request->hasParam("current_min")) {
+        int current = request->getParam("current_min")->value().toInt();
+        if(current >= MIN_CURRENT && current <= 16 && LoadBl < 2) {
+            MinCurrent = current;
+            shadowPrefs.markUShort("MinCurrent", &MinCurrent);
+            doc["current_min"] = MinCurrent;
+        } else {
+            doc["current_min"] = "Value not allowed!";
         }
+    }
 
-        if(request->hasParam("current_max_sum_mains")) {
-            int current = request->getParam("current_max_sum_mains")->value().toInt();
-            if((current == 0 || (current >= 10 && current <= 600)) && LoadBl < 2) {
-                MaxSumMains = current;
+    if(request->hasParam("capacity_mode")) {
+        int val = request->getParam("capacity_mode")->value().toInt();
+        if (val >= 0 && val <= 3) {
+            CapacityMode = (CapacityMode_t)val;
+            shadowPrefs.markUShort("CapacityMode", &CapacityMode);
+            if (CapacityMode == CAP_DISABLED) {
+                MaxSumMains = 0;
                 shadowPrefs.markUShort("MaxSumMains", &MaxSumMains);
-                doc["current_max_sum_mains"] = MaxSumMains;
-            } else {
-                doc["current_max_sum_mains"] = "Value not allowed!";
             }
+            doc["capacity_mode"] = val;
         }
+    }
 
-        if(request->hasParam("max_sum_mains_timer")) {
-            int time = request->getParam("max_sum_mains_timer")->value().toInt();
-            if(time >= 0 && time <= 60 && LoadBl < 2) {
-                MaxSumMainsTime = time;
-                shadowPrefs.markUShort("MaxSumMainsTime", &MaxSumMainsTime);
-                doc["max_sum_mains_time"] = MaxSumMainsTime;
-            } else {
-                doc["max_sum_mains_time"] = "Value not allowed!";
-            }
-        }
+    if (request->hasParam("intervals")) {
+        static String jsonStr;
+        jsonStr = request->getParam("intervals")->value();
+        shadowPrefs.markString("intervals_json", &jsonStr);
+        SetIntervalString(jsonStr);
+    }
 
-        if(request->hasParam("disable_override_current")) {
-            setOverrideCurrent(0);
-            //not saved in NVS
-            doc["disable_override_current"] = "OK";
+    if(request->hasParam("current_max_sum_mains")) {
+        int current = request->getParam("current_max_sum_mains")->value().toInt();
+        if((current == 0 || (current >= 10 && current <= 600)) && LoadBl < 2) {
+            MaxSumMains = current;
+            shadowPrefs.markUShort("MaxSumMains", &MaxSumMains);
+            doc["current_max_sum_mains"] = MaxSumMains;
+        } else {
+            doc["current_max_sum_mains"] = "Value not allowed!";
         }
+    }
 
-        if(request->hasParam("custombutton")) {
-            CustomButton = request->getParam("custombutton")->value().toInt() > 0;
-            //not saved in NVS
-            doc["custombutton"] = CustomButton;
+    if(request->hasParam("max_sum_mains_timer")) {
+        int time = request->getParam("max_sum_mains_timer")->value().toInt();
+        if(time >= 0 && time <= 60 && LoadBl < 2) {
+            MaxSumMainsTime = time;
+            shadowPrefs.markUShort("MaxSumMainsTime", &MaxSumMainsTime);
+            doc["max_sum_mains_time"] = MaxSumMainsTime;
+        } else {
+            doc["max_sum_mains_time"] = "Value not allowed!";
         }
+    }
 
-        if(request->hasParam("mode")) {
-            String mode = request->getParam("mode")->value();
+    if(request->hasParam("disable_override_current")) {
+        setOverrideCurrent(0);
+        //not saved in NVS
+        doc["disable_override_current"] = "OK";
+    }
 
-            //first check if we have a delayed mode switch
-            if(request->hasParam("starttime")) {
-                String DelayedStartTimeStr = request->getParam("starttime")->value();
-                //string time_str = "2023-04-14T11:31";
-                if (!StoreTimeString(DelayedStartTimeStr, &DelayedStartTime)) {
-                    //parse OK
-                    if (DelayedStartTime.diff > 0)
-                        setAccess(OFF);                         //switch to OFF, we are Delayed Charging
-                    else {//we are in the past so no delayed charging
-                        DelayedStartTime.epoch2 = DELAYEDSTARTTIME;
-                        DelayedStopTime.epoch2 = DELAYEDSTOPTIME;
-                        DelayedRepeat = 0;
-                    }
-                }
-                else {
-                    //we couldn't parse the string, so we are NOT Delayed Charging
+    if(request->hasParam("custombutton")) {
+        CustomButton = request->getParam("custombutton")->value().toInt() > 0;
+        //not saved in NVS
+        doc["custombutton"] = CustomButton;
+    }
+
+    if(request->hasParam("mode")) {
+        String mode = request->getParam("mode")->value();
+
+        //first check if we have a delayed mode switch
+        if(request->hasParam("starttime")) {
+            String DelayedStartTimeStr = request->getParam("starttime")->value();
+            //string time_str = "2023-04-14T11:31";
+            if (!StoreTimeString(DelayedStartTimeStr, &DelayedStartTime)) {
+                //parse OK
+                if (DelayedStartTime.diff > 0)
+                    setAccess(OFF);                         //switch to OFF, we are Delayed Charging
+                else {//we are in the past so no delayed charging
                     DelayedStartTime.epoch2 = DELAYEDSTARTTIME;
                     DelayedStopTime.epoch2 = DELAYEDSTOPTIME;
                     DelayedRepeat = 0;
                 }
+            }
+            else {
+                //we couldn't parse the string, so we are NOT Delayed Charging
+                DelayedStartTime.epoch2 = DELAYEDSTARTTIME;
+                DelayedStopTime.epoch2 = DELAYEDSTOPTIME;
+                DelayedRepeat = 0;
+            }
 
-                // so now we might have a starttime and we might be Delayed Charging
-                if (DelayedStartTime.epoch2) {
-                    //we only accept a DelayedStopTime if we have a valid DelayedStartTime
-                    if(request->hasParam("stoptime")) {
-                        String DelayedStopTimeStr = request->getParam("stoptime")->value();
-                        //string time_str = "2023-04-14T11:31";
-                        if (!StoreTimeString(DelayedStopTimeStr, &DelayedStopTime)) {
-                            //parse OK
-                            if (DelayedStopTime.diff <= 0 || DelayedStopTime.epoch2 <= DelayedStartTime.epoch2)
-                                //we are in the past or DelayedStopTime before DelayedStartTime so no DelayedStopTime
-                                DelayedStopTime.epoch2 = DELAYEDSTOPTIME;
-                        }
-                        else
-                            //we couldn't parse the string, so no DelayedStopTime
+            // so now we might have a starttime and we might be Delayed Charging
+            if (DelayedStartTime.epoch2) {
+                //we only accept a DelayedStopTime if we have a valid DelayedStartTime
+                if(request->hasParam("stoptime")) {
+                    String DelayedStopTimeStr = request->getParam("stoptime")->value();
+                    //string time_str = "2023-04-14T11:31";
+                    if (!StoreTimeString(DelayedStopTimeStr, &DelayedStopTime)) {
+                        //parse OK
+                        if (DelayedStopTime.diff <= 0 || DelayedStopTime.epoch2 <= DelayedStartTime.epoch2)
+                            //we are in the past or DelayedStopTime before DelayedStartTime so no DelayedStopTime
                             DelayedStopTime.epoch2 = DELAYEDSTOPTIME;
-                        doc["stoptime"] = (DelayedStopTime.epoch2 ? DelayedStopTime.epoch2 + EPOCH2_OFFSET : 0);
-                        if(request->hasParam("repeat")) {
-                            int Repeat = request->getParam("repeat")->value().toInt();
-                            if (Repeat >= 0 && Repeat <= 1) {                                   //boundary check
-                                DelayedRepeat = Repeat;
-                                doc["repeat"] = Repeat;
-                            }
+                    }
+                    else
+                        //we couldn't parse the string, so no DelayedStopTime
+                        DelayedStopTime.epoch2 = DELAYEDSTOPTIME;
+                    doc["stoptime"] = (DelayedStopTime.epoch2 ? DelayedStopTime.epoch2 + EPOCH2_OFFSET : 0);
+                    if(request->hasParam("repeat")) {
+                        int Repeat = request->getParam("repeat")->value().toInt();
+                        if (Repeat >= 0 && Repeat <= 1) {                                   //boundary check
+                            DelayedRepeat = Repeat;
+                            doc["repeat"] = Repeat;
                         }
                     }
-
                 }
-                doc["starttime"] = (DelayedStartTime.epoch2 ? DelayedStartTime.epoch2 + EPOCH2_OFFSET : 0);
-            } else
-                DelayedStartTime.epoch2 = DELAYEDSTARTTIME;
 
-            //setMode will save all settings, so no need to save mode or delayed times here
-            switch(mode.toInt()) {
-                case 0: // OFF
-                    setAccess(OFF);
-                    break;
-                case 1:
-                    setMode(MODE_NORMAL);
-                    break;
-                case 2:
-                    setMode(MODE_SOLAR);
-                    break;
-                case 3:
-                    setMode(MODE_SMART);
-                    break;
-                case 4: // PAUSE
-                    setAccess(PAUSE);
-                    break;
-                default:
-                    mode = "Value not allowed!";
             }
-            doc["mode"] = mode;
+            doc["starttime"] = (DelayedStartTime.epoch2 ? DelayedStartTime.epoch2 + EPOCH2_OFFSET : 0);
+        } else
+            DelayedStartTime.epoch2 = DELAYEDSTARTTIME;
+
+        //setMode will save all settings, so no need to save mode or delayed times here
+        switch(mode.toInt()) {
+            case 0: // OFF
+                setAccess(OFF);
+                break;
+            case 1:
+                setMode(MODE_NORMAL);
+                break;
+            case 2:
+                setMode(MODE_SOLAR);
+                break;
+            case 3:
+                setMode(MODE_SMART);
+                break;
+            case 4: // PAUSE
+                setAccess(PAUSE);
+                break;
+            default:
+                mode = "Value not allowed!";
         }
+        doc["mode"] = mode;
+    }
+
+    if(request->hasParam("enable_C2")) {
+        EnableC2 = (EnableC2_t) request->getParam("enable_C2")->value().toInt();
+        shadowPrefs.markUShort("EnableC2", &EnableC2);
+        doc["settings"]["enable_C2"] = StrEnableC2[EnableC2];
+    }
 
-        if(request->hasParam("enable_C2")) {
-            EnableC2 = (EnableC2_t) request->getParam("enable_C2")->value().toInt();
-            shadowPrefs.markUShort("EnableC2", &EnableC2);
-            doc["settings"]["enable_C2"] = StrEnableC2[EnableC2];
+    if(request->hasParam("evse_phase")) {
+        int phase = request->getParam("evse_phase")->value().toInt();
+        if(phase >= 0 && phase <= 3) {
+            EvsePhase = phase;
+            shadowPrefs.markUChar("EvsePhase", &EvsePhase);
+            doc["evse_phase"] = EvsePhase;
+        } else {
+            doc["evse_phase"] = "Value not allowed!";
         }
+    }
 
-        if(request->hasParam("stop_timer")) {
-            int stop_timer = request->getParam("stop_timer")->value().toInt();
+    if(request->hasParam("balance_policy")) {
+        int policy = request->getParam("balance_policy")->value().toInt();
+        if(policy >= 0 && policy <= POLICY_DEFICIT) {
+            BalancePolicy = policy;
+            shadowPrefs.markUChar("BalancePolicy", &BalancePolicy);
+            doc["balance_policy"] = StrBalancePolicy[BalancePolicy];
+        } else {
+            doc["balance_policy"] = "Value not allowed!";
+        }
+    }
 
-            if(stop_timer >= 0 && stop_timer <= 60) {
-                StopTime = stop_timer;
-                shadowPrefs.markUShort("StopTime", &StopTime);
-                doc["stop_timer"] = true;
-            } else {
-                doc["stop_timer"] = false;
-            }
+    if(request->hasParam("balance_weights")) {
+        if(setBalanceWeights(request->getParam("balance_weights")->value().c_str())) {
+            doc["balance_weights"] = BalanceWeights;
+        } else {
+            doc["balance_weights"] = "Value not allowed!";
+        }
+    }
+
+    if(request->hasParam("site_role")) {
+        int role = request->getParam("site_role")->value().toInt();
+        if(role >= SITE_OFF && role <= SITE_COORDINATOR) {
+#if MQTT
+            siteUnsubscribe(role);
+#endif
+            SiteRole = role;
+            shadowPrefs.markUChar("SiteRole", &SiteRole);
+#if MQTT
+            siteSubscribe();
+#endif
+            doc["site_role"] = SiteRole;
+        } else {
+            doc["site_role"] = "Value not allowed!";
+        }
+    }
+
+    if(request->hasParam("site_max")) {
+        int current = request->getParam("site_max")->value().toInt();
+        if(current >= MIN_CURRENT && current <= 1000) {
+            SiteMax = current;
+            shadowPrefs.markUShort("SiteMax", &SiteMax);
+            doc["site_max"] = SiteMax;
+        } else {
+            doc["site_max"] = "Value not allowed!";
+        }
+    }
+
+    if(request->hasParam("site_fallback")) {
+        int current = request->getParam("site_fallback")->value().toInt();
+        if(current >= 0 && current <= 200) {
+            SiteFallback = current;
+            shadowPrefs.markUShort("SiteFallback", &SiteFallback);
+            doc["site_fallback"] = SiteFallback;
+        } else {
+            doc["site_fallback"] = "Value not allowed!";
+        }
+    }
+
+    if(request->hasParam("stop_timer")) {
+        int stop_timer = request->getParam("stop_timer")->value().toInt();
 
+        if(stop_timer >= 0 && stop_timer <= 60) {
+            StopTime = stop_timer;
+            shadowPrefs.markUShort("StopTime", &StopTime);
+            doc["stop_timer"] = true;
+        } else {
+            doc["stop_timer"] = false;
         }
 
-        if(Mode == MODE_NORMAL || Mode == MODE_SMART) {
-            if(request->hasParam("override_current")) {
-                int current = request->getParam("override_current")->value().toInt();
-                if (LoadBl < 2 && (current == 0 || (current >= ( MinCurrent * 10 ) && current <= ( MaxCurrent * 10 )))) { //OverrideCurrent not possible on Slave
-                    setOverrideCurrent(current);
-                    doc["override_current"] = OverrideCurrent;
-                } else {
-                    doc["override_current"] = "Value not allowed!";
-                }
-            }
-        }
+    }
 
-        if(request->hasParam("solar_start_current")) {
-            int current = request->getParam("solar_start_current")->value().toInt();
-            if(current >= 0 && current <= 48) {
-                StartCurrent = current;
-                shadowPrefs.markUShort("StartCurrent", &StartCurrent);
-                doc["solar_start_current"] = StartCurrent;
+    if(Mode == MODE_NORMAL || Mode == MODE_SMART) {
+        if(request->hasParam("override_current")) {
+            int current = request->getParam("override_current")->value().toInt();
+            if (LoadBl < 2 && (current == 0 || (current >= ( MinCurrent * 10 ) && current <= ( MaxCurrent * 10 )))) { //OverrideCurrent not possible on Slave
+                setOverrideCurrent(current);
+                doc["override_current"] = OverrideCurrent;
             } else {
-                doc["solar_start_current"] = "Value not allowed!";
+                doc["override_current"] = "Value not allowed!";
             }
         }
+    }
 
-        if(request->hasParam("solar_max_import")) {
-            int current = request->getParam("solar_max_import")->value().toInt();
-            if(current >= 0 && current <= 48) {
-                ImportCurrent = current;
-                shadowPrefs.markUShort("ImportCurrent", &ImportCurrent);
-                doc["solar_max_import"] = ImportCurrent;
-            } else {
-                doc["solar_max_import"] = "Value not allowed!";
-            }
+    if(request->hasParam("solar_start_current")) {
+        int current = request->getParam("solar_start_current")->value().toInt();
+        if(current >= 0 && current <= 48) {
+            StartCurrent = current;
+            shadowPrefs.markUShort("StartCurrent", &StartCurrent);
+            doc["solar_start_current"] = StartCurrent;
+        } else {
+            doc["solar_start_current"] = "Value not allowed!";
         }
+    }
 
-        //special section to post stuff for experimenting with an ISO15118 modem
-        if(request->hasParam("override_pwm")) {
-            int pwm = request->getParam("override_pwm")->value().toInt();
-            if (pwm == 0){
-                PILOT_DISCONNECTED;
-                CPDutyOverride = true;
-            } else if (pwm < 0){
-                PILOT_CONNECTED;
-                CPDutyOverride = false;
-                pwm = 100; // 10% until next loop, to be safe, corresponds to 6A
-            } else{
-                PILOT_CONNECTED;
-                CPDutyOverride = true;
-            }
+    if(request->hasParam("solar_max_import")) {
+        int current = request->getParam("solar_max_import")->value().toInt();
+        if(current >= 0 && current <= 48) {
+            ImportCurrent = current;
+            shadowPrefs.markUShort("ImportCurrent", &ImportCurrent);
+            doc["solar_max_import"] = ImportCurrent;
+        } else {
+            doc["solar_max_import"] = "Value not allowed!";
+        }
+    }
 
-            SetCPDuty(pwm);
-            doc["override_pwm"] = pwm;
+    //special section to post stuff for experimenting with an ISO15118 modem
+    if(request->hasParam("override_pwm")) {
+        int pwm = request->getParam("override_pwm")->value().toInt();
+        if (pwm == 0){
+            PILOT_DISCONNECTED;
+            CPDutyOverride = true;
+        } else if (pwm < 0){
+            PILOT_CONNECTED;
+            CPDutyOverride = false;
+            pwm = 100; // 10% until next loop, to be safe, corresponds to 6A
+        } else{
+            PILOT_CONNECTED;
+            CPDutyOverride = true;
         }
+
+        SetCPDuty(pwm);
+        doc["override_pwm"] = pwm;
+    }
 #if MODEM
-        //allow basic plug 'n charge based on evccid
-        //if required_evccid is set to a value, SmartEVSE will only allow charging requests from said EVCCID
-        if(request->hasParam("required_evccid")) {
-            if (request->getParam("required_evccid")->value().length() <= 32) {
-                strncpy(RequiredEVCCID, request->getParam("required_evccid")->value().c_str(), sizeof(RequiredEVCCID));
-                doc["required_evccid"] = RequiredEVCCID;
-                shadowPrefs.markString("RequiredEVCCID", &RequiredEVCCID);
-            } else {
-                doc["required_evccid"] = "EVCCID too long (max 32 char)";
-            }
+    //allow basic plug 'n charge based on evccid
+    //if required_evccid is set to a value, SmartEVSE will only allow charging requests from said EVCCID
+    if(request->hasParam("required_evccid")) {
+        if (request->getParam("required_evccid")->value().length() <= 32) {
+            strncpy(RequiredEVCCID, request->getParam("required_evccid")->value().c_str(), sizeof(RequiredEVCCID));
+            doc["required_evccid"] = RequiredEVCCID;
+            shadowPrefs.markString("RequiredEVCCID", &RequiredEVCCID);
+        } else {
+            doc["required_evccid"] = "EVCCID too long (max 32 char)";
         }
+    }
 #endif
-        if(request->hasParam("lcdlock")) {
-            int lock = request->getParam("lcdlock")->value().toInt();
-            if (lock >= 0 && lock <= 1) {                                   //boundary check
-                LCDlock = lock;
-                shadowPrefs.markUChar("LCDlock", &LCDlock);
-                doc["lcdlock"] = lock;
-            }
+    if(request->hasParam("lcdlock")) {
+        int lock = request->getParam("lcdlock")->value().toInt();
+        if (lock >= 0 && lock <= 1) {                                   //boundary check
+            LCDlock = lock;
+            shadowPrefs.markUChar("LCDlock", &LCDlock);
+            doc["lcdlock"] = lock;
         }
+    }
 
-        if(request->hasParam("cablelock")) {
-            int c_lock = request->getParam("cablelock")->value().toInt();
-            if (c_lock >= 0 && c_lock <= 1) {                               //boundary check
-                CableLock = c_lock;
-                shadowPrefs.markUChar("CableLock", &CableLock);
-                doc["cablelock"] = c_lock;
-            }
+    if(request->hasParam("cablelock")) {
+        int c_lock = request->getParam("cablelock")->value().toInt();
+        if (c_lock >= 0 && c_lock <= 1) {                               //boundary check
+            CableLock = c_lock;
+            shadowPrefs.markUChar("CableLock", &CableLock);
+            doc["cablelock"] = c_lock;
         }
+    }
 
-        if(request->hasParam("ocpp_update")) {
-            if (request->getParam("ocpp_update")->value().toInt() == 1) {
+    // HomeWizard v2 push subscription: mains, circuit or ev
+    if(request->hasParam("homewizard_pair") || request->hasParam("homewizard_unpair")) {
+        bool pair = request->hasParam("homewizard_pair");
+        const char *param = pair ? "homewizard_pair" : "homewizard_unpair";
+        String which = request->getParam(param)->value();
+        Meter *meter = which == "mains" ? &MainsMeter : which == "circuit" ? &CircuitMeter : which == "ev" ? &EVMeter : nullptr;
+        if (meter == nullptr || meter->Type != EM_HOMEWIZARD) {
+            doc[param] = "Value not allowed!";
+        } else if (pair) {
+            doc[param] = homewizardPair(*meter) ? "Press the button on the meter" : "Meter not resolved yet";
+        } else {
+            meter->DeviceToken[0] = '\0';
+            meter->DeviceCert[0] = '\0';
+            write_settings();
+            doc[param] = which;
+        }
+    }
 
-                if(request->hasParam("ocpp_mode")) {
-                    OcppMode = request->getParam("ocpp_mode")->value().toInt();
-                    shadowPrefs.markUChar("OcppMode", &OcppMode);
-                    doc["ocpp_mode"] = OcppMode;
+    // Transport of a networked meter: mains, circuit or ev
+    if(request->hasParam("meter")) {
+        String which = request->getParam("meter")->value();
+        Meter *meter = which == "mains" ? &MainsMeter : which == "circuit" ? &CircuitMeter : which == "ev" ? &EVMeter : nullptr;
+        if (meter == nullptr || meter->Type == EM_HOMEWIZARD) {
+            doc["meter"] = "Value not allowed!";
+        } else {
+#if MQTT
+            char oldTopic[sizeof(meter->DevicePath)] = "";                  // topic we are subscribed to for this meter
+            if (meter->Transport == METER_MQTT) strcpy(oldTopic, meter->DevicePath);
+#endif
+            if(request->hasParam("meter_transport")) {
+                int transport = meterTransportFromName(request->getParam("meter_transport")->value().c_str());
+                if (transport < 0 || (transport == METER_MODBUS_TCP && meter->Type == EM_API)) {
+                    doc["meter_transport"] = "Value not allowed!";
+                } else {
+                    meter->Transport = transport;
+                    doc["meter_transport"] = meterTransportName(meter->Transport);
                 }
-
-                if(request->hasParam("ocpp_backend_url")) {
-                    if (OcppWsClient) {
-                        OcppWsClient->setBackendUrl(request->getParam("ocpp_backend_url")->value().c_str());
-                        doc["ocpp_backend_url"] = OcppWsClient->getBackendUrl();
-                    } else {
-                        doc["ocpp_backend_url"] = "Can only update when OCPP enabled";
-                    }
+            }
+            // strings that do not fit are refused rather than cut off
+            auto setString = [request, &doc](const char *param, char *dest, size_t size) {
+                if (!request->hasParam(param)) return;
+                String value = request->getParam(param)->value();
+                if (value.length() >= size) {
+                    doc[param] = "Value too long!";
+                } else {
+                    strcpy(dest, value.c_str());
+                    doc[param] = value;
                 }
+            };
+            setString("meter_host", meter->DeviceHostName, sizeof(meter->DeviceHostName));
+            setString("meter_path", meter->DevicePath, sizeof(meter->DevicePath));
+            setString("meter_json", meter->JsonPaths, sizeof(meter->JsonPaths));
+            if(request->hasParam("meter_interval")) {
+                int interval = request->getParam("meter_interval")->value().toInt();
+                if (interval == 0 || (interval >= NETMETER_INTERVAL_MIN && interval <= NETMETER_INTERVAL_MAX)) {
+                    meter->Interval = interval;
+                    doc["meter_interval"] = interval;
+                } else {
+                    doc["meter_interval"] = "Value not allowed!";
+                }
+            }
+#if MQTT
+            const char *newTopic = meter->Transport == METER_MQTT ? meter->DevicePath : "";
+            if (strcmp(oldTopic, newTopic)) {
+                bool shared = false;                                        // another meter may read the same topic
+                for (Meter *other : {&MainsMeter, &CircuitMeter, &EVMeter})
+                    shared |= other != meter && other->Transport == METER_MQTT && !strcmp(other->DevicePath, oldTopic);
+                if (oldTopic[0] && !shared) MQTTclient.unsubscribe(oldTopic);
+                if (newTopic[0]) MQTTclient.subscribe(newTopic, 0);
+            }
+#endif
+            write_settings();
+            doc["meter"] = which;
+        }
+    }
 
-                if(request->hasParam("ocpp_cb_id")) {
-                    if (OcppWsClient) {
-                        OcppWsClient->setChargeBoxId(request->getParam("ocpp_cb_id")->value().c_str());
-                        doc["ocpp_cb_id"] = OcppWsClient->getChargeBoxId();
-                    } else {
-                        doc["ocpp_cb_id"] = "Can only update when OCPP enabled";
-                    }
+    if(request->hasParam("ocpp_update")) {
+        if (request->getParam("ocpp_update")->value().toInt() == 1) {
+
+            if(request->hasParam("ocpp_mode")) {
+                OcppMode = request->getParam("ocpp_mode")->value().toInt();
+                shadowPrefs.markUChar("OcppMode", &OcppMode);
+                doc["ocpp_mode"] = OcppMode;
+            }
+
+            if(request->hasParam("ocpp_backend_url")) {
+                if (OcppWsClient) {
+                    OcppWsClient->setBackendUrl(request->getParam("ocpp_backend_url")->value().c_str());
+                    doc["ocpp_backend_url"] = OcppWsClient->getBackendUrl();
+                } else {
+                    doc["ocpp_backend_url"] = "Can only update when OCPP enabled";
                 }
+            }
 
-                if(request->hasParam("ocpp_auth_key")) {
-                    if (OcppWsClient) {
-                        OcppWsClient->setAuthKey(request->getParam("ocpp_auth_key")->value().c_str());
-                        doc["ocpp_auth_key"] = OcppWsClient->getAuthKey();
-                    } else {
-                        doc["ocpp_auth_key"] = "Can only update when OCPP enabled";
-                    }
+            if(request->hasParam("ocpp_cb_id")) {
+                if (OcppWsClient) {
+                    OcppWsClient->setChargeBoxId(request->getParam("ocpp_cb_id")->value().c_str());
+                    doc["ocpp_cb_id"] = OcppWsClient->getChargeBoxId();
+                } else {
+                    doc["ocpp_cb_id"] = "Can only update when OCPP enabled";
                 }
+            }
 
-                if(request->hasParam("ocpp_auto_auth")) {
-                    auto freevendMode = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendActive");
-                    if (freevendMode) {
-                        freevendMode->setBool(request->getParam("ocpp_auto_auth")->value().toInt());
-                        doc["ocpp_auto_auth"] = freevendMode->getBool() ? 1 : 0;
-                    } else {
-                        doc["ocpp_auto_auth"] = "Can only update when OCPP enabled";
-                    }
+            if(request->hasParam("ocpp_auth_key")) {
+                if (OcppWsClient) {
+                    OcppWsClient->setAuthKey(request->getParam("ocpp_auth_key")->value().c_str());
+                    doc["ocpp_auth_key"] = OcppWsClient->getAuthKey();
+                } else {
+                    doc["ocpp_auth_key"] = "Can only update when OCPP enabled";
                 }
+            }
 
-                if(request->hasParam("ocpp_auto_auth_idtag")) {
-                    auto freevendIdTag = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendIdTag");
-                    if (freevendIdTag) {
-                        freevendIdTag->setString(request->getParam("ocpp_auto_auth_idtag")->value().c_str());
-                        doc["ocpp_auto_auth_idtag"] = freevendIdTag->getString();
-                    } else {
-                        doc["ocpp_auto_auth_idtag"] = "Can only update when OCPP enabled";
-                    }
+            if(request->hasParam("ocpp_auto_auth")) {
+                auto freevendMode = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendActive");
+                if (freevendMode) {
+                    freevendMode->setBool(request->getParam("ocpp_auto_auth")->value().toInt());
+                    doc["ocpp_auto_auth"] = freevendMode->getBool() ? 1 : 0;
+                } else {
+                    doc["ocpp_auto_auth"] = "Can only update when OCPP enabled";
                 }
+            }
 
-                // Apply changes in OcppWsClient
-                if (OcppWsClient) {
-                    OcppWsClient->reloadConfigs();
+            if(request->hasParam("ocpp_auto_auth_idtag")) {
+                auto freevendIdTag = MicroOcpp::getConfigurationPublic(MO_CONFIG_EXT_PREFIX "FreeVendIdTag");
+                if (freevendIdTag) {
+                    freevendIdTag->setString(request->getParam("ocpp_auto_auth_idtag")->value().c_str());
+                    doc["ocpp_auto_auth_idtag"] = freevendIdTag->getString();
+                } else {
+                    doc["ocpp_auto_auth_idtag"] = "Can only update when OCPP enabled";
                 }
-                MicroOcpp::configuration_save();
             }
-        }
 
-        mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        { MgChunkPrint out(c); serializeJson(doc, out); }
-        return true;
-      }
-    } else if (mg_http_match_uri(hm, "/power_day") && !memcmp("GET", hm->method.buf, hm->method.len)) {
-        // Stream JSON via HTTP chunked encoding to avoid the ~8 KB DynamicJsonDocument + serialized String
-        time_t now = time(NULL);
-        struct tm tm_info_buf;
-        struct tm *tm_info = localtime_r(&now, &tm_info_buf);
-        uint8_t i, idx = tm_info->tm_hour * (3600/CapacityPeriodSeconds) + tm_info->tm_min / (CapacityPeriodSeconds/60);
-        idx++; //go to the next time period; since PowerMeasured_Period is circular, this would be the oldest entry
-
-        mg_printf(c, "HTTP/1.1 200 OK\r\n"
-                     "Content-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        mg_http_printf_chunk(c, "{\"power_day\":[");
-        for (int x = idx; x < DAY_POINTS + idx; x++) {
-            if (x < DAY_POINTS)
-                i = x;
-            else
-                i = x - DAY_POINTS;
-
-            mg_http_printf_chunk(c, "%s{\"time\":\"%02d:%02d\",\"power\":%d}",
-                (x == idx) ? "" : ",",
-                (i * CapacityPeriodSeconds) / 3600,
-                (i * CapacityPeriodSeconds/60) % 60,
-                (int)MainsMeter.PowerMeasured_Period[i]);
-        }
-        mg_http_printf_chunk(c, "]}\r\n");
-        mg_http_printf_chunk(c, "");  // terminating empty chunk
-        return true;
-    } else if (!memcmp("POST", hm->method.buf, hm->method.len) && (
-                  mg_http_match_uri(hm, "/color_off")    ||
-                  mg_http_match_uri(hm, "/color_normal") ||
-                  mg_http_match_uri(hm, "/color_smart")  ||
-                  mg_http_match_uri(hm, "/color_solar")  ||
-                  mg_http_match_uri(hm, "/color_custom"))) {
-        // Unified handler for 5 /color_* POST endpoints. Replaces 5 copies of
-        // the same DynamicJsonDocument(200) + String + serializeJson + reply
-        // boilerplate; saves both flash and a heap alloc per click.
-        static const struct { const char *uri, *key; uint8_t *arr; } cmap[] = {
-            { "/color_off",    "off",    ColorOff },
-            { "/color_normal", "normal", ColorNormal },
-            { "/color_smart",  "smart",  ColorSmart },
-            { "/color_solar",  "solar",  ColorSolar },
-            { "/color_custom", "custom", ColorCustom },
-        };
-        const char *key = nullptr; uint8_t *arr = nullptr;
-        for (auto &m : cmap) if (mg_http_match_uri(hm, m.uri)) { key = m.key; arr = m.arr; break; }
-
-        bool ok = false;
-        if (request->hasParam("R") && request->hasParam("G") && request->hasParam("B")) {
-            int32_t R = request->getParam("R")->value().toInt();
-            int32_t G = request->getParam("G")->value().toInt();
-            int32_t B = request->getParam("B")->value().toInt();
-            if ((R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
-                arr[0] = R; arr[1] = G; arr[2] = B; ok = true;
+            // Apply changes in OcppWsClient
+            if (OcppWsClient) {
+                OcppWsClient->reloadConfigs();
             }
+            MicroOcpp::configuration_save();
         }
-        if (ok) {
-            mg_http_reply(c, 200, "Content-Type: application/json\r\n",
-                "{\"color\":{\"%s\":{\"R\":%u,\"G\":%u,\"B\":%u}}}\r\n",
-                key, arr[0], arr[1], arr[2]);
-        } else {
-            mg_http_reply(c, 200, "Content-Type: application/json\r\n", "{}\r\n");
-        }
-        return true;
-    } else if (mg_http_match_uri(hm, "/currents") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        DynamicJsonDocument doc(200);
+    }
 
-        if(request->hasParam("battery_current")) {
-            if (LoadBl < 2) {
-                homeBatteryCurrent = request->getParam("battery_current")->value().toInt();
-                homeBatteryLastUpdate = time(NULL);
-                doc["battery_current"] = homeBatteryCurrent;
-            } else
-                doc["battery_current"] = "not allowed on slave";
-        }
-
-        if(MainsMeter.Type == EM_API) {
-            if(request->hasParam("L1") && request->hasParam("L2") && request->hasParam("L3")) {
-                if (LoadBl < 2) {
-                    MainsMeter.Irms[0] = request->getParam("L1")->value().toInt();
-                    MainsMeter.Irms[1] = request->getParam("L2")->value().toInt();
-                    MainsMeter.Irms[2] = request->getParam("L3")->value().toInt();
-
-                    CalcIsum();
-                    MainsMeter.setTimeout(COMM_TIMEOUT);
-                    for (int x = 0; x < 3; x++) {
-                        char key[4]; snprintf(key, sizeof(key), "L%d", x + 1);
-                        doc["original"][key] = IrmsOriginal[x];
-                        doc[key] = MainsMeter.Irms[x];
-                    }
-                    doc["TOTAL"] = Isum;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    { MgChunkPrint out(c); serializeJson(doc, out); }
+    return true;
+}
 
-                } else
-                    doc["TOTAL"] = "not allowed on slave";
-            }
+static bool http_power_day(struct mg_connection *c, struct mg_http_message *, webServerRequest *) {
+    // Stream JSON via HTTP chunked encoding to avoid the ~8 KB DynamicJsonDocument + serialized String
+    time_t now = time(NULL);
+    struct tm tm_info_buf;
+    struct tm *tm_info = localtime_r(&now, &tm_info_buf);
+    uint8_t i, idx = tm_info->tm_hour * (3600/CapacityPeriodSeconds) + tm_info->tm_min / (CapacityPeriodSeconds/60);
+    idx++; //go to the next time period; since PowerMeasured_Period is circular, this would be the oldest entry
+
+    mg_printf(c, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    mg_http_printf_chunk(c, "{\"power_day\":[");
+    for (int x = idx; x < DAY_POINTS + idx; x++) {
+        if (x < DAY_POINTS)
+            i = x;
+        else
+            i = x - DAY_POINTS;
+
+        mg_http_printf_chunk(c, "%s{\"time\":\"%02d:%02d\",\"power\":%d}",
+            (x == idx) ? "" : ",",
+            (i * CapacityPeriodSeconds) / 3600,
+            (i * CapacityPeriodSeconds/60) % 60,
+            (int)MainsMeter.PowerMeasured_Period[i]);
+    }
+    mg_http_printf_chunk(c, "]}\r\n");
+    mg_http_printf_chunk(c, "");  // terminating empty chunk
+    return true;
+}
+
+static bool http_color(struct mg_connection *c, struct mg_http_message *hm, webServerRequest *request) {
+    // Unified handler for 5 /color_* POST endpoints. Replaces 5 copies of
+    // the same DynamicJsonDocument(200) + String + serializeJson + reply
+    // boilerplate; saves both flash and a heap alloc per click.
+    static const struct { const char *uri, *key; uint8_t *arr; } cmap[] = {
+        { "/color_off",    "off",    ColorOff },
+        { "/color_normal", "normal", ColorNormal },
+        { "/color_smart",  "smart",  ColorSmart },
+        { "/color_solar",  "solar",  ColorSolar },
+        { "/color_custom", "custom", ColorCustom },
+    };
+    const char *key = nullptr; uint8_t *arr = nullptr;
+    for (auto &m : cmap) if (mg_http_match_uri(hm, m.uri)) { key = m.key; arr = m.arr; break; }
+
+    bool ok = false;
+    if (request->hasParam("R") && request->hasParam("G") && request->hasParam("B")) {
+        int32_t R = request->getParam("R")->value().toInt();
+        int32_t G = request->getParam("G")->value().toInt();
+        int32_t B = request->getParam("B")->value().toInt();
+        if ((R >= 0 && R < 256) && (G >= 0 && G < 256) && (B >= 0 && B < 256)) {
+            arr[0] = R; arr[1] = G; arr[2] = B; ok = true;
         }
+    }
+    if (ok) {
+        mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+            "{\"color\":{\"%s\":{\"R\":%u,\"G\":%u,\"B\":%u}}}\r\n",
+            key, arr[0], arr[1], arr[2]);
+    } else {
+        mg_http_reply(c, 200, "Content-Type: application/json\r\n", "{}\r\n");
+    }
+    return true;
+}
 
-        mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        { MgChunkPrint out(c); serializeJson(doc, out); }
-        return true;
-    } else if (mg_http_match_uri(hm, "/ev_meter") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        DynamicJsonDocument doc(200);
-
-        if(EVMeter.Type == EM_API) {
-            if(request->hasParam("L1") && request->hasParam("L2") && request->hasParam("L3")) {
-                EVMeter.Irms[0] = request->getParam("L1")->value().toInt();
-                EVMeter.Irms[1] = request->getParam("L2")->value().toInt();
-                EVMeter.Irms[2] = request->getParam("L3")->value().toInt();
-                EVMeter.CalcImeasured();
-                EVMeter.Timeout = COMM_EVTIMEOUT;
+static bool http_currents(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    DynamicJsonDocument doc(200);
+
+    if(request->hasParam("battery_current")) {
+        if (LoadBl < 2) {
+            homeBatteryCurrent = request->getParam("battery_current")->value().toInt();
+            homeBatteryLastUpdate = time(NULL);
+            doc["battery_current"] = homeBatteryCurrent;
+        } else
+            doc["battery_current"] = "not allowed on slave";
+    }
+
+    if(MainsMeter.Type == EM_API) {
+        if(request->hasParam("L1") && request->hasParam("L2") && request->hasParam("L3")) {
+            if (LoadBl < 2) {
+                MainsMeter.Irms[0] = request->getParam("L1")->value().toInt();
+                MainsMeter.Irms[1] = request->getParam("L2")->value().toInt();
+                MainsMeter.Irms[2] = request->getParam("L3")->value().toInt();
+
+                CalcIsum();
+                MainsMeter.setTimeout(COMM_TIMEOUT);
                 for (int x = 0; x < 3; x++) {
                     char key[4]; snprintf(key, sizeof(key), "L%d", x + 1);
-                    doc["ev_meter"]["currents"][key] = EVMeter.Irms[x];
+                    doc["original"][key] = IrmsOriginal[x];
+                    doc[key] = MainsMeter.Irms[x];
                 }
-                doc["ev_meter"]["currents"]["TOTAL"] = EVMeter.Irms[0] + EVMeter.Irms[1] + EVMeter.Irms[2];
-            }
+                doc["TOTAL"] = Isum;
 
-            if(request->hasParam("import_active_energy") && request->hasParam("export_active_energy") && request->hasParam("import_active_power")) {
-
-                EVMeter.Import_active_energy = request->getParam("import_active_energy")->value().toInt();
-                EVMeter.Export_active_energy = request->getParam("export_active_energy")->value().toInt();
-                EVMeter.PowerMeasured = request->getParam("import_active_power")->value().toInt();
-                EVMeter.UpdateEnergies();
-                doc["ev_meter"]["import_active_power"] = EVMeter.PowerMeasured;
-                doc["ev_meter"]["import_active_energy"] = EVMeter.Import_active_energy;
-                doc["ev_meter"]["export_active_energy"] = EVMeter.Export_active_energy;
-                doc["ev_meter"]["total_kwh"] = EVMeter.Energy;
-                doc["ev_meter"]["charged_kwh"] = EVMeter.EnergyCharged;
-            }
+            } else
+                doc["TOTAL"] = "not allowed on slave";
         }
+    }
 
-        mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        { MgChunkPrint out(c); serializeJson(doc, out); }
-        return true;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    { MgChunkPrint out(c); serializeJson(doc, out); }
+    return true;
+}
 
-    } else if (mg_http_match_uri(hm, "/lcd")) {
-        if (strncmp("POST", hm->method.buf, hm->method.len) == 0) {
-            if (LCDPasswordOK) {
-                const String btnName = request->getParam("button")->value();
-                const bool btnDown = request->getParam("state")->value() == "1";
-
-                // Button state bitmasks.
-                static constexpr uint8_t RIGHT_MASK = 0b100;
-                static constexpr uint8_t MIDDLE_MASK = 0b010;
-                static constexpr uint8_t LEFT_MASK = 0b001;
-                static constexpr uint8_t ALL_BUTTONS_UP = 0b111;
-                static const std::unordered_map<std::string, uint8_t> btnMasks = {
-                    {"right", RIGHT_MASK},
-                    {"middle", MIDDLE_MASK},
-                    {"left", LEFT_MASK}
-                };
-
-                xSemaphoreTake(buttonMutex, portMAX_DELAY);
-                auto it = btnMasks.find(btnName.c_str());
-                if (it != btnMasks.end()) {
-                    // Clear bits if button is pressed, set bits if up.
-                    const uint8_t mask = it->second;
-                    if (btnDown) {
-                        ButtonStateOverride = ALL_BUTTONS_UP & ~mask;
-                    } else {
-                        ButtonStateOverride = ALL_BUTTONS_UP | mask;
-                    }
-                    // Prevent stuck button in case we forget to reset to a 'down' button state.
-                    LastBtnOverrideTime = millis();
-                }
-                xSemaphoreGive(buttonMutex);
+static bool http_ev_meter(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    DynamicJsonDocument doc(200);
 
-                mg_http_reply(c, 200, "Content-Type: application/json\r\n",
-                    "{\"button\":{\"right\":\"%s\",\"middle\":\"%s\",\"left\":\"%s\"}}\r\n",
-                    (ButtonStateOverride & 4) ? "up" : "down",
-                    (ButtonStateOverride & 2) ? "up" : "down",
-                    (ButtonStateOverride & 1) ? "up" : "down");
-            } else {
-                // Without password all buttons appear "down" (not pressed).
-                mg_http_reply(c, 200, "Content-Type: application/json\r\n",
-                    "{\"button\":{\"right\":\"down\",\"middle\":\"down\",\"left\":\"down\"}}\r\n");
+    if(EVMeter.Type == EM_API) {
+        if(request->hasParam("L1") && request->hasParam("L2") && request->hasParam("L3")) {
+            EVMeter.Irms[0] = request->getParam("L1")->value().toInt();
+            EVMeter.Irms[1] = request->getParam("L2")->value().toInt();
+            EVMeter.Irms[2] = request->getParam("L3")->value().toInt();
+            EVMeter.CalcImeasured();
+            EVMeter.Timeout = COMM_EVTIMEOUT;
+            for (int x = 0; x < 3; x++) {
+                char key[4]; snprintf(key, sizeof(key), "L%d", x + 1);
+                doc["ev_meter"]["currents"][key] = EVMeter.Irms[x];
             }
-        } else {
-            // Generate BMP image from LCD buffer (into a static buffer; no heap activity).
-            size_t bmpImageSize = 0;
-            const uint8_t *bmpImage = createImageFromGLCDBuffer(bmpImageSize);
-
-            // Start the HTTP response with chunked encoding
-            mg_printf(c,
-                      "HTTP/1.1 200 OK\r\n"
-                      "Content-Type: image/bmp\r\n"
-                      "Connection: keep-alive\r\n"
-                      "Cache-Control: no-cache\r\n"
-                      "Transfer-Encoding: chunked\r\n"
-                      "\r\n");
-
-            // Using chunked transfer encoding to get rid of content-len + keep-alive problems.
-            mg_http_write_chunk(c, reinterpret_cast<const char *>(bmpImage), bmpImageSize);
-
-            // Send an empty chunk to signal the end of the response.
-            mg_http_write_chunk(c, "", 0);
+            doc["ev_meter"]["currents"]["TOTAL"] = EVMeter.Irms[0] + EVMeter.Irms[1] + EVMeter.Irms[2];
         }
-        return true;
 
-    } else if (mg_http_match_uri(hm, "/lcd-verify-password") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        char password[32];
-        mg_http_get_var(&hm->body, "password", password, sizeof(password));
-        LCDPasswordOK = (atoi(password) == LCDPin);
-        mg_http_reply(c, 200, "Content-Type: application/json\r\n",
-            "{\"success\":%s}\r\n", LCDPasswordOK ? "true" : "false");
-        return true;
+        if(request->hasParam("import_active_energy") && request->hasParam("export_active_energy") && request->hasParam("import_active_power")) {
 
+            EVMeter.Import_active_energy = request->getParam("import_active_energy")->value().toInt();
+            EVMeter.Export_active_energy = request->getParam("export_active_energy")->value().toInt();
+            EVMeter.PowerMeasured = request->getParam("import_active_power")->value().toInt();
+            EVMeter.UpdateEnergies();
+            doc["ev_meter"]["import_active_power"] = EVMeter.PowerMeasured;
+            doc["ev_meter"]["import_active_energy"] = EVMeter.Import_active_energy;
+            doc["ev_meter"]["export_active_energy"] = EVMeter.Export_active_energy;
+            doc["ev_meter"]["total_kwh"] = EVMeter.Energy;
+            doc["ev_meter"]["charged_kwh"] = EVMeter.EnergyCharged;
+        }
+    }
 
-    } else if (mg_http_match_uri(hm, "/cablelock") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        CableLock = request->hasParam("1") ? 1 : 0;
-        mg_http_reply(c, 200, "Content-Type: application/json\r\n",
-            "{\"cablelock\":%u}\r\n", CableLock);
-        return true;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    { MgChunkPrint out(c); serializeJson(doc, out); }
+    return true;
+}
 
-    } else if (mg_http_match_uri(hm, "/rfid") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        DynamicJsonDocument doc(200);
-
-        uint8_t RFIDReader = getItemValue(MENU_RFIDREADER);
-        if (!RFIDReader) {
-            doc["rfid_status"] = "RFID reader not enabled";
-        } else if (request->hasParam("rfid")) {
-            String hexString = request->getParam("rfid")->value();
-            hexString.trim();
-
-            // Check if payload is valid hex and correct length
-            bool validHex = true;
-            for (size_t i = 0; i < hexString.length(); i++) {
-                if (!isxdigit(hexString[i])) {
-                    validHex = false;
-                    break;
+static bool http_lcd(struct mg_connection *c, struct mg_http_message *hm, webServerRequest *request) {
+    if (strncmp("POST", hm->method.buf, hm->method.len) == 0) {
+        if (LCDPasswordOK) {
+            const String btnName = request->getParam("button")->value();
+            const bool btnDown = request->getParam("state")->value() == "1";
+
+            // Button state bitmasks.
+            static constexpr uint8_t RIGHT_MASK = 0b100;
+            static constexpr uint8_t MIDDLE_MASK = 0b010;
+            static constexpr uint8_t LEFT_MASK = 0b001;
+            static constexpr uint8_t ALL_BUTTONS_UP = 0b111;
+            static const std::unordered_map<std::string, uint8_t> btnMasks = {
+                {"right", RIGHT_MASK},
+                {"middle", MIDDLE_MASK},
+                {"left", LEFT_MASK}
+            };
+
+            xSemaphoreTake(buttonMutex, portMAX_DELAY);
+            auto it = btnMasks.find(btnName.c_str());
+            if (it != btnMasks.end()) {
+                // Clear bits if button is pressed, set bits if up.
+                const uint8_t mask = it->second;
+                if (btnDown) {
+                    ButtonStateOverride = ALL_BUTTONS_UP & ~mask;
+                } else {
+                    ButtonStateOverride = ALL_BUTTONS_UP | mask;
                 }
+                // Prevent stuck button in case we forget to reset to a 'down' button state.
+                LastBtnOverrideTime = millis();
             }
+            xSemaphoreGive(buttonMutex);
 
-            if (!validHex) {
-                doc["rfid_status"] = "Invalid RFID hex string";
-            } else if (hexString.length() == 12 || hexString.length() == 14) {
-                // Parse hex string into RFID array
-                memset(RFID, 0, 8);
-
-                if (hexString.length() == 12) {
-                    // 6 byte UID (old reader format, starts at RFID[1])
-                    RFID[0] = 0x01; // Family code for old reader
-                    for (int i = 0; i < 6; i++) {
-                        RFID[i + 1] = (uint8_t)strtol(hexString.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
-                    }
-                    RFID[7] = crc8((unsigned char *)RFID, 7);
-                } else {
-                    // 7 byte UID (new reader format)
-                    for (int i = 0; i < 7; i++) {
-                        RFID[i] = (uint8_t)strtol(hexString.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
-                    }
-                    RFID[7] = crc8((unsigned char *)RFID, 7);
-                }
+            mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+                "{\"button\":{\"right\":\"%s\",\"middle\":\"%s\",\"left\":\"%s\"}}\r\n",
+                (ButtonStateOverride & 4) ? "up" : "down",
+                (ButtonStateOverride & 2) ? "up" : "down",
+                (ButtonStateOverride & 1) ? "up" : "down");
+        } else {
+            // Without password all buttons appear "down" (not pressed).
+            mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+                "{\"button\":{\"right\":\"down\",\"middle\":\"down\",\"left\":\"down\"}}\r\n");
+        }
+    } else {
+        // Generate BMP image from LCD buffer (into a static buffer; no heap activity).
+        size_t bmpImageSize = 0;
+        const uint8_t *bmpImage = createImageFromGLCDBuffer(bmpImageSize);
+
+        // Start the HTTP response with chunked encoding
+        mg_printf(c,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: image/bmp\r\n"
+                  "Connection: keep-alive\r\n"
+                  "Cache-Control: no-cache\r\n"
+                  "Transfer-Encoding: chunked\r\n"
+                  "\r\n");
+
+        // Using chunked transfer encoding to get rid of content-len + keep-alive problems.
+        mg_http_write_chunk(c, reinterpret_cast<const char *>(bmpImage), bmpImageSize);
+
+        // Send an empty chunk to signal the end of the response.
+        mg_http_write_chunk(c, "", 0);
+    }
+    return true;
+}
 
-                _LOG_A("RFID received via REST API: %s\n", hexString.c_str());
+static bool http_lcd_verify_password(struct mg_connection *c, struct mg_http_message *hm, webServerRequest *) {
+    char password[32];
+    mg_http_get_var(&hm->body, "password", password, sizeof(password));
+    LCDPasswordOK = (atoi(password) == LCDPin);
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+        "{\"success\":%s}\r\n", LCDPasswordOK ? "true" : "false");
+    return true;
+}
 
-                // Reset RFIDstatus so CheckRFID processes the card as new
-                RFIDstatus = 0;
+static bool http_cablelock(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    CableLock = request->hasParam("1") ? 1 : 0;
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+        "{\"cablelock\":%u}\r\n", CableLock);
+    return true;
+}
 
-                // Process RFID using existing logic (whitelist check, OCPP, etc.)
-                CheckRFID();
+static bool http_rfid(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    DynamicJsonDocument doc(200);
+
+    uint8_t RFIDReader = getItemValue(MENU_RFIDREADER);
+    if (!RFIDReader) {
+        doc["rfid_status"] = "RFID reader not enabled";
+    } else if (request->hasParam("rfid")) {
+        String hexString = request->getParam("rfid")->value();
+        hexString.trim();
+
+        // Check if payload is valid hex and correct length
+        bool validHex = true;
+        for (size_t i = 0; i < hexString.length(); i++) {
+            if (!isxdigit(hexString[i])) {
+                validHex = false;
+                break;
+            }
+        }
 
-                doc["rfid"] = hexString;
-                doc["rfid_status"] = !RFIDReader ? "Not Installed" : RFIDstatus >= 8 ? "NOSTATUS" : StrRFIDStatusWeb[RFIDstatus];
+        if (!validHex) {
+            doc["rfid_status"] = "Invalid RFID hex string";
+        } else if (hexString.length() == 12 || hexString.length() == 14) {
+            // Parse hex string into RFID array
+            memset(RFID, 0, 8);
+
+            if (hexString.length() == 12) {
+                // 6 byte UID (old reader format, starts at RFID[1])
+                RFID[0] = 0x01; // Family code for old reader
+                for (int i = 0; i < 6; i++) {
+                    RFID[i + 1] = (uint8_t)strtol(hexString.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
+                }
+                RFID[7] = crc8((unsigned char *)RFID, 7);
             } else {
-                doc["rfid_status"] = "Invalid RFID length";
+                // 7 byte UID (new reader format)
+                for (int i = 0; i < 7; i++) {
+                    RFID[i] = (uint8_t)strtol(hexString.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
+                }
+                RFID[7] = crc8((unsigned char *)RFID, 7);
             }
+
+            _LOG_A("RFID received via REST API: %s\n", hexString.c_str());
+
+            // Reset RFIDstatus so CheckRFID processes the card as new
+            RFIDstatus = 0;
+
+            // Process RFID using existing logic (whitelist check, OCPP, etc.)
+            CheckRFID();
+
+            doc["rfid"] = hexString;
+            doc["rfid_status"] = !RFIDReader ? "Not Installed" : RFIDstatus >= 8 ? "NOSTATUS" : StrRFIDStatusWeb[RFIDstatus];
         } else {
-            doc["rfid_status"] = "Missing rfid parameter";
+            doc["rfid_status"] = "Invalid RFID length";
         }
+    } else {
+        doc["rfid_status"] = "Missing rfid parameter";
+    }
 
-        mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        { MgChunkPrint out(c); serializeJson(doc, out); }
-        return true;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    { MgChunkPrint out(c); serializeJson(doc, out); }
+    return true;
+}
 
 #if MODEM && SMARTEVSE_VERSION < 40
-    } else if (mg_http_match_uri(hm, "/ev_state") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        DynamicJsonDocument doc(200);
+static bool http_ev_state(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    DynamicJsonDocument doc(200);
 
-        //State of charge posting
-        int current_soc = request->getParam("current_soc")->value().toInt();
-        int full_soc = request->getParam("full_soc")->value().toInt();
+    //State of charge posting
+    int current_soc = request->getParam("current_soc")->value().toInt();
+    int full_soc = request->getParam("full_soc")->value().toInt();
 
-        // Energy requested by car
-        int energy_request = request->getParam("energy_request")->value().toInt();
+    // Energy requested by car
+    int energy_request = request->getParam("energy_request")->value().toInt();
 
-        // Total energy capacity of car's battery
-        int energy_capacity = request->getParam("energy_capacity")->value().toInt();
+    // Total energy capacity of car's battery
+    int energy_capacity = request->getParam("energy_capacity")->value().toInt();
 
-        // Update EVCCID of car
-        if (request->hasParam("evccid")) {
-            if (request->getParam("evccid")->value().length() <= 32) {
-                strncpy(EVCCID, request->getParam("evccid")->value().c_str(), sizeof(EVCCID));
-                doc["evccid"] = EVCCID;
-            }
+    // Update EVCCID of car
+    if (request->hasParam("evccid")) {
+        if (request->getParam("evccid")->value().length() <= 32) {
+            strncpy(EVCCID, request->getParam("evccid")->value().c_str(), sizeof(EVCCID));
+            doc["evccid"] = EVCCID;
         }
+    }
 
-        if (full_soc >= FullSoC) // Only update if we received it, since sometimes it's there, sometimes it's not
-            FullSoC = full_soc;
+    if (full_soc >= FullSoC) // Only update if we received it, since sometimes it's there, sometimes it's not
+        FullSoC = full_soc;
 
-        if (energy_capacity >= EnergyCapacity) // Only update if we received it, since sometimes it's there, sometimes it's not
-            EnergyCapacity = energy_capacity;
+    if (energy_capacity >= EnergyCapacity) // Only update if we received it, since sometimes it's there, sometimes it's not
+        EnergyCapacity = energy_capacity;
 
-        if (energy_request >= EnergyRequest) // Only update if we received it, since sometimes it's there, sometimes it's not
-            EnergyRequest = energy_request;
+    if (energy_request >= EnergyRequest) // Only update if we received it, since sometimes it's there, sometimes it's not
+        EnergyRequest = energy_request;
 
-        if (current_soc >= 0 && current_soc <= 100) {
-            // We set the InitialSoC for our own calculations
-            InitialSoC = current_soc;
+    if (current_soc >= 0 && current_soc <= 100) {
+        // We set the InitialSoC for our own calculations
+        InitialSoC = current_soc;
 
-            // We also set the ComputedSoC to allow for app integrations
-            ComputedSoC = current_soc;
+        // We also set the ComputedSoC to allow for app integrations
+        ComputedSoC = current_soc;
 
-            // Skip waiting, charge since we have what we've got
-            if (State == STATE_MODEM_REQUEST || State == STATE_MODEM_WAIT || State == STATE_MODEM_DONE){
-                _LOG_A("Received SoC via REST. Shortcut to State Modem Done\n");
-                setState(STATE_MODEM_DONE); // Go to State B, which means in this case setting PWM
-            }
+        // Skip waiting, charge since we have what we've got
+        if (State == STATE_MODEM_REQUEST || State == STATE_MODEM_WAIT || State == STATE_MODEM_DONE){
+            _LOG_A("Received SoC via REST. Shortcut to State Modem Done\n");
+            setState(STATE_MODEM_DONE); // Go to State B, which means in this case setting PWM
         }
+    }
 
-        RecomputeSoC();
+    RecomputeSoC();
 
-        doc["current_soc"] = current_soc;
-        doc["full_soc"] = full_soc;
-        doc["energy_capacity"] = energy_capacity;
-        doc["energy_request"] = energy_request;
+    doc["current_soc"] = current_soc;
+    doc["full_soc"] = full_soc;
+    doc["energy_capacity"] = energy_capacity;
+    doc["energy_request"] = energy_request;
 
-        mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
-                     "Transfer-Encoding: chunked\r\n\r\n");
-        { MgChunkPrint out(c); serializeJson(doc, out); }
-        return true;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    { MgChunkPrint out(c); serializeJson(doc, out); }
+    return true;
+}
 #endif
+
 #if MODEM && SMARTEVSE_VERSION >= 40
-    } else if (mg_http_match_uri(hm, "/ev_state") && !memcmp("GET", hm->method.buf, hm->method.len)) {
-        //this can be activated by: curl -X GET "http://smartevse-xxxx.lan/ev_state?update_ev_state=1" -d ''
-        uint8_t GetState = 0;
-        if(request->hasParam("update_ev_state")) {
-            GetState = strtol(request->getParam("update_ev_state")->value().c_str(),NULL,0);
-            if (GetState)
-                setState(STATE_MODEM_REQUEST);
-        }
-        _LOG_A("DEBUG: GetState=%u.\n", GetState);
-        mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", ""); //json request needs json response
-        return true;
+static bool http_ev_state(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    //this can be activated by: curl -X GET "http://smartevse-xxxx.lan/ev_state?update_ev_state=1" -d ''
+    uint8_t GetState = 0;
+    if(request->hasParam("update_ev_state")) {
+        GetState = strtol(request->getParam("update_ev_state")->value().c_str(),NULL,0);
+        if (GetState)
+            setState(STATE_MODEM_REQUEST);
+    }
+    _LOG_A("DEBUG: GetState=%u.\n", GetState);
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", ""); //json request needs json response
+    return true;
+}
 #endif
 
-#if FAKE_RFID
-    //this can be activated by: http://smartevse-xxx.lan/debug?showrfid=1
-    } else if (mg_http_match_uri(hm, "/debug") && !memcmp("GET", hm->method.buf, hm->method.len)) {
-        if(request->hasParam("showrfid")) {
-            Show_RFID = strtol(request->getParam("showrfid")->value().c_str(),NULL,0);
-        }
-        _LOG_A("DEBUG: Show_RFID=%u.\n",Show_RFID);
-        mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", ""); //json request needs json response
+static bool http_ethernet(struct mg_connection *c, struct mg_http_message *hm, webServerRequest *request) {
+    // CH390 driver counters; POST with loopback=<frames> starts the PHY loopback benchmark
+    // in the background, its result is reported by later requests
+    ch390_stats_t st;
+    if (!ch390_get_stats(&st)) {
+        mg_http_reply(c, 404, "Content-Type: application/json\r\n", "{\"eth\":\"not present\"}\r\n");
         return true;
+    }
+    char bench[192] = "";
+    if (!memcmp("POST", hm->method.buf, hm->method.len) && request->hasParam("loopback")) {
+        uint32_t frames = constrain(request->getParam("loopback")->value().toInt(), 1, 10000);
+        uint16_t size = request->hasParam("size") ? request->getParam("size")->value().toInt() : 60;
+        if (ch390_loopback_start(frames, size) != ESP_OK) {
+            mg_http_reply(c, 409, "Content-Type: application/json\r\n", "{\"loopback\":\"not started\"}\r\n");
+            return true;
+        }
+    }
+    ch390_bench_t r;
+    switch (ch390_get_bench(&r)) {
+    case CH390_BENCH_RUNNING:
+        snprintf(bench, sizeof(bench), ",\"loopback\":\"running\"");
+        break;
+    case CH390_BENCH_DONE:
+        snprintf(bench, sizeof(bench), ",\"loopback\":{\"sent\":%u,\"received\":%u,\"elapsed_us\":%u,"
+                 "\"pps\":%u,\"latency_avg_us\":%u,\"latency_max_us\":%u}",
+                 r.sent, r.received, r.elapsed_us, r.pps, r.latency_avg_us, r.latency_max_us);
+        break;
+    default:
+        break;
+    }
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+        "{\"rx_frames\":%u,\"rx_bytes\":%u,\"tx_frames\":%u,\"tx_bytes\":%u,"
+        "\"rx_overflows\":%u,\"rx_errors\":%u,\"rx_nomem\":%u,\"tx_queue_full\":%u,"
+        "\"rx_spi_us_per_frame\":%u,\"tx_spi_us_per_frame\":%u,"
+        "\"lock_total_us\":%llu,\"lock_max_us\":%u%s}\r\n",
+        st.rx_frames, st.rx_bytes, st.tx_frames, st.tx_bytes,
+        st.rx_overflows, st.rx_errors, st.rx_nomem, st.tx_queue_full,
+        st.rx_frames ? (uint32_t)(st.rx_spi_us / st.rx_frames) : 0,
+        st.tx_frames ? (uint32_t)(st.tx_spi_us / st.tx_frames) : 0,
+        (unsigned long long)st.lock_total_us, st.lock_max_us, bench);
+    return true;
+}
+
+#if FAKE_RFID
+//this can be activated by: http://smartevse-xxx.lan/debug?showrfid=1
+static bool http_debug(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    if(request->hasParam("showrfid")) {
+        Show_RFID = strtol(request->getParam("showrfid")->value().c_str(),NULL,0);
+    }
+    _LOG_A("DEBUG: Show_RFID=%u.\n",Show_RFID);
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", ""); //json request needs json response
+    return true;
+}
 #endif
 
 #if AUTOMATED_TESTING
-    //this can be activated by: http://smartevse-xxx.lan/automated_testing?current_max=100
-    //WARNING: because of automated testing, no limitations here!
-    //THAT IS DANGEROUS WHEN USED IN PRODUCTION ENVIRONMENT
-    //FOR SMARTEVSE's IN A TESTING BENCH ONLY!!!!
-    } else if (mg_http_match_uri(hm, "/automated_testing") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-        if(request->hasParam("current_max")) {
-            MaxCurrent = strtol(request->getParam("current_max")->value().c_str(),NULL,0);
-        }
-        if(request->hasParam("current_main")) {
-            MaxMains = strtol(request->getParam("current_main")->value().c_str(),NULL,0);
-        }
-        if(request->hasParam("current_max_circuit")) {
-            MaxCircuit = strtol(request->getParam("current_max_circuit")->value().c_str(),NULL,0);
-        }
-        if(request->hasParam("mainsmeter")) {
-            MainsMeter.Type = strtol(request->getParam("mainsmeter")->value().c_str(),NULL,0);
-        }
-        if(request->hasParam("evmeter")) {
-            EVMeter.Type = strtol(request->getParam("evmeter")->value().c_str(),NULL,0);
-        }
-        if(request->hasParam("config")) {
-            Config = strtol(request->getParam("config")->value().c_str(),NULL,0);
-            setState(STATE_A);                                                  // so the new value will actually be read
-        }
-        if(request->hasParam("loadbl")) {
-            int LBL = strtol(request->getParam("loadbl")->value().c_str(),NULL,0);
-            ConfigureModbusMode(LBL);
-            LoadBl = LBL;
-        }
-        mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", ""); //json request needs json response
-        return true;
+//this can be activated by: http://smartevse-xxx.lan/automated_testing?current_max=100
+//WARNING: because of automated testing, no limitations here!
+//THAT IS DANGEROUS WHEN USED IN PRODUCTION ENVIRONMENT
+//FOR SMARTEVSE's IN A TESTING BENCH ONLY!!!!
+static bool http_automated_testing(struct mg_connection *c, struct mg_http_message *, webServerRequest *request) {
+    if(request->hasParam("current_max")) {
+        MaxCurrent = strtol(request->getParam("current_max")->value().c_str(),NULL,0);
+    }
+    if(request->hasParam("current_main")) {
+        MaxMains = strtol(request->getParam("current_main")->value().c_str(),NULL,0);
+    }
+    if(request->hasParam("current_max_circuit")) {
+        MaxCircuit = strtol(request->getParam("current_max_circuit")->value().c_str(),NULL,0);
+    }
+    if(request->hasParam("mainsmeter")) {
+        MainsMeter.Type = strtol(request->getParam("mainsmeter")->value().c_str(),NULL,0);
+    }
+    if(request->hasParam("evmeter")) {
+        EVMeter.Type = strtol(request->getParam("evmeter")->value().c_str(),NULL,0);
+    }
+    if(request->hasParam("config")) {
+        Config = strtol(request->getParam("config")->value().c_str(),NULL,0);
+        setState(STATE_A);                                                  // so the new value will actually be read
+    }
+    if(request->hasParam("loadbl")) {
+        int LBL = strtol(request->getParam("loadbl")->value().c_str(),NULL,0);
+        ConfigureModbusMode(LBL);
+        LoadBl = LBL;
+    }
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", ""); //json request needs json response
+    return true;
+}
+#endif
+
+// Route table for handle_URI(), sorted by uri so the request path is found with
+// a binary search instead of a chain of string matches. Routes sharing a uri
+// are told apart by method; the order is verified at compile time below.
+enum RouteMethod : uint8_t { ROUTE_ANY, ROUTE_GET, ROUTE_POST };
+
+struct HttpRoute {
+    const char *uri;
+    RouteMethod method;
+    bool (*fn)(struct mg_connection *, struct mg_http_message *, webServerRequest *);
+};
+
+static constexpr HttpRoute httpRoutes[] = {
+#if AUTOMATED_TESTING
+    { "/automated_testing",    ROUTE_POST, http_automated_testing },
+#endif
+    { "/cablelock",            ROUTE_POST, http_cablelock },
+    { "/color_custom",         ROUTE_POST, http_color },
+    { "/color_normal",         ROUTE_POST, http_color },
+    { "/color_off",            ROUTE_POST, http_color },
+    { "/color_smart",          ROUTE_POST, http_color },
+    { "/color_solar",          ROUTE_POST, http_color },
+    { "/currents",             ROUTE_POST, http_currents },
+#if FAKE_RFID
+    { "/debug",                ROUTE_GET,  http_debug },
+#endif
+    { "/ethernet",             ROUTE_ANY,  http_ethernet },
+    { "/ev_meter",             ROUTE_POST, http_ev_meter },
+#if MODEM && SMARTEVSE_VERSION < 40
+    { "/ev_state",             ROUTE_POST, http_ev_state },
 #endif
-  }
-  return false;
+#if MODEM && SMARTEVSE_VERSION >= 40
+    { "/ev_state",             ROUTE_GET,  http_ev_state },
+#endif
+    { "/lcd",                  ROUTE_ANY,  http_lcd },
+    { "/lcd-verify-password",  ROUTE_POST, http_lcd_verify_password },
+    { "/power_day",            ROUTE_GET,  http_power_day },
+    { "/rfid",                 ROUTE_POST, http_rfid },
+    { "/settings",             ROUTE_GET,  http_settings_get },
+    { "/settings",             ROUTE_POST, http_settings_post },
+    { "/ws/state",             ROUTE_GET,  http_ws_state },
+};
+static constexpr size_t httpRouteCount = sizeof(httpRoutes) / sizeof(httpRoutes[0]);
+
+static constexpr bool routesSorted(size_t i) {
+    return i + 1 >= httpRouteCount || (!strLess(httpRoutes[i + 1].uri, httpRoutes[i].uri) && routesSorted(i + 1));
+}
+static_assert(routesSorted(0), "httpRoutes must be sorted by uri");
+
+// handles URI, returns true if handled, false if not
+bool handle_URI(struct mg_connection *c, struct mg_http_message *hm,  webServerRequest* request) {
+    size_t lo = 0, hi = httpRouteCount;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (mg_strcmp(mg_str(httpRoutes[mid].uri), hm->uri) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < httpRouteCount && mg_strcmp(mg_str(httpRoutes[lo].uri), hm->uri) == 0; lo++) {
+        const HttpRoute &r = httpRoutes[lo];
+        if (r.method == ROUTE_ANY ||
+            mg_strcmp(hm->method, mg_str(r.method == ROUTE_GET ? "GET" : "POST")) == 0) {
+            return r.fn(c, hm, request);
+        }
+    }
+    return false;
 }
 
 
@@ -3003,7 +3797,6 @@ void BuzzError (void) {
 static TaskHandle_t tHandleTimer10ms  = nullptr;
 static TaskHandle_t tHandleTimer100ms = nullptr;
 static TaskHandle_t tHandleTimer1S    = nullptr;
-static TaskHandle_t tHandleHomewizard = nullptr;
 static TaskHandle_t tHandleLoop       = nullptr;
 
 void setup() {
@@ -3176,6 +3969,14 @@ void setup() {
     }
 
 
+#if NR_EVSES > 8
+    // the Node tables are initialized for 8 EVSEs
+    for (uint8_t n = 8; n < NR_EVSES; n++) {
+        Node[n].ConfigChanged = 1;
+        BalanceWeight[n] = BALANCE_WEIGHT;
+    }
+#endif
+
     // Read all settings from non volatile memory; MQTTprefix will be overwritten if stored in NVS
     read_settings();                                                            // initialize with default data when starting for the first time
     validate_settings();
@@ -3281,123 +4082,6 @@ bool fwNeedsUpdate(char * version) {
     return false;
 }
 
-/**
-  * Periodically retrieves current measurements from networked energy meters
-  * and updates the meters' currents and energies.
-  *
-  * This function ensures a delay of at least 1.95 seconds between consecutive data retrieval attempts.
-  *
-  * Implementation note: the worker runs as a persistent task that blocks on a
-  * binary semaphore. homewizard_loop() just gives the semaphore every 1.95 s.
-  * This avoids ~3 KB of heap churn every 2 s from xTaskCreate/vTaskDelete.
-  */
-static SemaphoreHandle_t homewizardWakeSem = nullptr;
-
-static void homewizard_task(void *parameter) {
-    for (;;) {
-        // Block until homewizard_loop() signals it's time for another poll cycle.
-        xSemaphoreTake(homewizardWakeSem, portMAX_DELAY);
-
-    if (strlen(MainsMeter.DeviceHostName) == 0 && MainsMeter.Type == EM_HOMEWIZARD && LoadBl < 2) { //Mains Initialize
-        // Prevent existing HomeWizard P1 users from having to reconfigure their meter after updating to a version with the new HomeWizard Kwh implementation.
-        // We can remove this code after a few releases, when we are sure most users have updated at least once.
-        _LOG_A("Migrating HomeWizard P1 implementation");
-        //Old implementation just picked the first p1meter entry discovered, so we do the same here
-        const mDNSServiceEntry *service = getmDNSServiceByIndex(EM_HOMEWIZARD, String("p1meter-"), 0, true);
-        if (service != nullptr) {
-            strncpy(MainsMeter.DeviceHostName, service->HostName.c_str(), sizeof(MainsMeter.DeviceHostName));
-            MainsMeter.DeviceHostName[sizeof(MainsMeter.DeviceHostName) - 1] = '\0';
-            write_settings();
-        }
-    }
-
-    if (MainsMeter.Type == EM_HOMEWIZARD && LoadBl < 2) {
-        _LOG_A("Start HomeWizard MainsMeter reading.");
-        const auto evdata = getDataFromHomeWizard(MainsMeter.DeviceHostName);
-        for (int i = 0; i < evdata.first; i++)
-            MainsMeter.Irms[i] = evdata.second[i];
-        if (evdata.first) {
-            CalcIsum();
-            MainsMeter.setTimeout(COMM_TIMEOUT);
-            MainsMeter.Import_active_energy = evdata.second[3];
-            MainsMeter.Export_active_energy = evdata.second[4];
-            MainsMeter.PowerMeasured = evdata.second[5];
-            MainsMeter.UpdateEnergies();
-            _LOG_A("Updated MainsMeter with Irms: %d, %d, %d, ActiveEnergyImport: %u, ActiveEnergyExport: %u, PowerMeasured: %u.\n", evdata.second[0], evdata.second[1], evdata.second[2], evdata.second[3], evdata.second[4], evdata.second[5]);
-        }
-    }
-
-    if (CircuitMeter.Type == EM_HOMEWIZARD) {
-        _LOG_A("Start HomeWizard CircuitMeter reading.");
-        const auto evdata = getDataFromHomeWizard(CircuitMeter.DeviceHostName);
-        for (int i = 0; i < evdata.first; i++)
-            CircuitMeter.Irms[i] = evdata.second[i];
-        if (evdata.first) {
-            CircuitMeter.CalcImeasured();
-            CircuitMeter.setTimeout(COMM_TIMEOUT);
-            CircuitMeter.Import_active_energy = evdata.second[3];
-            CircuitMeter.Export_active_energy = evdata.second[4];
-            CircuitMeter.PowerMeasured = evdata.second[5];
-            CircuitMeter.UpdateEnergies();
-            _LOG_A("Updated CircuitMeter with Irms: %d, %d, %d, ActiveEnergyImport: %u, ActiveEnergyExport: %u, PowerMeasured: %u.\n", evdata.second[0], evdata.second[1], evdata.second[2], evdata.second[3], evdata.second[4], evdata.second[5]);
-        }
-    }
-
-    if (EVMeter.Type == EM_HOMEWIZARD) {
-        _LOG_A("Start HomeWizard EVMeter reading.");
-        const auto evdata = getDataFromHomeWizard(EVMeter.DeviceHostName);
-        for (int i = 0; i < evdata.first; i++)
-            EVMeter.Irms[i] = evdata.second[i];
-        if (evdata.first) {
-            EVMeter.CalcImeasured();
-            EVMeter.setTimeout(COMM_TIMEOUT);
-            EVMeter.Import_active_energy = evdata.second[3];
-            EVMeter.Export_active_energy = evdata.second[4];
-            EVMeter.PowerMeasured = evdata.second[5];
-            EVMeter.UpdateEnergies();
-            _LOG_A("Updated EVMeter with Irms: %d, %d, %d, ActiveEnergyImport: %u, ActiveEnergyExport: %u, PowerMeasured: %u.\n", evdata.second[0], evdata.second[1], evdata.second[2], evdata.second[3], evdata.second[4], evdata.second[5]);
-        }
-    }
-    } // end for(;;)
-}
-
- void homewizard_loop() {
-    static unsigned long lastCheck_homewizard = 0;
-
-    constexpr unsigned long interval = 1950; // 1.95 seconds - With this setting there can be 5 attempts for updating the data before the 10 second Mains Meter timeout.
-    const unsigned long currentTime = millis();
-
-    if (MainsMeter.Type != EM_HOMEWIZARD &&
-            EVMeter.Type != EM_HOMEWIZARD &&
-            CircuitMeter.Type != EM_HOMEWIZARD) {
-        return;
-     }
-
-    if (currentTime - lastCheck_homewizard < interval) {
-        return;
-    }
-    lastCheck_homewizard = currentTime;
-
-    // Lazy first-time setup: create the wake semaphore and the persistent worker task.
-    // Done lazily so users without a HomeWizard meter never pay for the task at all.
-    if (homewizardWakeSem == nullptr) {
-        homewizardWakeSem = xSemaphoreCreateBinary();
-        if (homewizardWakeSem == nullptr) {
-            _LOG_A("Failed to create HomeWizard semaphore\n");
-            return;
-        }
-        if (xTaskCreate(homewizard_task, "HomeWizard", 3072, NULL, 1, &tHandleHomewizard) != pdPASS) {
-            _LOG_A("Failed to create HomeWizard task\n");
-            vSemaphoreDelete(homewizardWakeSem);
-            homewizardWakeSem = nullptr;
-            return;
-        }
-    }
-
-    // Wake the worker; if it's still busy from the previous cycle the give is a no-op.
-    xSemaphoreGive(homewizardWakeSem);
-}
-
 // Warn when heap or task stacks are getting close to the point where the next
 // allocation / deeper call chain will crash the firmware. Called once per second
 // from loop(). Critical conditions use _LOG_A (always shown); the softer "low"
@@ -3449,7 +4133,7 @@ static void checkMemoryHealth() {
 void loop() {
 
     network_loop();
-    homewizard_loop();
+    netmeter_loop();
     
     static unsigned long lastCheck = 0;
     if (millis() - lastCheck >= 1000) {
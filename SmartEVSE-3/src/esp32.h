@@ -139,6 +139,13 @@ extern String PairingPin;
 extern const char StrEnableC2[5][12];
 //extern Single_Phase_t Switching_To_Single_Phase;
 extern uint8_t Nr_Of_Phases_Charging;
+extern uint8_t EvsePhase;
+extern uint8_t BalancePolicy;
+extern uint8_t BalanceWeight[NR_EVSES];
+extern const char StrBalancePolicy[5][9];
+extern uint8_t SiteRole;
+extern uint16_t SiteMax;
+extern uint16_t SiteFallback;
 
 extern uint16_t EMConfigSize;
 
@@ -158,7 +165,7 @@ const struct {
     {"LOCK",    "Cable locking actuator type",                        0, 2, LOCK},
     {"MIN",     "MIN Charge Current the EV will accept (per phase)",  MIN_CURRENT, 16, MIN_CURRENT},
     {"MAX",     "MAX Charge Current for this EVSE (per phase)",       6, 80, MAX_CURRENT},
-    {"PWR SHARE", "Share Power between multiple SmartEVSEs (2-8)",    0, NR_EVSES, LOADBL},
+    {"PWR SHARE", "Share Power between multiple SmartEVSEs",          0, NR_EVSES, LOADBL},
     {"SWITCH",  "Switch function control on pin SW",                  0, 7, SWITCH},
     {"RCMON",   "Residual Current Monitor on pin RCM",                0, 1, RC_MON},
     {"RFID",    "RFID reader, learn/remove cards",                    0, 6, RFID_READER},
@@ -234,6 +241,8 @@ void setOverrideCurrent(uint16_t Current);
 void SetCPDuty(uint32_t DutyCycle);
 uint8_t setItemValue(uint8_t nav, uint16_t val);
 uint16_t getItemValue(uint8_t nav);
+uint16_t getEnergyNeed(void);
+void getSiteDemand(uint16_t *Min, uint16_t *Max);
 void ConfigureModbusMode(uint8_t newmode);
 void setMode(uint8_t NewMode) ;
 void BuzzConfirmation(void);
@@ -0,0 +1,171 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#include "estimator.h"
+
+#ifdef ESP32
+#include "freertos/FreeRTOS.h"
+static portMUX_TYPE estimatorMux = portMUX_INITIALIZER_UNLOCKED;
+#define ESTIMATOR_LOCK()    portENTER_CRITICAL(&estimatorMux)
+#define ESTIMATOR_UNLOCK()  portEXIT_CRITICAL(&estimatorMux)
+#else                                                                       // host builds of the test/ benchmarks
+#define ESTIMATOR_LOCK()
+#define ESTIMATOR_UNLOCK()
+#endif
+
+MainsEstimator MainsPrediction;
+
+void MainsEstimator::reset() {
+    ESTIMATOR_LOCK();
+    Head = 0;
+    Steps = 0;
+    LastSample = 0;
+    Samples = 0;
+    for (int x = 0; x < 3; x++) {
+        Base[x] = 0;
+        Trend[x] = 0;
+    }
+    ESTIMATOR_UNLOCK();
+}
+
+/**
+ * Remember the charge current we set, the EV follows it after ESTIMATOR_EV_DELAY
+ *
+ * @param int16_t *Current: sum of the charge currents of the charging EVSEs per phase (dA)
+ * @param uint32_t Now: ms
+ */
+void MainsEstimator::command(const int16_t *Current, uint32_t Now) {
+    ESTIMATOR_LOCK();
+    if (Steps) {
+        const Step &last = History[(Head + ESTIMATOR_HISTORY - 1) % ESTIMATOR_HISTORY];
+        if (last.Current[0] == Current[0] && last.Current[1] == Current[1] && last.Current[2] == Current[2]) {
+            ESTIMATOR_UNLOCK();
+            return;
+        }
+    }
+    History[Head].Time = Now;
+    for (int x = 0; x < 3; x++) History[Head].Current[x] = Current[x];
+    Head = (Head + 1) % ESTIMATOR_HISTORY;
+    if (Steps < ESTIMATOR_HISTORY) Steps++;
+    ESTIMATOR_UNLOCK();
+}
+
+const MainsEstimator::Step *MainsEstimator::stepAt(uint32_t Time) const {
+    const Step *step = NULL;
+
+    for (uint8_t n = 1; n <= Steps; n++) {                                  // newest first
+        step = &History[(Head + ESTIMATOR_HISTORY - n) % ESTIMATOR_HISTORY];
+        if ((int32_t)(Time - step->Time) >= ESTIMATOR_EV_DELAY) return step;
+    }
+    return step;                                                            // all changes are more recent, the oldest one known
+}
+
+/**
+ * Update the baseload estimate with a new mains measurement
+ *
+ * @param int16_t *Irms: 3 phases (dA)
+ * @param uint32_t Now: ms
+ * @param int16_t *EVCurrent: charge current measured by the EV meter per mains phase (dA),
+ *                            NULL = take the charge current set ESTIMATOR_EV_DELAY ago
+ */
+void MainsEstimator::sample(const int16_t *Irms, uint32_t Now, const int16_t *EVCurrent) {
+    ESTIMATOR_LOCK();
+    const Step *step = EVCurrent ? NULL : stepAt(Now);
+    uint32_t dt = Now - LastSample;
+    bool restart = !Samples || dt > ESTIMATOR_STALE;
+
+    if ((!EVCurrent && !step) || (!restart && !dt)) {                       // charge current unknown, can't separate the baseload
+        ESTIMATOR_UNLOCK();
+        return;
+    }
+    for (int x = 0; x < 3; x++) {
+        float baseload = Irms[x] - (EVCurrent ? EVCurrent[x] : step->Current[x]);
+        if (restart) {
+            Base[x] = baseload;
+            Trend[x] = 0;
+        } else {
+            float predicted = Base[x] + Trend[x] * dt;
+            float innovation = baseload - predicted;
+            if (innovation > ESTIMATOR_STEP || innovation < -ESTIMATOR_STEP) {
+                Base[x] = baseload;                                         // a load was switched, not a trend
+                Trend[x] = 0;
+            } else {
+                Base[x] = predicted + ESTIMATOR_ALPHA * innovation;
+                Trend[x] += ESTIMATOR_BETA * innovation / dt;
+            }
+        }
+    }
+    if (restart) Samples = 1;
+    else if (Samples < 255) Samples++;
+    LastSample = Now;
+    ESTIMATOR_UNLOCK();
+}
+
+bool MainsEstimator::ready(uint32_t Now) const {
+    ESTIMATOR_LOCK();
+    bool ret = Steps && Samples >= ESTIMATOR_MIN_SAMPLES && Now - LastSample <= ESTIMATOR_STALE;
+    ESTIMATOR_UNLOCK();
+    return ret;
+}
+
+/**
+ * Mains current once the charge current set now is drawn by the EV
+ *
+ * @param uint8_t Phase: 0-2
+ * @param uint32_t Now: ms
+ * @return int16_t current (dA)
+ */
+int16_t MainsEstimator::predict(uint8_t Phase, uint32_t Now) const {
+    ESTIMATOR_LOCK();
+    int16_t ret = estimate(Phase, Now);
+    ESTIMATOR_UNLOCK();
+    return ret;
+}
+
+int16_t MainsEstimator::estimate(uint8_t Phase, uint32_t Now) const {
+    uint32_t dt = Now - LastSample;
+    int16_t ev = Steps ? History[(Head + ESTIMATOR_HISTORY - 1) % ESTIMATOR_HISTORY].Current[Phase] : 0;
+
+    if (dt > ESTIMATOR_HORIZON) dt = ESTIMATOR_HORIZON;
+    float base = Base[Phase] + Trend[Phase] * dt;
+    return (int16_t)(base + (base < 0 ? -0.5f : 0.5f)) + ev;
+}
+
+int16_t MainsEstimator::predictMax(uint32_t Now) const {
+    ESTIMATOR_LOCK();
+    int16_t max = estimate(0, Now);
+
+    for (uint8_t x = 1; x < 3; x++) {
+        int16_t value = estimate(x, Now);
+        if (value > max) max = value;
+    }
+    ESTIMATOR_UNLOCK();
+    return max;
+}
+
+int16_t MainsEstimator::predictSum(uint32_t Now) const {
+    ESTIMATOR_LOCK();
+    int16_t sum = estimate(0, Now) + estimate(1, Now) + estimate(2, Now);
+    ESTIMATOR_UNLOCK();
+    return sum;
+}
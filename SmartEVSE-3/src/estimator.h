@@ -0,0 +1,79 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#ifndef __EVSE_ESTIMATOR
+
+#define __EVSE_ESTIMATOR
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Prediction of the mains current, used by CalcBalancedCurrent() in Smart and Solar mode
+#define ESTIMATOR_ALPHA             0.5f                                    // part of a new sample taken into the baseload estimate
+#define ESTIMATOR_BETA              0.05f                                   // part of a new sample taken into the trend
+#define ESTIMATOR_STEP              10                                      // dA off the prediction is taken as a load switching
+#define ESTIMATOR_EV_DELAY          3000                                    // ms before the EV draws a new charge current
+#define ESTIMATOR_STALE             15000                                   // ms without samples before the estimate is dropped
+#define ESTIMATOR_HORIZON           5000                                    // ms the trend is extrapolated at most
+#define ESTIMATOR_MIN_SAMPLES       3                                       // samples before the prediction is used
+#define ESTIMATOR_HISTORY           8                                       // charge current changes remembered
+
+// Per phase alpha-beta filter on the load without the EVSEs (baseload). The charge current we set
+// shows up on the mains after the EV's response delay, so each sample is corrected with the charge
+// current that was in effect at that moment. The prediction adds the charge current set now,
+// so the balancer can correct the whole difference at once instead of waiting for the EV.
+// The charge current set is only what the EV may draw; an EV that draws less (full battery, its own
+// limit) shows up as baseload. When an EV meter measures all charge current, sample() takes that
+// instead. Its reading can be up to a Modbus cycle older than the mains reading.
+// sample() is called from the meter, network and MQTT tasks, command() and predict*() from the
+// timers, so all public members take the estimator lock.
+class MainsEstimator {
+  public:
+    MainsEstimator() { reset(); }
+    void reset();
+    void command(const int16_t *Current, uint32_t Now);                     // charge current of the EVSEs per phase (dA)
+    void sample(const int16_t *Irms, uint32_t Now,                          // mains current per phase (dA)
+                const int16_t *EVCurrent = NULL);                           // measured charge current per phase (dA)
+    bool ready(uint32_t Now) const;
+    int16_t predict(uint8_t Phase, uint32_t Now) const;                     // dA, with the charge current set now
+    int16_t predictMax(uint32_t Now) const;                                 // highest phase
+    int16_t predictSum(uint32_t Now) const;                                 // sum of the phases
+
+  private:
+    struct Step {
+        uint32_t Time;
+        int16_t Current[3];
+    } History[ESTIMATOR_HISTORY];                                           // ring buffer of charge current changes
+    uint8_t Head, Steps;
+    float Base[3];                                                          // dA
+    float Trend[3];                                                         // dA/ms
+    uint32_t LastSample;
+    uint8_t Samples;
+
+    const Step *stepAt(uint32_t Time) const;                                // charge current the EV drew at Time, NULL = none set
+    int16_t estimate(uint8_t Phase, uint32_t Now) const;                    // predict() without the lock
+};
+
+extern MainsEstimator MainsPrediction;
+
+#endif
@@ -585,7 +585,7 @@ void GLCD(void) {
             } else if (ErrorFlags & CIRCUIT_NOCOMM) {
                 GLCD_print_buf2(0, (const char *) "CAN'T READ");
                 GLCD_print_buf2(2, (const char *) "CIRCUIT METER");
-            } else if (MainsMeter.Type == EM_API || MainsMeter.Type == EM_HOMEWIZARD) {
+            } else if (!MainsMeter.onBus()) {
                 GLCD_print_buf2(0, (const char *) "CAN'T READ");
                 GLCD_print_buf2(2, (const char *) "MAINS METER");
             } else {
@@ -981,9 +981,9 @@ static const char *getMeterHostStr(const Meter &meter, uint8_t value) {
         return Str;
     }
     else{   //Discovered mDNS service selected ( value >= 2 ), show the host name of the selected mDNS entry
-        const mDNSServiceEntry *service = getCompatiblemDNSServiceByIndex(meter.Type, value - 2);
-        if (service && !service->HostName.isEmpty()) {
-            compileServiceName(meter.Type, service->HostName.c_str(), Str, sizeof(Str));
+        mDNSServiceEntry service;
+        if (getCompatiblemDNSServiceByIndex(meter.Type, value - 2, service) && service.HostName[0]) {
+            compileServiceName(meter.Type, service.HostName, Str, sizeof(Str));
             if (Str[0] != '\0') {
                 return Str;
             }
@@ -1009,15 +1009,15 @@ static void commitMeterHostSelection(Meter &meter, uint8_t value) {
     }
     // If the user selected an mDNS entry (value >= 2) attempt to update the meter's DeviceHostName
     if (value >= 2) {
-        const mDNSServiceEntry *service = getCompatiblemDNSServiceByIndex(meter.Type, value - 2);
-        if (service && !service->HostName.isEmpty()) {
-            strncpy(meter.DeviceHostName, service->HostName.c_str(), sizeof(meter.DeviceHostName));
+        mDNSServiceEntry service;
+        if (getCompatiblemDNSServiceByIndex(meter.Type, value - 2, service) && service.HostName[0]) {
+            strncpy(meter.DeviceHostName, service.HostName, sizeof(meter.DeviceHostName));
             meter.DeviceHostName[sizeof(meter.DeviceHostName) - 1] = '\0';
         }
     }
     // If the user selected "Discover" (value == 0), start mDNS discovery
     if (value == 0) {
-        clearmDNSServices();
+        refreshmDNSServices();
     }
 
     meter.HostMenuSelection = 1;
@@ -1035,7 +1035,7 @@ const char * getMenuItemOption(uint8_t nav) {
     const static char StrSolenoid[] = "Solenoid";
     const static char StrMotor[]   = "Motor";
     const static char StrDisabled[] = "Disabled";
-    const static char StrLoadBl[9][9]  = {"Disabled", "Master", "Node 1", "Node 2", "Node 3", "Node 4", "Node 5", "Node 6", "Node 7"};
+    const static char StrLoadBl[2][9]  = {"Disabled", "Master"};
     const static char StrSwitch[8][11] = {"Disabled", "Access B", "Access S", "Sma-Sol B", "Sma-Sol S", "Grid Relay", "Custom B", "Custom S"};
     const static char StrGrid[2][10] = {"4Wire", "3Wire"};
     const static char StrEnabled[] = "Enabled";
@@ -1071,7 +1071,9 @@ const char * getMenuItemOption(uint8_t nav) {
                 return Str;
             } else return StrDisabled;
         case MENU_LOADBL:
-            return StrLoadBl[LoadBl]; //TODO shouldnt this be [value] ?
+            if (LoadBl < 2) return StrLoadBl[LoadBl]; //TODO shouldnt this be [value] ?
+            sprintf(Str, "Node %u", LoadBl - 1);
+            return Str;
         case MENU_SUMMAINS:
             if (value)
                 sprintf(Str, "%2u A", value);
@@ -1188,7 +1190,7 @@ uint8_t getMenuItems (void) {
     if (!getItemValue(MENU_CONFIG)) {                                                              // ? Fixed Cable?
         MenuItems[m++] = MENU_LOCK;                                             // - Cable lock (0:Disable / 1:Solenoid / 2:Motor)
     }
-    MenuItems[m++] = MENU_LOADBL;                                               // Load Balance Setting (0:Disable / 1:Master / 2-8:Node)
+    MenuItems[m++] = MENU_LOADBL;                                               // Load Balance Setting (0:Disable / 1:Master / 2-NR_EVSES:Node)
     if (Mode) {                                                                 // ? Smart or Solar mode?
         if (LoadBl < 2) {                                                       // - ? Load Balancing Disabled/Master?
             MenuItems[m++] = MENU_MAINSMETER;                                   // - - Type of Mains electric meter (0: Disabled / Constants EM_*)
@@ -0,0 +1,302 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+// Connection limits and request statistics for the mongoose web server.
+// All functions are called from the mongoose event loop, so no locking is needed.
+
+#include "http_metrics.h"
+#include "debug.h"
+
+uint8_t HttpMaxConnections = HTTP_MAX_CONNECTIONS;
+uint8_t HttpMaxPerClient = HTTP_MAX_PER_CLIENT;
+uint16_t HttpIdleTimeout = HTTP_IDLE_TIMEOUT;
+
+// Handler time histogram, upper bounds in us; the last bucket is everything slower
+static const uint32_t bucketBounds[] = { 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000 };
+#define HTTP_BUCKETS (sizeof(bucketBounds) / sizeof(bucketBounds[0]) + 1)
+
+struct HttpRouteStats {
+    char name[24];
+    uint32_t requests;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    uint64_t timeSum;                                                       // us
+    uint32_t timeMax;                                                       // us
+    uint32_t buckets[HTTP_BUCKETS];
+};
+
+static HttpRouteStats routes[HTTP_METRICS_ROUTES + 1];                     // last slot is "other"
+static uint8_t routeCount = 0;
+
+// Busiest clients by request count, kept with the space-saving algorithm: a new
+// client replaces the one with the lowest count and takes over that count, so the
+// heavy hitters stay in the table while the counts are an upper bound.
+struct HttpClientStats {
+    struct mg_addr addr;
+    uint32_t requests;
+};
+
+static HttpClientStats clients[HTTP_METRICS_CLIENTS];
+
+static const char *rejectReasons[] = { "max_connections", "per_client", "busy" };
+enum { REJECT_MAX_CONNECTIONS, REJECT_PER_CLIENT, REJECT_BUSY };
+static uint32_t rejected[3];
+static uint32_t accepted = 0, keepAliveReused = 0, idleClosed = 0;
+
+// Per connection state, kept at the start of c->data (mongoose uses the last size_t of it
+// while serving files). Copied in and out, c->data is not aligned.
+struct HttpConnMeta {
+    uint32_t lastActive;                                                    // millis() of the last traffic
+    uint8_t route;                                                          // route of the current request, for the sent bytes
+    uint8_t requests;                                                       // requests on this connection, saturates at 255
+    bool isStatic;                                                          // served from the packed fs
+};
+static_assert(sizeof(HttpConnMeta) + sizeof(size_t) <= MG_DATA_SIZE, "HttpConnMeta overlaps mongoose's use of c->data");
+
+static HttpConnMeta getMeta(struct mg_connection *c) {
+    HttpConnMeta m;
+    memcpy(&m, c->data, sizeof(m));
+    return m;
+}
+
+static void setMeta(struct mg_connection *c, const HttpConnMeta &m) {
+    memcpy(c->data, &m, sizeof(m));
+}
+
+static bool isServerConnection(const struct mg_connection *c) {
+    return c->is_accepted && !c->is_client && !c->is_listening && !c->is_closing;
+}
+
+static bool sameClient(const struct mg_addr &a, const struct mg_addr &b) {
+    return a.is_ip6 == b.is_ip6 && memcmp(a.ip, b.ip, a.is_ip6 ? 16 : 4) == 0;
+}
+
+// Count only accepted inbound server connections.
+// (This does not count listeners, outbound client connections,
+// or connections already closing, so the connection limit reflects actual
+// in-use HTTP/WebSocket server slots more accurately).
+int httpActiveConnections(struct mg_mgr *mgr) {
+    int n = 0;
+    for (struct mg_connection *t = mgr->conns; t != NULL; t = t->next) {
+        if (isServerConnection(t)) n++;
+    }
+    return n;
+}
+
+bool httpMetricsAccept(struct mg_connection *c) {
+    int n = 0, same = 0;
+    for (struct mg_connection *t = c->mgr->conns; t != NULL; t = t->next) {
+        if (!isServerConnection(t)) continue;
+        n++;
+        if (sameClient(t->rem, c->rem)) same++;
+    }
+    if (n > HttpMaxConnections + HTTP_WS_RESERVE) {
+        _LOG_W("Too many connections (%d), rejecting new connection\n", n);
+        rejected[REJECT_MAX_CONNECTIONS]++;
+        return false;
+    }
+    if (HttpMaxPerClient && same > HttpMaxPerClient) {
+        char ip[40];
+        mg_snprintf(ip, sizeof(ip), "%M", mg_print_ip, &c->rem);
+        _LOG_W("Too many connections from %s (%d), rejecting new connection\n", ip, same);
+        rejected[REJECT_PER_CLIENT]++;
+        return false;
+    }
+    accepted++;
+    HttpConnMeta m = {};
+    m.lastActive = millis();
+    m.route = 0xFF;                                                         // no request yet
+    setMeta(c, m);
+    return true;
+}
+
+bool httpMetricsBusy(struct mg_connection *c) {
+    if (httpActiveConnections(c->mgr) <= HttpMaxConnections) return false;
+    mg_http_reply(c, 503, "Connection: close\r\nContent-Type: text/plain\r\n",
+                  "Server busy, retry shortly");
+    c->is_draining = 1;
+    rejected[REJECT_BUSY]++;
+    return true;
+}
+
+void httpMetricsStatic(struct mg_connection *c) {
+    HttpConnMeta m = getMeta(c);
+    m.isStatic = true;
+    setMeta(c, m);
+}
+
+void httpMetricsEvent(struct mg_connection *c, int ev, void *ev_data) {
+    if (!c->is_accepted) return;
+    HttpConnMeta m = getMeta(c);
+    if (ev == MG_EV_READ || ev == MG_EV_WRITE) {
+        if (ev == MG_EV_WRITE && m.route <= HTTP_METRICS_ROUTES) routes[m.route].bytesOut += *(long *) ev_data;
+        m.lastActive = millis();
+        setMeta(c, m);
+    } else if (ev == MG_EV_POLL) {
+        // keep-alive connections hold one of the few sockets; close the ones that went quiet
+        if (HttpIdleTimeout && !c->is_websocket && !c->is_closing && c->send.len == 0 &&
+            millis() - m.lastActive > HttpIdleTimeout * 1000UL) {
+            c->is_closing = 1;
+            idleClosed++;
+        }
+    }
+}
+
+static uint8_t findRoute(const char *name) {
+    for (uint8_t i = 0; i < routeCount; i++) {
+        if (!strcmp(routes[i].name, name)) return i;
+    }
+    if (routeCount == HTTP_METRICS_ROUTES) return HTTP_METRICS_ROUTES;     // "other"
+    strcpy(routes[routeCount].name, name);
+    return routeCount++;
+}
+
+static void countClient(const struct mg_addr &addr) {
+    HttpClientStats *min = &clients[0];
+    for (HttpClientStats &cl : clients) {
+        if (cl.requests && sameClient(cl.addr, addr)) {
+            cl.requests++;
+            return;
+        }
+        if (cl.requests < min->requests) min = &cl;
+    }
+    min->addr = addr;
+    min->addr.port = 0;
+    min->requests++;
+}
+
+HttpRequestTimer::HttpRequestTimer(struct mg_connection *cc, struct mg_http_message *m) : c(cc), hm(m), start(micros()) {
+    HttpConnMeta meta = getMeta(c);
+    meta.isStatic = false;
+    if (meta.requests && meta.requests < 255) keepAliveReused++;
+    if (meta.requests < 255) meta.requests++;
+    setMeta(c, meta);
+}
+
+HttpRequestTimer::~HttpRequestTimer() {
+    uint32_t us = micros() - start;
+    HttpConnMeta meta = getMeta(c);
+    char name[24];
+    if (meta.isStatic) strcpy(name, "static");
+    else {
+        snprintf(name, sizeof(name), "%.*s", (int) hm->uri.len, hm->uri.buf);
+        for (char *p = name; *p; p++) if (*p == '"' || *p == '\\') *p = '_';  // labels are quoted in the output
+    }
+    meta.route = findRoute(name);
+    setMeta(c, meta);
+
+    HttpRouteStats &r = routes[meta.route];
+    r.requests++;
+    r.bytesIn += hm->message.len;
+    r.timeSum += us;
+    if (us > r.timeMax) r.timeMax = us;
+    size_t b = 0;
+    while (b < HTTP_BUCKETS - 1 && us > bucketBounds[b]) b++;
+    r.buckets[b]++;
+    countClient(c->rem);
+}
+
+// Quantile estimate from the histogram: the upper bound of the bucket it falls in
+static double quantile(const HttpRouteStats &r, double q) {
+    uint32_t rank = (uint32_t) (q * r.requests + 0.5), n = 0;
+    if (rank == 0) rank = 1;
+    for (size_t b = 0; b < HTTP_BUCKETS - 1; b++) {
+        n += r.buckets[b];
+        if (n >= rank) return (bucketBounds[b] < r.timeMax ? bucketBounds[b] : r.timeMax) / 1e6;
+    }
+    return r.timeMax / 1e6;
+}
+
+// GET /metrics in the Prometheus text format
+void httpMetricsReply(struct mg_connection *c) {
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Cache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n\r\n");
+    mg_http_printf_chunk(c, "# HELP smartevse_http_connections Open HTTP and websocket connections\n"
+                            "# TYPE smartevse_http_connections gauge\n"
+                            "smartevse_http_connections %d\n", httpActiveConnections(c->mgr));
+    mg_http_printf_chunk(c, "# HELP smartevse_http_connection_limit Configured connection limits\n"
+                            "# TYPE smartevse_http_connection_limit gauge\n"
+                            "smartevse_http_connection_limit{limit=\"max_connections\"} %u\n"
+                            "smartevse_http_connection_limit{limit=\"max_per_client\"} %u\n"
+                            "smartevse_http_connection_limit{limit=\"idle_timeout_seconds\"} %u\n",
+                            HttpMaxConnections, HttpMaxPerClient, HttpIdleTimeout);
+    mg_http_printf_chunk(c, "# HELP smartevse_http_connections_accepted_total Accepted connections\n"
+                            "# TYPE smartevse_http_connections_accepted_total counter\n"
+                            "smartevse_http_connections_accepted_total %lu\n", (unsigned long) accepted);
+    mg_http_printf_chunk(c, "# HELP smartevse_http_connections_rejected_total Connections or requests refused by a limit\n"
+                            "# TYPE smartevse_http_connections_rejected_total counter\n");
+    for (size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++)
+        mg_http_printf_chunk(c, "smartevse_http_connections_rejected_total{reason=\"%s\"} %lu\n", rejectReasons[i], (unsigned long) rejected[i]);
+    mg_http_printf_chunk(c, "# HELP smartevse_http_keepalive_reused_total Requests served on an already used connection\n"
+                            "# TYPE smartevse_http_keepalive_reused_total counter\n"
+                            "smartevse_http_keepalive_reused_total %lu\n"
+                            "# HELP smartevse_http_idle_closed_total Keep-alive connections closed after the idle timeout\n"
+                            "# TYPE smartevse_http_idle_closed_total counter\n"
+                            "smartevse_http_idle_closed_total %lu\n", (unsigned long) keepAliveReused, (unsigned long) idleClosed);
+
+    static const struct { const char *metric, *help; } counters[] = {
+        { "smartevse_http_requests_total",       "Requests per route" },
+        { "smartevse_http_request_bytes_total",  "Request bytes received per route" },
+        { "smartevse_http_response_bytes_total", "Response bytes sent per route" },
+    };
+    for (size_t k = 0; k < sizeof(counters) / sizeof(counters[0]); k++) {
+        mg_http_printf_chunk(c, "# HELP %s %s\n# TYPE %s counter\n", counters[k].metric, counters[k].help, counters[k].metric);
+        for (size_t i = 0; i <= HTTP_METRICS_ROUTES; i++) {
+            const HttpRouteStats &r = routes[i];
+            if (i >= routeCount && (i < HTTP_METRICS_ROUTES || !r.requests)) continue;
+            const char *name = i < HTTP_METRICS_ROUTES ? r.name : "other";
+            mg_http_printf_chunk(c, "%s{route=\"%s\"} %lu\n", counters[k].metric, name,
+                                 (unsigned long) (k == 0 ? r.requests : k == 1 ? r.bytesIn : r.bytesOut));
+        }
+    }
+
+    mg_http_printf_chunk(c, "# HELP smartevse_http_handler_seconds Time spent in the request handler per route\n"
+                            "# TYPE smartevse_http_handler_seconds summary\n");
+    for (size_t i = 0; i <= HTTP_METRICS_ROUTES; i++) {
+        const HttpRouteStats &r = routes[i];
+        if (i >= routeCount && (i < HTTP_METRICS_ROUTES || !r.requests)) continue;
+        const char *name = i < HTTP_METRICS_ROUTES ? r.name : "other";
+        mg_http_printf_chunk(c, "smartevse_http_handler_seconds{route=\"%s\",quantile=\"0.5\"} %.6f\n"
+                                "smartevse_http_handler_seconds{route=\"%s\",quantile=\"0.99\"} %.6f\n"
+                                "smartevse_http_handler_seconds_sum{route=\"%s\"} %.6f\n"
+                                "smartevse_http_handler_seconds_count{route=\"%s\"} %lu\n",
+                                name, quantile(r, 0.5), name, quantile(r, 0.99),
+                                name, r.timeSum / 1e6, name, (unsigned long) r.requests);
+    }
+
+    mg_http_printf_chunk(c, "# HELP smartevse_http_client_requests_total Requests of the busiest clients (upper bound)\n"
+                            "# TYPE smartevse_http_client_requests_total counter\n");
+    for (const HttpClientStats &cl : clients) {
+        if (cl.requests) mg_http_printf_chunk(c, "smartevse_http_client_requests_total{client=\"%M\"} %lu\n",
+                                              mg_print_ip, &cl.addr, (unsigned long) cl.requests);
+    }
+
+    mg_http_printf_chunk(c, "# HELP smartevse_heap_free_bytes Free heap\n"
+                            "# TYPE smartevse_heap_free_bytes gauge\n"
+                            "smartevse_heap_free_bytes %lu\n"
+                            "# HELP smartevse_uptime_seconds Time since boot\n"
+                            "# TYPE smartevse_uptime_seconds counter\n"
+                            "smartevse_uptime_seconds %lu\n",
+                            (unsigned long) ESP.getFreeHeap(), (unsigned long) (millis() / 1000));
+    mg_http_write_chunk(c, "", 0);
+}
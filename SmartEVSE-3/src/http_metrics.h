@@ -0,0 +1,63 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#ifndef __HTTP_METRICS
+
+#define __HTTP_METRICS
+
+#include <Arduino.h>
+#include "mongoose.h"
+
+// Connection limits of the web server, set with POST /settings?http_update=1 and stored in NVS
+#define HTTP_MAX_CONNECTIONS        8                                       // requests beyond this get a 503
+#define HTTP_MAX_CONNECTIONS_LIMIT  16
+#define HTTP_WS_RESERVE             1                                       // extra sockets accepted for websockets
+#define HTTP_MAX_PER_CLIENT         0                                       // connections per client ip, 0 = no limit
+#define HTTP_IDLE_TIMEOUT           30                                      // s, idle keep-alive connections are closed, 0 = never
+#define HTTP_IDLE_TIMEOUT_LIMIT     3600
+
+extern uint8_t HttpMaxConnections;
+extern uint8_t HttpMaxPerClient;
+extern uint16_t HttpIdleTimeout;
+
+// Per route request statistics
+#define HTTP_METRICS_ROUTES         24                                      // further routes are counted as "other"
+#define HTTP_METRICS_CLIENTS        8                                       // busiest client ips that are tracked
+
+int httpActiveConnections(struct mg_mgr *mgr);
+bool httpMetricsAccept(struct mg_connection *c);                            // false: over a limit, close it
+bool httpMetricsBusy(struct mg_connection *c);                              // true: 503 was sent
+void httpMetricsStatic(struct mg_connection *c);                            // request is served from the packed fs
+void httpMetricsEvent(struct mg_connection *c, int ev, void *ev_data);
+void httpMetricsReply(struct mg_connection *c);                             // GET /metrics
+
+// Times the request handler; the request is recorded when this goes out of scope
+struct HttpRequestTimer {
+    struct mg_connection *c;
+    struct mg_http_message *hm;
+    uint32_t start;
+    HttpRequestTimer(struct mg_connection *cc, struct mg_http_message *m);
+    ~HttpRequestTimer();
+};
+
+#endif
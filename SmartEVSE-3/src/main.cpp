@@ -5,6 +5,7 @@
 #include "modbus.h"
 #include "memory.h"  //for memcpy
 #include <time.h>
+#include <limits.h>
 
 #define EXT extern
 #define _GLCD GLCD()
@@ -17,6 +18,8 @@
 
 #include <WiFi.h>
 #include "network_common.h"
+#include "estimator.h"
+#include "site.h"
 #include "esp_ota_ops.h"
 #include "mbedtls/md_internal.h"
 
@@ -75,7 +78,7 @@ uint8_t Lock = LOCK;                                                        // C
 uint8_t CableLock = CABLE_LOCK;                                             // 0 = Disabled (default), 1 = Enabled; when enabled the cable is locked at all times, when disabled only when STATE != A
 uint16_t MaxCircuit = MAX_CIRCUIT;                                          // Max current of the EVSE circuit (A)
 uint8_t Config = CONFIG;                                                    // Configuration (0:Socket / 1:Fixed Cable)
-uint8_t LoadBl = LOADBL;                                                    // Load Balance Setting (0:Disable / 1:Master / 2-8:Node)
+uint8_t LoadBl = LOADBL;                                                    // Load Balance Setting (0:Disable / 1:Master / 2-NR_EVSES:Node)
 uint8_t Switch = SWITCH;                                                    // External Switch (0:Disable / 1:Access B / 2:Access S / 
                                                                             // 3:Smart-Solar B / 4:Smart-Solar S / 5: Grid Relay
                                                                             // 6:Custom B / 7:Custom S)
@@ -100,6 +103,12 @@ Meter EVMeter(EV_METER, EV_METER_ADDRESS, COMM_EVTIMEOUT);
 Meter CircuitMeter(CIRCUIT_METER, CIRCUIT_METER_ADDRESS, COMM_CIRCTIMEOUT);
 
 uint8_t Nr_Of_Phases_Charging = 3;                                          // Nr of phases we are charging with. Set to 1 or 3, depending on the CONTACT 2 setting, and the MODE we are in.
+uint8_t EvsePhase = EVSE_PHASE;                                             // Mains phase (1-3) the L1 of this EVSE is wired to, 0 = not set (all phases are assumed)
+uint8_t BalancePolicy = BALANCE_POLICY;                                     // How the Master shares the current over the charging EVSEs
+uint8_t BalanceWeight[NR_EVSES] = {1, 1, 1, 1, 1, 1, 1, 1};                 // Weight (Weighted policy) or priority (Priority policy) per EVSE
+uint8_t SiteRole = SITE_ROLE;                                               // Site balancing: Off, Group or Coordinator
+uint16_t SiteMax = SITE_MAX;                                                // Coordinator: site current per phase (A)
+uint16_t SiteFallback = SITE_FALLBACK;                                      // Group: current per phase without allotment (A)
 Switch_Phase_t Switching_Phases_C2 = NO_SWITCH;                             // Switching between 1P and 3P with the second contactor output, depends on the CONTACT 2 setting, and the MODE.
 
 uint8_t State = STATE_A;
@@ -176,6 +185,7 @@ extern volatile uint16_t ADC_CP[NUM_ADC_SAMPLES];
 
 int phasesLastUpdate = 0;
 bool phasesLastUpdateFlag = false;
+volatile bool MainsMeterPushed = false;                                     // Mains data pushed by a networked meter, balance without waiting for the 2s cycle
 int16_t IrmsOriginal[3]={0, 0, 0};
 int16_t homeBatteryCurrent = 0;
 time_t homeBatteryLastUpdate = 0; // Time in seconds since epoch
@@ -214,15 +224,13 @@ EXT uint8_t ProximityPin();
 EXT void PowerPanicCtrl(uint8_t enable);
 EXT uint8_t ReadESPdata(char *buf);
 
-extern void requestEnergyMeasurement(uint8_t Meter, uint8_t Address, bool Export);
 extern void requestNodeConfig(uint8_t NodeNr);
-extern void requestPowerMeasurement(uint8_t Meter, uint8_t Address, uint16_t PRegister);
 extern void requestNodeStatus(uint8_t NodeNr);
 extern uint8_t processAllNodeStates(uint8_t NodeNr);
 extern void BroadcastCurrent(void);
 extern void CheckRFID(void);
 extern void mqttPublishData();
-extern void mqttSmartEVSEPublishData();
+extern void siteUpdate(void);
 extern bool MQTTclientSmartEVSE_AppConnected;
 extern void DisconnectEvent(void);
 extern char EVCCID[32];
@@ -233,6 +241,7 @@ extern unsigned char triwave8(unsigned char in);
 
 extern const char StrStateName[15][13] = {"A", "B", "C", "D", "COMM_B", "COMM_B_OK", "COMM_C", "COMM_C_OK", "Activate", "B1", "C1", "MODEM_REQ", "MODEM_WAIT", "MODEM_DONE", "MODEM_DENIED"}; //note that the extern is necessary here because the const will point the compiler to internal linkage; https://cplusplus.com/forum/general/81640/
 extern const char StrEnableC2[5][12] = { "Not present", "Always Off", "Solar Off", "Always On", "Auto" };
+extern const char StrBalancePolicy[5][9] = { "Equal", "Weighted", "Priority", "FCFS", "Deficit" };
 
 //TODO perhaps move those routines from modbus to main?
 extern void ReadItemValueResponse(void);
@@ -781,14 +790,153 @@ uint8_t Pilot() {
 }
 
 
+// Mains phases (bit per phase) EVSE n draws its charge current from.
+// All three when the wiring or the number of phases is not known, which is always safe.
+static uint8_t EVSEPhaseMask(uint8_t n) {
+    uint8_t Phases = n ? Node[n].Phases : Nr_Of_Phases_Charging;
+    uint8_t L1Phase = n ? Node[n].L1Phase : EvsePhase;
+    uint8_t Mask = Phases == 1 ? 0x01 : 0x03;                                   // L1, or L1 and L2 of the EVSE
+
+    if (!Phases || Phases >= 3 || !L1Phase || L1Phase > 3) return 0x07;
+    return ((Mask << (L1Phase - 1)) | (Mask >> (4 - L1Phase))) & 0x07;         // rotated to the mains phases
+}
+
+// Load on each mains phase without the charge currents we set, and the number of charging EVSEs per phase.
+// Baseload_Circuit is 0 when no CircuitMeter is installed.
+static void CalcPhaseLoad(int *Baseload, int *Baseload_Circuit, uint8_t *Count) {
+    int Current[3] = {0, 0, 0};
+
+    for (uint8_t n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+        uint8_t Mask = EVSEPhaseMask(n);
+        for (uint8_t p = 0; p < 3; p++) if (Mask & (1 << p)) Current[p] += Balanced[n];
+    }
+    for (uint8_t p = 0; p < 3; p++) {
+        Baseload[p] = MainsMeter.Irms[p] - Current[p];
+        Baseload_Circuit[p] = max(CircuitMeter.Irms[p] - Current[p], 0);
+        Count[p] = 0;
+    }
+    for (uint8_t n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+        uint8_t Mask = EVSEPhaseMask(n);
+        for (uint8_t p = 0; p < 3; p++) if (Mask & (1 << p)) Count[p]++;
+    }
+}
+
+// Share of an EVSE with weight w in what is left on the most loaded of the phases in Mask.
+// Weight[] is the sum of the weights of the EVSEs per phase that do not have a current yet.
+static int PhaseShare(const int *Capacity, const uint16_t *Weight, uint8_t Mask, uint16_t w) {
+    int Share = INT_MAX;
+
+    for (uint8_t p = 0; p < 3; p++)
+        if ((Mask & (1 << p)) && Weight[p] && Capacity[p] * w / Weight[p] < Share) Share = Capacity[p] * w / Weight[p];
+    return max(Share, 0);
+}
+
+// Lower the Extra of the phases so that the EVSEs together stay within Budget (dA, sum of the phases).
+// Every phase with a charging EVSE can draw IsetBalanced + Extra[p]; the phases that have the most Extra give it up first.
+static void LimitPhaseExtra(int *Extra, const uint8_t *PhaseEVSE, int IsetBalanced, int Budget) {
+    int Total = 0;
+    uint8_t p;
+
+    for (p = 0; p < 3; p++) if (PhaseEVSE[p]) Total += IsetBalanced + Extra[p];
+    while (Total > Budget) {
+        uint8_t Most = 3;
+        for (p = 0; p < 3; p++)
+            if (PhaseEVSE[p] && Extra[p] > 0 && (Most == 3 || Extra[p] > Extra[Most])) Most = p;
+        if (Most == 3) break;                                                   // no Extra left, IsetBalanced is guarded on its own
+        int Cut = min(Extra[Most], Total - Budget);
+        Extra[Most] -= Cut;
+        Total -= Cut;
+    }
+}
+
+// Weight and rank of every charging EVSE under the BalancePolicy.
+// All EVSEs get MinCurrent, then the EVSEs with rank 0 are raised first, then those with rank 1, etc.
+// EVSEs with the same rank share the current by their weight.
+static void BalanceOrder(uint16_t *Weight, uint8_t *Rank) {
+    uint32_t NeedSum = 0;
+    uint8_t n, m, Known = 0;
+
+    for (n = 0; n < NR_EVSES; n++) {
+        Weight[n] = 1;
+        Rank[n] = 0;
+        uint16_t Need = n ? Node[n].EnergyNeed : getItemValue(STATUS_ENERGY_NEED);
+        if (BalancedState[n] == STATE_C && Need) {
+            NeedSum += min(Need, (uint16_t) BALANCE_NEED_MAX);
+            Known++;
+        }
+    }
+    for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+        switch (BalancePolicy) {
+            case POLICY_WEIGHTED:
+                Weight[n] = BalanceWeight[n];
+                break;
+            case POLICY_PRIORITY:                                               // higher priority first
+                for (m = 0; m < NR_EVSES; m++)
+                    if (BalancedState[m] == STATE_C && BalanceWeight[m] > BalanceWeight[n]) Rank[n]++;
+                break;
+            case POLICY_FCFS:                                                   // longest charging first
+                for (m = 0; m < NR_EVSES; m++)
+                    if (BalancedState[m] == STATE_C && (Node[m].IntTimer > Node[n].IntTimer || (Node[m].IntTimer == Node[n].IntTimer && m < n))) Rank[n]++;
+                break;
+            case POLICY_DEFICIT: {                                              // EVs that need the most energy get the most current
+                uint16_t Need = n ? Node[n].EnergyNeed : getItemValue(STATUS_ENERGY_NEED);
+                if (Need) Weight[n] = min(Need, (uint16_t) BALANCE_NEED_MAX);
+                else if (Known) Weight[n] = NeedSum / Known;                    // unknown needs count as average
+                break;
+            }
+            default:
+                break;
+        }
+        if (!Weight[n]) Weight[n] = 1;
+    }
+}
+
+// Current per phase the EVSEs of this group may use together (dA). This is MaxCircuit,
+// or less when a site coordinator shares the current of the site with other groups.
+static int CircuitLimit(void) {
+    if (SiteRole == SITE_OFF || LoadBl > 1) return MaxCircuit * 10;
+    return min(MaxCircuit * 10, (int) SiteAllotted.limit(SiteFallback * 10, millis()));
+}
+
+// Conditions in which MaxCircuit has to be considered
+static bool CircuitGuarded(void) {
+    return (LoadBl == 0 && CircuitMeter.Type && Mode != MODE_NORMAL) || LoadBl == 1 || SiteRole != SITE_OFF;
+}
+
+/**
+ * Demand of this group for the site coordinator, on the most loaded phase (dA)
+ *
+ * @param uint16_t *Min: keeps the charging EVs at MinCurrent
+ * @param uint16_t *Max: lets the charging EVs use their max, and the waiting EVs start
+ */
+void getSiteDemand(uint16_t *Min, uint16_t *Max) {
+    int Baseload[3], Baseload_Circuit[3], Low[3], High[3];
+    uint8_t n, p, PhaseEVSE[3];
+
+    CalcPhaseLoad(Baseload, Baseload_Circuit, PhaseEVSE);
+    for (p = 0; p < 3; p++) Low[p] = High[p] = Baseload_Circuit[p];
+    for (n = 0; n < NR_EVSES; n++) {
+        uint8_t Mask = EVSEPhaseMask(n);
+        for (p = 0; p < 3; p++) if (Mask & (1 << p)) {
+            if (BalancedState[n] == STATE_C) {
+                Low[p] += min((uint16_t)(MinCurrent * 10), BalancedMax[n]);
+                High[p] += BalancedMax[n];
+            } else if (BalancedState[n] == STATE_B) High[p] += MinCurrent * 10;
+        }
+    }
+    *Min = max(Low[0], max(Low[1], Low[2]));
+    *Max = max(High[0], max(High[1], High[2]));
+}
+
 // Is there at least 6A(configurable MinCurrent) available for a new EVSE?
 // Look whether there would be place for one more EVSE if we could lower them all down to MinCurrent
 // returns 1 if there is 6A available
 // returns 0 if there is no current available
 // only runs on the Master or when loadbalancing Disabled
 char IsCurrentAvailable(void) {
-    uint8_t n, ActiveEVSE = 0;
-    int Baseload, Baseload_Circuit, TotalCurrent = 0;
+    uint8_t n, p, ActiveEVSE = 0, PhaseEVSE[3];
+    int Baseload[3], Baseload_Circuit[3], TotalCurrent = 0;
+    int Circuit = CircuitLimit();
 //TODO debug:
 //    printf("@MSG: BalancedStates=%s,%s,%s,%s,%s,%s,%s,%s.\n", StrStateName[BalancedState[0]],StrStateName[BalancedState[1]],StrStateName[BalancedState[2]],StrStateName[BalancedState[3]],StrStateName[BalancedState[4]],StrStateName[BalancedState[5]],StrStateName[BalancedState[6]],StrStateName[BalancedState[7]]);
     for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C)             // must be in STATE_C
@@ -820,19 +968,21 @@ char IsCurrentAvailable(void) {
 
     ActiveEVSE++;                                                           // Do calculations with one more EVSE
     if (ActiveEVSE > NR_EVSES) ActiveEVSE = NR_EVSES;
-    Baseload = MainsMeter.Imeasured - TotalCurrent;                         // Calculate Baseload (load without any active EVSE)
-    Baseload_Circuit = CircuitMeter.Imeasured - TotalCurrent;               // Load on the Circuit subpanel excluding any active EVSE
-    if (Baseload_Circuit < 0) Baseload_Circuit = 0;                         // so Baseload_Circuit = 0 when no CircuitMeter installed
-
-    // Check if the lowest charge current(6A) x ActiveEV's + baseload would be higher then the MaxMains.
-    if (Mode != MODE_NORMAL && (ActiveEVSE * (MinCurrent * 10) + Baseload) > (MaxMains * 10)) {
-        printf("@MSG: No current available MaxMains line %d. ActiveEVSE=%u, Baseload=%d.%dA, MinCurrent=%uA, MaxMains=%uA.\n", __LINE__, ActiveEVSE, Baseload/10, abs(Baseload%10), MinCurrent, MaxMains);
-        return 0;                                                           // Not enough current available!, return with error
-    }
-    if (((LoadBl == 0 && CircuitMeter.Type && Mode != MODE_NORMAL) || LoadBl == 1) // Conditions in which MaxCircuit has to be considered
-        && ((ActiveEVSE * (MinCurrent * 10) + Baseload_Circuit) > (MaxCircuit * 10))) { // MaxCircuit is exceeded
-        printf("@MSG: No current available MaxCircuit line %d. ActiveEVSE=%u, Baseload_Circuit=%d.%dA, MinCurrent=%uA, MaxCircuit=%uA.\n", __LINE__, ActiveEVSE, Baseload_Circuit/10, abs(Baseload_Circuit%10), MinCurrent, MaxCircuit);
-        return 0;                                                           // Not enough current available!, return with error
+    CalcPhaseLoad(Baseload, Baseload_Circuit, PhaseEVSE);                   // Baseload per phase (load without any active EVSE)
+
+    // Check if the lowest charge current(6A) x EVSEs on a phase + baseload would be higher then the MaxMains.
+    // The new EVSE can be on any phase, so it is counted on all of them.
+    for (p = 0; p < 3; p++) {
+        uint8_t PhaseActive = min(PhaseEVSE[p] + 1, NR_EVSES);
+        if (Mode != MODE_NORMAL && (PhaseActive * (MinCurrent * 10) + Baseload[p]) > (MaxMains * 10)) {
+            printf("@MSG: No current available MaxMains line %d. L%u ActiveEVSE=%u, Baseload=%d.%dA, MinCurrent=%uA, MaxMains=%uA.\n", __LINE__, p + 1, PhaseActive, Baseload[p]/10, abs(Baseload[p]%10), MinCurrent, MaxMains);
+            return 0;                                                       // Not enough current available!, return with error
+        }
+        if (CircuitGuarded()                                                // Conditions in which MaxCircuit has to be considered
+            && ((PhaseActive * (MinCurrent * 10) + Baseload_Circuit[p]) > Circuit)) { // MaxCircuit is exceeded
+            printf("@MSG: No current available MaxCircuit line %d. L%u ActiveEVSE=%u, Baseload_Circuit=%d.%dA, MinCurrent=%uA, MaxCircuit=%d.%dA.\n", __LINE__, p + 1, PhaseActive, Baseload_Circuit[p]/10, abs(Baseload_Circuit[p]%10), MinCurrent, Circuit/10, Circuit%10);
+            return 0;                                                       // Not enough current available!, return with error
+        }
     } //else
         //printf("@MSG: Current available MaxCircuit line %d. ActiveEVSE=%u, Baseload_Circuit=%d.%dA, MinCurrent=%uA, MaxCircuit=%uA.\n", __LINE__, ActiveEVSE, Baseload_Circuit/10, abs(Baseload_Circuit%10), MinCurrent, MaxCircuit);
 
@@ -864,13 +1014,19 @@ char IsCurrentAvailable(void) {
 // mod =1 we have a new EVSE requesting to start charging.
 // only runs on the Master or when loadbalancing Disabled
 void CalcBalancedCurrent(char mod) {
-    int Average, MaxBalanced, Idifference, Baseload_Circuit;
+    int Average, Idifference, Baseload_Circuit;
     int ActiveEVSE = 0;
     signed int IsumImport = 0;
     int ActiveMax = 0, TotalCurrent = 0, Baseload;
     char CurrentSet[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};
-    uint8_t n;
+    uint8_t n, p;
+    int Baseload_Phase[3], Baseload_Circuit_Phase[3], Extra[3], MinBalanced;
+    int Circuit = CircuitLimit();                                               // MaxCircuit, or the site allotment
+    uint8_t PhaseEVSE[3];
     bool LimitedByMaxSumMains = false;
+    bool Predicted = MainsPrediction.ready(millis());                          // mains current with the charge currents already sent
+    int MainsImax = Predicted ? MainsPrediction.predictMax(millis()) : MainsMeter.Imeasured;
+    int MainsIsum = Predicted ? MainsPrediction.predictSum(millis()) : Isum;
     // ############### first calculate some basic variables #################
     if (BalancedState[0] == STATE_C && MaxCurrent > MaxCapacity && !Config)
         ChargeCurrent = MaxCapacity * 10;
@@ -903,17 +1059,35 @@ void CalcBalancedCurrent(char mod) {
 
     _LOG_V("Checkpoint 1 Isetbalanced=%d.%d A Imeasured=%d.%d A MaxCircuit=%d Imeasured_Circuit=%d.%d A, Battery Current = %d.%d A, mode=%u.\n", IsetBalanced/10, abs(IsetBalanced%10), MainsMeter.Imeasured/10, abs(MainsMeter.Imeasured%10), MaxCircuit, CircuitMeter.Imeasured/10, abs(CircuitMeter.Imeasured%10), homeBatteryCurrent/10, abs(homeBatteryCurrent%10), Mode);
 
-    Baseload_Circuit = CircuitMeter.Imeasured - TotalCurrent;                   // Calculate Baseload (load without any active EVSE)
-    if (Baseload_Circuit < 0)
-        Baseload_Circuit = 0;
-    Baseload = MainsMeter.Imeasured - TotalCurrent;                             // Calculate Baseload (load without any active EVSE)
+    CalcPhaseLoad(Baseload_Phase, Baseload_Circuit_Phase, PhaseEVSE);          // Calculate Baseload per phase (load without any active EVSE)
+    Baseload = max(Baseload_Phase[0], max(Baseload_Phase[1], Baseload_Phase[2]));
+    Baseload_Circuit = max(Baseload_Circuit_Phase[0], max(Baseload_Circuit_Phase[1], Baseload_Circuit_Phase[2]));
+
+    // IsetBalanced is the current for the EVSEs on the most loaded phase. Phases with more headroom can
+    // give their EVSEs this much extra (Smart and Normal mode; in Solar mode the surplus is the limit).
+    {
+        bool GuardMains = MainsMeter.Type && Mode != MODE_NORMAL;
+        bool GuardCircuit = CircuitGuarded();
+        int Headroom[3], MinHeadroom = INT_MAX;
+        for (p = 0; p < 3; p++) {
+            Headroom[p] = INT_MAX;
+            if (GuardMains) Headroom[p] = (MaxMains * 10) - Baseload_Phase[p];
+            if (GuardCircuit) Headroom[p] = min(Headroom[p], Circuit - Baseload_Circuit_Phase[p]);
+            MinHeadroom = min(MinHeadroom, Headroom[p]);
+        }
+        MinBalanced = 0;
+        for (p = 0; p < 3; p++) {
+            Extra[p] = Mode == MODE_SOLAR ? 0 : Headroom[p] - MinHeadroom;
+            MinBalanced = max(MinBalanced, PhaseEVSE[p] * MinCurrent * 10 - Extra[p]);  // MinCurrent for every EVSE on every phase
+        }
+    }
 
     // ############### now calculate IsetBalanced #################
 
     if (Mode == MODE_NORMAL)                                                    // Normal Mode
     {
         if (LoadBl == 1)                                                        // Load Balancing = Master? MaxCircuit is max current for all active EVSE's;
-            IsetBalanced = (MaxCircuit * 10 ) - Baseload_Circuit;
+            IsetBalanced = Circuit - Baseload_Circuit;
                                                                                 // limiting is per phase so no Nr_Of_Phases_Charging here!
         else
             IsetBalanced = ChargeCurrent;                                       // No Load Balancing in Normal Mode. Set current to ChargeCurrent (fix: v2.05)
@@ -949,10 +1123,10 @@ void CalcBalancedCurrent(char mod) {
 
         if (LoadBl <= 1 && CircuitMeter.Type)                                   // Conditions in which MaxCircuit has to be considered;
                                                                                 // mode = Smart/Solar so don't test for that
-            Idifference = min((MaxMains * 10) - MainsMeter.Imeasured, (MaxCircuit * 10) - CircuitMeter.Imeasured);
+            Idifference = min((MaxMains * 10) - MainsImax, Circuit - CircuitMeter.Imeasured);
         else
-            Idifference = (MaxMains * 10) - MainsMeter.Imeasured;
-        int ExcessMaxSumMains = ((MaxSumMains * 10) - Isum);
+            Idifference = (MaxMains * 10) - MainsImax;
+        int ExcessMaxSumMains = ((MaxSumMains * 10) - MainsIsum);
         if (MaxSumMains) {
             // Use ExcessMaxSumMains as additional per-phase constraint (prevents current fluctuations when CAPACITY is used)
             Idifference = min(Idifference, ExcessMaxSumMains / 3);
@@ -970,7 +1144,10 @@ void CalcBalancedCurrent(char mod) {
             if (phasesLastUpdateFlag) {                                         // only increase or decrease current if measurements are updated
                 _LOG_V("phaseLastUpdate=%u.\n", phasesLastUpdate);
                 if (Idifference > 0) {
-                    if (Mode == MODE_SMART) IsetBalanced += (Idifference / 4);  // increase with 1/4th of difference (slowly increase current)
+                    if (Mode == MODE_SMART) {
+                        if (Predicted) IsetBalanced += Idifference;             // the prediction includes the current we set, so no need to wait for the EV
+                        else IsetBalanced += (Idifference / 4);                 // increase with 1/4th of difference (slowly increase current)
+                    }
                 }                                                               // in Solar mode we compute increase of current later on!
                 else
                     IsetBalanced += Idifference;                                // last PWM setting + difference (immediately decrease current) (Smart and Solar mode)
@@ -983,11 +1160,17 @@ void CalcBalancedCurrent(char mod) {
 
         if (Mode == MODE_SOLAR)                                                 // Solar version
         {
-            IsumImport = Isum - (10 * ImportCurrent);                           // Allow Import of power from the grid when solar charging
+            IsumImport = MainsIsum - (10 * ImportCurrent);                      // Allow Import of power from the grid when solar charging
             // when there is NO charging, do not change the setpoint (IsetBalanced); except when we are in Master/Slave configuration
             if (ActiveEVSE > 0 && Idifference > 0) {                            // so we had some room for power as far as MaxCircuit and MaxMains are concerned
                 if (phasesLastUpdateFlag) {                                     // only increase or decrease current if measurements are updated.
-                    if (IsumImport < 0) {
+                    if (Predicted) {
+                        // the predicted surplus already holds the charge current we set, correct it in one step.
+                        // Every mains phase with a charging EVSE draws IsetBalanced, so the sum moves that many times the step.
+                        uint8_t LoadedPhases = (PhaseEVSE[0] > 0) + (PhaseEVSE[1] > 0) + (PhaseEVSE[2] > 0);
+                        if (IsumImport < -3 || IsumImport > 3)
+                            IsetBalanced = IsetBalanced - max(IsumImport / max(LoadedPhases, (uint8_t)1), -Idifference);
+                    } else if (IsumImport < 0) {
                         // negative, we have surplus (solar) power available
                         if (IsumImport < -10 && Idifference > 10)
                             IsetBalanced = IsetBalanced + 5;                        // more then 1A available, increase Balanced charge current with 0.5A
@@ -1012,9 +1195,9 @@ void CalcBalancedCurrent(char mod) {
             if (mod && ActiveEVSE) {                                            // if we have an ActiveEVSE and mod=1, we must be Master, so MaxCircuit has to be
                                                                                 // taken into account
 
-                IsetBalanced = min((MaxMains * 10) - Baseload, (MaxCircuit * 10 ) - Baseload_Circuit ); //assume the current should be available on all 3 phases
+                IsetBalanced = min((MaxMains * 10) - Baseload, Circuit - Baseload_Circuit ); //assume the current should be available on all 3 phases
                 if (MaxSumMains)
-                    IsetBalanced = min((int) IsetBalanced, ((MaxSumMains * 10) - Isum)/3); //assume the current should be available on all 3 phases
+                    IsetBalanced = min((int) IsetBalanced, ((MaxSumMains * 10) - MainsIsum)/3); //assume the current should be available on all 3 phases
                 _LOG_V("Checkpoint 3 Smart Isetbalanced=%d.%d A, IsumImport=%d.%d, Isum=%d.%d, ImportCurrent=%u.\n", IsetBalanced/10, abs(IsetBalanced%10), IsumImport/10, abs(IsumImport%10), Isum/10, abs(Isum%10), ImportCurrent);
             }
         } //end MODE_SMART
@@ -1029,13 +1212,23 @@ void CalcBalancedCurrent(char mod) {
     if (MainsMeter.Type && Mode != MODE_NORMAL)
         IsetBalanced = min((int) IsetBalanced, (MaxMains * 10) - Baseload); //limiting is per phase so no Nr_Of_Phases_Charging here!
     // guard MaxCircuit
-    if ((LoadBl == 0 && CircuitMeter.Type && Mode != MODE_NORMAL) || LoadBl == 1)     // Conditions in which MaxCircuit has to be considered
-        IsetBalanced = min((int) IsetBalanced, (MaxCircuit * 10) - Baseload_Circuit); //limiting is per phase so no Nr_Of_Phases_Charging here!
+    if (CircuitGuarded())                                                       // Conditions in which MaxCircuit has to be considered
+        IsetBalanced = min((int) IsetBalanced, Circuit - Baseload_Circuit);     //limiting is per phase so no Nr_Of_Phases_Charging here!
     // guard GridRelay
     if (GridRelayOpen) {
         int Phases = Force_Single_Phase_Charging() ? 1 : 3;
         IsetBalanced = min((int) IsetBalanced, (GridRelayMaxSumMains * 10)/Phases); //assume the current should be available on all 3 phases
     }
+    // The Extra of the lightly loaded phases must not take the sum past MaxSumMains or the GridRelay limit
+    if ((MaxSumMains && Mode != MODE_NORMAL) || GridRelayOpen) {
+        int Budget = INT_MAX;
+        if (MaxSumMains && Mode != MODE_NORMAL)
+            Budget = (MaxSumMains * 10) - (Baseload_Phase[0] + Baseload_Phase[1] + Baseload_Phase[2]);
+        if (GridRelayOpen) Budget = min(Budget, GridRelayMaxSumMains * 10);    // the EVSEs only
+        LimitPhaseExtra(Extra, PhaseEVSE, IsetBalanced, Budget);
+        MinBalanced = 0;
+        for (p = 0; p < 3; p++) MinBalanced = max(MinBalanced, PhaseEVSE[p] * MinCurrent * 10 - Extra[p]);
+    }
     _LOG_V("Checkpoint 4 Isetbalanced=%d.%d A.\n", IsetBalanced/10, abs(IsetBalanced%10));
 
     // ############### the rest of the work we only do if there are ActiveEVSEs #################
@@ -1045,11 +1238,11 @@ void CalcBalancedCurrent(char mod) {
 
         // ############### we now check shortage of power  #################
 
-        if (IsetBalanced < (ActiveEVSE * MinCurrent * 10)) {
+        if (IsetBalanced < MinBalanced) {
 
             // ############### shortage of power  #################
 
-            IsetBalanced = ActiveEVSE * MinCurrent * 10;                        // retain old software behaviour: set minimal "MinCurrent" charge per active EVSE
+            IsetBalanced = MinBalanced;                                         // retain old software behaviour: set minimal "MinCurrent" charge per active EVSE
             if (Mode == MODE_SOLAR) {
                 // ----------- Check to see if we have to continue charging on solar power alone ----------
                                               // Importing too much?
@@ -1091,14 +1284,16 @@ void CalcBalancedCurrent(char mod) {
             // with SOFT shortage we have a timer running
             // IsetBalanced is already set to the minimum needed power to charge all Nodes
             bool hardShortage = false;
-            // guard MaxMains
-            if (MainsMeter.Type && Mode != MODE_NORMAL)
-                if (IsetBalanced > (MaxMains * 10) - Baseload)
-                    hardShortage = true;
-            // guard MaxCircuit
-            if (((LoadBl == 0 && CircuitMeter.Type && Mode != MODE_NORMAL) || LoadBl == 1) // Conditions in which MaxCircuit has to be considered
-                && (IsetBalanced > (MaxCircuit * 10) - Baseload_Circuit))
-                    hardShortage = true;
+            for (p = 0; p < 3; p++) {
+                // guard MaxMains
+                if (MainsMeter.Type && Mode != MODE_NORMAL)
+                    if (PhaseEVSE[p] * MinCurrent * 10 > (MaxMains * 10) - Baseload_Phase[p])
+                        hardShortage = true;
+                // guard MaxCircuit
+                if (CircuitGuarded()                                            // Conditions in which MaxCircuit has to be considered
+                    && (PhaseEVSE[p] * MinCurrent * 10 > Circuit - Baseload_Circuit_Phase[p]))
+                        hardShortage = true;
+            }
             if (!MaxSumMainsTime && LimitedByMaxSumMains)                       // if we don't use the Capacity timer, we want a hard stop
                 hardShortage = true;
             if (hardShortage && Switching_Phases_C2 != GOING_TO_SWITCH_1P) {    // because switching to single phase might solve the shortage
@@ -1160,54 +1355,80 @@ void CalcBalancedCurrent(char mod) {
 
         if (IsetBalanced > ActiveMax) IsetBalanced = ActiveMax;                 // limit to total maximum Amps (of all active EVSE's)
                                                                                 // TODO not sure if Nr_Of_Phases_Charging should be involved here
-        MaxBalanced = IsetBalanced;                                             // convert to Amps
-
-        // Calculate average current per EVSE
-        n = 0;
-        while (n < NR_EVSES && ActiveEVSE) {
-            Average = MaxBalanced / ActiveEVSE;                                 // Average current for all active EVSE's
-
-            // Active EVSE, and current not yet calculated?
-            if ((BalancedState[n] == STATE_C) && (!CurrentSet[n])) {            
-
-                // Check for EVSE's that are starting with Solar charging
-                if ((Mode == MODE_SOLAR) && (Node[n].IntTimer < SOLARSTARTTIME)) {
-                    Balanced[n] = MinCurrent * 10;                              // Set to MinCurrent
-                    _LOG_V("[S]Node %u = %u.%u A\n", n, Balanced[n]/10, Balanced[n]%10);
-                    CurrentSet[n] = 1;                                          // mark this EVSE as set.
-                    ActiveEVSE--;                                               // decrease counter of active EVSE's
-                    MaxBalanced -= Balanced[n];                                 // Update total current to new (lower) value
-                    IsetBalanced = TotalCurrent;
-                    n = 0;                                                      // reset to recheck all EVSE's
-                    continue;                                                   // ensure the loop restarts from the beginning
-                
-                // Check for EVSE's that have a Max Current that is lower then the average
-                } else if (Average >= BalancedMax[n]) {
-                    Balanced[n] = BalancedMax[n];                               // Set current to Maximum allowed for this EVSE
-                    _LOG_V("[L]Node %u = %u.%u A\n", n, Balanced[n]/10, Balanced[n]%10);
-                    CurrentSet[n] = 1;                                          // mark this EVSE as set.
-                    ActiveEVSE--;                                               // decrease counter of active EVSE's
-                    MaxBalanced -= Balanced[n];                                 // Update total current to new (lower) value
-                    n = 0;                                                      // reset to recheck all EVSE's
-                    continue;                                                   // ensure the loop restarts from the beginning
-                }
-
+        int Capacity[3];                                                        // current left for the EVSEs per phase
+        uint16_t Weight[NR_EVSES], PhaseWeight[3];                              // weight of the EVSEs per phase without a current yet
+        uint8_t Rank[NR_EVSES];
+        BalanceOrder(Weight, Rank);
+        for (p = 0; p < 3; p++) Capacity[p] = IsetBalanced + Extra[p];
+
+        // Every EVSE gets MinCurrent first, EVSE's that are starting with Solar charging stay there
+        for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+            uint8_t Mask = EVSEPhaseMask(n);
+            Balanced[n] = min((uint16_t)(MinCurrent * 10), BalancedMax[n]);
+            if ((Mode == MODE_SOLAR) && (Node[n].IntTimer < SOLARSTARTTIME)) {
+                Balanced[n] = MinCurrent * 10;                                  // Set to MinCurrent
+                _LOG_V("[S]Node %u = %u.%u A\n", n, Balanced[n]/10, Balanced[n]%10);
+                CurrentSet[n] = 1;                                              // mark this EVSE as set.
+                ActiveEVSE--;                                                   // decrease counter of active EVSE's
+                IsetBalanced = TotalCurrent;
             }
-            n++;
+            for (p = 0; p < 3; p++) if (Mask & (1 << p)) Capacity[p] -= Balanced[n];
         }
 
-        // All EVSE's which had a Max current lower then the average are set.
-        // Now calculate the current for the EVSE's which had a higher Max current
-        n = 0;
-        while (n < NR_EVSES && ActiveEVSE) {                                    // Check for EVSE's that are not set yet
-            if ((BalancedState[n] == STATE_C) && (!CurrentSet[n])) {            // Active EVSE, and current not yet calculated?
-                Balanced[n] = MaxBalanced / ActiveEVSE;                         // Set current to Average
-                _LOG_V("[H]Node %u = %u.%u A.\n", n, Balanced[n]/10, Balanced[n]%10);
-                CurrentSet[n] = 1;                                              // mark this EVSE as set.
-                ActiveEVSE--;                                                   // decrease counter of active EVSE's
-                MaxBalanced -= Balanced[n];                                     // Update total current to new (lower) value
-            }                                                                   //TODO since the average has risen the other EVSE's should be checked for exceeding their MAX's too!
-            n++;
+        // Then the rest is shared by the EVSEs of each rank in turn, a rank gets all it can use before the next
+        for (uint8_t R = 0; R < NR_EVSES && ActiveEVSE; R++) {
+            for (p = 0; p < 3; p++) PhaseWeight[p] = 0;
+            for (n = 0; n < NR_EVSES; n++) {
+                uint8_t Mask = EVSEPhaseMask(n);
+                if ((BalancedState[n] == STATE_C) && (!CurrentSet[n]) && Rank[n] == R)
+                    for (p = 0; p < 3; p++) if (Mask & (1 << p)) PhaseWeight[p] += Weight[n];
+            }
+
+            // Raise the EVSEs until they reach their Max current, or one of the phases they use is full
+            while (PhaseWeight[0] || PhaseWeight[1] || PhaseWeight[2]) {
+                n = 0;
+                while (n < NR_EVSES) {
+                    // Active EVSE of this rank, and current not yet calculated?
+                    if ((BalancedState[n] == STATE_C) && (!CurrentSet[n]) && Rank[n] == R) {
+                        uint8_t Mask = EVSEPhaseMask(n);
+                        Average = PhaseShare(Capacity, PhaseWeight, Mask, Weight[n]);
+                        // Check for EVSE's that have a Max Current that is lower then their share
+                        if (Balanced[n] + Average >= BalancedMax[n]) {
+                            for (p = 0; p < 3; p++) if (Mask & (1 << p)) {
+                                Capacity[p] -= BalancedMax[n] - Balanced[n];    // Update current left on the phase to new (lower) value
+                                PhaseWeight[p] -= Weight[n];
+                            }
+                            Balanced[n] = BalancedMax[n];                       // Set current to Maximum allowed for this EVSE
+                            _LOG_V("[L]Node %u = %u.%u A\n", n, Balanced[n]/10, Balanced[n]%10);
+                            CurrentSet[n] = 1;                                  // mark this EVSE as set.
+                            ActiveEVSE--;                                       // decrease counter of active EVSE's
+                            n = 0;                                              // reset to recheck all EVSE's
+                            continue;                                           // ensure the loop restarts from the beginning
+                        }
+                    }
+                    n++;
+                }
+                if (!(PhaseWeight[0] || PhaseWeight[1] || PhaseWeight[2])) break;
+
+                // The EVSE's on the most loaded phase get their share of what is left on it
+                uint8_t Full = 3;
+                for (p = 0; p < 3; p++)
+                    if (PhaseWeight[p] && (Full == 3 || Capacity[p] * PhaseWeight[Full] < Capacity[Full] * PhaseWeight[p])) Full = p;
+                for (n = 0; n < NR_EVSES; n++) {
+                    uint8_t Mask = EVSEPhaseMask(n);
+                    if ((BalancedState[n] == STATE_C) && (!CurrentSet[n]) && Rank[n] == R && (Mask & (1 << Full))) {
+                        Average = PhaseShare(Capacity, PhaseWeight, Mask, Weight[n]);
+                        Balanced[n] += Average;                                 // Set current to its share
+                        _LOG_V("[H]Node %u = %u.%u A.\n", n, Balanced[n]/10, Balanced[n]%10);
+                        CurrentSet[n] = 1;                                      // mark this EVSE as set.
+                        ActiveEVSE--;                                           // decrease counter of active EVSE's
+                        for (p = 0; p < 3; p++) if (Mask & (1 << p)) {
+                            Capacity[p] -= Average;                             // Update current left on the phase to new (lower) value
+                            PhaseWeight[p] -= Weight[n];
+                        }
+                    }
+                }
+            }
         }
     } //ActiveEVSE && phasesLastUpdateFlag
 
@@ -1221,6 +1442,13 @@ void CalcBalancedCurrent(char mod) {
     // Reset flag that keeps track of new MainsMeter measurements
     phasesLastUpdateFlag = false;
 
+    int16_t PhaseCurrent[3] = {0, 0, 0};                                        // the EVs draw this after their response delay
+    for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+        uint8_t Mask = EVSEPhaseMask(n);
+        for (p = 0; p < 3; p++) if (Mask & (1 << p)) PhaseCurrent[p] += Balanced[n];
+    }
+    MainsPrediction.command(PhaseCurrent, millis());
+
     // ############### print all the distributed currents #################
 
     _LOG_V("Checkpoint 5 Isetbalanced=%d.%d A.\n", IsetBalanced/10, abs(IsetBalanced%10));
@@ -1502,6 +1730,12 @@ void Timer1S_singlerun(void) {
         lastSmartEVSEUpdate = 0;
         mqttSmartEVSEPublishData();
     }
+    // Exchange demand and allotment with the site coordinator, every two seconds
+    static uint8_t siteTimer = 0;
+    if (++siteTimer >= 2) {
+        siteTimer = 0;
+        siteUpdate();
+    }
 #endif
 
 } //Timer1S_singlerun
@@ -1518,6 +1752,8 @@ void Timer1S_singlerun(void) {
     Node 5 	        0x06            0x06
     Node 6 	        0x07            0x07
     Node 7 	        0x08            0x08
+    Node 8 	        0xC0            0x09            Only when built with NR_EVSES > 8
+    Node n 	        0xB8 + n        n + 1
     Broadcast to all SmartEVSE with address 0x09.
 **/
 
@@ -1540,16 +1776,19 @@ void Timer1S_singlerun(void) {
  */
 void BroadcastCurrent(void) {
     //prepare registers 0x0020 thru 0x002A (including) to be sent
-    uint8_t buf[sizeof(Balanced)+ 6], i;
+    uint8_t buf[8 * 2 + 6], i;
     uint8_t *p=buf;
-    memcpy(p, Balanced, sizeof(Balanced));
-    p = p + sizeof(Balanced);
+    memcpy(p, Balanced, 8 * 2);                                                 // Master and Node 1-7
+    p = p + 8 * 2;
     // Irms values, we only send the 16 least significant bits (range -327.6A to +327.6A) per phase
     for ( i=0; i<3; i++) {
         p[i * 2] = MainsMeter.Irms[i] & 0xff;
         p[(i * 2) + 1] = MainsMeter.Irms[i] >> 8;
     }
     ModbusWriteMultipleRequest(BROADCAST_ADR, 0x0020, (uint16_t *) buf, 8 + 3);
+#if NR_EVSES > 8
+    ModbusWriteMultipleRequest(BROADCAST_ADR, MODBUS_BROADCAST_EXT, &Balanced[8], NR_EVSES - 8);
+#endif
 }
 
 /**
@@ -1591,7 +1830,7 @@ Regis 	Access 	Description 	                                        Unit 	Values
  * @param uint8_t NodeNr (1-7)
  */
 void requestNodeConfig(uint8_t NodeNr) {
-    ModbusReadInputRequest(NodeNr + 1u, 4, 0x0108, 2);
+    ModbusReadInputRequest(NodeAddress(NodeNr), 4, 0x0108, 2);
 }
 
 /**
@@ -1621,7 +1860,7 @@ void receiveNodeConfig(uint8_t *buf, uint8_t NodeNr) {
     Node[NodeNr].EVAddress = buf[3];
 
     Node[NodeNr].ConfigChanged = 0;                                             // Reset flag on master
-    ModbusWriteSingleRequest(NodeNr + 1u, 0x0006, 0);                           // Reset flag on node
+    ModbusWriteSingleRequest(NodeAddress(NodeNr), 0x0006, 0);                           // Reset flag on node
 }
 
 /**
@@ -1636,10 +1875,26 @@ void requestNodeStatus(uint8_t NodeNr) {
             // Reset Node state when node is offline
             BalancedState[NodeNr] = STATE_A;
             Balanced[NodeNr] = 0;
+            Node[NodeNr].EnergyNeed = 0;
         }
     }
 
-    ModbusReadInputRequest(NodeNr + 1u, 4, 0x0000, 8);
+    ModbusReadInputRequest(NodeAddress(NodeNr), 4, 0x0000, 9);
+}
+
+/**
+ * Master requests the energy the EV on a Node still needs (register 0x000C), for the Deficit policy.
+ * Nodes with older firmware answer with an exception; their need stays unknown.
+ *
+ * @param uint8_t NodeNr
+ */
+void requestNodeEnergyNeed(uint8_t NodeNr) {
+    ModbusReadInputRequest(NodeAddress(NodeNr), 4, 0x000C, 1);
+}
+
+void receiveNodeEnergyNeed(uint8_t *buf, uint8_t NodeNr) {
+    Node[NodeNr].EnergyNeed = (buf[0] << 8) | buf[1];                           // 0.1 kWh
+    _LOG_D("ReceivedNode[%u]EnergyNeed %u.%u kWh\n", NodeNr, Node[NodeNr].EnergyNeed/10, Node[NodeNr].EnergyNeed%10);
 }
 
 /** To have full control over the nodes, you will have to read each node's status registers, and see if it requests to charge.
@@ -1676,23 +1931,27 @@ Regist 	Access  Description 	        Unit 	Values
 0x0005 	R/W 	Access bit 		        0:No Access / 1:Access
 0x0006 	R/W 	Configuration changed (Not implemented)
 0x0007 	R 	Maximum charging current A
-0x0008 	R/W 	Number of used phases (Not implemented) 0:Undetected / 1 - 3
+0x0008 	R 	Number of used phases                   bit 0-3: 1 - 3 / bit 4-5: mains phase of L1, 0:Not set / 1 - 3
 0x0009 	R 	Real charging current (Not implemented) 0.1 A
 0x000A 	R 	Temperature 	        K
 0x000B 	R 	Serial number
+0x000C 	R 	Energy the EV still needs 0.1 kWh 0:Unknown
 0x0020 - 0x0027
         W 	Broadcast charge current. SmartEVSE uses only one value depending on the "Load Balancing" configuration
                                         0.1 A 	0:no current available
 0x0028 - 0x0030
         W 	Broadcast MainsMeter currents L1 - L3.
                                         0.1 A
+0x0040 - 0x0077
+        W 	Broadcast charge current of Node 8 and up (only when built with NR_EVSES > 8)
+                                        0.1 A 	0:no current available
 **/
 
 /**
  * Master receives Node status over modbus
  * Node -> Master
  *
- * @param uint8_t NodeAdr (1-7)
+ * @param uint8_t NodeAdr (1 - NR_EVSES-1)
  */
 void receiveNodeStatus(uint8_t *buf, uint8_t NodeNr) {
     Node[NodeNr].Online = 5;
@@ -1709,82 +1968,17 @@ void receiveNodeStatus(uint8_t *buf, uint8_t NodeNr) {
     Node[NodeNr].SolarTimer = (buf[8] * 256) + buf[9];
     Node[NodeNr].ConfigChanged = buf[13] | Node[NodeNr].ConfigChanged;
     BalancedMax[NodeNr] = buf[15] * 10;                                         // Node Max ChargeCurrent (0.1A)
+    Node[NodeNr].Phases = buf[17] & 0x0F;                                       // 0 on older firmware: all phases are assumed
+    Node[NodeNr].L1Phase = (buf[17] >> 4) & 0x03;
     _LOG_D("ReceivedNode[%u]Status State:%u (%s) Error:%u, BalancedMax:%u, Mode:%u, ConfigChanged:%u.\n", NodeNr, BalancedState[NodeNr], StrStateName[BalancedState[NodeNr]], BalancedError[NodeNr], BalancedMax[NodeNr], Node[NodeNr].Mode, Node[NodeNr].ConfigChanged);
 }
 
 
-/**
- * Send Energy measurement request over modbus
- *
- * @param uint8_t Meter
- * @param uint8_t Address
- * @param bool    Export (if exported energy is requested)
- */
-void requestEnergyMeasurement(uint8_t Meter, uint8_t Address, bool Export) {
-    uint8_t Count = 1;                                                          // by default it only takes 1 register to get the energy measurement
-    uint16_t Register = EMConfig[Meter].ERegister;
-    if (Export)
-        Register = EMConfig[Meter].ERegister_Exp;
-
-    switch (Meter) {
-        case EM_FINDER_7E:
-        case EM_EASTRON3P:
-        case EM_EASTRON1P:
-        case EM_WAGO:
-            break;
-        case EM_SOLAREDGE:
-            // Note:
-            // - SolarEdge uses 16-bit values, except for this measurement it uses 32bit int format
-            // - EM_SOLAREDGE should not be used for EV Energy Measurements
-            // fallthrough
-        case EM_SINOTIMER:
-            // Note:
-            // - Sinotimer uses 16-bit values, except for this measurement it uses 32bit int format
-            // fallthrough
-        case EM_ABB:
-            // Note:
-            // - ABB uses 64bit values for this register (size 2)
-            Count = 2;
-            break;
-        case EM_EASTRON3P_INV:
-            if (Export)
-                Register = EMConfig[Meter].ERegister;
-            else
-                Register = EMConfig[Meter].ERegister_Exp;
-            break;
-        default:
-            if (Export)
-                Count = 0; //refuse to do a request on exported energy if the meter doesnt support it
-            break;
-    }
-    if (Count)
-        requestMeasurement(Meter, Address, Register, Count);
-}
-
-/**
- * Send Power measurement request over modbus
- *
- * @param uint8_t Meter
- * @param uint8_t Address
- */
-void requestPowerMeasurement(uint8_t Meter, uint8_t Address, uint16_t PRegister) {
-    uint8_t Count = 1;                                                          // by default it only takes 1 register to get power measurement
-    switch (Meter) {
-        case EM_SINOTIMER:
-            // Note:
-            // - Sinotimer does not output total power but only individual power of the 3 phases
-            Count = 3;
-            break;
-    }
-    requestMeasurement(Meter, Address, PRegister, Count);
-}
-
-
 /**
  * Master checks node status requests, and responds with new state
  * Master -> Node
  *
- * @param uint8_t NodeAdr (1-7)
+ * @param uint8_t NodeAdr (1 - NR_EVSES-1)
  * @return uint8_t success
  */
 uint8_t processAllNodeStates(uint8_t NodeNr) {
@@ -1820,6 +2014,7 @@ uint8_t processAllNodeStates(uint8_t NodeNr) {
             Node[NodeNr].Timer = 0;
             Node[NodeNr].Phases = 0;
             Node[NodeNr].MinCurrent = 0;
+            Node[NodeNr].EnergyNeed = 0;                                        // the next EV reports its own
             break;
 
         case STATE_COMM_B:                                                      // Request to charge A->B
@@ -1893,7 +2088,7 @@ uint8_t processAllNodeStates(uint8_t NodeNr) {
 
     if (write) {
         _LOG_D("processAllNode[%u]States State:%u (%s), BalancedError:%u, Mode:%u, SolarStopTimer:%u\n",NodeNr, BalancedState[NodeNr], StrStateName[BalancedState[NodeNr]], BalancedError[NodeNr], Mode, SolarStopTimer);
-        ModbusWriteMultipleRequest(NodeNr+1 , 0x0000, values, regs);            // Write State, Error, Charge Current, Mode and Solar Timer to Node
+        ModbusWriteMultipleRequest(NodeAddress(NodeNr), 0x0000, values, regs);           // Write State, Error, Charge Current, Mode and Solar Timer to Node
     }
 
     return write;
@@ -1942,9 +2137,66 @@ static unsigned int locktimer = 0, unlocktimer = 0;
             unlocktimer = 0;
         }
     }
+
+    // Pushed mains measurements are balanced right away, the Modbus cycle only runs every two seconds.
+    // Only while the prediction is used: it already counts the charge current sent, the step-wise
+    // corrections on the measured current would step again before the EV has followed the last one.
+    if (MainsMeterPushed && LoadBl < 2 && !ModbusRequest) {
+        MainsMeterPushed = false;
+        if (MainsPrediction.ready(millis())) {
+            CalcBalancedCurrent(0);
+            if (LoadBl == 1 && !(ErrorFlags & CT_NOCOMM)) BroadcastCurrent();
+        }
+    }
 }
 
 // Sequentially call the Mains/EVmeters, and polls Nodes
+// Is the EV meter of this Node read over the RS485 bus?
+// Node 0 is our own EV meter, which may also be a networked meter.
+static bool EVMeterOnBus(uint8_t NodeNr) {
+    if (NodeNr == 0) return EVMeter.onBus();
+    return Node[NodeNr].EVMeter && Node[NodeNr].EVMeter != EM_API && Node[NodeNr].EVMeter != EM_HOMEWIZARD;
+}
+
+// Select the Nodes whose status is read this cycle, in ascending order. Returns the number of Nodes.
+// Online Nodes take turns, one place is kept to probe an offline Node, when there is one.
+// Up to NODE_POLL_BATCH Nodes, every Node is read each cycle, so the two second cycle also holds for large clusters.
+static uint8_t selectNodeBatch(uint8_t *Batch) {
+    static uint8_t NodeOnlineNext = 1;
+    static uint8_t NodeOfflineProbe = 1;
+    bool selected[NR_EVSES] = {};
+    uint8_t n, i, slots = NODE_POLL_BATCH, count = 0;
+
+    for (n = 1; n < NR_EVSES; n++) {
+        if (!Node[n].Online) {
+            slots--;
+            break;
+        }
+    }
+    for (i = 1, n = NodeOnlineNext; i < NR_EVSES && count < slots; i++) {
+        if (Node[n].Online) {
+            selected[n] = true;
+            count++;
+        }
+        if (++n >= NR_EVSES) n = 1;
+    }
+    NodeOnlineNext = n;
+
+    if (slots < NODE_POLL_BATCH) {
+        while (Node[NodeOfflineProbe].Online) {
+            if (++NodeOfflineProbe >= NR_EVSES) NodeOfflineProbe = 1;
+        }
+        selected[NodeOfflineProbe] = true;
+        _LOG_D("Probing offline Node %u\n", NodeOfflineProbe);
+        if (++NodeOfflineProbe >= NR_EVSES) NodeOfflineProbe = 1;
+    }
+
+    for (n = 1, i = 0; n < NR_EVSES; n++) {
+        if (selected[n]) Batch[i++] = n;
+    }
+    return i;
+}
+
 // Called by MBHandleError, and MBHandleData response functions.
 // Once every two seconds started by Timer1s()
 //
@@ -1952,8 +2204,8 @@ void ModbusRequestLoop() {
 
     static uint8_t PollEVNode = NR_EVSES;
     static uint16_t energytimer = 0;
-    static uint8_t NodeOfflineProbe = 1;
-    static bool probedThisCycle = false;
+    static uint8_t PollBatch[NODE_POLL_BATCH];
+    static uint8_t PollBatchSize = 0;
     uint8_t updated = 0;
     uint8_t nodeNr;
 
@@ -1964,7 +2216,7 @@ void ModbusRequestLoop() {
                 ModbusRequest++;
                 // fall through
             case 2:                                                         // Sensorbox or kWh meter that measures -all- currents
-                if (MainsMeter.Type && MainsMeter.Type != EM_API && MainsMeter.Type != EM_HOMEWIZARD) { // we don't want modbus meter currents to conflict with EM_API and EM_HOMEWIZARD currents
+                if (MainsMeter.onBus()) {                                   // we don't want modbus meter currents to conflict with networked meter currents
                     _LOG_D("ModbusRequest %u: Request MainsMeter Measurement\n", ModbusRequest);
                     requestCurrentMeasurement(MainsMeter.Type, MainsMeter.Address);
                     break;
@@ -1990,11 +2242,17 @@ void ModbusRequestLoop() {
                     requestNodeConfig(PollEVNode);
                     break;
                 }
+                // Request the energy the EV still needs, when the current is shared by it
+                if (BalancePolicy == POLICY_DEFICIT && PollEVNode && BalancedState[PollEVNode] == STATE_C) {
+                    _LOG_D("ModbusRequest %u: Request Energy Need Node %u\n", ModbusRequest, PollEVNode);
+                    requestNodeEnergyNeed(PollEVNode);
+                    break;
+                }
                 ModbusRequest++;
                 // fall through
             case 4:                                                         // EV kWh meter, Energy measurement (total charged kWh)
                 // Request Energy if EV meter is configured
-                if (Node[PollEVNode].EVMeter && Node[PollEVNode].EVMeter != EM_API && Node[PollEVNode].EVMeter != EM_HOMEWIZARD) {
+                if (EVMeterOnBus(PollEVNode)) {
                     _LOG_D("ModbusRequest %u: Request Energy Node %u\n", ModbusRequest, PollEVNode);
                     requestEnergyMeasurement(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress, 0);
                     break;
@@ -2003,27 +2261,14 @@ void ModbusRequestLoop() {
                 // fall through
             case 5:                                                         // EV kWh meter, Power measurement (momentary power in Watt)
                 // Request Power if EV meter is configured
-                if (Node[PollEVNode].EVMeter && Node[PollEVNode].EVMeter != EM_API && Node[PollEVNode].EVMeter != EM_HOMEWIZARD) {
-                    updated = 1;
-                    switch(EVMeter.Type) {
-                        //these meters all have their power measured via receiveCurrentMeasurement already
-                        case EM_EASTRON1P:
-                        case EM_EASTRON3P:
-                        case EM_EASTRON3P_INV:
-                        case EM_ABB:
-                        case EM_FINDER_7M:
-                        case EM_SCHNEIDER:
-                            updated = 0;
-                            break;
-                        default:
-                            requestPowerMeasurement(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress,EMConfig[Node[PollEVNode].EVMeter].PRegister);
-                            break;
-                    }
-                    if (updated) break;  // do not break when EVmeter is one of the above types
+                if (EVMeterOnBus(PollEVNode) && !powerInCurrentMeasurement(Node[PollEVNode].EVMeter)) {
+                    // meters with the power in the current measurement are not polled for it
+                    requestPowerMeasurement(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress,EMConfig[Node[PollEVNode].EVMeter].PRegister);
+                    break;
                 }
                 ModbusRequest++;
                 // fall through
-            case 6:                                                         // Node 1
+            case 6:                                                         // Node status, NODE_POLL_BATCH states
             case 7:
             case 8:
             case 9:
@@ -2033,24 +2278,11 @@ void ModbusRequestLoop() {
                 // Request Node Status, skip offline nodes to save time in the loop.
                 // Probe One offline Node per cycle.
                 if (LoadBl == 1) {
-                    if (ModbusRequest == 6) probedThisCycle = false;
-
-                    while (ModbusRequest <= 12) {
-                        nodeNr = ModbusRequest - 5u;
-                        if (Node[nodeNr].Online || (!probedThisCycle && nodeNr == NodeOfflineProbe)) {
-                            if (!Node[nodeNr].Online) {
-                                probedThisCycle = true;
-                                do { 
-                                    if (++NodeOfflineProbe >= NR_EVSES) NodeOfflineProbe = 1;
-                                } while (Node[NodeOfflineProbe].Online && NodeOfflineProbe != nodeNr);
-                                _LOG_D("Probing offline Node %u\n", nodeNr);
-                            }
-                            requestNodeStatus(nodeNr);
-                            break;
-                        }
-                        ModbusRequest++;
+                    if (ModbusRequest == 6) PollBatchSize = selectNodeBatch(PollBatch);
+                    if (ModbusRequest - 6u < PollBatchSize) {
+                        requestNodeStatus(PollBatch[ModbusRequest - 6u]);
+                        break;
                     }
-                    if (ModbusRequest <= 12) break;
                 }
                 ModbusRequest = 13;
                 // fall through
@@ -2064,21 +2296,23 @@ void ModbusRequestLoop() {
                 // Here we write State, Error, Mode and SolarTimer to Online Nodes
                 updated = 0;
                 if (LoadBl == 1) {
-                    do {       
-                        if (Node[ModbusRequest - 12u].Online) {             // Skip if not online
-                            if (processAllNodeStates(ModbusRequest - 12u) ) {
+                    while (ModbusRequest - 13u < PollBatchSize) {           // the Nodes read this cycle
+                        nodeNr = PollBatch[ModbusRequest - 13u];
+                        if (Node[nodeNr].Online) {                          // Skip if not online
+                            if (processAllNodeStates(nodeNr) ) {
                                 updated = 1;                                // Node updated 
                                 break;
                             }
                         }
-                    } while (++ModbusRequest < 20);
-
+                        ModbusRequest++;
+                    }
+                    if (!updated) ModbusRequest = 20;
                 } else ModbusRequest = 20;
                 if (updated) break;  // break when Node updated
                 // fall through
             case 20:                                                         // EV kWh meter, Current measurement
                 // Request Current if EV meter is configured
-                if (Node[PollEVNode].EVMeter && Node[PollEVNode].EVMeter != EM_API && Node[PollEVNode].EVMeter != EM_HOMEWIZARD) {
+                if (EVMeterOnBus(PollEVNode)) {
                     _LOG_D("ModbusRequest %u: Request EVMeter Current Measurement Node %u\n", ModbusRequest, PollEVNode);
                     requestCurrentMeasurement(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress);
                     break;
@@ -2089,7 +2323,7 @@ void ModbusRequestLoop() {
                 if (++energytimer >= 60) energytimer = 0;                   // ~2s tick, wraps every ~2min
                 // Request active energy if Mainsmeter is configured
 
-                if (MainsMeter.Type && MainsMeter.Type != EM_API && MainsMeter.Type != EM_HOMEWIZARD && MainsMeter.Type != EM_SENSORBOX) { // EM_API, EM_HOMEWIZARD and Sensorbox do not support energy postings
+                if (MainsMeter.onBus() && MainsMeter.Type != EM_SENSORBOX) { // networked meters and Sensorbox do not support energy postings
 
                     if (energytimer == 30) {
                         _LOG_D("ModbusRequest %u: Request MainsMeter Import Active Energy Measurement\n", ModbusRequest);
@@ -2103,7 +2337,7 @@ void ModbusRequestLoop() {
                     }
                 }
                 // Request active energy if Circuitmeter is configured
-                if (CircuitMeter.Type && CircuitMeter.Type != EM_API) {     // EM_API is not a modbus device
+                if (CircuitMeter.onBus()) {                                 // networked meters are not read here
                     if (energytimer == 15) {
                         _LOG_D("ModbusRequest %u: Request CircuitMeter Import Active Energy Measurement\n", ModbusRequest);
                         requestEnergyMeasurement(CircuitMeter.Type, CircuitMeter.Address, 0);
@@ -2118,7 +2352,7 @@ void ModbusRequestLoop() {
                 ModbusRequest++;
                 // fall through
             case 22:                                                         // Sensorbox or kWh meter that measures -all- currents
-                if (CircuitMeter.Type && CircuitMeter.Type != EM_API && CircuitMeter.Type != EM_HOMEWIZARD) { // we don't want modbus meter currents to conflict with EM_API and EM_HOMEWIZARD currents
+                if (CircuitMeter.onBus()) {                                 // we don't want modbus meter currents to conflict with networked meter currents
                     _LOG_D("ModbusRequest %u: Request CircuitMeter Current Measurement\n", ModbusRequest);
                     requestCurrentMeasurement(CircuitMeter.Type, CircuitMeter.Address);
                     break;
@@ -2819,6 +3053,8 @@ uint16_t getItemValue(uint8_t nav) {
         // Status readonly
         case STATUS_MAX:
             return min(MaxCapacity,MaxCurrent);
+        case STATUS_PHASE_COUNT:
+            return Nr_Of_Phases_Charging | (EvsePhase << 4);
         case STATUS_TEMP:
             return (signed int)TempEVSE;
         case MENU_RCMON:
@@ -2829,6 +3065,8 @@ uint16_t getItemValue(uint8_t nav) {
             return LedMode;
         case STATUS_SERIAL:
             return serialnr;
+        case STATUS_ENERGY_NEED:
+            return getEnergyNeed();
         default:
             return 0;
     }
@@ -2890,5 +3128,12 @@ void CalcIsum(void) {
         Isum = Isum + MainsMeter.Irms[x];
     }
     MainsMeter.CalcImeasured();
+    // Without Nodes our EV meter measures all charge current, rotated to the mains phases
+    if (LoadBl == 0 && EVMeter.Type && !(ErrorFlags & EV_NOCOMM)) {
+        int16_t EVCurrent[3];
+        uint8_t Shift = (EvsePhase >= 1 && EvsePhase <= 3) ? EvsePhase - 1 : 0;
+        for (int x = 0; x < 3; x++) EVCurrent[(x + Shift) % 3] = EVMeter.Irms[x];
+        MainsPrediction.sample(MainsMeter.Irms, millis(), EVCurrent);
+    } else MainsPrediction.sample(MainsMeter.Irms, millis());
 }
 
@@ -99,7 +99,7 @@
 #define CIRCUIT_METER_ADDRESS 13
 #define MIN_METER_ADDRESS 10
 #define MIN_EV_METER_ADDRESS 11
-#define MAX_METER_ADDRESS 247
+#define MAX_METER_ADDRESS (NR_EVSES > 8 ? NODE_ADDRESS_EXT - 1 : 247)           // Node 8 and up use NODE_ADDRESS_EXT and up
 #define EMCUSTOM_ENDIANESS 0
 #define EMCUSTOM_DATATYPE 0
 #define EMCUSTOM_FUNCTION 4
@@ -115,6 +115,14 @@
 #define WIFI_MODE 0
 #define CARD_OFFSET 0
 #define ENABLE_C2 ALWAYS_ON
+#define EVSE_PHASE 0                                                            // Mains phase (1-3) the L1 of this EVSE is wired to, 0 = not set
+#define BALANCE_POLICY POLICY_EQUAL                                             // How the Master shares the current over the charging EVSEs
+#define BALANCE_WEIGHT 1                                                        // Weight / priority of an EVSE (1-10)
+#define BALANCE_WEIGHT_MAX 10
+#define BALANCE_NEED_MAX 1000                                                   // 0.1 kWh, Deficit policy: larger energy needs are not favoured further
+#define SITE_ROLE SITE_OFF                                                      // Site balancing with other Masters over MQTT: Off, Group or Coordinator
+#define SITE_MAX 25                                                             // Coordinator: site current per phase shared by all groups (A)
+#define SITE_FALLBACK 6                                                         // Group: current per phase used when the coordinator is silent (A)
 #define MAX_TEMPERATURE 65
 #define DELAYEDSTARTTIME 0                                                             // The default StartTime for delayed charged, 0 = not delaying
 #define DELAYEDSTOPTIME 0                                                       // The default StopTime for delayed charged, 0 = not stopping
@@ -136,7 +144,15 @@
 #define MODBUS_BAUDRATE 9600
 #define MODBUS_TIMEOUT 4
 #define ACK_TIMEOUT 1000                                                        // 1000ms timeout
-#define NR_EVSES 8
+#ifndef NR_EVSES
+#define NR_EVSES 8                                                              // EVSEs that share power, Master included. Larger clusters: build with -DNR_EVSES=32
+#endif
+#if NR_EVSES < 8 || NR_EVSES > 64
+#error "NR_EVSES must be 8 - 64"
+#endif
+#define NODE_ADDRESS_EXT 0xC0                                                   // Modbus address of Node 8 and up, Node 1-7 use 0x02-0x08
+#define NODE_POLL_BATCH 7                                                       // Node status reads per two second cycle, states 6-12 of ModbusRequestLoop
+#define MODBUS_BROADCAST_EXT 0x0040                                             // Broadcast charge currents of Node 8 and up
 #define BROADCAST_ADR 0x09
 #define COMM_TIMEOUT 11                                                         // Timeout for MainsMeter
 #define COMM_CIRCTIMEOUT 20                                                     // Timeout for CircuitMeter
@@ -186,7 +202,7 @@ void setPilot(bool On);
 #define MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE 0x03
 
 #define MODBUS_EVSE_STATUS_START 0x0000
-#define MODBUS_EVSE_STATUS_COUNT 12
+#define MODBUS_EVSE_STATUS_COUNT 13
 #define MODBUS_EVSE_CONFIG_START 0x0100
 #define MODBUS_EVSE_CONFIG_COUNT 10
 #define MODBUS_SYS_CONFIG_START  0x0200
@@ -204,10 +220,11 @@ void setPilot(bool On);
 #define STATUS_ACCESS 69                                                        // 0x0005: Access bit
 #define STATUS_CONFIG_CHANGED 70                                                // 0x0006: Configuration changed
 #define STATUS_MAX 71                                                           // 0x0007: Maximum charging current (RO)
-#define STATUS_PHASE_COUNT 72                                                   // 0x0008: Number of used phases (RO) (ToDo)
+#define STATUS_PHASE_COUNT 72                                                   // 0x0008: Number of used phases, mains phase of L1 << 4 (RO)
 #define STATUS_REAL_CURRENT 73                                                  // 0x0009: Real charging current (RO) (ToDo)
 #define STATUS_TEMP 74                                                          // 0x000A: Temperature (RO)
 #define STATUS_SERIAL 75                                                        // 0x000B: Serial number (RO)
+#define STATUS_ENERGY_NEED 76                                                   // 0x000C: Energy the EV still needs, 0.1 kWh, 0 = unknown (RO)
 
 // Node specific configuration
 #define MENU_ENTER 1
@@ -300,6 +317,7 @@ enum Charging_Protocol_t {IEC, DIN, ISO2, ISO20}; // IEC 61851-1 (low-level sign
 extern void CalcBalancedCurrent(char mod);
 extern void write_settings(void);
 extern void CalcIsum(void);
+extern volatile bool MainsMeterPushed;
 extern void setChargeDelay(uint8_t delay);
 
 struct Sensorbox {
@@ -317,6 +335,7 @@ uint16_t getItemValue(uint8_t nav);
 
 enum EnableC2_t { NOT_PRESENT, ALWAYS_OFF, SOLAR_OFF, ALWAYS_ON, AUTO };
 extern EnableC2_t EnableC2;
+enum BalancePolicy_t { POLICY_EQUAL, POLICY_WEIGHTED, POLICY_PRIORITY, POLICY_FCFS, POLICY_DEFICIT };
 enum CapacityMode_t { CAP_DISABLED, FIXED, INTERVAL, FLANDERS };
 extern CapacityMode_t CapacityMode;
 typedef struct CapacityNode {
@@ -336,6 +355,8 @@ struct Node_t {
     uint32_t IntTimer;      // 1s
     uint16_t SolarTimer;    // 1s
     uint8_t Mode;
+    uint8_t L1Phase;        // mains phase (1-3) of the node's L1, 0 = not set
+    uint16_t EnergyNeed;    // 0.1 kWh the EV still needs, 0 = unknown
 };
 
 extern bool BuzzerPresent;
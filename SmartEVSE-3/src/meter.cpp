@@ -4,7 +4,6 @@
 #include <modbus.h>
 #include "esp32.h"
 
-extern unsigned long pow_10[10];
 extern void CalcIsum(void);
 extern void RecomputeSoC(void);
 extern bool LocalTimeSet;
@@ -19,7 +18,8 @@ CapacityNode* first_interval = NULL;
 #define ENDIANESS_HBF_HWF 3
 
 // WARNING: ONLY ADD new meters to the END of this ARRAY. The row number is stored in the config of the user, if you change the order YOU WILL RUIN THE CONFIGS OF USERS !!!!!!!
-struct EMstruct EMConfig[] = {
+// Compile-time profiles of the meter types, the decoders are specialised on these rows.
+constexpr struct EMstruct EMProfiles[] = {
     /* DESC,      ENDIANNESS,      FCT, DATATYPE,            U_REG,DIV, I_REG,DIV, P_REG,DIV, E_REG_IMP,DIV, E_REG_EXP, DIV */
     {"Disabled",  ENDIANESS_LBF_LWF, 0, MB_DATATYPE_INT32,        0, 0,      0, 0,      0, 0,      0, 0,0     , 0}, // First entry!
     {"Sensorbox", ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32, 0xFFFF, 0,      0, 0, 0xFFFF, 0, 0xFFFF, 0,0     , 0}, // Sensorbox (Own routine for request/receive)
@@ -45,6 +45,15 @@ struct EMstruct EMConfig[] = {
 };
 // WARNING: ONLY ADD new meters to the END of this ARRAY. The row number is stored in the config of the user, if you change the order YOU WILL RUIN THE CONFIGS OF USERS !!!!!!!
 
+// Runtime copy, EM_CUSTOM is filled in from the settings
+struct EMstruct EMConfig[] = {
+    EMProfiles[0],  EMProfiles[1],  EMProfiles[2],  EMProfiles[3],  EMProfiles[4],
+    EMProfiles[5],  EMProfiles[6],  EMProfiles[7],  EMProfiles[8],  EMProfiles[9],
+    EMProfiles[10], EMProfiles[11], EMProfiles[12], EMProfiles[13], EMProfiles[14],
+    EMProfiles[15], EMProfiles[16], EMProfiles[17], EMProfiles[18], EMProfiles[19]
+};
+static_assert(sizeof(EMConfig) == sizeof(EMProfiles), "EMConfig has to copy every row of EMProfiles");
+
 uint16_t EMConfigSize = sizeof(EMConfig);
 
 struct Sensorbox SB2;
@@ -55,6 +64,12 @@ Meter::Meter(uint8_t type, uint8_t address, uint8_t timeout) {
         Power[x] = 0;
     }
     DeviceHostName[0] = '\0';
+    DeviceToken[0] = '\0';
+    DeviceCert[0] = '\0';
+    Transport = METER_RTU;
+    Interval = 0;
+    DevicePath[0] = '\0';
+    JsonPaths[0] = '\0';
     HostMenuSelection = 1;
     Type = type;
     Address = address;
@@ -71,98 +86,152 @@ Meter::Meter(uint8_t type, uint8_t address, uint8_t timeout) {
 }
 
 /**
- * Combine Bytes received over modbus
+ * Raw bits of a value received over modbus
  *
- * @param pointer to var
- * @param pointer to buf
- * @param uint8_t pos
- * @param uint8_t endianness:\n
+ * @param pointer to the first byte of the value
+ * @param uint8_t Endianness:\n
  *        0: low byte first, low word first (little endian)\n
  *        1: low byte first, high word first\n
  *        2: high byte first, low word first\n
  *        3: high byte first, high word first (big endian)
- * @param MBDataType dataType: used to determine how many bytes should be combined
+ * @param bool Wide: 32 bit value, otherwise 16 bit
+ * @return uint32_t bits
  */
-void Meter::combineBytes(void *var, uint8_t *buf, uint8_t pos, uint8_t endianness, MBDataType dataType) {
-    char *pBytes;
-    pBytes = (char *)var;
-
-    // ESP32 is little endian
-    switch(endianness) {
-        case ENDIANESS_LBF_LWF: // low byte first, low word first (little endian)
-            *pBytes++ = (uint8_t)buf[pos + 0];
-            *pBytes++ = (uint8_t)buf[pos + 1];
-            if (dataType != MB_DATATYPE_INT16) {
-                *pBytes++ = (uint8_t)buf[pos + 2];
-                *pBytes   = (uint8_t)buf[pos + 3];
-            }
-            break;
-        case ENDIANESS_LBF_HWF: // low byte first, high word first
-            if (dataType != MB_DATATYPE_INT16) {
-                *pBytes++ = (uint8_t)buf[pos + 2];
-                *pBytes++ = (uint8_t)buf[pos + 3];
-            }
-            *pBytes++ = (uint8_t)buf[pos + 0];
-            *pBytes   = (uint8_t)buf[pos + 1];
-            break;
-        case ENDIANESS_HBF_LWF: // high byte first, low word first
-            *pBytes++ = (uint8_t)buf[pos + 1];
-            *pBytes++ = (uint8_t)buf[pos + 0];
-            if (dataType != MB_DATATYPE_INT16) {
-                *pBytes++ = (uint8_t)buf[pos + 3];
-                *pBytes   = (uint8_t)buf[pos + 2];
-            }
-            break;
-        case ENDIANESS_HBF_HWF: // high byte first, high word first (big endian)
-            if (dataType != MB_DATATYPE_INT16) {
-                *pBytes++ = (uint8_t)buf[pos + 3];
-                *pBytes++ = (uint8_t)buf[pos + 2];
-            }
-            *pBytes++ = (uint8_t)buf[pos + 1];
-            *pBytes   = (uint8_t)buf[pos + 0];
-            break;
-        default:
-            break;
+static inline __attribute__((always_inline)) uint32_t registerBits(const uint8_t *p, uint8_t Endianness, bool Wide) {
+    uint32_t w0, w1;
+
+    if (Endianness & 2) {                                                       // high byte first
+        w0 = (uint32_t)p[0] << 8 | p[1];
+        if (!Wide) return w0;
+        w1 = (uint32_t)p[2] << 8 | p[3];
+    } else {
+        w0 = (uint32_t)p[1] << 8 | p[0];
+        if (!Wide) return w0;
+        w1 = (uint32_t)p[3] << 8 | p[2];
+    }
+    return (Endianness & 1) ? (w0 << 16 | w1) : (w1 << 16 | w0);               // high word first
+}
+
+constexpr uint64_t pow10u(int n) { return n > 0 ? 10 * pow10u(n - 1) : 1; }
+
+/**
+ * IEEE-754 single precision value times 10^Scale, rounded to the nearest integer.
+ * Integer math only; values that do not fit in 32 bits are clamped.
+ *
+ * @param uint32_t bits of the float
+ * @param int8_t Scale: -9..9
+ * @return int32_t value
+ */
+static inline __attribute__((always_inline)) int32_t scaleFloat(uint32_t bits, int8_t Scale) {
+    int16_t exponent = (bits >> 23) & 0xFF;
+    uint64_t num, den, mag;
+
+    if (exponent == 0 || exponent == 0xFF || Scale > 9 || Scale < -9) return 0; // zero, denormal, inf or NaN
+    int16_t shift = exponent - 150;                                             // value = mantissa * 2^shift
+    num = ((bits & 0x7FFFFF) | 0x800000) * pow10u(Scale);
+    den = pow10u(-Scale);
+    if (shift > 0) {
+        if (shift > 40 || num > (UINT64_MAX >> shift)) mag = INT32_MAX;
+        else mag = ((num << shift) + den / 2) / den;
+    } else {
+        if (shift < -96) return 0;
+        if (shift < -33) {                                                      // keep den << -shift within 64 bits
+            num >>= -33 - shift;
+            shift = -33;
+        }
+        den <<= -shift;
+        mag = (num + den / 2) / den;
     }
+    if (mag > INT32_MAX) mag = INT32_MAX;
+    return (bits & 0x80000000) ? -(int32_t)mag : (int32_t)mag;
 }
 
 /**
- * Decode measurement value
+ * Decode a measurement value
  *
  * @param pointer to buf
- * @param uint8_t Count
- * @param signed char Divisor
- * @return signed int Measurement
+ * @param uint8_t index of the value in buf
+ * @param uint8_t Endianness
+ * @param MBDataType DataType
+ * @param int8_t Scale: the value is multiplied by 10^Scale
+ * @return int32_t Measurement
  */
+static inline __attribute__((always_inline)) int32_t decodeValue(const uint8_t *buf, uint8_t index, uint8_t Endianness, MBDataType DataType, int8_t Scale) {
+    int32_t value;
+    uint32_t bits = registerBits(buf + index * (DataType == MB_DATATYPE_INT16 ? 2u : 4u), Endianness, DataType != MB_DATATYPE_INT16);
+
+    if (DataType == MB_DATATYPE_FLOAT32) return scaleFloat(bits, Scale);
+    if (DataType == MB_DATATYPE_INT16) value = (int16_t)bits;                   // sign extend 16bit into 32bit
+    else value = (int32_t)bits;
+    if (Scale >= 0) return value * (int32_t)pow10u(Scale);
+    return value / (int32_t)pow10u(-Scale);
+}
 
-signed int Meter::decodeMeasurement(uint8_t *buf, uint8_t Count, signed char Divisor) {
-    return decodeMeasurement(buf, Count, EMConfig[Type].Endianness, EMConfig[Type].DataType, Divisor);
+// Same, with byte order, data type and scaling fixed at compile time
+template <uint8_t Endianness, MBDataType DataType, int8_t Scale>
+static int32_t decodeValue(const uint8_t *buf, uint8_t index) {
+    return decodeValue(buf, index, Endianness, DataType, Scale);
 }
 
-signed int Meter::decodeMeasurement(uint8_t *buf, uint8_t Count, uint8_t Endianness, MBDataType dataType, signed char Divisor) {
-    float dCombined;
-    signed int lCombined;
+// SolarEdge and Sinotimer use 16-bit values, ABB 64-bit for energy; they are read as 32bit int.
+constexpr MBDataType energyDataType(uint8_t Type) {
+    return (Type == EM_ABB || Type == EM_SOLAREDGE || Type == EM_SINOTIMER) ? MB_DATATYPE_INT32 : EMProfiles[Type].DataType;
+}
 
-    if (dataType == MB_DATATYPE_FLOAT32) {
-        combineBytes(&dCombined, buf, Count * (dataType == MB_DATATYPE_INT16 ? 2u : 4u), Endianness, dataType);
-        if (Divisor >= 0) {
-            lCombined = (signed int)(dCombined / (signed int)pow_10[(unsigned)Divisor]);
-        } else {
-            lCombined = (signed int)(dCombined * (signed int)pow_10[(unsigned)-Divisor]);
-        }
-    } else {
-        combineBytes(&lCombined, buf, Count * (dataType == MB_DATATYPE_INT16 ? 2u : 4u), Endianness, dataType);
-        if (dataType == MB_DATATYPE_INT16) {
-            lCombined = (signed int)((int16_t)lCombined); /* sign extend 16bit into 32bit */
-        }
-        if (Divisor >= 0) {
-            lCombined = lCombined / (signed int)pow_10[(unsigned)Divisor];
-        } else {
-            lCombined = lCombined * (signed int)pow_10[(unsigned)-Divisor];
-        }
+// Decoders of a meter type, specialised on its row in EMProfiles
+template <uint8_t Type>
+struct ProfileDecoder {
+    static int32_t current(const uint8_t *buf, uint8_t index) {                 // mA
+        return decodeValue<EMProfiles[Type].Endianness, EMProfiles[Type].DataType, 3 - EMProfiles[Type].IDivisor>(buf, index);
+    }
+    static int32_t power(const uint8_t *buf, uint8_t index) {                   // W
+        return decodeValue<EMProfiles[Type].Endianness, EMProfiles[Type].DataType, -EMProfiles[Type].PDivisor>(buf, index);
     }
+    static int32_t energy(const uint8_t *buf, uint8_t index) {                  // Wh
+        return decodeValue<EMProfiles[Type].Endianness, energyDataType(Type), 3 - EMProfiles[Type].EDivisor>(buf, index);
+    }
+};
 
-    return lCombined;
+// EM_CUSTOM is set up from the menu or the web interface, so it is decoded at runtime
+static int32_t customCurrent(const uint8_t *buf, uint8_t index) {
+    return decodeValue(buf, index, EMConfig[EM_CUSTOM].Endianness, EMConfig[EM_CUSTOM].DataType, 3 - EMConfig[EM_CUSTOM].IDivisor);
+}
+static int32_t customPower(const uint8_t *buf, uint8_t index) {
+    return decodeValue(buf, index, EMConfig[EM_CUSTOM].Endianness, EMConfig[EM_CUSTOM].DataType, -EMConfig[EM_CUSTOM].PDivisor);
+}
+static int32_t customEnergy(const uint8_t *buf, uint8_t index) {
+    return decodeValue(buf, index, EMConfig[EM_CUSTOM].Endianness, EMConfig[EM_CUSTOM].DataType, 3 - EMConfig[EM_CUSTOM].EDivisor);
+}
+
+struct MeterDecoder {
+    int32_t (*Current)(const uint8_t *buf, uint8_t index);                      // mA
+    int32_t (*Power)(const uint8_t *buf, uint8_t index);                        // W
+    int32_t (*Energy)(const uint8_t *buf, uint8_t index);                       // Wh
+};
+
+#define PROFILE_DECODER(t) { ProfileDecoder<t>::current, ProfileDecoder<t>::power, ProfileDecoder<t>::energy }
+// Indexed by meter type, same order as EMConfig
+static const MeterDecoder MeterDecoders[] = {
+    PROFILE_DECODER(0),  PROFILE_DECODER(1),  PROFILE_DECODER(2),  PROFILE_DECODER(3),
+    PROFILE_DECODER(4),  PROFILE_DECODER(5),  PROFILE_DECODER(6),  PROFILE_DECODER(7),
+    PROFILE_DECODER(8),  PROFILE_DECODER(9),  PROFILE_DECODER(10), PROFILE_DECODER(11),
+    PROFILE_DECODER(12), PROFILE_DECODER(13), PROFILE_DECODER(14), PROFILE_DECODER(15),
+    PROFILE_DECODER(16), PROFILE_DECODER(17), PROFILE_DECODER(18),
+    { customCurrent, customPower, customEnergy }                                // EM_CUSTOM
+};
+static_assert(sizeof(MeterDecoders) / sizeof(MeterDecoders[0]) == sizeof(EMProfiles) / sizeof(EMProfiles[0]), "MeterDecoders needs an entry for every meter type");
+
+/**
+ * Decode measurement value, using the byte order and data type of this meter
+ *
+ * @param pointer to buf
+ * @param uint8_t Count
+ * @param signed char Divisor
+ * @return signed int Measurement
+ */
+
+signed int Meter::decodeMeasurement(uint8_t *buf, uint8_t Count, signed char Divisor) {
+    return decodeValue(buf, Count, EMConfig[Type].Endianness, EMConfig[Type].DataType, -Divisor);
 }
 
 /**
@@ -191,7 +260,7 @@ uint8_t Meter::receiveCurrentMeasurement(ModBus MB) {
             // offset 16 is Smart meter P1 current
             for (x = 0; x < 3; x++) {
                 // SmartEVSE works with Amps * 10
-                var[x] = decodeMeasurement(buf, offset + x, EMConfig[Type].IDivisor - 3u);
+                var[x] = MeterDecoders[Type].Current(buf, offset + x);
                 if (offset == 7) {
                     // When MaxMains is set to >100A, it's assumed 200A:50ma CT's are used.
                     if (getItemValue(MENU_MAINS) > 100) var[x] = var[x] * 2;                    // Multiply measured currents with 2
@@ -260,14 +329,14 @@ uint8_t Meter::receiveCurrentMeasurement(ModBus MB) {
         }
         case EM_CHINT_1P:
         {
-            var[0] = decodeMeasurement(buf, 0, EMConfig[Type].IDivisor - 3);
+            var[0] = MeterDecoders[Type].Current(buf, 0);
             var[1] = 0;
             var[2] = 0;
         }
         break;
         default:
             for (x = 0; x < 3; x++) {
-                var[x] = decodeMeasurement(buf, x, EMConfig[Type].IDivisor - 3);
+                var[x] = MeterDecoders[Type].Current(buf, x);
             }
             break;
     }
@@ -299,7 +368,7 @@ uint8_t Meter::receiveCurrentMeasurement(ModBus MB) {
             
     }
     if (Type == EM_CHINT_1P) {                                                  // single-phase meter, current and power are returned in one response
-        Power[0] = decodeMeasurement(buf, 1, EMConfig[Type].PDivisor);
+        Power[0] = MeterDecoders[Type].Power(buf, 1);
         Power[1] = 0;
         Power[2] = 0;
         PowerMeasured = Power[0];
@@ -307,7 +376,7 @@ uint8_t Meter::receiveCurrentMeasurement(ModBus MB) {
     } else if (offset) {                                                        // this is one of the meters that has to measure power to determine current direction
         PowerMeasured = 0;                                                      // so we calculate PowerMeasured so we dont have to poll for this again
         for (x = 0; x < 3; x++) {
-            Power[x] = decodeMeasurement(buf, x + offset, EMConfig[Type].PDivisor);
+            Power[x] = MeterDecoders[Type].Power(buf, x + offset);
             if(Type == EM_EASTRON3P_INV) Power[x] = -Power[x];
             PowerMeasured += Power[x];
             if (Power[x] < 0) var[x] = -var[x];
@@ -335,18 +404,18 @@ signed int Meter::receiveEnergyMeasurement(uint8_t *buf) {
             // Note:
             // - ABB uses 32-bit values, except for this measurement it uses 64bit unsigned int format
             // We skip the first 4 bytes (effectivaly creating uint 32). Will work as long as the value does not exeed  roughly 20 million
-            return decodeMeasurement(buf, 1, EMConfig[Type].Endianness, MB_DATATYPE_INT32, EMConfig[Type].EDivisor-3);
+            return MeterDecoders[Type].Energy(buf, 1);
         case EM_SOLAREDGE:
             // Note:
             // - SolarEdge uses 16-bit values, except for this measurement it uses 32bit int format
             // - EM_SOLAREDGE should not be used for EV Energy Measurements
-            return decodeMeasurement(buf, 0, EMConfig[Type].Endianness, MB_DATATYPE_INT32, EMConfig[Type].EDivisor - 3);
+            return MeterDecoders[Type].Energy(buf, 0);
         case EM_SINOTIMER:
             // Note:
             // - Sinotimer uses 16-bit values, except for this measurement it uses 32bit int format
-            return decodeMeasurement(buf, 0, EMConfig[Type].Endianness, MB_DATATYPE_INT32, EMConfig[Type].EDivisor - 3);
+            return MeterDecoders[Type].Energy(buf, 0);
         default:
-            return decodeMeasurement(buf, 0, EMConfig[Type].Endianness, EMConfig[Type].DataType, EMConfig[Type].EDivisor - 3);
+            return MeterDecoders[Type].Energy(buf, 0);
     }
 }
 
@@ -368,19 +437,19 @@ signed int Meter::receivePowerMeasurement(uint8_t *buf) {
             return decodeMeasurement(buf, 0, scalingFactor);
         }
         case EM_EASTRON3P_INV:
-            return -decodeMeasurement(buf, 0, EMConfig[Type].PDivisor);
+            return -MeterDecoders[Type].Power(buf, 0);
         case EM_SINOTIMER:
         {
             //Note:
             // - Sinotimer does not output total power but only individual power of the 3 phases which we need to add to eachother.
-            Power[0] = (int)decodeMeasurement(buf, 0, EMConfig[Type].PDivisor);
-            Power[1] = (int)decodeMeasurement(buf, 1, EMConfig[Type].PDivisor);
-            Power[2] = (int)decodeMeasurement(buf, 2, EMConfig[Type].PDivisor);
+            Power[0] = MeterDecoders[Type].Power(buf, 0);
+            Power[1] = MeterDecoders[Type].Power(buf, 1);
+            Power[2] = MeterDecoders[Type].Power(buf, 2);
             _LOG_V("Received power EVmeter L1=(%dW), L2=(%dW), L3=(%dW)\n", Power[0], Power[1], Power[2]);
             return (Power[0] + Power[1] + Power[2]);
         }
         default:
-            return decodeMeasurement(buf, 0, EMConfig[Type].PDivisor);
+            return MeterDecoders[Type].Power(buf, 0);
     }
 }
 
@@ -402,7 +471,7 @@ void Meter::UpdateCapacity() {
     time_t now;
     time(&now);
     // only process if time is valid
-    if (LocalTimeSet && now != 0 && Address == MainsMeter.Address) {
+    if (LocalTimeSet && now != 0 && this == &MainsMeter) {
         if (CapacityMode == FLANDERS) {
     //Flanders: https://www.vlaamsenutsregulator.be/elektriciteit-en-aardgas/nettarieven/capaciteitstarief
     #define CapacityMinimumPower 2500  // 2.5kW is the minimum billed
@@ -537,17 +606,17 @@ void Meter::setTimeout(uint8_t NewTimeout) {
 void Meter::ResponseToMeasurement(ModBus MB) {
     if (MB.Type == MODBUS_RESPONSE) {
         if (MB.Register == EMConfig[Type].IRegister) {
-            if (Address == MainsMeter.Address) {
+            if (this == &MainsMeter) {
                 if (receiveCurrentMeasurement(MB)) {
                     setTimeout(COMM_TIMEOUT);
                 }
                 CalcIsum();
-            } else if (Address == CircuitMeter.Address) {
+            } else if (this == &CircuitMeter) {
                 if (receiveCurrentMeasurement(MB)) {
                     setTimeout(COMM_CIRCTIMEOUT);
                 }
                 CalcImeasured();
-            } else if (Address == EVMeter.Address) {
+            } else if (this == &EVMeter) {
                 if (receiveCurrentMeasurement(MB)) {
                     setTimeout(COMM_EVTIMEOUT);
                 }
@@ -562,14 +631,14 @@ void Meter::ResponseToMeasurement(ModBus MB) {
                 Export_active_energy = receiveEnergyMeasurement(MB.Data);
             else {
                 Import_active_energy = receiveEnergyMeasurement(MB.Data);
-                if (Address == MainsMeter.Address) UpdateCapacity();
+                if (this == &MainsMeter) UpdateCapacity();
             }
             UpdateEnergies();
         } else if (MB.Register == EMConfig[Type].ERegister_Exp) {
             //export active energy
             if (Type == EM_EASTRON3P_INV) {
                 Import_active_energy = receiveEnergyMeasurement(MB.Data);
-                if (Address == MainsMeter.Address) UpdateCapacity();
+                if (this == &MainsMeter) UpdateCapacity();
             } else
                 Export_active_energy = receiveEnergyMeasurement(MB.Data);
             UpdateEnergies();
@@ -578,6 +647,10 @@ void Meter::ResponseToMeasurement(ModBus MB) {
     }
 }
 
+bool Meter::onBus(void) const {
+    return Type && Type != EM_API && Type != EM_HOMEWIZARD && Transport == METER_RTU;
+}
+
 void Meter::CalcImeasured(void) {
     // Initialize Imeasured (max power used) to first channel.
     Imeasured = Irms[0];
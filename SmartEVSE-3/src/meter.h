@@ -49,6 +49,11 @@
 #define EM_UNUSED_SLOT4 18
 #define EM_CUSTOM 19
 
+#define METER_RTU 0                                                             // Meter transports: Modbus RTU on the RS485 bus
+#define METER_MODBUS_TCP 1                                                      // EMConfig registers over Modbus-TCP
+#define METER_HTTP_JSON 2                                                       // JSON document polled over HTTP
+#define METER_MQTT 3                                                            // JSON document published on an MQTT topic
+
 typedef enum mb_datatype {
     MB_DATATYPE_INT32 = 0,
     MB_DATATYPE_FLOAT32 = 1,
@@ -81,6 +86,12 @@ class Meter {
     uint8_t Type;                                                               // previously: MainsMeter; Type of Mains electric meter (0: Disabled / Constants EM_*)
     uint8_t Address;
     char DeviceHostName[32];                                                    // Selected hostname for networked meters
+    char DeviceToken[33];                                                       // HomeWizard API v2 token, empty = not paired
+    char DeviceCert[65];                                                        // SHA-256 (hex) of the HomeWizard certificate seen at pairing
+    uint8_t Transport;                                                          // METER_RTU, or how a networked meter is read
+    uint16_t Interval;                                                          // ms between polls of a networked meter, 0 = default
+    char DevicePath[64];                                                        // HTTP path or MQTT topic of a networked meter
+    char JsonPaths[96];                                                         // JSON paths: L1,L2,L3 current (A), import, export (kWh), power (W)
         uint8_t HostMenuSelection;                                                  // Pending host menu selection for this meter
     int16_t Irms[3];                                                            // Momentary current per Phase (23 = 2.3A) (resolution 100mA)
     int16_t Imeasured;                                                          // Max of all Phases (Amps *10) of mains power
@@ -110,13 +121,12 @@ class Meter {
     void ResponseToMeasurement(struct ModBus MB);
     void CalcImeasured(void);
     void setTimeout(uint8_t Timeout);
+    bool onBus(void) const;                                                     // read by ModbusRequestLoop() over RS485
   private:
     uint8_t receiveCurrentMeasurement(ModBus MB);
     signed int receivePowerMeasurement(uint8_t *buf);
     signed int receiveEnergyMeasurement(uint8_t *buf);
-    void combineBytes(void *var, uint8_t *buf, uint8_t pos, uint8_t endianness, MBDataType dataType);
     signed int decodeMeasurement(uint8_t *buf, uint8_t Count, signed char Divisor);
-    signed int decodeMeasurement(uint8_t *buf, uint8_t Count, uint8_t Endianness, MBDataType dataType, signed char Divisor);
 };
 
 extern Meter MainsMeter;
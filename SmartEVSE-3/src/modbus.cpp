@@ -33,6 +33,7 @@ extern uint8_t State;
 extern int16_t Isum;
 extern void setState(uint8_t NewState);
 extern void receiveNodeStatus(uint8_t *buf, uint8_t NodeNr); //TODO move to modbus.cpp?
+extern void receiveNodeEnergyNeed(uint8_t *buf, uint8_t NodeNr);
 extern void receiveNodeConfig(uint8_t *buf, uint8_t NodeNr); //TODO move to modbus.cpp?
 extern void ModbusRequestLoop();
 extern uint8_t ModbusRequest;
@@ -316,6 +317,11 @@ void ModbusDecode(uint8_t * buf, uint8_t len) {
 // ########################### EVSE modbus functions ###########################
 
 
+// Number of modbus registers that hold Count values of a meter
+static uint16_t measurementQuantity(uint8_t Meter, uint8_t Count) {
+    return EMConfig[Meter].DataType == MB_DATATYPE_INT16 ? Count : (Count * 2u);
+}
+
 /**
  * Send measurement request over modbus
  * 
@@ -325,66 +331,212 @@ void ModbusDecode(uint8_t * buf, uint8_t len) {
  * @param uint8_t Count
  */
 void requestMeasurement(uint8_t Meter, uint8_t Address, uint16_t Register, uint8_t Count) {
-    ModbusReadInputRequest(Address, EMConfig[Meter].Function, Register, (EMConfig[Meter].DataType == MB_DATATYPE_INT16 ? Count : (Count * 2u)));
+    ModbusReadInputRequest(Address, EMConfig[Meter].Function, Register, measurementQuantity(Meter, Count));
 }
 
 /**
- * Send current measurement request over modbus
+ * Build the request for a current measurement of a meter
  * 
  * @param uint8_t Meter
- * @param uint8_t Address
+ * @param MeterRequest req
+ * @return bool false if the meter is not read over modbus
  */
-void requestCurrentMeasurement(uint8_t Meter, uint8_t Address) {
+bool currentMeasurementRequest(uint8_t Meter, MeterRequest &req) {
+    req.Function = EMConfig[Meter].Function;
+    req.Register = EMConfig[Meter].IRegister;
     switch(Meter) {
         case EM_API:
         case EM_HOMEWIZARD:
-            break;
+            return false;
         case EM_SENSORBOX:
-            if (SB2.SoftwareVer >= 1) {
-                ModbusReadInputRequest(Address, 4, 0, 32);
-            } else ModbusReadInputRequest(Address, 4, 0, 20);
+            req.Function = 4;
+            req.Register = 0;
+            req.Quantity = SB2.SoftwareVer >= 1 ? 32 : 20;
             break;
         case EM_EASTRON1P:
         case EM_EASTRON3P:
         case EM_EASTRON3P_INV:
             // Phase 1-3 current: Register 0x06 - 0x0B (unsigned)
             // Phase 1-3 power:   Register 0x0C - 0x11 (signed)
-            ModbusReadInputRequest(Address, 4, 0x06, 12);
+            req.Function = 4;
+            req.Register = 0x06;
+            req.Quantity = 12;
             break;
         case EM_ABB:
             // Phase 1-3 current: Register 0x5B0C - 0x5B11 (unsigned)
             // Phase 1-3 power:   Register 0x5B16 - 0x5B1B (signed)
-            ModbusReadInputRequest(Address, 3, 0x5B0C, 16);
+            req.Function = 3;
+            req.Register = 0x5B0C;
+            req.Quantity = 16;
             break;
         case EM_SOLAREDGE:
             // Read 3 Current values + scaling factor
-            ModbusReadInputRequest(Address, EMConfig[Meter].Function, EMConfig[Meter].IRegister, 4);
+            req.Quantity = 4;
             break;
         case EM_FINDER_7M:
             // Phase 1-3 current: Register 2516 - 2521 (unsigned)
             // Phase 1-3 power:   Register 2530 - 2535 (signed)
-            ModbusReadInputRequest(Address, 4, 2516, 20);
+            req.Function = 4;
+            req.Register = 2516;
+            req.Quantity = 20;
             break;
         case EM_SCHNEIDER:
             // Phase 1-3 current: Register 0x0BB7 - 0x0BBC (unsigned)
             // Phase 1-3 power:   Register 0x0BED - 0x0BF2 (signed)
-            ModbusReadInputRequest(Address, 3, 0x0BB7, 60);
+            req.Function = 3;
+            req.Register = 0x0BB7;
+            req.Quantity = 60;
             break;
         case EM_CHINT_3P:
             // Phase 1-3 current: Register 0x200C - 0x2011 (unsigned)
             // Phase 1-3 power:   Register 0x2014 - 0x2019 (signed)
-            ModbusReadInputRequest(Address, 3, 0x200C, 14);
+            req.Function = 3;
+            req.Register = 0x200C;
+            req.Quantity = 14;
             break;
         case EM_CHINT_1P:
             // Phase 1 current: Register 0x2002 - 0x2003 (unsigned)
             // Phase 1 power:   Register 0x2004 - 0x2005 (signed)
-            ModbusReadInputRequest(Address, 3, 0x2002, 4);
+            req.Function = 3;
+            req.Register = 0x2002;
+            req.Quantity = 4;
             break;
         default:
             // Read 3 Current values
-            requestMeasurement(Meter, Address, EMConfig[Meter].IRegister, 3);
+            req.Quantity = measurementQuantity(Meter, 3);
             break;
-    }  
+    }
+    return true;
+}
+
+/**
+ * Send current measurement request over modbus
+ * 
+ * @param uint8_t Meter
+ * @param uint8_t Address
+ */
+void requestCurrentMeasurement(uint8_t Meter, uint8_t Address) {
+    MeterRequest req;
+    if (currentMeasurementRequest(Meter, req))
+        ModbusReadInputRequest(Address, req.Function, req.Register, req.Quantity);
+}
+
+/**
+ * Does the reply to the current measurement also hold the power of the meter?
+ * 
+ * @param uint8_t Meter
+ */
+bool powerInCurrentMeasurement(uint8_t Meter) {
+    switch (Meter) {
+        //these meters all have their power measured via receiveCurrentMeasurement already
+        case EM_EASTRON1P:
+        case EM_EASTRON3P:
+        case EM_EASTRON3P_INV:
+        case EM_ABB:
+        case EM_FINDER_7M:
+        case EM_SCHNEIDER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Build the request for an energy measurement of a meter
+ *
+ * @param uint8_t Meter
+ * @param bool    Export (if exported energy is requested)
+ * @param MeterRequest req
+ * @return bool false if the meter does not support the measurement
+ */
+bool energyMeasurementRequest(uint8_t Meter, bool Export, MeterRequest &req) {
+    uint8_t Count = 1;                                                          // by default it only takes 1 register to get the energy measurement
+    uint16_t Register = EMConfig[Meter].ERegister;
+    if (Export)
+        Register = EMConfig[Meter].ERegister_Exp;
+
+    switch (Meter) {
+        case EM_FINDER_7E:
+        case EM_EASTRON3P:
+        case EM_EASTRON1P:
+        case EM_WAGO:
+            break;
+        case EM_SOLAREDGE:
+            // Note:
+            // - SolarEdge uses 16-bit values, except for this measurement it uses 32bit int format
+            // - EM_SOLAREDGE should not be used for EV Energy Measurements
+            // fallthrough
+        case EM_SINOTIMER:
+            // Note:
+            // - Sinotimer uses 16-bit values, except for this measurement it uses 32bit int format
+            // fallthrough
+        case EM_ABB:
+            // Note:
+            // - ABB uses 64bit values for this register (size 2)
+            Count = 2;
+            break;
+        case EM_EASTRON3P_INV:
+            if (Export)
+                Register = EMConfig[Meter].ERegister;
+            else
+                Register = EMConfig[Meter].ERegister_Exp;
+            break;
+        default:
+            if (Export)
+                Count = 0; //refuse to do a request on exported energy if the meter doesnt support it
+            break;
+    }
+    if (!Count) return false;
+    req.Function = EMConfig[Meter].Function;
+    req.Register = Register;
+    req.Quantity = measurementQuantity(Meter, Count);
+    return true;
+}
+
+/**
+ * Send Energy measurement request over modbus
+ *
+ * @param uint8_t Meter
+ * @param uint8_t Address
+ * @param bool    Export (if exported energy is requested)
+ */
+void requestEnergyMeasurement(uint8_t Meter, uint8_t Address, bool Export) {
+    MeterRequest req;
+    if (energyMeasurementRequest(Meter, Export, req))
+        ModbusReadInputRequest(Address, req.Function, req.Register, req.Quantity);
+}
+
+/**
+ * Build the request for a power measurement of a meter
+ *
+ * @param uint8_t Meter
+ * @param uint16_t PRegister
+ * @param MeterRequest req
+ */
+void powerMeasurementRequest(uint8_t Meter, uint16_t PRegister, MeterRequest &req) {
+    uint8_t Count = 1;                                                          // by default it only takes 1 register to get power measurement
+    switch (Meter) {
+        case EM_SINOTIMER:
+            // Note:
+            // - Sinotimer does not output total power but only individual power of the 3 phases
+            Count = 3;
+            break;
+    }
+    req.Function = EMConfig[Meter].Function;
+    req.Register = PRegister;
+    req.Quantity = measurementQuantity(Meter, Count);
+}
+
+/**
+ * Send Power measurement request over modbus
+ *
+ * @param uint8_t Meter
+ * @param uint8_t Address
+ */
+void requestPowerMeasurement(uint8_t Meter, uint8_t Address, uint16_t PRegister) {
+    MeterRequest req;
+    powerMeasurementRequest(Meter, PRegister, req);
+    ModbusReadInputRequest(Address, req.Function, req.Register, req.Quantity);
 }
 
 
@@ -511,6 +663,13 @@ void WriteMultipleItemValueResponse(void) {
     }
 }
 
+// Charge current broadcast by the Master
+static void receiveBroadcastCurrent(uint16_t Current) {
+    Balanced[0] = Current;
+    if (Balanced[0] == 0 && State == STATE_C) setState(STATE_C1);               // tell EV to stop charging if charge current is zero
+    else if ((State == STATE_B) || (State == STATE_C)) SetCurrent(Balanced[0]); // Set charge current, and PWM output
+}
+
 void HandleModbusRequest(void) {
         // Broadcast or addressed to this device
         switch (MB.Function) {
@@ -529,9 +688,7 @@ void HandleModbusRequest(void) {
             case 0x10: // (Write multiple register))
                 // 0x0020: Balance currents
                 if (MB.Register == 0x0020 && LoadBl > 1) {      // Message for Node(s)
-                    Balanced[0] = (MB.Data[(LoadBl - 1) * 2] <<8) | MB.Data[(LoadBl - 1) * 2 + 1];
-                    if (Balanced[0] == 0 && State == STATE_C) setState(STATE_C1);               // tell EV to stop charging if charge current is zero
-                    else if ((State == STATE_B) || (State == STATE_C)) SetCurrent(Balanced[0]); // Set charge current, and PWM output
+                    if (LoadBl <= 8) receiveBroadcastCurrent((MB.Data[(LoadBl - 1) * 2] <<8) | MB.Data[(LoadBl - 1) * 2 + 1]);
                     MainsMeter.setTimeout(COMM_TIMEOUT);                          // reset 10 second timeout
                     _LOG_V("Broadcast received, Node %.1f A, MainsMeter Irms ", (float) Balanced[0]/10);
 
@@ -546,6 +703,10 @@ void HandleModbusRequest(void) {
                         }
                         _LOG_V_NO_FUNC("\n");
                     }
+                // 0x0040: Balance currents of Node 8 and up
+                } else if (MB.Register == MODBUS_BROADCAST_EXT && LoadBl > 1) {
+                    uint8_t i = (LoadBl - 9) * 2;                       // Node 1-7 ignore it
+                    if (LoadBl > 8 && MB.DataLength >= i + 2) receiveBroadcastCurrent((MB.Data[i] <<8) | MB.Data[i + 1]);
                 } else {
 
                     WriteMultipleItemValueResponse();
@@ -563,20 +724,23 @@ void HandleModbusResponse(void) {
     switch (MB.Function) {
         case 0x03: // (Read holding register)
         case 0x04: // (Read input register)
-            if (MainsMeter.Type && MainsMeter.Type!=EM_API && MB.Address == MainsMeter.Address) {
+            if (MainsMeter.onBus() && MB.Address == MainsMeter.Address) {
                 MainsMeter.ResponseToMeasurement(MB);
-            } else if (CircuitMeter.Type && MB.Address == CircuitMeter.Address) {
+            } else if (CircuitMeter.onBus() && MB.Address == CircuitMeter.Address) {
                 CircuitMeter.ResponseToMeasurement(MB);
-            } else if (EVMeter.Type && EVMeter.Type != EM_HOMEWIZARD && MB.Address == EVMeter.Address) {
+            } else if (EVMeter.onBus() && MB.Address == EVMeter.Address) {
                 EVMeter.ResponseToMeasurement(MB);
-            } else if (LoadBl == 1 && MB.Address > 1 && MB.Address <= NR_EVSES) {
+            } else if (LoadBl == 1 && AddressNode(MB.Address)) {
                 // Packet from a Node EVSE, only for Master!
                 if (MB.Register == 0x0000) {
                     // Node status
-                    receiveNodeStatus(MB.Data, MB.Address - 1u);
+                    receiveNodeStatus(MB.Data, AddressNode(MB.Address));
+                }  else if (MB.Register == 0x000C) {
+                    // Node energy need
+                    receiveNodeEnergyNeed(MB.Data, AddressNode(MB.Address));
                 }  else if (MB.Register == 0x0108) {
                     // Node configuration
-                    receiveNodeConfig(MB.Data, MB.Address - 1u);
+                    receiveNodeConfig(MB.Data, AddressNode(MB.Address));
                     return; // Do not call ModbusRequestLoop(), we still expect an Ack from the Node
                 }
             }
@@ -596,7 +760,7 @@ ModbusMessage MBNodeRequest(ModbusMessage request) {
     response.clear(); //clear global response message
 
     // Check if the call is for our current ServerID, or maybe for an old ServerID?
-    if (LoadBl != request.getServerID()) return NIL_RESPONSE;
+    if (NodeAddress(LoadBl - 1) != request.getServerID()) return NIL_RESPONSE;
 
     ModbusDecode( (uint8_t*)request.data(), request.size());
     HandleModbusRequest();
@@ -691,13 +855,13 @@ void ConfigureModbusMode(uint8_t newmode) {
             if (newmode != 255 ) MBclient.end();
             _LOG_A("ConfigureModbusMode1 task free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
 
-            // Register worker. at serverID 'LoadBl', all function codes
-            MBserver.registerWorker(LoadBl, ANY_FUNCTION_CODE, &MBNodeRequest);
+            // Register worker. at the serverID of Node 'LoadBl-1', all function codes
+            MBserver.registerWorker(NodeAddress(LoadBl - 1), ANY_FUNCTION_CODE, &MBNodeRequest);
             // Also add handler for all broadcast messages from Master.
             MBserver.registerWorker(BROADCAST_ADR, ANY_FUNCTION_CODE, &MBbroadcast);
 
-            if (EVMeter.Type && EVMeter.Type != EM_API && EVMeter.Type != EM_HOMEWIZARD) MBserver.registerWorker(EVMeter.Address, ANY_FUNCTION_CODE, &MBEVMeterResponse);
-            if (CircuitMeter.Type && CircuitMeter.Type != EM_API) MBserver.registerWorker(CircuitMeter.Address, ANY_FUNCTION_CODE, &MBCircuitMeterResponse);
+            if (EVMeter.onBus()) MBserver.registerWorker(EVMeter.Address, ANY_FUNCTION_CODE, &MBEVMeterResponse);
+            if (CircuitMeter.onBus()) MBserver.registerWorker(CircuitMeter.Address, ANY_FUNCTION_CODE, &MBCircuitMeterResponse);
 
             // Start ModbusRTU Node background task
             MBserver.begin(Serial1);
@@ -720,7 +884,7 @@ void ConfigureModbusMode(uint8_t newmode) {
         // Register worker. at serverID 'LoadBl', all function codes
         _LOG_A("Registering new LoadBl worker at id %u\n", newmode);
         LoadBl = newmode;
-        MBserver.registerWorker(newmode, ANY_FUNCTION_CODE, &MBNodeRequest);
+        MBserver.registerWorker(NodeAddress(newmode - 1), ANY_FUNCTION_CODE, &MBNodeRequest);
     }
 
 }
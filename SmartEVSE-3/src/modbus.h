@@ -54,7 +54,33 @@ void ModbusWriteSingleRequest(uint8_t address, uint16_t reg, uint16_t value);
 void ModbusWriteMultipleRequest(uint8_t address, uint16_t reg, uint16_t *values, uint8_t count);
 void ModbusException(uint8_t address, uint8_t function, uint8_t exception);
 
+// A read request for a meter in EMConfig, independent of the bus it is sent over
+struct MeterRequest {
+    uint8_t Function;
+    uint16_t Register;
+    uint16_t Quantity;
+};
+
 void requestMeasurement(uint8_t Meter, uint8_t Address, uint16_t Register, uint8_t Count);
+bool currentMeasurementRequest(uint8_t Meter, MeterRequest &req);
+bool energyMeasurementRequest(uint8_t Meter, bool Export, MeterRequest &req);
+void powerMeasurementRequest(uint8_t Meter, uint16_t PRegister, MeterRequest &req);
+bool powerInCurrentMeasurement(uint8_t Meter);
 void requestCurrentMeasurement(uint8_t Meter, uint8_t Address);
+void requestEnergyMeasurement(uint8_t Meter, uint8_t Address, bool Export);
+void requestPowerMeasurement(uint8_t Meter, uint8_t Address, uint16_t PRegister);
 void BroadcastSettings(void);
+
+// Modbus address of a Node (1 .. NR_EVSES-1). Nodes 1-7 use 0x02-0x08, larger clusters continue at
+// NODE_ADDRESS_EXT, past the broadcast address and the default meter addresses.
+inline uint8_t NodeAddress(uint8_t NodeNr) {
+    return NodeNr < 8 ? NodeNr + 1 : NODE_ADDRESS_EXT + NodeNr - 8;
+}
+
+// Node number of a Modbus address, 0 if it is not the address of a Node
+inline uint8_t AddressNode(uint8_t Address) {
+    if (Address > 1 && Address <= 8) return Address - 1;
+    if (Address >= NODE_ADDRESS_EXT && Address < NODE_ADDRESS_EXT + NR_EVSES - 8) return Address - NODE_ADDRESS_EXT + 8;
+    return 0;
+}
 #endif
@@ -0,0 +1,799 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#include <WiFi.h>
+#include "netmeter.h"
+#include "network_common.h"
+#include "esp32.h"
+#include "meter.h"
+#include "modbus.h"
+#include "debug.h"
+
+// Keys of the HomeWizard V1 and V2 API, in the order of HomeWizardScanner::values[]
+enum { HW_I_L1, HW_I_L2, HW_I_L3, HW_I, HW_P_L1, HW_P_L2, HW_P_L3, HW_P, HW_IMPORT, HW_EXPORT, HW_FIELDS };
+static const char *hwKeys[HW_FIELDS] = {
+    "active_current_l1_a", "active_current_l2_a", "active_current_l3_a", "active_current_a",
+    "active_power_l1_w", "active_power_l2_w", "active_power_l3_w", "active_power_w",
+    "total_power_import_kwh", "total_power_export_kwh"
+};
+static const char *hwKeysV2[HW_FIELDS] = {
+    "current_l1_a", "current_l2_a", "current_l3_a", "current_a",
+    "power_l1_w", "power_l2_w", "power_l3_w", "power_w",
+    "energy_import_kwh", "energy_export_kwh"
+};
+
+void HomeWizardScanner::reset() {
+    for (auto &v : values) v = 0;
+    seen = 0;
+    depth = keyLen = numLen = 0;
+    inString = escape = isKey = expectKey = overflow = false;
+    field = -1;
+}
+
+void HomeWizardScanner::feed(char ch) {
+    if (inString) {
+        if (escape) {
+            escape = false;
+        } else if (ch == '\\') {
+            escape = true;
+            overflow = true;                                                // none of our keys contain escapes
+        } else if (ch == '"') {
+            inString = false;
+            if (isKey) {
+                field = -1;
+                if (!overflow) {
+                    const char **keys = v2 ? hwKeysV2 : hwKeys;
+                    key[keyLen] = '\0';
+                    for (int8_t i = 0; i < HW_FIELDS; i++) {
+                        if (strcmp(key, keys[i]) == 0) field = i;
+                    }
+                }
+            }
+            return;
+        }
+        if (isKey) {
+            if (keyLen < sizeof(key) - 1) key[keyLen++] = ch;
+            else overflow = true;
+        }
+        return;
+    }
+
+    if (numLen) {
+        if ((ch >= '0' && ch <= '9') || ch == '.' || ch == '-' || ch == '+' || ch == 'e' || ch == 'E') {
+            if (numLen < sizeof(num) - 1) num[numLen++] = ch;
+            return;
+        }
+        num[numLen] = '\0';
+        values[field] = strtof(num, NULL);
+        seen |= 1 << field;
+        numLen = 0;
+        field = -1;
+    }
+
+    switch (ch) {
+        case '"':
+            inString = true;
+            isKey = depth == 1 && expectKey;
+            keyLen = 0;
+            overflow = false;
+            break;
+        case '{':
+        case '[':
+            if (++depth == 1) expectKey = true;
+            break;
+        case '}':
+        case ']':
+            if (depth) depth--;
+            break;
+        case ':':
+            if (depth == 1) expectKey = false;
+            break;
+        case ',':
+            if (depth == 1) {
+                expectKey = true;
+                field = -1;
+            }
+            break;
+        default:
+            if (depth == 1 && !expectKey && field >= 0 && ((ch >= '0' && ch <= '9') || ch == '-')) {
+                num[0] = ch;
+                numLen = 1;
+            }
+            break;
+    }
+}
+
+/**
+ * @brief Converts the scanned values to meter data.
+ *
+ * @return A pair containing:
+ *     - A int flag indicating: 0: failure, 1: single phase current, 3: 3 phase current
+ *     - An array of 6 values: current in deci-amps for L1, L2, L3 (sign taken from the power of
+ *       that phase, negative is feed-in), import in Wh, export in Wh and total power in W
+ */
+std::pair<int8_t, std::array<std::int32_t, 6>> HomeWizardScanner::result() const {
+    std::array<int32_t, 6> evdata{};
+    int8_t phases;
+
+    auto current = [this](int i, int p) -> int32_t {
+        int16_t rawCurrent = values[i] * 10;
+        return std::abs(rawCurrent) * (values[p] < 0 ? -1 : 1);
+    };
+
+    if (seen & ((1 << HW_I_L1) | (1 << HW_I_L2) | (1 << HW_I_L3))) {
+        phases = 3;
+        for (int i = 0; i < 3; i++) evdata[i] = current(HW_I_L1 + i, HW_P_L1 + i);
+    } else if (seen & (1 << HW_I)) {
+        phases = 1;
+        evdata[0] = current(HW_I, HW_P);
+    } else {
+        return {0, evdata};
+    }
+    evdata[3] = values[HW_IMPORT] * 1000;                                   // total import in Wh
+    evdata[4] = values[HW_EXPORT] * 1000;                                   // total export in Wh
+    evdata[5] = values[HW_P];                                               // total power in Watts
+    return {phases, evdata};
+}
+
+std::pair<int8_t, std::array<std::int32_t, 6>> parseHomeWizardData(struct mg_str json, bool v2) {
+    HomeWizardScanner scanner(v2);
+    scanner.feed(json);
+    scanner.finish();
+    return scanner.result();
+}
+
+/**
+ * Reads a meter from a JSON document with the mg_json_get() paths in Meter::JsonPaths,
+ * comma separated in the order L1, L2, L3 current (A), import, export (kWh), power (W),
+ * e.g. "$.i[0],$.i[1],$.i[2],$.e_in,$.e_out,$.p". Entries may be left empty; the values
+ * they stand for are kept as they are in evdata.
+ *
+ * @return The number of phases with a current: 0 (failure), 1 (only L1) or 3
+ */
+int8_t parseJsonPaths(struct mg_str json, const char *paths, std::array<std::int32_t, 6> &evdata) {
+    static const double scale[6] = { 10, 10, 10, 1000, 1000, 1 };            // deci-amps, Wh, W
+    int8_t phases = 0;
+    const char *p = paths;
+
+    for (int i = 0; i < 6; i++) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        char path[48];
+        double value;
+        if (len && len < sizeof(path)) {
+            memcpy(path, p, len);
+            path[len] = '\0';
+            if (mg_json_get_num(json, path, &value)) {
+                evdata[i] = lround(value * scale[i]);
+                if (i < 3) phases = i ? 3 : (phases ? phases : 1);
+            }
+        }
+        if (!end) break;
+        p = end + 1;
+    }
+    return phases;
+}
+
+
+// One entry per meter that can be read over the network: a HomeWizard meter, or any
+// meter with a Transport other than METER_RTU.
+// ip/port are written by the resolver task and read by the loop task, under netMeterMux.
+// Everything else is only used from the loop task, which also runs mg_mgr_poll().
+struct NetMeterConn {
+    Meter *meter;
+    const char *name;
+    bool mains;
+    uint32_t ip;                                                            // resolved IPv4 address, network order, 0 = unresolved
+    uint16_t port;                                                          // 0 = the default port of the transport
+    char host[sizeof(Meter::DeviceHostName)];                               // hostname ip belongs to, resolver task only
+    struct mg_connection *c;
+    uint32_t connIp;                                                        // address c is connected to
+    uint16_t connPort;
+    uint8_t connTransport;                                                  // transport c was opened for
+    unsigned long sent;                                                     // millis() of the outstanding request, 0 = idle
+    unsigned long lastPoll;                                                 // millis() of the last poll or MQTT message
+    uint8_t failures;
+    MeterRequest req[4];                                                    // Modbus-TCP requests of this poll
+    uint8_t reqCount, reqIndex;
+    uint16_t txid;                                                          // Modbus-TCP transaction identifier
+    uint8_t polls;                                                          // counts to NETMETER_ENERGY_POLLS
+    struct mg_connection *ws;                                               // v2 push subscription
+    uint8_t pushState;
+    unsigned long pushLast;                                                 // millis() of the last measurement or handshake step
+    unsigned long pushFailed;                                               // millis() the subscription was lost, 0 = never
+    bool certOk;                                                            // ws presented the certificate pinned at pairing
+    struct mg_connection *pc;                                               // v2 pairing request
+    unsigned long pairStart;                                                // millis() pairing was started, 0 = not pairing
+    unsigned long pairLast;                                                 // millis() of the last pairing request
+    char pairCert[sizeof(Meter::DeviceCert)];                               // certificate hash of the pairing session
+};
+
+enum { PUSH_CONNECTING, PUSH_SUBSCRIBED, PUSH_RECEIVING };
+
+static NetMeterConn netMeters[] = {
+    { &MainsMeter, "MainsMeter", true },
+    { &CircuitMeter, "CircuitMeter", false },
+    { &EVMeter, "EVMeter", false },
+};
+
+static portMUX_TYPE netMeterMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t homewizardWakeSem = nullptr;
+TaskHandle_t tHandleHomewizard = nullptr;
+
+static const char *transportNames[] = { "rtu", "modbus_tcp", "http_json", "mqtt" };
+
+const char *meterTransportName(uint8_t transport) {
+    return transport < sizeof(transportNames) / sizeof(transportNames[0]) ? transportNames[transport] : "";
+}
+
+int meterTransportFromName(const char *name) {
+    for (uint8_t i = 0; i < sizeof(transportNames) / sizeof(transportNames[0]); i++) {
+        if (strcmp(name, transportNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// How the meter is read; a HomeWizard meter has its own HTTP API
+static uint8_t netMeterTransport(const NetMeterConn &m) {
+    return m.meter->Type == EM_HOMEWIZARD ? METER_HTTP_JSON : m.meter->Transport;
+}
+
+static bool netMeterEnabled(const NetMeterConn &m) {
+    const Meter &meter = *m.meter;
+    if (meter.Type == 0 || (m.mains && LoadBl >= 2)) return false;
+    if (meter.Type == EM_HOMEWIZARD) return true;
+    return meter.Transport == METER_HTTP_JSON || meter.Transport == METER_MQTT ||
+           (meter.Transport == METER_MODBUS_TCP && meter.Type != EM_API);  // Modbus-TCP needs the registers of a meter type
+}
+
+/**
+ * Resolves the hostnames of the networked meters.
+ *
+ * Name lookups (mostly .local names through mDNS) block, and mongoose cannot resolve
+ * .local names itself, so this runs in its own task; discovered meters come straight
+ * from the mDNS directory. The polling happens in the loop task on the resolved
+ * addresses. The task blocks on a binary semaphore that
+ * netmeter_loop() gives every poll interval, and only does work when a hostname
+ * changed or an address was dropped after failed requests.
+ */
+static void homewizard_task(void *parameter) {
+    for (;;) {
+        xSemaphoreTake(homewizardWakeSem, portMAX_DELAY);
+
+        if (strlen(MainsMeter.DeviceHostName) == 0 && MainsMeter.Type == EM_HOMEWIZARD && LoadBl < 2) { //Mains Initialize
+            // Prevent existing HomeWizard P1 users from having to reconfigure their meter after updating to a version with the new HomeWizard Kwh implementation.
+            // We can remove this code after a few releases, when we are sure most users have updated at least once.
+            _LOG_A("Migrating HomeWizard P1 implementation");
+            //Old implementation just picked the first p1meter entry discovered, so we do the same here
+            mDNSServiceEntry service;
+            if (getmDNSServiceByIndex(EM_HOMEWIZARD, String("p1meter-"), 0, service, true)) {
+                strncpy(MainsMeter.DeviceHostName, service.HostName, sizeof(MainsMeter.DeviceHostName));
+                MainsMeter.DeviceHostName[sizeof(MainsMeter.DeviceHostName) - 1] = '\0';
+                write_settings();
+            }
+        }
+
+        for (auto &m : netMeters) {
+            if (!netMeterEnabled(m) || netMeterTransport(m) == METER_MQTT) continue;
+
+            char host[sizeof(m.host)];
+            strncpy(host, m.meter->DeviceHostName, sizeof(host));
+            host[sizeof(host) - 1] = '\0';
+            if (host[0] == '\0') continue;
+
+            // The hostname may carry a port, e.g. "p1meter-123456.local:8080"
+            uint16_t port = 0;
+            char *colon = strrchr(host, ':');
+            char name[sizeof(host)];
+            strcpy(name, host);
+            if (colon) {
+                port = atoi(colon + 1);
+                name[colon - host] = '\0';
+            }
+
+            // Discovered meters are looked up in the mDNS directory, which also follows
+            // address changes; other names are resolved once, and again after failures.
+            uint32_t ip = 0;
+            bool cached = getmDNSServiceAddress(name, ip);
+            portENTER_CRITICAL(&netMeterMux);
+            bool current = m.ip && strcmp(m.host, host) == 0 && (!cached || m.ip == ip);
+            portEXIT_CRITICAL(&netMeterMux);
+            if (current) continue;
+
+            if (!cached) {
+                IPAddress addr;
+                if (!WiFi.hostByName(name, addr) || (uint32_t)addr == 0) {
+                    _LOG_A("Could not resolve %s hostname %s.\n", m.name, name);
+                    continue;
+                }
+                ip = (uint32_t)addr;
+            }
+            _LOG_A("%s %s resolved to %s:%u.\n", m.name, name, IPAddress(ip).toString().c_str(), port);
+
+            portENTER_CRITICAL(&netMeterMux);
+            strcpy(m.host, host);
+            m.port = port;
+            m.ip = ip;
+            portEXIT_CRITICAL(&netMeterMux);
+        }
+    }
+}
+
+static void netMeterApply(NetMeterConn &m, const std::pair<int8_t, std::array<std::int32_t, 6>> &evdata, bool push) {
+    Meter &meter = *m.meter;
+    for (int i = 0; i < evdata.first; i++)
+        meter.Irms[i] = evdata.second[i];
+    if (m.mains) {
+        CalcIsum();
+        if (push) MainsMeterPushed = true;
+    } else meter.CalcImeasured();
+    meter.setTimeout(COMM_TIMEOUT);
+    meter.Import_active_energy = evdata.second[3];
+    meter.Export_active_energy = evdata.second[4];
+    meter.PowerMeasured = evdata.second[5];
+    meter.UpdateEnergies();
+    _LOG_D("Updated %s with Irms: %d, %d, %d, ActiveEnergyImport: %u, ActiveEnergyExport: %u, PowerMeasured: %u.\n", m.name, evdata.second[0], evdata.second[1], evdata.second[2], evdata.second[3], evdata.second[4], evdata.second[5]);
+}
+
+// Decodes a JSON document of a meter with Meter::JsonPaths; values without a path keep their last value
+static std::pair<int8_t, std::array<std::int32_t, 6>> netMeterJson(const Meter &meter, struct mg_str json) {
+    std::array<int32_t, 6> evdata = { meter.Irms[0], meter.Irms[1], meter.Irms[2],
+                                      meter.Import_active_energy, meter.Export_active_energy, meter.PowerMeasured };
+    int8_t phases = parseJsonPaths(json, meter.JsonPaths, evdata);
+    return {phases, evdata};
+}
+
+static void netMeterSend(NetMeterConn &m) {
+    const char *path = m.meter->Type == EM_HOMEWIZARD ? "/api/v1/data" : m.meter->DevicePath[0] ? m.meter->DevicePath : "/";
+    mg_printf(m.c, "GET %s HTTP/1.1\r\n"
+                   "Host: %s\r\n"
+                   "User-Agent: SmartEVSE-v3\r\n"
+                   "Accept: application/json\r\n"
+                   "Connection: keep-alive\r\n\r\n", path, m.meter->DeviceHostName);
+}
+
+// A failed request; after a few in a row the address is dropped so the resolver looks it up again
+static void netMeterFailed(NetMeterConn &m, const char *reason) {
+    _LOG_A("Error on network meter request for %s: %s.\n", m.name, reason);
+    m.sent = 0;
+    if (++m.failures >= NETMETER_RESOLVE_RETRY) {
+        m.failures = 0;
+        portENTER_CRITICAL(&netMeterMux);
+        m.ip = 0;
+        portEXIT_CRITICAL(&netMeterMux);
+    }
+}
+
+static void fn_netmeter(struct mg_connection *c, int ev, void *ev_data) {
+    NetMeterConn *m = (NetMeterConn *) c->fn_data;
+
+    if (ev == MG_EV_CONNECT) {
+        netMeterSend(*m);
+    } else if (ev == MG_EV_HTTP_MSG) {
+        struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+        int status = mg_http_status(hm);
+        if (status != 200) {
+            char reason[16];
+            snprintf(reason, sizeof(reason), "HTTP %d", status);
+            netMeterFailed(*m, reason);
+            return;
+        }
+        const auto evdata = m->meter->Type == EM_HOMEWIZARD ? parseHomeWizardData(hm->body) : netMeterJson(*m->meter, hm->body);
+        m->sent = 0;
+        if (!evdata.first) {
+            netMeterFailed(*m, "no current in the reply");
+            return;
+        }
+        m->failures = 0;
+        netMeterApply(*m, evdata, false);
+    } else if (ev == MG_EV_ERROR) {
+        if (m->sent) netMeterFailed(*m, (const char *) ev_data);
+    } else if (ev == MG_EV_CLOSE) {
+        // An idle keep-alive connection closed by the meter is not a failure
+        if (m->sent) netMeterFailed(*m, "connection closed");
+        m->c = NULL;
+    }
+}
+
+// The requests of one Modbus-TCP poll: the currents, the power when the EV meter does not
+// report it with the currents, and every NETMETER_ENERGY_POLLS polls the energies.
+static void netMeterModbusPlan(NetMeterConn &m) {
+    uint8_t type = m.meter->Type;
+    m.reqCount = m.reqIndex = 0;
+    if (currentMeasurementRequest(type, m.req[m.reqCount])) m.reqCount++;
+    if (m.meter == &EVMeter && !powerInCurrentMeasurement(type) && type != EM_SENSORBOX)
+        powerMeasurementRequest(type, EMConfig[type].PRegister, m.req[m.reqCount++]);
+    if (m.polls == 0 && type != EM_SENSORBOX) {
+        if (energyMeasurementRequest(type, false, m.req[m.reqCount])) m.reqCount++;
+        if (energyMeasurementRequest(type, true, m.req[m.reqCount])) m.reqCount++;
+    }
+    if (++m.polls >= NETMETER_ENERGY_POLLS) m.polls = 0;
+}
+
+static void netMeterModbusSend(NetMeterConn &m) {
+    const MeterRequest &req = m.req[m.reqIndex];
+    uint8_t frame[12] = {
+        (uint8_t) (m.txid >> 8), (uint8_t) m.txid, 0, 0, 0, 6,             // MBAP header: transaction, protocol 0, length
+        m.meter->Address, req.Function,
+        (uint8_t) (req.Register >> 8), (uint8_t) req.Register,
+        (uint8_t) (req.Quantity >> 8), (uint8_t) req.Quantity
+    };
+    mg_send(m.c, frame, sizeof(frame));
+}
+
+// Next request of the poll, or the poll is done
+static void netMeterModbusNext(NetMeterConn &m) {
+    m.txid++;
+    if (++m.reqIndex < m.reqCount) {
+        netMeterModbusSend(m);
+    } else {
+        m.sent = 0;
+        m.failures = 0;
+    }
+}
+
+// Modbus-TCP replies are passed to Meter::ResponseToMeasurement() like the ones from the RS485 bus
+static void fn_netmeter_modbus(struct mg_connection *c, int ev, void *ev_data) {
+    NetMeterConn *m = (NetMeterConn *) c->fn_data;
+
+    if (ev == MG_EV_CONNECT) {
+        netMeterModbusSend(*m);
+    } else if (ev == MG_EV_READ) {
+        while (c->recv.len >= 8) {
+            uint8_t *buf = c->recv.buf;
+            size_t len = 6 + (buf[4] << 8 | buf[5]);
+            if (c->recv.len < len) break;
+            uint16_t txid = buf[0] << 8 | buf[1];
+            if (m->sent && txid == m->txid && len >= 8) {
+                const MeterRequest &req = m->req[m->reqIndex];
+                if (buf[7] != req.Function) {
+                    // An exception; a meter that does not support a measurement should not stop the others
+                    _LOG_D("Modbus-TCP exception %02x on register %04x of %s.\n", len > 8 ? buf[8] : 0, req.Register, m->name);
+                } else if (len >= 9 && buf[8] >= req.Quantity * 2u && 9u + buf[8] <= len) {
+                    ModBus MB = {};
+                    MB.Address = buf[6];
+                    MB.Function = buf[7];
+                    MB.Register = req.Register;
+                    MB.RegisterCount = req.Quantity;
+                    MB.Data = buf + 9;
+                    MB.DataLength = buf[8];
+                    MB.Type = MODBUS_RESPONSE;
+                    m->meter->ResponseToMeasurement(MB);
+                }
+                mg_iobuf_del(&c->recv, 0, len);
+                netMeterModbusNext(*m);
+            } else {
+                mg_iobuf_del(&c->recv, 0, len);                             // a late reply to a request that timed out
+            }
+        }
+    } else if (ev == MG_EV_ERROR) {
+        if (m->sent) netMeterFailed(*m, (const char *) ev_data);
+    } else if (ev == MG_EV_CLOSE) {
+        if (m->sent) netMeterFailed(*m, "connection closed");
+        m->c = NULL;
+    }
+}
+
+// The v2 API is HTTPS only, with certificates from the HomeWizard CA that name the device,
+// not the address we resolved on the local network, so the chain is not verified. Instead the
+// certificate seen at pairing is pinned (Meter::DeviceCert), and the token is only sent to a
+// meter presenting that same certificate.
+static void netMeterTls(struct mg_connection *c) {
+    struct mg_tls_opts opts = {};
+    opts.skip_verification = 1;
+    mg_tls_init(c, &opts);
+}
+
+// SHA-256 of the certificate the meter presented, as hex; false if there is none
+static bool netMeterCertHash(struct mg_connection *c, char hex[65]) {
+    struct mg_tls *tls = (struct mg_tls *) c->tls;
+    const mbedtls_x509_crt *crt = tls ? mbedtls_ssl_get_peer_cert(&tls->ssl) : NULL;
+    if (crt == NULL) return false;
+    uint8_t hash[32];
+    mg_sha256(hash, crt->raw.p, crt->raw.len);
+    for (int i = 0; i < 32; i++) mg_snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    return true;
+}
+
+// A TLS session takes 35-40 KB of heap; keep the number open at once bounded
+static bool netMeterTlsAllowed(void) {
+    uint8_t open = 0;
+    for (auto &m : netMeters) open += (m.ws != NULL) + (m.pc != NULL);
+    return open < NETMETER_TLS_MAX && esp_get_free_heap_size() >= NETMETER_TLS_HEAP;
+}
+
+static bool jsonIs(struct mg_str json, const char *path, const char *value) {
+    int len;
+    int off = mg_json_get(json, path, &len);
+    size_t n = strlen(value);
+    return off >= 0 && (size_t) len == n + 2 && memcmp(json.buf + off + 1, value, n) == 0;
+}
+
+// Websocket subscription to the measurements of a paired v2 meter
+static void fn_netmeter_push(struct mg_connection *c, int ev, void *ev_data) {
+    NetMeterConn *m = (NetMeterConn *) c->fn_data;
+
+    if (ev == MG_EV_CONNECT) {
+        netMeterTls(c);
+    } else if (ev == MG_EV_TLS_HS) {
+        char cert[sizeof(m->meter->DeviceCert)];
+        if (!netMeterCertHash(c, cert)) {
+            c->is_closing = 1;
+        } else if (!m->meter->DeviceCert[0]) {
+            strcpy(m->meter->DeviceCert, cert);                             // paired before certificates were pinned
+            write_settings();
+            m->certOk = true;
+        } else if (strcmp(cert, m->meter->DeviceCert)) {
+            _LOG_A("HomeWizard %s presented another certificate than at pairing, pair it again.\n", m->name);
+            c->is_closing = 1;
+        } else {
+            m->certOk = true;
+        }
+    } else if (ev == MG_EV_WS_MSG) {
+        struct mg_str data = ((struct mg_ws_message *) ev_data)->data;
+        if (jsonIs(data, "$.type", "measurement")) {
+            int len;
+            int off = mg_json_get(data, "$.data", &len);
+            if (off < 0) return;
+            const auto evdata = parseHomeWizardData(mg_str_n(data.buf + off, len), true);
+            if (!evdata.first) return;
+            if (m->pushState != PUSH_RECEIVING) _LOG_A("Receiving HomeWizard push measurements for %s.\n", m->name);
+            m->pushState = PUSH_RECEIVING;
+            m->pushLast = millis();
+            netMeterApply(*m, evdata, true);
+        } else if (jsonIs(data, "$.type", "authorization_requested")) {
+            if (!m->certOk) return;
+            mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{%m:%m,%m:%m}", MG_ESC("type"), MG_ESC("authorization"),
+                         MG_ESC("data"), MG_ESC(m->meter->DeviceToken));
+        } else if (jsonIs(data, "$.type", "authorized")) {
+            mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\":\"subscribe\",\"data\":\"measurement\"}");
+            m->pushState = PUSH_SUBSCRIBED;
+            m->pushLast = millis();
+        } else if (jsonIs(data, "$.type", "error")) {
+            _LOG_A("HomeWizard push for %s refused: %.*s\n", m->name, (int) data.len, data.buf);
+            c->is_closing = 1;
+        }
+    } else if (ev == MG_EV_ERROR) {
+        _LOG_A("HomeWizard push for %s: %s\n", m->name, (const char *) ev_data);
+    } else if (ev == MG_EV_CLOSE) {
+        _LOG_A("HomeWizard push for %s closed, polling until it is retried.\n", m->name);
+        m->ws = NULL;
+        m->pushFailed = millis() | 1;
+    }
+}
+
+// Creates a v2 API token; the meter only hands one out after its button was pressed
+static void fn_netmeter_pair(struct mg_connection *c, int ev, void *ev_data) {
+    NetMeterConn *m = (NetMeterConn *) c->fn_data;
+
+    if (ev == MG_EV_CONNECT) {
+        static const char body[] = "{\"name\":\"local/smartevse\"}";
+        netMeterTls(c);
+        m->pairCert[0] = '\0';
+        mg_printf(c, "POST /api/user HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "Content-Type: application/json\r\n"
+                     "X-Api-Version: 2\r\n"
+                     "Connection: close\r\n"
+                     "Content-Length: %u\r\n\r\n%s", m->meter->DeviceHostName, (unsigned) strlen(body), body);
+    } else if (ev == MG_EV_TLS_HS) {
+        if (!netMeterCertHash(c, m->pairCert)) m->pairCert[0] = '\0';
+    } else if (ev == MG_EV_HTTP_MSG) {
+        struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+        char *token = mg_http_status(hm) == 200 ? mg_json_get_str(hm->body, "$.token") : NULL;
+        if (token && strlen(token) < sizeof(m->meter->DeviceToken) && m->pairCert[0]) {
+            strcpy(m->meter->DeviceToken, token);
+            strcpy(m->meter->DeviceCert, m->pairCert);
+            write_settings();
+            m->pairStart = 0;
+            m->pushFailed = 0;
+            _LOG_A("Paired with HomeWizard %s.\n", m->name);
+        } else {
+            _LOG_I("Waiting for the button on HomeWizard %s.\n", m->name);
+        }
+        free(token);
+        c->is_draining = 1;
+    } else if (ev == MG_EV_CLOSE) {
+        m->pc = NULL;
+    }
+}
+
+static NetMeterConn *netMeterFind(const Meter &meter) {
+    for (auto &m : netMeters) {
+        if (m.meter == &meter) return &m;
+    }
+    return NULL;
+}
+
+bool homewizardPair(Meter &meter) {
+    NetMeterConn *m = netMeterFind(meter);
+    if (m == NULL || !netMeterEnabled(*m) || !m->ip) return false;
+    m->pairStart = millis() | 1;
+    return true;
+}
+
+const char *homewizardPushState(const Meter &meter) {
+    NetMeterConn *m = netMeterFind(meter);
+    if (m == NULL) return "off";
+    if (m->pairStart) return "pairing";
+    if (!meter.DeviceToken[0]) return "off";
+    if (m->ws == NULL) return "paired";
+    return m->pushState == PUSH_RECEIVING ? "connected" : "connecting";
+}
+
+static void netMeterClose(struct mg_connection *c) {
+    if (c) c->is_closing = 1;
+}
+
+/**
+ * Measurements of meters with the MQTT transport, a JSON document published on the topic
+ * in Meter::DevicePath. Like a push from a HomeWizard meter, a mains measurement starts a
+ * new balancing round; Meter::Interval limits how often one is used.
+ *
+ * @return true if the message was for one of the meters
+ */
+bool netMeterMqttMessage(struct mg_str topic, struct mg_str payload) {
+    for (auto &m : netMeters) {
+        const Meter &meter = *m.meter;
+        if (!netMeterEnabled(m) || netMeterTransport(m) != METER_MQTT || mg_strcmp(topic, mg_str(meter.DevicePath))) continue;
+        const unsigned long currentTime = millis();
+        if (meter.Interval && currentTime - m.lastPoll < meter.Interval) return true;
+        const auto evdata = netMeterJson(meter, payload);
+        if (!evdata.first) {
+            _LOG_W("No current in the MQTT message for %s.\n", m.name);
+            return true;
+        }
+        m.lastPoll = currentTime;
+        netMeterApply(m, evdata, true);
+        return true;
+    }
+    return false;
+}
+
+/**
+  * Periodically retrieves current measurements from networked energy meters
+  * and updates the meters' currents and energies.
+  *
+  * Every Meter::Interval (NETMETER_POLL_INTERVAL when not set) one poll is done on
+  * each meter over its own keep-alive connection: one HTTP request for HomeWizard and
+  * HTTP JSON meters, a few requests in a row for Modbus-TCP meters. The replies are
+  * handled as they come in, so a slow meter no longer delays the others. A poll that
+  * takes longer than NETMETER_TIMEOUT closes its connection; the next poll opens a new one.
+  * MQTT meters are not polled, see netMeterMqttMessage().
+  *
+  * HomeWizard meters paired with the v2 API push their measurements over a websocket
+  * instead. While those arrive polling is skipped; when they stop for NETMETER_PUSH_STALE,
+  * polling takes over and the subscription is retried after NETMETER_PUSH_RETRY.
+  */
+void netmeter_loop() {
+    static unsigned long lastResolve = 0;
+    const unsigned long currentTime = millis();
+    bool enabled = false;
+
+    for (auto &m : netMeters) {
+        if (!netMeterEnabled(m)) {
+            netMeterClose(m.c);
+            netMeterClose(m.ws);
+            netMeterClose(m.pc);
+            m.pairStart = 0;
+            continue;
+        }
+        enabled = true;
+        if (m.c && m.sent && currentTime - m.sent > NETMETER_TIMEOUT) {
+            netMeterFailed(m, "timeout");
+            m.c->is_closing = 1;
+        }
+        if (m.ws && (m.meter->Type != EM_HOMEWIZARD || !m.meter->DeviceToken[0] || currentTime - m.pushLast > NETMETER_PUSH_STALE)) {
+            m.ws->is_closing = 1;                                           // unpaired, or no measurements
+        }
+        if (m.pairStart && currentTime - m.pairStart > NETMETER_PAIR_TIME) {
+            _LOG_A("Pairing with HomeWizard %s timed out.\n", m.name);
+            m.pairStart = 0;
+        }
+    }
+    if (!enabled) return;
+
+    if (currentTime - lastResolve >= NETMETER_POLL_INTERVAL) {
+        lastResolve = currentTime;
+        // Lazy first-time setup: create the wake semaphore and the resolver task.
+        // Done lazily so users without a networked meter never pay for the task at all.
+        if (homewizardWakeSem == nullptr) {
+            homewizardWakeSem = xSemaphoreCreateBinary();
+            if (homewizardWakeSem == nullptr) {
+                _LOG_A("Failed to create HomeWizard semaphore\n");
+                return;
+            }
+            if (xTaskCreate(homewizard_task, "HomeWizard", 3072, NULL, 1, &tHandleHomewizard) != pdPASS) {
+                _LOG_A("Failed to create HomeWizard task\n");
+                vSemaphoreDelete(homewizardWakeSem);
+                homewizardWakeSem = nullptr;
+                return;
+            }
+        }
+        // Let the resolver check for changed hostnames; a no-op if it is still busy.
+        xSemaphoreGive(homewizardWakeSem);
+    }
+
+    for (auto &m : netMeters) {
+        const uint8_t transport = netMeterTransport(m);
+        if (!netMeterEnabled(m) || transport == METER_MQTT) continue;
+        if (currentTime - m.lastPoll < (m.meter->Interval ? m.meter->Interval : NETMETER_POLL_INTERVAL)) continue;
+
+        portENTER_CRITICAL(&netMeterMux);
+        uint32_t ip = m.ip;
+        uint16_t port = m.port;
+        portEXIT_CRITICAL(&netMeterMux);
+        if (!ip) continue;
+        if (!port) port = transport == METER_MODBUS_TCP ? NETMETER_MODBUS_PORT : 80;
+        m.lastPoll = currentTime;
+
+        char url[40];
+        if (m.meter->Type == EM_HOMEWIZARD) {
+            if (m.pairStart && m.pc == NULL && currentTime - m.pairLast >= NETMETER_PAIR_INTERVAL && netMeterTlsAllowed()) {
+                m.pairLast = currentTime;
+                mg_snprintf(url, sizeof(url), "https://%M:%u/api/user", mg_print_ip4, &ip, NETMETER_PUSH_PORT);
+                m.pc = mg_http_connect(&mgr, url, fn_netmeter_pair, &m);
+            }
+            if (m.meter->DeviceToken[0] && m.ws == NULL &&
+                (!m.pushFailed || currentTime - m.pushFailed >= NETMETER_PUSH_RETRY) && netMeterTlsAllowed()) {
+                mg_snprintf(url, sizeof(url), "wss://%M:%u/api/ws", mg_print_ip4, &ip, NETMETER_PUSH_PORT);
+                m.ws = mg_ws_connect(&mgr, url, fn_netmeter_push, &m, NULL);
+                m.certOk = false;
+                m.pushState = PUSH_CONNECTING;
+                m.pushLast = currentTime;
+                if (m.ws == NULL) m.pushFailed = currentTime | 1;
+            }
+            if (m.ws && m.pushState == PUSH_RECEIVING) {
+                if (!m.sent) netMeterClose(m.c);                            // measurements are pushed, no need to poll
+                continue;
+            }
+        }
+
+        if (m.sent) continue;                                               // previous poll still outstanding
+        if (m.c && (m.connIp != ip || m.connPort != port || m.connTransport != transport)) {
+            m.c->is_closing = 1;                                            // hostname or transport changed, reconnect next time
+            continue;
+        }
+        m.sent = currentTime;
+        if (transport == METER_MODBUS_TCP) netMeterModbusPlan(m);
+        if (m.c) {
+            if (transport == METER_MODBUS_TCP) netMeterModbusSend(m);
+            else netMeterSend(m);
+            continue;
+        }
+        if (transport == METER_MODBUS_TCP) {
+            mg_snprintf(url, sizeof(url), "tcp://%M:%u", mg_print_ip4, &ip, port);
+            m.c = mg_connect(&mgr, url, fn_netmeter_modbus, &m);
+        } else {
+            mg_snprintf(url, sizeof(url), "http://%M:%u", mg_print_ip4, &ip, port);
+            m.c = mg_http_connect(&mgr, url, fn_netmeter, &m);
+        }
+        if (m.c == NULL) {
+            netMeterFailed(m, "connect");
+            continue;
+        }
+        m.connIp = ip;
+        m.connPort = port;
+        m.connTransport = transport;
+    }
+}
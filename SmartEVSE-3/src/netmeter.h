@@ -0,0 +1,85 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#ifndef __NETMETER
+
+#define __NETMETER
+
+#include <Arduino.h>
+#include <array>
+#include <utility>
+#include "mongoose.h"
+
+// Networked meters, polled as parallel requests on the mongoose event manager
+#define NETMETER_POLL_INTERVAL      1950                                    // ms, 5 attempts before the 10 s meter timeout
+#define NETMETER_INTERVAL_MIN       500                                     // ms, lowest Meter::Interval that can be set
+#define NETMETER_INTERVAL_MAX       60000
+#define NETMETER_TIMEOUT            1500                                    // ms for connect + request + reply
+#define NETMETER_RESOLVE_RETRY      3                                       // failed requests before the hostname is resolved again
+#define NETMETER_MODBUS_PORT        502
+#define NETMETER_ENERGY_POLLS       30                                      // Modbus-TCP polls between energy requests
+
+// HomeWizard API v2 push: a websocket subscription to the meter's measurements, polling is the fallback
+#define NETMETER_PUSH_PORT          443
+#define NETMETER_PUSH_STALE         5000                                    // ms without a measurement before we poll again
+#define NETMETER_PUSH_RETRY         60000                                   // ms before a failed subscription is retried
+#define NETMETER_PAIR_TIME          30000                                   // ms to press the button on the meter
+#define NETMETER_PAIR_INTERVAL      2000                                    // ms between pairing requests
+#define NETMETER_TLS_MAX            2                                       // TLS sessions (push and pairing) open at once, 35-40 KB heap each
+#define NETMETER_TLS_HEAP           49152                                   // free heap needed to open one
+
+// Incremental scanner for a HomeWizard /api/v1/data reply or v2 measurement. Characters are
+// fed as they arrive; only the top level numbers we use are kept, nothing is allocated.
+struct HomeWizardScanner {
+    bool v2;                                                                // key names of the v2 API
+    float values[10];
+    uint16_t seen;                                                          // bit per entry in values[]
+    uint8_t depth;
+    bool inString, escape, isKey, expectKey, overflow;
+    int8_t field;                                                           // key of the value being read, -1 = not used
+    uint8_t keyLen, numLen;
+    char key[24];
+    char num[16];
+
+    HomeWizardScanner(bool apiV2 = false) : v2(apiV2) { reset(); }
+    void reset();
+    void feed(char ch);
+    void feed(struct mg_str data) { for (size_t i = 0; i < data.len; i++) feed(data.buf[i]); }
+    void finish() { feed(' '); }                                            // flushes a number at the end of the input
+    std::pair<int8_t, std::array<std::int32_t, 6>> result() const;
+};
+
+extern TaskHandle_t tHandleHomewizard;
+
+class Meter;
+
+std::pair<int8_t, std::array<std::int32_t, 6>> parseHomeWizardData(struct mg_str json, bool v2 = false);
+int8_t parseJsonPaths(struct mg_str json, const char *paths, std::array<std::int32_t, 6> &evdata);
+const char *meterTransportName(uint8_t transport);
+int meterTransportFromName(const char *name);                              // -1 = unknown
+bool netMeterMqttMessage(struct mg_str topic, struct mg_str payload);
+void netmeter_loop();
+bool homewizardPair(Meter &meter);                                          // false: meter is not a resolved HomeWizard meter
+const char *homewizardPushState(const Meter &meter);
+
+#endif
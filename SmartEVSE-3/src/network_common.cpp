@@ -2,11 +2,13 @@
 
 #include <WiFi.h>
 #include <vector>
+#include <algorithm>
 #include "mbedtls/md_internal.h"
 #include "mbedtls/base64.h"
 #include "mbedtls/sha256.h"
 #include "utils.h"
 #include "network_common.h"
+#include "http_metrics.h"
 #include "glcd.h"
 #include "esp32.h"
 #include <ArduinoJson.h>
@@ -55,6 +57,7 @@ uint8_t lastMqttUpdate = 0;
 bool MQTTtls = false;
 bool MQTTSmartServer = false;               // Use mqtt.smartevse.nl server, can be set from the LCD menu
 bool MQTTSmartServerChanged = false;        // Flag to trigger reconnect from network_loop()
+uint8_t MQTTtelemetry = MQTT_TELEMETRY_TOPICS;  // Per-value topics and/or one aggregated /Telemetry document
 bool WIFImodeChanged = false;               // Flag to trigger handleWIFImode() from network_loop()
 String MQTTprivatePassword;                 // mqtt.smartevse.nl pre calculated password (hash of ec_private key)
 #endif
@@ -92,6 +95,9 @@ extern void write_settings(void);
 extern void StopwebServer(void); //TODO or move over to network.cpp?
 extern void StartwebServer(void); //TODO or move over to network.cpp?
 extern bool handle_URI(struct mg_connection *c, struct mg_http_message *hm,  webServerRequest* request);
+#ifndef SENSORBOX_VERSION
+extern void ws_state_close(struct mg_connection *c);
+#endif
 extern uint8_t AutoUpdate;
 extern uint16_t firmwareUpdateTimer;
 
@@ -129,12 +135,8 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
         MQTTclient.connected = false;
         break;
     case MQTT_EVENT_DATA:
-        {
-        String topic2 = String(event->topic).substring(0,event->topic_len);
-        String payload2 = String(event->data).substring(0,event->data_len);
-        //_LOG_A("Received MQTT EVENT DATA: topic=%s, payload=%s.\n", topic2.c_str(), payload2.c_str());
-        mqtt_receive_callback(topic2, payload2);
-        }
+        //_LOG_A("Received MQTT EVENT DATA: topic=%.*s, payload=%.*s.\n", event->topic_len, event->topic, event->data_len, event->data);
+        mqtt_receive_callback(mg_str_n(event->topic, event->topic_len), mg_str_n(event->data, event->data_len));
         break;
     case MQTT_EVENT_ERROR:
         _LOG_I("MQTT_EVENT_ERROR; Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
@@ -197,50 +199,189 @@ void MQTTclient_t::disconnect(void) {
 #endif
 
 
+// Queue a message; returns false if it was dropped.
+bool MQTToutbox_t::push(const char *topic, const char *payload, size_t len, bool retained, int qos) {
+    size_t tlen = strlen(topic);
+    size_t need = sizeof(Msg) + tlen + 1 + len + 1;
+    if (len > UINT16_MAX || need > MQTT_OUTBOX_BYTES) { dropped++; return false; }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t mseq = seq, mqueued = millis();
+    int i = find(topic);
+    if (i >= 0) {
+        // latest value wins, but keep the place in the queue
+        mseq = slot[i]->seq;
+        mqueued = slot[i]->queued;
+        retained |= slot[i]->retained;
+        if (slot[i]->qos > qos) qos = slot[i]->qos;
+        remove(i);
+        coalesced++;
+    } else {
+        seq++;
+    }
+    // make room by dropping the oldest measurement; state is never dropped for a measurement
+    Msg *m = nullptr;
+    while (depth == MQTT_OUTBOX_MAX || !(m = alloc(need))) {
+        int victim = -1;
+        for (i = 0; i < MQTT_OUTBOX_MAX; i++) {
+            if (slot[i] && !urgent(slot[i]) && (victim < 0 || slot[i]->seq < slot[victim]->seq)) victim = i;
+        }
+        if (victim < 0) break;
+        remove(victim);
+        dropped++;
+    }
+    bool ok = depth < MQTT_OUTBOX_MAX && m;
+    if (ok) {
+        m->seq = mseq;
+        m->queued = mqueued;
+        m->len = len;
+        m->retained = retained;
+        m->qos = qos;
+        memcpy(m->topic(), topic, tlen + 1);
+        memcpy(m->payload(), payload, len);
+        m->payload()[len] = 0;
+        for (i = 0; slot[i]; i++);
+        slot[i] = m;
+        depth++;
+        bytes += tlen + len;
+        if (depth > maxDepth) maxDepth = depth;
+    } else {
+        if (m) release(m);
+        dropped++;
+    }
+    xSemaphoreGive(lock);
+    return ok;
+}
+
+// First fit of len bytes in the arena, or nullptr. Call with lock held.
+MQTToutbox_t::Msg *MQTToutbox_t::alloc(size_t len) {
+    uint16_t n = (len + MQTT_OUTBOX_BLOCK - 1) / MQTT_OUTBOX_BLOCK, run = 0;
+    for (uint16_t b = 0; b < MQTT_OUTBOX_BLOCKS; b++) {
+        if (used[b / 32] & (1UL << (b % 32))) { run = 0; continue; }
+        if (++run < n) continue;
+        uint16_t first = b + 1 - n;
+        for (b = first; b < first + n; b++) used[b / 32] |= 1UL << (b % 32);
+        Msg *m = (Msg *)(arena + first * MQTT_OUTBOX_BLOCK);
+        m->blocks = n;
+        return m;
+    }
+    return nullptr;
+}
+
+void MQTToutbox_t::release(Msg *m) {
+    uint16_t first = ((uint8_t *)m - arena) / MQTT_OUTBOX_BLOCK;
+    for (uint16_t b = first; b < first + m->blocks; b++) used[b / 32] &= ~(1UL << (b % 32));
+}
+
+// index of the queued message for topic, or -1. Call with lock held.
+int MQTToutbox_t::find(const char *topic) {
+    for (int i = 0; i < MQTT_OUTBOX_MAX; i++) {
+        if (slot[i] && !strcmp(slot[i]->topic(), topic)) return i;
+    }
+    return -1;
+}
+
+// index of the message to send next: the oldest urgent one, else the oldest one. Call with lock held.
+int MQTToutbox_t::next(void) {
+    int best = -1;
+    for (int i = 0; i < MQTT_OUTBOX_MAX; i++) {
+        if (!slot[i]) continue;
+        if (best < 0 || (urgent(slot[i]) && !urgent(slot[best])) ||
+            (urgent(slot[i]) == urgent(slot[best]) && slot[i]->seq < slot[best]->seq)) best = i;
+    }
+    return best;
+}
+
+void MQTToutbox_t::remove(int i) {
+    depth--;
+    bytes -= size(slot[i]);
+    release(slot[i]);
+    slot[i] = nullptr;
+}
+
+MQTToutbox_t::Stats MQTToutbox_t::stats(void) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    Stats st = { depth, maxDepth, bytes, sent, dropped, coalesced,
+                 sent ? (uint32_t)(latencySum / sent) : 0, latencyMax };
+    xSemaphoreGive(lock);
+    return st;
+}
+
+
 //wrapper so MQTTClient::Publish works
 void MQTTclient_t::publish(const String &topic, const String &payload, bool retained, int qos) {
+    outbox.push(topic.c_str(), payload.c_str(), payload.length(), retained, qos);
+}
+
+bool MQTTclient_t::publish(const char *topic, const char *payload, size_t payload_len, bool retained, int qos) {
+    return outbox.push(topic, payload, payload_len, retained, qos);
+}
+
+#if MQTT_ESP == 1
+// Queue a message in the esp-mqtt outbox, which the esp-mqtt task sends; the publish call
+// blocks on the socket, and network_loop() should not. Holds back while the outbox is full.
+static bool espMqttEnqueue(esp_mqtt_client_handle_t client, const char *topic, const char *payload, size_t len, bool retained, int qos) {
+    if (esp_mqtt_client_get_outbox_size(client) > MQTT_OUTBOX_SOCKBUF) return false;
+    return esp_mqtt_client_enqueue(client, topic, payload, (int)len, qos, retained, true) >= 0;
+}
+#endif
+
+// Hand one message to the MQTT client; false if it could not take it now.
+bool MQTTclient_t::send(const char *topic, const char *payload, size_t payload_len, bool retained, int qos) {
 #if MQTT_ESP == 0
-    if (s_conn && connected) {
-        struct mg_mqtt_opts opts = default_opts;
-        opts.topic = mg_str(topic.c_str());
-        opts.message = mg_str(payload.c_str());
-        opts.qos = qos;
-        opts.retain = retained;
-        mg_mqtt_pub(s_conn, &opts);
-    }
+    if (!s_conn || !connected || s_conn->send.len > MQTT_OUTBOX_SOCKBUF) return false;
+    struct mg_mqtt_opts opts = default_opts;
+    opts.topic = mg_str(topic);
+    opts.message = mg_str_n(payload, payload_len);
+    opts.qos = qos;
+    opts.retain = retained;
+    mg_mqtt_pub(s_conn, &opts);
+    return true;
 #else
-    if (connected && client)
-        esp_mqtt_client_publish(client, topic.c_str(), payload.c_str(), payload.length(), qos, retained);
+    if (!connected || !client) return false;
+    return espMqttEnqueue(client, topic, payload, payload_len, retained, qos);
 #endif
 }
 
-void MQTTclient_t::publish(const char *topic, const char *payload, size_t payload_len, bool retained, int qos) {
+void MQTTclient_t::flush(void) {
+    outbox.flush([this](const char *topic, const char *payload, size_t len, bool retained, int qos) -> bool {
+        if (!send(topic, payload, len, retained, qos)) return false;
+        if (retained) discoverySent(topic, payload, len);
+        return true;
+    });
+}
+
+void MQTTclient_t::subscribe(const String &topic, int qos) {
 #if MQTT_ESP == 0
     if (s_conn && connected) {
         struct mg_mqtt_opts opts = default_opts;
-        opts.topic = mg_str(topic);
-        opts.message = mg_str_n(payload, payload_len);
+        opts.topic = mg_str(topic.c_str());
         opts.qos = qos;
-        opts.retain = retained;
-        mg_mqtt_pub(s_conn, &opts);
+        mg_mqtt_sub(s_conn, &opts);
     }
 #else
     if (connected && client)
-        esp_mqtt_client_publish(client, topic, payload, (int)payload_len, qos, retained);
+        esp_mqtt_client_subscribe(client, topic.c_str(), qos);
 #endif
 }
 
-void MQTTclient_t::subscribe(const String &topic, int qos) {
+void MQTTclient_t::unsubscribe(const String &topic) {
 #if MQTT_ESP == 0
     if (s_conn && connected) {
-        struct mg_mqtt_opts opts = default_opts;
-        opts.topic = mg_str(topic.c_str());
-        opts.qos = qos;
-        mg_mqtt_sub(s_conn, &opts);
+        // mongoose has no helper for this one: packet id, (MQTT 5: no properties), topic
+        if (++s_conn->mgr->mqtt_id == 0) ++s_conn->mgr->mqtt_id;
+        uint16_t id = s_conn->mgr->mqtt_id, len = topic.length();
+        uint8_t buf[] = { (uint8_t)(id >> 8), (uint8_t)id, 0 };
+        mg_mqtt_send_header(s_conn, MQTT_CMD_UNSUBSCRIBE, 2, 2 + s_conn->is_mqtt5 + 2 + len);
+        mg_send(s_conn, buf, 2 + s_conn->is_mqtt5);
+        buf[0] = len >> 8;
+        buf[1] = len & 0xff;
+        mg_send(s_conn, buf, 2);
+        mg_send(s_conn, topic.c_str(), len);
     }
 #else
     if (connected && client)
-        esp_mqtt_client_subscribe(client, topic.c_str(), qos);
+        esp_mqtt_client_unsubscribe(client, topic.c_str());
 #endif
 }
 
@@ -250,6 +391,9 @@ void MQTTclient_t::announce(const String& entity_name, const String& domain, con
 }
 
 void MQTTclient_t::announce(const char *entity_name, const char *domain, const char *optional_payload) {
+    if (!connected) return;
+    if (discAnnouncer) discEntities++;
+
     // Build entity_suffix (entity_name with spaces removed) on the stack.
     char suffix[64];
     { size_t j = 0; const char *s = entity_name;
@@ -310,7 +454,117 @@ void MQTTclient_t::announce(const char *entity_name, const char *domain, const c
     payload[n++] = '}';
     payload[n]   = 0;
 
-    publish(topic, payload, (size_t)n, true, 0);  // Retain + QoS 0
+    if (!discoveryChanged(topic, payload, (size_t)n)) return;
+    outbox.push(topic, payload, (size_t)n, true, 0);                            // Retain + QoS 0
+}
+
+// Returns true if this discovery config was not published before with the same content.
+bool MQTTclient_t::discoveryChanged(const char *topic, const char *payload, size_t len) {
+    uint32_t th = fnv1a(topic, strlen(topic));
+
+    for (uint8_t i = 0; i < discCount; i++) {
+        if (discHash[i].topic == th) return discHash[i].config != fnv1a(payload, len);
+    }
+    return true;
+}
+
+// Remembers a discovery config as published, once flush() handed it to the MQTT client.
+// A config that is dropped or still queued is published again by the next pass.
+void MQTTclient_t::discoverySent(const char *topic, const char *payload, size_t len) {
+    static const char head[] = "homeassistant/", tail[] = "/config";
+    size_t tlen = strlen(topic);
+    uint8_t i;
+
+    if (tlen < sizeof(head) - 1 + sizeof(tail) - 1 || strncmp(topic, head, sizeof(head) - 1)
+        || strcmp(topic + tlen - (sizeof(tail) - 1), tail)) return;
+    uint32_t th = fnv1a(topic, tlen);
+    for (i = 0; i < discCount; i++) {
+        if (discHash[i].topic == th) break;
+    }
+    if (i == discCount) {
+        if (discCount == MQTT_DISCOVERY_MAX) return;                            // table full, always publish
+        discHash[discCount++].topic = th;
+    }
+    discHash[i].config = fnv1a(payload, len);
+    discDirty = true;
+}
+
+// Start a (re)publish of the Home Assistant discovery configs. announcer(section) calls announce()
+// for the entities of one section and returns false past the last section; discoveryLoop() runs
+// the sections in order. force=true republishes all entities, f.e. when Home Assistant comes online.
+// Only hands the request over, so it can be called from any task.
+void MQTTclient_t::discoveryStart(bool (*announcer)(uint8_t section), bool force) {
+    portENTER_CRITICAL(&discMux);
+    discRequest = announcer;
+    discRequestForce |= force;
+    portEXIT_CRITICAL(&discMux);
+}
+
+// Picks up a discoveryStart() request, in network_loop()
+void MQTTclient_t::discoveryBegin(bool (*announcer)(uint8_t), bool force) {
+    char ctx[80];
+    snprintf(ctx, sizeof(ctx), "%s:%u", MQTTHost.c_str(), MQTTPort);
+    uint32_t context = fnv1a(ctx, strlen(ctx));
+
+    if (!discLoaded) {
+        Preferences prefs;                                                      // local handle
+        if (prefs.begin("MQTTdisc", true)) {                                    // true = readonly
+            discContext = prefs.getUInt("context", 0);
+            size_t len = prefs.getBytesLength("hashes");
+            if (len <= sizeof(discHash)) {
+                prefs.getBytes("hashes", discHash, len);
+                discCount = len / sizeof(DiscoveryHash);
+            }
+            prefs.end();
+        }
+        discLoaded = true;
+    }
+    // hashes are only valid for the broker they were published to
+    if (force || context != discContext) {
+        discCount = 0;
+        discContext = context;
+        discDirty = true;
+    }
+    discSection = 0;
+    discEntities = 0;
+    discAnnouncer = announcer;
+}
+
+// Called every network_loop(); runs the next sections of a running pass, until at least
+// MQTT_DISCOVERY_BURST entities were handled. The hashes are stored in NVS when no pass runs
+// and the outbox has drained while connected, so they only cover configs that were sent.
+void MQTTclient_t::discoveryLoop(void) {
+    portENTER_CRITICAL(&discMux);
+    bool (*request)(uint8_t) = discRequest;
+    bool force = discRequestForce;
+    discRequest = nullptr;
+    discRequestForce = false;
+    portEXIT_CRITICAL(&discMux);
+    if (request) discoveryBegin(request, force);
+
+    if (!connected) return;
+    if (!discAnnouncer) {
+        if (discDirty && !outbox.stats().depth) {
+            Preferences prefs;
+            if (prefs.begin("MQTTdisc", false)) {
+                prefs.putUInt("context", discContext);
+                prefs.putBytes("hashes", discHash, discCount * sizeof(DiscoveryHash));
+                prefs.end();
+            }
+            discDirty = false;
+        }
+        return;
+    }
+
+    uint16_t start = discEntities;
+    while (discEntities - start < MQTT_DISCOVERY_BURST) {
+        if (!discAnnouncer(discSection)) break;
+        discSection++;
+    }
+    if (discEntities - start >= MQTT_DISCOVERY_BURST) return;                 // more sections left
+
+    discAnnouncer = nullptr;
+    _LOG_D("MQTT discovery done, %u entities.\n", discEntities);
 }
 
 MQTTclient_t MQTTclient;
@@ -350,18 +604,18 @@ void mqtt_smartevse_event_handler(void *handler_args, esp_event_base_t base, int
             if (payload != "offline") {
                 MQTTclientSmartEVSE_AppConnected = true;
                 _LOG_I("SmartEVSE App connected, publishing data.\n");
-                mqttSmartEVSEPublishData();
+                mqttSmartEVSEPublishData(true);
             } else {
                 MQTTclientSmartEVSE_AppConnected = false;
                 _LOG_I("SmartEVSE App disconnected.\n");
             }
         } else if (topic.indexOf("/Set/") >= 0) {
             // Handle Set commands and publish updated data immediately
-            mqtt_receive_callback(topic, payload);
+            mqtt_receive_callback(mg_str_n(event->topic, event->topic_len), mg_str_n(event->data, event->data_len));
             mqttSmartEVSEPublishData();
         } else {
             // Other messages (e.g. subscribed topics) - just process, don't publish
-            mqtt_receive_callback(topic, payload);
+            mqtt_receive_callback(mg_str_n(event->topic, event->topic_len), mg_str_n(event->data, event->data_len));
         }
         }
         break;
@@ -430,8 +684,18 @@ void MQTTclientSmartEVSE_t::disconnect(void) {
 }
 
 void MQTTclientSmartEVSE_t::publish(const String &topic, const String &payload, bool retained, int qos) {
-    if (connected && client)
-        esp_mqtt_client_publish(client, topic.c_str(), payload.c_str(), payload.length(), qos, retained);
+    outbox.push(topic.c_str(), payload.c_str(), payload.length(), retained, qos);
+}
+
+bool MQTTclientSmartEVSE_t::publish(const char *topic, const char *payload, size_t payload_len, bool retained, int qos) {
+    return outbox.push(topic, payload, payload_len, retained, qos);
+}
+
+void MQTTclientSmartEVSE_t::flush(void) {
+    outbox.flush([this](const char *topic, const char *payload, size_t len, bool retained, int qos) -> bool {
+        if (!connected || !client) return false;
+        return espMqttEnqueue(client, topic, payload, len, retained, qos);
+    });
 }
 
 void MQTTclientSmartEVSE_t::subscribe(const String &topic, int qos) {
@@ -598,10 +862,9 @@ bool getLatestVersion(String owner_repo, String asset_name, char *version) {
 unsigned char *signature = NULL;
 #define SIGNATURE_LENGTH 512
 
-// SHA-Verify the OTA partition after it's been written
-// https://techtutorialsx.com/2018/05/10/esp32-arduino-mbed-tls-using-the-sha-256-algorithm/
+// Check the RSA signature over a SHA256 hash of the firmware
 // https://github.com/ARMmbed/mbedtls/blob/development/programs/pkey/rsa_verify.c
-bool validate_sig( const esp_partition_t* partition, unsigned char *signature, int size )
+static bool verify_sig( const unsigned char *hash, const unsigned char *signature )
 {
     const char* rsa_key_pub = R"RSA_KEY_PUB(
 -----BEGIN PUBLIC KEY-----
@@ -620,26 +883,37 @@ YtSTUJNSiSwqWt1m0FLOJD0CAwEAAQ==
 -----END PUBLIC KEY-----
 )RSA_KEY_PUB";
 
-    if( !partition ) {
-        _LOG_A( "Could not find update partition!.\n");
-        return false;
-    }
     _LOG_D("Creating mbedtls context.\n");
     mbedtls_pk_context pk;
-    mbedtls_md_context_t rsa;
     mbedtls_pk_init( &pk );
     _LOG_D("Parsing public key.\n");
 
     int ret;
     if( ( ret = mbedtls_pk_parse_public_key( &pk, (const unsigned char*)rsa_key_pub, strlen(rsa_key_pub)+1 ) ) != 0 ) {
         _LOG_A( "Parsing public key failed! mbedtls_pk_parse_public_key %d (%d bytes)\n%s", ret, strlen(rsa_key_pub)+1, rsa_key_pub);
+        mbedtls_pk_free( &pk );
         return false;
     }
     if( !mbedtls_pk_can_do( &pk, MBEDTLS_PK_RSA ) ) {
         _LOG_A( "Public key is not an rsa key -0x%x", -ret );
+        mbedtls_pk_free( &pk );
+        return false;
+    }
+    ret = mbedtls_pk_verify( &pk, MBEDTLS_MD_SHA256, hash, 32, signature, SIGNATURE_LENGTH );
+    mbedtls_pk_free( &pk );
+    return ret == 0;
+}
+
+// SHA-Verify the OTA partition after it's been written
+// https://techtutorialsx.com/2018/05/10/esp32-arduino-mbed-tls-using-the-sha-256-algorithm/
+bool validate_sig( const esp_partition_t* partition, unsigned char *signature, int size )
+{
+    if( !partition ) {
+        _LOG_A( "Could not find update partition!.\n");
         return false;
     }
     _LOG_D("Initing mbedtls.\n");
+    mbedtls_md_context_t rsa;
     const mbedtls_md_info_t *mdinfo = mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 );
     mbedtls_md_init( &rsa );
     mbedtls_md_setup( &rsa, mdinfo, 0 );
@@ -670,17 +944,10 @@ YtSTUJNSiSwqWt1m0FLOJD0CAwEAAQ==
     }
     free( _buffer );
 
-    unsigned char *hash = (unsigned char*)malloc( mdinfo->size );
-    if(!hash){
-        _LOG_A( "malloc failed.\n");
-        return false;
-    }
+    unsigned char hash[32];
     mbedtls_md_finish( &rsa, hash );
-    ret = mbedtls_pk_verify( &pk, MBEDTLS_MD_SHA256, hash, mdinfo->size, (unsigned char*)signature, SIGNATURE_LENGTH );
-    free( hash );
     mbedtls_md_free( &rsa );
-    mbedtls_pk_free( &pk );
-    if( ret == 0 ) {
+    if( verify_sig( hash, signature ) ) {
         return true;
     }
 
@@ -691,13 +958,16 @@ YtSTUJNSiSwqWt1m0FLOJD0CAwEAAQ==
 }
 
 
-bool forceUpdate(const char* firmwareURL, bool validate) {
-    HTTPClient httpClient;
-    //WiFiClientSecure _client;
-    int partition = U_FLASH;
+#define OTA_CHUNK_SIZE      4096
+#define OTA_STALL_TIMEOUT   10000                                           // ms without data before the download is resumed
+#define OTA_RESUME_RETRIES  5
 
+int downloadRate = 0;                                                       // bytes/s of the running firmware download
+int downloadResumes = 0;                                                    // times the running download was resumed
+
+// (Re)open the firmware download, from byte offset on
+static int ota_open(HTTPClient &httpClient, const char* firmwareURL, int offset) {
     httpClient.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
-    _LOG_A("Connecting to: %s.\n", firmwareURL );
     if( String(firmwareURL).startsWith("https") ) {
         //_client.setCACert(root_ca_github); // OR
         //_client.setInsecure(); //not working for github
@@ -708,18 +978,32 @@ bool forceUpdate(const char* firmwareURL, bool validate) {
     httpClient.addHeader("User-Agent", "SmartEVSE-v3");
     httpClient.addHeader("Accept", "application/vnd.github+json");
     httpClient.addHeader("X-GitHub-Api-Version", "2022-11-28" );
+    if (offset) httpClient.addHeader("Range", "bytes=" + String(offset) + "-");
     const char* get_headers[] = { "Content-Length", "Content-type", "Accept-Ranges" };
     httpClient.collectHeaders( get_headers, sizeof(get_headers)/sizeof(const char*) );
+    return httpClient.GET();
+}
+
+// Download the firmware straight into the OTA partition. The signature check hashes the
+// image while it streams in, so it is done when the last byte lands instead of reading
+// the partition back. A dropped or stalled connection is resumed with a Range request
+// when the server supports it; a server that answers the range with the whole file is
+// read up to the resume point again.
+bool forceUpdate(const char* firmwareURL, bool validate) {
+    HTTPClient httpClient;
+    int partition = U_FLASH;
 
-    int updateSize = 0;
-    int httpCode = httpClient.GET();
+    _LOG_A("Connecting to: %s.\n", firmwareURL );
+    int fileSize = 0;
+    bool resumable = false;
+    int httpCode = ota_open(httpClient, firmwareURL, 0);
     String contentType;
 
     if( httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY ) {
-        updateSize = httpClient.getSize();
+        fileSize = httpClient.getSize();
         contentType = httpClient.header( "Content-type" );
-        String acceptRange = httpClient.header( "Accept-Ranges" );
-        if( acceptRange == "bytes" ) {
+        resumable = httpClient.header( "Accept-Ranges" ) == "bytes";
+        if( resumable ) {
             _LOG_V("This server supports resume!\n");
         } else {
             _LOG_V("This server does not support resume!\n");
@@ -729,32 +1013,18 @@ bool forceUpdate(const char* firmwareURL, bool validate) {
         return false;
     }
 
-    _LOG_D("updateSize : %i, contentType: %s.\n", updateSize, contentType.c_str());
-    Stream * stream = httpClient.getStreamPtr();
-    if( updateSize<=0 || stream == nullptr ) {
+    _LOG_D("fileSize : %i, contentType: %s.\n", fileSize, contentType.c_str());
+    if( fileSize<=0 || httpClient.getStreamPtr() == nullptr ) {
         _LOG_A("HTTP Error.\n");
         return false;
     }
 
-    // some network streams (e.g. Ethernet) can be laggy and need to 'breathe'
-    if( ! stream->available() ) {
-        uint32_t timeout = millis() + 10000;
-        while( ! stream->available() ) {
-            if( millis()>timeout ) {
-                _LOG_A("Stream timed out.\n");
-                return false;
-            }
-            vTaskDelay(1);
-        }
-    }
-
-    if( validate ) {
-        if( updateSize == UPDATE_SIZE_UNKNOWN || updateSize <= SIGNATURE_LENGTH ) {
-            _LOG_A("Malformed signature+fw combo.\n");
-            return false;
-        }
-        updateSize -= SIGNATURE_LENGTH;
+    int sigSize = validate ? SIGNATURE_LENGTH : 0;                          // the signature is prepended to the image
+    if( validate && fileSize <= SIGNATURE_LENGTH ) {
+        _LOG_A("Malformed signature+fw combo.\n");
+        return false;
     }
+    int updateSize = fileSize - sigSize;
 
     if( !Update.begin(updateSize, partition) ) {
         _LOG_A("ERROR Not enough space to begin OTA, partition size mismatch? Update failed!\n");
@@ -762,31 +1032,90 @@ bool forceUpdate(const char* firmwareURL, bool validate) {
         return false;
     }
 
-    Update.onProgress( [](uint32_t progress, uint32_t size) {
-      _LOG_V("Firmware update progress %i/%i.\n", progress, size);
-      //move this data to global var
-      downloadProgress = progress;
-      downloadSize = size;
-      //give background tasks some air
-      //vTaskDelay(100 / portTICK_PERIOD_MS);
-    });
-
-    // read signature
-    if( validate ) {
-        signature = (unsigned char *) malloc(SIGNATURE_LENGTH);                       //tried to free in in all exit scenarios, RISK of leakage!!!
-        stream->readBytes( signature, SIGNATURE_LENGTH );
+    uint8_t *buf = (uint8_t *) malloc(OTA_CHUNK_SIZE);
+    if( validate ) signature = (unsigned char *) malloc(SIGNATURE_LENGTH);  //tried to free in in all exit scenarios, RISK of leakage!!!
+    if( !buf || (validate && !signature) ) {
+        _LOG_A("malloc failed.\n");
+        Update.abort();
+        FREE(buf);
+        FREE(signature);
+        return false;
     }
+    mbedtls_md_context_t sha;
+    mbedtls_md_init( &sha );
+    mbedtls_md_setup( &sha, mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 ), 0 );
+    mbedtls_md_starts( &sha );
 
     _LOG_I("Begin %s OTA. This may take 2 - 5 mins to complete. Things might be quiet for a while.. Patience!\n", partition==U_FLASH?"Firmware":"Filesystem");
 
-    // Some activity may appear in the Serial monitor during the update (depends on Update.onProgress)
-    int written = Update.writeStream(*stream);                                 // although writeStream returns size_t, we don't expect >2Gb
+    int pos = 0;                                                            // bytes of the file we have
+    int skip = 0;                                                           // bytes to discard after a resume that was answered with the whole file
+    uint32_t received = 0;                                                  // bytes read from the network, for the throughput
+    uint32_t start = millis(), lastData = start;
+    bool ok = true;
+    downloadSize = updateSize;
+    downloadRate = 0;
+    downloadResumes = 0;
+    while( pos < fileSize ) {
+        WiFiClient *stream = httpClient.getStreamPtr();
+        int avail = stream ? stream->available() : 0;
+        if( avail > 0 ) {
+            int n = stream->readBytes( buf, min(avail, skip ? min(skip, OTA_CHUNK_SIZE) : min(fileSize - pos, OTA_CHUNK_SIZE)) );
+            received += n;
+            lastData = millis();
+            if( skip ) {
+                skip -= n;
+                continue;
+            }
+            int off = 0;
+            if( pos < sigSize ) {
+                off = min(n, sigSize - pos);
+                memcpy( signature + pos, buf, off );
+            }
+            if( n > off ) {
+                if( Update.write( buf + off, n - off ) != (size_t)(n - off) ) {
+                    _LOG_A("ERROR: Update has error:%s.\n", Update.errorString());
+                    ok = false;
+                    break;
+                }
+                mbedtls_md_update( &sha, buf + off, n - off );
+            }
+            pos += n;
+            if( pos > sigSize ) downloadProgress = pos - sigSize;
+            if( millis() - start >= 1000 ) downloadRate = (uint64_t) received * 1000 / (millis() - start);
+            continue;
+        }
+        if( httpClient.connected() && millis() - lastData < OTA_STALL_TIMEOUT ) {
+            vTaskDelay(1);                                                  // some network streams (e.g. Ethernet) can be laggy and need to 'breathe'
+            continue;
+        }
+        // connection dropped or stalled: continue where we are
+        if( !resumable || downloadResumes >= OTA_RESUME_RETRIES ) {
+            _LOG_A("Download interrupted at %d/%d bytes, giving up.\n", pos, fileSize);
+            ok = false;
+            break;
+        }
+        downloadResumes++;
+        _LOG_A("Download interrupted at %d/%d bytes, resuming (%d/%d).\n", pos, fileSize, downloadResumes, OTA_RESUME_RETRIES);
+        httpClient.end();
+        vTaskDelay( pdMS_TO_TICKS(1000 << downloadResumes) );              // 2, 4, 8.. s backoff
+        httpCode = ota_open( httpClient, firmwareURL, pos );
+        if( httpCode == HTTP_CODE_OK ) skip = pos;                          // range ignored, the file starts over
+        else if( httpCode == HTTP_CODE_PARTIAL_CONTENT ) skip = 0;
+        else _LOG_A("Resume failed, server responded with HTTP Status %i.\n", httpCode);
+        lastData = millis();
+    }
+    free( buf );
+    httpClient.end();
+
+    uint32_t elapsed = millis() - start;
+    _LOG_I("Downloaded %u bytes in %u.%03u s, %u bytes/s, %d resumes.\n", received, elapsed / 1000, elapsed % 1000,
+           elapsed ? (unsigned) ((uint64_t) received * 1000 / elapsed) : 0, downloadResumes);
 
-    if ( written == updateSize ) {
-        _LOG_D("Written : %d successfully", written);
-        updateSize = written; // flatten value to prevent overflow when checking signature
-    } else {
-        _LOG_A("Written only : %u/%u Premature end of stream?", written, updateSize);
+    unsigned char hash[32];
+    mbedtls_md_finish( &sha, hash );
+    mbedtls_md_free( &sha );
+    if( !ok ) {
         Update.abort();
         FREE(signature);
         return false;
@@ -804,9 +1133,6 @@ bool forceUpdate(const char* firmwareURL, bool validate) {
         //getPartition( partition ); // updated partition => '_target_partition' pointer
         const esp_partition_t* _target_partition = esp_ota_get_next_update_partition(NULL);
 
-        #define CHECK_SIG_ERROR_PARTITION_NOT_FOUND -1
-        #define CHECK_SIG_ERROR_VALIDATION_FAILED   -2
-
         if( !_target_partition ) {
             _LOG_A("Can't access partition #%d to check signature!", partition);
             FREE(signature);
@@ -828,7 +1154,7 @@ bool forceUpdate(const char* firmwareURL, bool validate) {
             // during signature validation (crash, oom, power failure).
         }
 
-        if( !validate_sig( _target_partition, signature, updateSize ) ) {
+        if( !verify_sig( hash, signature ) ) {
             FREE(signature);
             // erase partition
             esp_partition_erase_range( _target_partition, _target_partition->address, _target_partition->size );
@@ -949,13 +1275,27 @@ void setTimeZone(void * parameter) {
 }
 
 #ifndef SENSORBOX_VERSION
-std::array<mDNSServiceEntry, 8> mDNSServices = {};
-HTTPClient* homeWizardHttpClient=nullptr;
-bool homeWizardHttpClientInitialized = false;
+// The directory of discovered services. The discovery task merges each query into the
+// inactive copy and then flips mdnsActive, so readers never see a table that is being
+// written and no lock is needed. Entries are sorted by type and hostname, with the
+// range of every type kept in TypeFirst/TypeCount.
+struct mDNSDirectory {
+    mDNSServiceEntry Services[MDNS_SERVICES];
+    uint8_t Count;
+    uint8_t TypeFirst[EM_CUSTOM + 1];
+    uint8_t TypeCount[EM_CUSTOM + 1];
+};
+static mDNSDirectory mdnsDirectories[2] = {};
+static volatile uint8_t mdnsActive = 0;
 static bool mdnsDiscoveryInProgress = false;            // True when async mDNS task is running
-static bool mdnsDiscoveryHasRun = false;                // True after mDNS discovery has been executed for the current network state
-static unsigned long lastMdnsQueryTime = 0;             // Last time mDNS query was attempted
+static bool mdnsDiscoveryForeground = false;            // True when the LCD waits for the running discovery
+static unsigned long mdnsNextRefresh = 0;               // millis() the next background refresh is due
+static bool mdnsRefreshDue = true;                      // the first discovery runs as soon as the network is up
 static const unsigned long MDNS_RETRY_INTERVAL = 30000; // Retry mDNS discovery every 30 seconds if not found
+static const unsigned long MDNS_REFRESH_INTERVAL = 300000; // Look for new services every 5 minutes
+static const uint32_t MDNS_QUERY_TIME = 3000;           // ms the query collects answers
+static const uint32_t MDNS_TTL_MIN = 60;                // s, bounds for the TTL of a record
+static const uint32_t MDNS_TTL_MAX = 3600;
 
 struct MdnsServiceQuery {
     const char *service;
@@ -963,85 +1303,91 @@ struct MdnsServiceQuery {
 };
 
 static constexpr MdnsServiceQuery mdnsServiceQueries[] = {
-    {"hwenergy", "tcp"}, // HomeWizard Energy meters use this mDNS service
+    {"_hwenergy", "_tcp"}, // HomeWizard Energy meters use this mDNS service
     // Add more entries here when we support other meter brands or service types.
     // Each brand can advertise a different mDNS service/protocol pair.
-    // For each entry, a separate mDNS discovery will be performed and cached in mDNSServices.
+    // For each entry, a separate mDNS discovery will be performed and merged into the directory.
 };
 
-/**
- * @brief Add one discovered HomeWizard service to the cached mDNS table.
- */
-static bool appendDiscoveredService(const String &hostname, uint16_t port, const String &ip, uint8_t &serviceCount) {
-    if (serviceCount >= mDNSServices.size()) {
-        return false;
-    }
-
-    const String fullHostname = hostname + ".local" + (port != 80 ? ":" + String(port) : "");
-    mDNSServices[serviceCount].ServiceType = getmDNSServiceType(hostname);
-    mDNSServices[serviceCount].HostName = fullHostname;
-    serviceCount++;
-    return true;
+static inline const mDNSDirectory &activeDirectory() {
+    return mdnsDirectories[mdnsActive];
 }
 
 /**
- * @brief Clear the cached mDNS discovery table.
+ * @brief Request a discovery now: from the LCD menu (the menu waits for it), or after
+ *        getting an IP. The directory is kept; entries that are no longer announced
+ *        drop out when their TTL runs out.
  */
-void clearmDNSServices() {
-    for (auto &service : mDNSServices) {
-        service.ServiceType = 0;
-        service.HostName = "";
-    }
-    mdnsDiscoveryHasRun = false;
-    lastMdnsQueryTime = 0;
+void refreshmDNSServices(bool foreground) {
+    mdnsRefreshDue = true;
+    if (foreground) mdnsDiscoveryForeground = true;
 }
 
+/**
+ * @brief True while the LCD has to wait for a discovery: a forced one, or the first one.
+ *        Background refreshes keep showing the cached services.
+ */
 bool isMDNSDiscoveryInProgress(void) {
-    return mdnsDiscoveryInProgress;
+    return mdnsDiscoveryInProgress && mdnsDiscoveryForeground;
 }
 
 /**
  * @brief Count cached services matching a specific HomeWizard service type.
  */
 uint8_t getmDNSServiceCount(int type) {
-    uint8_t count = 0;
-    for (const auto &service : mDNSServices) {
-        if (!service.HostName.isEmpty() && service.ServiceType == type) {
-            count++;
-        }
+    if (type <= 0 || type > EM_CUSTOM) {
+        return 0;
     }
-    return count;
+    return activeDirectory().TypeCount[type];
 }
 /**
  * @brief Count all cached mDNS services.
  */
 uint8_t getmDNSServiceCount() {
-    uint8_t count = 0;
-    for (const auto &service : mDNSServices) {
-        if (!service.HostName.isEmpty()) {
-            count++;
-        }
-    }
-    return count;
+    return activeDirectory().Count;
 }
 
 /**
- * @brief Return a cached service by type, optional hostname pattern, and zero-based index.
+ * @brief Copy a cached service by type, optional hostname pattern, and zero-based index.
  */
-const mDNSServiceEntry *getmDNSServiceByIndex(int type, const String &hostnamePattern, uint8_t index, bool strict) {
+bool getmDNSServiceByIndex(int type, const String &hostnamePattern, uint8_t index, mDNSServiceEntry &service, bool strict) {
+    const mDNSDirectory &dir = activeDirectory();
     uint8_t currentIndex = 0;
-    for (const auto &service : mDNSServices) {
-        const bool patternMatches = hostnamePattern.isEmpty() || service.HostName.indexOf(hostnamePattern) >= 0;
-        if (service.ServiceType != 0 &&
-            (type == 0 || service.ServiceType == type) &&
-            (!strict || patternMatches)) {
+    for (uint8_t i = 0; i < dir.Count; i++) {
+        const mDNSServiceEntry &entry = dir.Services[i];
+        const bool patternMatches = hostnamePattern.isEmpty() || strstr(entry.HostName, hostnamePattern.c_str()) != nullptr;
+        if ((type == 0 || entry.ServiceType == type) && (!strict || patternMatches)) {
             if (currentIndex == index) {
-                return &service;
+                service = entry;
+                return true;
             }
             currentIndex++;
         }
     }
-    return nullptr;
+    return false;
+}
+
+/**
+ * @brief Look up the address of a discovered host, so a networked meter does not have to
+ *        resolve its .local name itself.
+ *
+ * @param host Hostname without port, e.g. "p1meter-123456.local"
+ * @param ip   IPv4 address in network order
+ * @return false if the host is not in the directory, or its record has expired
+ */
+bool getmDNSServiceAddress(const char *host, uint32_t &ip) {
+    const mDNSDirectory &dir = activeDirectory();
+    const size_t len = strlen(host);
+    for (uint8_t i = 0; i < dir.Count; i++) {
+        const mDNSServiceEntry &service = dir.Services[i];
+        if (strncasecmp(service.HostName, host, len) == 0 &&
+            (service.HostName[len] == '\0' || service.HostName[len] == ':') &&
+            service.IP && (long)(millis() - service.Expires) < 0) {
+            ip = service.IP;
+            return true;
+        }
+    }
+    return false;
 }
 
 /**
@@ -1112,106 +1458,159 @@ int getmDNSServiceType(const String &hostname) {
  * @brief Count cached services compatible with the selected meter type.
  */
 uint8_t getCompatiblemDNSServiceCount(uint8_t meterType) {
-    if (meterType == 0) {
+    if (meterType == 0 || meterType > EM_CUSTOM) {
         return 0;
     }
+    return activeDirectory().TypeCount[meterType];
+}
 
-    uint8_t count = 0;
-    for (const auto &service : mDNSServices) {
-        if (!service.HostName.isEmpty() && service.ServiceType == meterType) {
-            count++;
-        }
+/**
+ * @brief Copy the zero-based compatible service for a meter type.
+ */
+bool getCompatiblemDNSServiceByIndex(uint8_t meterType, uint8_t index, mDNSServiceEntry &service) {
+    if (meterType == 0 || meterType > EM_CUSTOM) {
+        return false;
     }
-    return count;
+    const mDNSDirectory &dir = activeDirectory();
+    if (index >= dir.TypeCount[meterType]) {
+        return false;
+    }
+    service = dir.Services[dir.TypeFirst[meterType] + index];
+    return true;
 }
 
+
 /**
- * @brief Return the zero-based compatible service for a meter type.
+ * @brief Merge the answers to one service query into the list of services.
+ *
+ * Known hosts get their address, port and expiry updated, new hosts are added. A record
+ * with TTL 0 is a goodbye: the host left the network. When the list is full, the entry
+ * that expires first makes room.
  */
-const mDNSServiceEntry *getCompatiblemDNSServiceByIndex(uint8_t meterType, uint8_t index) {
-    if (meterType == 0) {
-        return nullptr;
-    }
+static void mergeDiscoveredServices(std::vector<mDNSServiceEntry> &services, mdns_result_t *results, unsigned long now) {
+    for (mdns_result_t *r = results; r != nullptr; r = r->next) {
+        if (r->hostname == nullptr) continue;
+
+        mDNSServiceEntry entry = {};
+        int n = r->port != 80 ? snprintf(entry.HostName, sizeof(entry.HostName), "%s.local:%u", r->hostname, r->port)
+                              : snprintf(entry.HostName, sizeof(entry.HostName), "%s.local", r->hostname);
+        if (n < 0 || (size_t)n >= sizeof(entry.HostName)) continue;         // would not fit in Meter::DeviceHostName
+        entry.ServiceType = getmDNSServiceType(String(r->hostname));
+        entry.Port = r->port;
+        for (mdns_ip_addr_t *a = r->addr; a != nullptr; a = a->next) {
+            if (a->addr.type == ESP_IPADDR_TYPE_V4) {
+                entry.IP = a->addr.u_addr.ip4.addr;
+                break;
+            }
+        }
+        const uint32_t ttl = r->ttl ? constrain(r->ttl, MDNS_TTL_MIN, MDNS_TTL_MAX) : 0;
+        entry.Expires = now + ttl * 1000;
+        entry.Refresh = now + ttl * 800;                                    // query again at 80% of the TTL
 
-    uint8_t currentIndex = 0;
-    for (const auto &service : mDNSServices) {
-        if (!service.HostName.isEmpty() && service.ServiceType == meterType) {
-            if (currentIndex == index) {
-                return &service;
+        auto known = std::find_if(services.begin(), services.end(), [&entry](const mDNSServiceEntry &service) {
+            return strcmp(service.HostName, entry.HostName) == 0;
+        });
+        if (ttl == 0) {
+            if (known != services.end()) {
+                _LOG_A("mDNS service %s left the network\n", entry.HostName);
+                services.erase(known);
             }
-            currentIndex++;
+            continue;
+        }
+        if (known != services.end()) {
+            if (entry.IP == 0) entry.IP = known->IP;                        // no A record in this answer
+            *known = entry;
+            continue;
+        }
+        char ip[16];
+        mg_snprintf(ip, sizeof(ip), "%M", mg_print_ip4, &entry.IP);
+        _LOG_A("Discovered mDNS service: %s (%s)\n", entry.HostName, ip);
+        if (services.size() >= MDNS_SERVICES) {
+            auto first = std::min_element(services.begin(), services.end(), [](const mDNSServiceEntry &left, const mDNSServiceEntry &right) {
+                return (long)(left.Expires - right.Expires) < 0;
+            });
+            *first = entry;
+        } else {
+            services.push_back(entry);
         }
     }
-    return nullptr;
 }
 
-
 /**
- * @brief FreeRTOS task that performs mDNS discovery in the background.
+ * @brief FreeRTOS task that refreshes the mDNS directory in the background.
  * 
- * This task runs the blocking mDNS query without blocking the main loop.
+ * This task runs the blocking mDNS queries without blocking the main loop. The answers
+ * are merged into the current directory rather than replacing it, so the services stay
+ * available while a query runs, and a host that misses one answer is not lost.
  */
 void mdnsDiscoveryTask(void* parameter) {
-    _LOG_A("mDNS discovery task started\n");
+    _LOG_D("mDNS discovery task started\n");
 
-    bool serviceListReset = false;
-    uint8_t serviceCount = 0;
-    bool anyServicesFound = false;
-
-    struct DiscoveredService {
-        String hostname;
-        uint16_t port;
-        String ip;
-    };
+    const mDNSDirectory &current = activeDirectory();
+    unsigned long now = millis();
+    std::vector<mDNSServiceEntry> services;
+    services.reserve(MDNS_SERVICES);
+    for (uint8_t i = 0; i < current.Count; i++) {
+        if ((long)(now - current.Services[i].Expires) < 0) {
+            services.push_back(current.Services[i]);
+        } else {
+            _LOG_A("mDNS service %s expired\n", current.Services[i].HostName);
+        }
+    }
 
     for (const auto &query : mdnsServiceQueries) {
         // Search for services defined in the compile-time query list.
         // https://api-documentation.homewizard.com/docs/discovery/
-        const int n = MDNS.queryService(query.service, query.protocol);
-        if (n < 0) {
+        mdns_result_t *results = nullptr;
+        esp_err_t err = mdns_query_ptr(query.service, query.protocol, MDNS_QUERY_TIME, 20, &results);
+        if (err != ESP_OK) {
             _LOG_A("MDNS query failed for %s.%s.\n", query.service, query.protocol);
             continue;
         }
-        if (n == 0) {
-            _LOG_A("No MDNS services found for %s.%s.\n", query.service, query.protocol);
+        if (results == nullptr) {
+            _LOG_D("No MDNS services found for %s.%s.\n", query.service, query.protocol);
             continue;
         }
+        mergeDiscoveredServices(services, results, millis());
+        mdns_query_results_free(results);
+    }
 
-        std::vector<DiscoveredService> services;
-        services.reserve(n);
-        for (int i = 0; i < n; i++) {
-            services.push_back({MDNS.hostname(i), MDNS.port(i), MDNS.IP(i).toString()});
-        }
-
-        std::sort(services.begin(), services.end(), [](const DiscoveredService &left, const DiscoveredService &right) {
-            return left.hostname < right.hostname;
-        });
+    std::sort(services.begin(), services.end(), [](const mDNSServiceEntry &left, const mDNSServiceEntry &right) {
+        if (left.ServiceType != right.ServiceType) return left.ServiceType < right.ServiceType;
+        return strcmp(left.HostName, right.HostName) < 0;
+    });
 
-        if (!serviceListReset) {
-            clearmDNSServices();
-            serviceCount = 0;
-            serviceListReset = true;
+    mDNSDirectory &next = mdnsDirectories[mdnsActive ^ 1];
+    memset(&next, 0, sizeof(next));
+    for (const auto &service : services) {
+        if (service.ServiceType > 0 && service.ServiceType <= EM_CUSTOM) {
+            if (next.TypeCount[service.ServiceType]++ == 0) next.TypeFirst[service.ServiceType] = next.Count;
         }
+        next.Services[next.Count++] = service;
+    }
+    mdnsActive ^= 1;
 
-        for (const auto &service : services) {
-            _LOG_A("Discovered mDNS service: %s.local (%s:%d)\n", service.hostname.c_str(), service.ip.c_str(), service.port);
-            anyServicesFound = true;
-            appendDiscoveredService(service.hostname, service.port, service.ip, serviceCount);
-        }
+    // Query again before the first record expires, and every few minutes for new services
+    now = millis();
+    unsigned long wait = services.empty() ? MDNS_RETRY_INTERVAL : MDNS_REFRESH_INTERVAL;
+    for (const auto &service : services) {
+        long left = (long)(service.Refresh - now);
+        if (left < (long)MDNS_RETRY_INTERVAL) left = MDNS_RETRY_INTERVAL;
+        if ((unsigned long)left < wait) wait = left;
     }
+    mdnsNextRefresh = now + wait;
 
-    if (!anyServicesFound) {
+    if (services.empty()) {
         _LOG_A("No matching mDNS services found.\n");
     }
-
-    mdnsDiscoveryHasRun = true;
+    _LOG_D("mDNS discovery task completed, %u services, next refresh in %lu seconds\n", (unsigned)services.size(), wait / 1000);
+    mdnsDiscoveryForeground = false;
     mdnsDiscoveryInProgress = false;
-    _LOG_A("mDNS discovery task completed\n");
     vTaskDelete(NULL);
 }
 
 /**
- * @brief Starts async mDNS discovery for networked meters.
+ * @brief Starts an async refresh of the mDNS directory when one is due.
  *
  * This function uses mDNS to search for services advertising "_hwenergy._tcp" on the local network.
  * This function spawns a background task to perform the blocking mDNS query,
@@ -1224,17 +1623,17 @@ void discoverNetworkMeters() {
         return;
     }
 
-    // Rate limit discovery attempts
     unsigned long now = millis();
-    if (lastMdnsQueryTime != 0 && (now - lastMdnsQueryTime) < MDNS_RETRY_INTERVAL) {
-        // Still in cooldown period, skip mDNS query
+    if (!mdnsRefreshDue && (long)(now - mdnsNextRefresh) < 0) {
         return;
     }
-    lastMdnsQueryTime = now;
-    
+    mdnsRefreshDue = false;
+    mdnsNextRefresh = now + MDNS_RETRY_INTERVAL;                                // rate limit, also when the task can not be started
+    if (activeDirectory().Count == 0) mdnsDiscoveryForeground = true;
+
     // Start async mDNS discovery task
     mdnsDiscoveryInProgress = true;
-    _LOG_A("Starting async mDNS discovery (next retry in %lu seconds)...\n", MDNS_RETRY_INTERVAL / 1000);
+    _LOG_D("Starting async mDNS discovery...\n");
     
     // Create task with 4KB stack, priority 1 (low), running on any core
     BaseType_t result = xTaskCreate(
@@ -1249,123 +1648,12 @@ void discoverNetworkMeters() {
     if (result != pdPASS) {
         _LOG_A("Failed to create mDNS discovery task!\n");
         mdnsDiscoveryInProgress = false;
+        mdnsDiscoveryForeground = false;
     }
     
     return;
 }
 
-/**
- * @brief Retrieves active current values from a HomeWizard V1 API.
- *
- * This function sends an HTTP GET request to the specified URL to fetch the active current data
- * in JSON format, parses the JSON response, and retrieves specific fields for current.
- *
- * @return A pair containing:
- *     - A int flag indicating: 0: failure, 1: single phase current, 3: 3 phase current
- *     - An array of 6 values representing the active current in deci-amps for L1, L2, L3, total, import, and export
- */
-std::pair<int8_t, std::array<std::int32_t, 6> > getDataFromHomeWizard(const char *hostname) {
-    _LOG_A("Invocation\n");
-    if (hostname == nullptr || hostname[0] == '\0') {
-        _LOG_A("No hostname provided.\n");
-        return {false, {0, 0, 0, 0, 0, 0}};
-    }
-    char url[64];
-    snprintf(url, sizeof(url), "http://%s/api/v1/data", hostname);
-
-    _LOG_A("Connect to URL %s\n", url);
-
-
-    if (!homeWizardHttpClientInitialized) {
-        homeWizardHttpClient = new HTTPClient();
-        homeWizardHttpClient->setTimeout(1500);
-        homeWizardHttpClient->setReuse(true);  // Persistent TCP across polls.
-        homeWizardHttpClient->addHeader("User-Agent", "SmartEVSE-v3");
-        homeWizardHttpClient->addHeader("Accept", "application/json");
-        homeWizardHttpClientInitialized = true;
-    }
-
-    homeWizardHttpClient->begin(url);
-
-    // Handle HTTP errors or timeout.
-    const int httpCode = homeWizardHttpClient->GET();
-    if (httpCode != HTTP_CODE_OK) {
-        _LOG_A("Error on HTTP request (httpCode=%i), url=%s.\n", httpCode, url);
-        homeWizardHttpClient->end(); // Always cleanup
-        delete homeWizardHttpClient;
-        homeWizardHttpClient = nullptr;
-        homeWizardHttpClientInitialized = false;
-        return {false, {0, 0, 0, 0, 0, 0}};
-    }
-
-    // Get the response stream
-    WiFiClient *stream = homeWizardHttpClient->getStreamPtr();
-
-    const char* currentKeys[] = {"active_current_l1_a", "active_current_l2_a", "active_current_l3_a","active_current_a"};
-    const char* powerKeys[] = { "active_power_l1_w", "active_power_l2_w", "active_power_l3_w","active_power_w"};
-    const char* totalsKeys[] = {"total_power_import_kwh", "total_power_export_kwh"};
-
-    // Filter is constant; build it once and reuse forever.
-    static StaticJsonDocument<256> filter;
-    static bool filterInit = false;
-    if (!filterInit) {
-        for (const auto* key : currentKeys) filter[key] = true;
-        for (const auto* key : powerKeys)   filter[key] = true;
-        for (const auto* key : totalsKeys)  filter[key] = true;
-        filterInit = true;
-    }
-
-    // Stack-allocated JSON document for the parsed response.
-    StaticJsonDocument<512> doc;
-    const DeserializationError error = deserializeJson(doc, *stream, DeserializationOption::Filter(filter));
-    homeWizardHttpClient->end();
-
-    // Handle JSON parsing errors.
-    if (error) {
-        _LOG_A("JSON deserialization failed: %s\n", error.c_str());
-        return {false, {0, 0, 0, 0, 0, 0}};
-    }
-
-    uint8_t phases = 0;
-    // Verify all required keys exist.
-    for (const auto* key : currentKeys) {
-        if (doc.containsKey(key))
-            phases++;
-    }
-
-    if (!phases) {
-        // Early return on missing data.
-        _LOG_A("Required JSON fields 'active_current_a' not found\n");
-        return {phases, {0, 0, 0, 0, 0, 0}};
-    }
-
-    std::array<int32_t, 6> evdata{};
-    _LOG_A("Reading %u-phase data\n", phases);
-
-    // Determine grid direction based on power: negative indicates feed-in, positive indicates usage.
-    auto getCorrection = [&doc](const char* powerKey) -> int8_t {
-        return doc[powerKey].as<int>() < 0 ? -1 : 1;
-    };
-
-    if (phases == 1) {
-        // Single phase case: use 'active_current_a' and 'active_power_w' for correction
-        int16_t rawCurrent = doc[currentKeys[3]].as<float>() * 10;
-        int8_t correction = getCorrection(powerKeys[3]);
-        evdata[0] = std::abs(rawCurrent) * correction;
-    }
-    else{
-        // Process all three phases.
-        for (size_t i = 0; i < 3; ++i) {
-            int16_t rawCurrent = doc[currentKeys[i]].as<float>() * 10;
-            evdata[i] = std::abs(rawCurrent) * getCorrection(powerKeys[i]);
-        }
-    }
-    evdata[3] = doc[totalsKeys[0]].as<float>() * 1000; // total import in Wh
-    evdata[4] = doc[totalsKeys[1]].as<float>() * 1000; // total export in Wh
-    evdata[5] = doc[powerKeys[3]].as<float>() * 1; // total power in Watts
-
-return {phases, evdata};
-}
 #endif
 
 void webServerRequest::setMessage(struct mg_http_message *hm) {
@@ -1417,9 +1705,7 @@ static void fn_mqtt(struct mg_connection *c, int ev, void *ev_data) {
         // When we get echo response, print it
         struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
         _LOG_V("%lu RECEIVED %.*s <- %.*s\n", c->id, (int) mm->data.len, mm->data.buf, (int) mm->topic.len, mm->topic.buf);
-        //somehow topic is not null terminated
-        String topic2 = String(mm->topic.buf).substring(0,mm->topic.len);
-        mqtt_receive_callback(topic2, mm->data.buf);
+        mqtt_receive_callback(mm->topic, mm->data);
     } else if (ev == MG_EV_CLOSE) {
         _LOG_V("%lu CLOSED\n", c->id);
         MQTTclient.connected = false;
@@ -1614,20 +1900,47 @@ R"EOF(
 )EOF";
 
 
-// Maximum concurrent HTTP connections to prevent socket exhaustion
-#define MAX_HTTP_CONNECTIONS 8
-#define WS_CONNECTION_RESERVE 1
-
-// Count only accepted inbound server connections.
-// (This does not count listeners, outbound client connections,
-// or connections already closing, so the connection limit reflects actual
-// in-use HTTP/WebSocket server slots more accurately).
-static int countConnections(struct mg_mgr *mgr) {
-  int n = 0;
-  for (struct mg_connection *t = mgr->conns; t != NULL; t = t->next) {
-    if (t->is_accepted && !t->is_client && !t->is_listening && !t->is_closing) n++;
-  }
-  return n;
+// Serve the packed web assets (see packfs.py). The ETag mongoose sends is derived from
+// a content hash, so pages are revalidated (304 Not Modified when unchanged), while
+// the assets index.html references as <name>?v=<hash> are cached as immutable.
+// Brotli variants are used when the build packed them and the browser accepts br.
+static void serve_packed(struct mg_connection *c, struct mg_http_message *hm) {
+    httpMetricsStatic(c);
+    const char *cache = "Cache-Control: no-cache\r\n";
+    if (mg_match(hm->query, mg_str("v=*"), NULL))
+        cache = "Cache-Control: public, max-age=31536000, immutable\r\n";
+    else if (mg_match(hm->uri, mg_str("#.webp"), NULL) ||                      // Cache ".webp" or ".ico" image files for one year
+             mg_match(hm->uri, mg_str("#.ico"), NULL))
+        cache = "Cache-Control: public, max-age=31536000\r\n";
+
+    char headers[128];
+    struct mg_http_serve_opts opts = {.root_dir = "/data", .ssi_pattern = NULL, .extra_headers = headers, .mime_types = NULL, .page404 = NULL, .fs = &mg_fs_packed };
+
+    struct mg_str *ae = mg_http_get_header(hm, "Accept-Encoding");
+    if (ae != NULL && mg_match(*ae, mg_str("#br#"), NULL) && hm->uri.len > 0 && hm->uri.len < MG_PATH_MAX - 24) {
+        static const struct { const char *ext, *mime; } brTypes[] = {
+            { "html", "br=text/html; charset=utf-8" },
+            { "css",  "br=text/css; charset=utf-8" },
+            { "js",   "br=text/javascript; charset=utf-8" },
+        };
+        char path[MG_PATH_MAX];
+        bool dir = hm->uri.buf[hm->uri.len - 1] == '/';
+        mg_snprintf(path, sizeof(path), "/data%.*s%s", (int) hm->uri.len, hm->uri.buf, dir ? "index.html" : "");
+        const char *ext = strrchr(path, '.');
+        for (size_t i = 0; ext && i < sizeof(brTypes) / sizeof(brTypes[0]); i++) {
+            if (strcmp(ext + 1, brTypes[i].ext)) continue;
+            strcat(path, ".br");
+            if (mg_unpack(path, NULL, NULL) != NULL) {
+                opts.mime_types = brTypes[i].mime;
+                mg_snprintf(headers, sizeof(headers), "%sContent-Encoding: br\r\nVary: Accept-Encoding\r\n", cache);
+                mg_http_serve_file(c, hm, path, &opts);
+                return;
+            }
+            break;
+        }
+    }
+    mg_snprintf(headers, sizeof(headers), "%sVary: Accept-Encoding\r\n", cache);
+    mg_http_serve_dir(c, hm, &opts);
 }
 
 // Connection event handler function
@@ -1635,11 +1948,10 @@ static int countConnections(struct mg_mgr *mgr) {
 // We use the same event handler function for HTTP and HTTPS connections
 // fn_data is NULL for plain HTTP, and non-NULL for HTTPS
 static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
+  httpMetricsEvent(c, ev, ev_data);                                           // traffic counters and idle timeout
   if (ev == MG_EV_ACCEPT) {
     // Limit concurrent connections to prevent socket exhaustion
-    int nconns = countConnections(c->mgr);
-    if (nconns > (MAX_HTTP_CONNECTIONS + WS_CONNECTION_RESERVE)) {
-      _LOG_W("Too many connections (%d), rejecting new connection\n", nconns);
+    if (!httpMetricsAccept(c)) {
       c->is_closing = 1;  // Immediately close the connection
       return;
     }
@@ -1669,6 +1981,9 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
         }
     }
     if (wsLcdConnections.empty()) stopLCDImageTimer(c->mgr);
+#ifndef SENSORBOX_VERSION
+    ws_state_close(c);
+#endif
   } else if (ev == MG_EV_WS_OPEN) {
     // Websocket connection opened - check if it's for /ws/lcd endpoint
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
@@ -1694,6 +2009,7 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
     // Binary messages are ignored (only server sends binary BMP images)
   } else if (ev == MG_EV_HTTP_MSG) {  // New HTTP request received
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;            // Parsed HTTP request
+    HttpRequestTimer timer(c, hm);                                              // per route metrics, recorded on return
 
     // Check for websocket upgrade request for LCD image stream
     if (mg_match(hm->uri, mg_str("/ws/lcd"), NULL)) {
@@ -1701,13 +2017,7 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
         return;  // Don't process as regular HTTP
     }
 
-    const int nconns = countConnections(c->mgr);
-    if (nconns > MAX_HTTP_CONNECTIONS) {
-        mg_http_reply(c, 503, "Connection: close\r\nContent-Type: text/plain\r\n",
-                      "Server busy, retry shortly");
-        c->is_draining = 1;
-        return;
-    }
+    if (httpMetricsBusy(c)) return;                                             // over HttpMaxConnections, 503 sent
 
     static webServerRequest requestObj;  // Static to avoid heap allocation on every request
     webServerRequest* request = &requestObj;
@@ -1787,9 +2097,11 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
 #endif
                 RunFirmwareUpdate();
             }                                                                       // after the first call we just report progress
-            DynamicJsonDocument doc(64); // https://arduinojson.org/v6/assistant/
+            DynamicJsonDocument doc(96); // https://arduinojson.org/v6/assistant/
             doc["progress"] = downloadProgress;
             doc["size"] = downloadSize;
+            doc["rate"] = downloadRate;
+            doc["resumes"] = downloadResumes;
             String json;
             serializeJson(doc, json);
             mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\n", json.c_str());    // Yes. Respond JSON
@@ -1968,7 +2280,7 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
             }
 #endif
         } else if (mg_http_match_uri(hm, "/settings") && !memcmp("POST", hm->method.buf, hm->method.len)) {
-            DynamicJsonDocument doc(64);
+            DynamicJsonDocument doc(256);
 #if MQTT
             if (request->hasParam("mqtt_update") && request->getParam("mqtt_update")->value().toInt() == 1) {
 
@@ -2012,6 +2324,12 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
                     doc["mqtt_tls"] = MQTTtls;
                 }
 
+                if (request->hasParam("mqtt_telemetry")) {
+                    int t = request->getParam("mqtt_telemetry")->value().toInt();
+                    if (t >= MQTT_TELEMETRY_TOPICS && t <= MQTT_TELEMETRY_SNAPSHOT) MQTTtelemetry = t;
+                    doc["mqtt_telemetry"] = MQTTtelemetry;
+                }
+
                 if(request->hasParam("mqtt_ca_cert")) {
                     String cert = request->getParam("mqtt_ca_cert")->value();
                     writeMqttCaCert(cert);                      // Save to LittleFS
@@ -2031,31 +2349,44 @@ static void fn_http_server(struct mg_connection *c, int ev, void *ev_data) {
                     preferences.putString("MQTTHost", MQTTHost);
                     preferences.putUShort("MQTTPort", MQTTPort);
                     preferences.putBool("MQTTtls", MQTTtls);
+                    preferences.putUChar("MQTTtelemetry", MQTTtelemetry);
                     preferences.end();
                 }
             }
 #endif
+            if (request->hasParam("http_update") && request->getParam("http_update")->value().toInt() == 1) {
+                if (request->hasParam("http_max_connections")) {
+                    int n = request->getParam("http_max_connections")->value().toInt();
+                    HttpMaxConnections = constrain(n, 1, HTTP_MAX_CONNECTIONS_LIMIT);
+                    doc["http_max_connections"] = HttpMaxConnections;
+                }
+                if (request->hasParam("http_max_per_client")) {
+                    int n = request->getParam("http_max_per_client")->value().toInt();
+                    HttpMaxPerClient = constrain(n, 0, HTTP_MAX_CONNECTIONS_LIMIT);
+                    doc["http_max_per_client"] = HttpMaxPerClient;
+                }
+                if (request->hasParam("http_idle_timeout")) {
+                    int n = request->getParam("http_idle_timeout")->value().toInt();
+                    HttpIdleTimeout = constrain(n, 0, HTTP_IDLE_TIMEOUT_LIMIT);
+                    doc["http_idle_timeout"] = HttpIdleTimeout;
+                }
+                if (preferences.begin("settings", false) ) {
+                    preferences.putUChar("HttpMaxConns", HttpMaxConnections);
+                    preferences.putUChar("HttpMaxClient", HttpMaxPerClient);
+                    preferences.putUShort("HttpIdle", HttpIdleTimeout);
+                    preferences.end();
+                }
+            }
             String json;
             serializeJson(doc, json);
             mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s\r\n", json.c_str());    // Yes. Respond JSON
+        } else if (mg_http_match_uri(hm, "/metrics") && !memcmp("GET", hm->method.buf, hm->method.len)) {
+            httpMetricsReply(c);
         } else if (mg_http_match_uri(hm, "/mqtt_ca_cert") && !memcmp("GET", hm->method.buf, hm->method.len)) {
             String cert = readMqttCaCert();
             mg_http_reply(c, 200, "Content-Type: text/plain\r\n", "%s\r\n", cert.c_str());
         } else {                                                                    // if everything else fails, serve static page
-            // Cache ".webp" or ".ico" image files for one year without revalidation or server checks.
-            if (mg_match(hm->uri, mg_str("#.webp"), NULL) ||
-                mg_match(hm->uri, mg_str("#.ico"), NULL)) {
-                struct mg_http_serve_opts opts = {
-                    .root_dir = "/data", .ssi_pattern = NULL,
-                    .extra_headers = "Cache-Control: public, max-age=31536000\r\n",
-                    .mime_types = NULL, .page404 = NULL, .fs = &mg_fs_packed
-                };
-                mg_http_serve_dir(c, hm, &opts);
-            } else {
-                struct mg_http_serve_opts opts = {.root_dir = "/data", .ssi_pattern = NULL, .extra_headers = NULL, .mime_types = NULL, .page404 = NULL, .fs = &mg_fs_packed };
-                //opts.fs = NULL;
-                mg_http_serve_dir(c, hm, &opts);
-            }
+            serve_packed(c, hm);
         }
     } // handle_URI
     // request is static, no delete needed
@@ -2133,7 +2464,7 @@ static void startNetworkServices(void) {
 // Configure DNS, SNTP and mDNS when an interface gets an IP.
 // Can be called from both WiFi and Ethernet got-IP events.
 void onGotIP(const char *dns_ip) {
-    clearmDNSServices();
+    refreshmDNSServices(false);
 
     // Load DHCP DNS into mongoose
     static char dns4url[] = "udp://123.123.123.123:53";
@@ -2387,7 +2718,11 @@ void WiFiSetup(void) {
         MQTTHost = preferences.getString("MQTTHost", "");
         MQTTPort = preferences.getUShort("MQTTPort", 1883);
         MQTTtls = preferences.getBool("MQTTtls", false);
+        MQTTtelemetry = preferences.getUChar("MQTTtelemetry", MQTT_TELEMETRY_TOPICS);
 #endif //MQTT
+        HttpMaxConnections = preferences.getUChar("HttpMaxConns", HTTP_MAX_CONNECTIONS);
+        HttpMaxPerClient = preferences.getUChar("HttpMaxClient", HTTP_MAX_PER_CLIENT);
+        HttpIdleTimeout = preferences.getUShort("HttpIdle", HTTP_IDLE_TIMEOUT);
         preferences.end();
     }
 
@@ -2438,7 +2773,15 @@ void network_loop() {
 
     mg_mgr_poll(&mgr, 100);                                                     // TODO increase this parameter to up to 1000 to make loop() less greedy
 
-    if (NetworkConnected() && !mdnsDiscoveryHasRun &&
+#if MQTT
+    MQTTclient.discoveryLoop();                                                 // paced Home Assistant discovery
+    MQTTclient.flush();
+#endif
+#if MQTT && MQTT_ESP && SMARTEVSE_VERSION
+    MQTTclientSmartEVSE.flush();
+#endif
+
+    if (NetworkConnected() &&
             (MainsMeter.Type == EM_HOMEWIZARD ||
              EVMeter.Type == EM_HOMEWIZARD ||
              CircuitMeter.Type == EM_HOMEWIZARD)) {
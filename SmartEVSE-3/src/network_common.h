@@ -25,6 +25,7 @@
 
 #define __EVSE_NETWORK
 
+#include <Arduino.h>
 #include "main.h" //so SENSORBOX_VERSION is read in Sensorbox
 #include "mongoose.h"
 #include "ch390.h"
@@ -60,9 +61,96 @@ extern uint8_t lastMqttUpdate;
 extern bool MQTTtls;
 extern bool MQTTSmartServer;
 extern bool MQTTSmartServerChanged;        // Flag to trigger reconnect from network_loop()
+#define MQTT_TELEMETRY_TOPICS   0           // one topic per value (default)
+#define MQTT_TELEMETRY_BOTH     1           // per-value topics plus the /Telemetry document
+#define MQTT_TELEMETRY_SNAPSHOT 2           // only the /Telemetry document
+extern uint8_t MQTTtelemetry;
 extern bool WIFImodeChanged;               // Flag to trigger handleWIFImode() from network_loop()
 extern String MQTTprivatePassword;   
 
+#define MQTT_OUTBOX_MAX         48          // messages queued per MQTT client
+#define MQTT_OUTBOX_BYTES       12288       // message arena per MQTT client
+#define MQTT_OUTBOX_BLOCK       64          // arena allocation unit
+#define MQTT_OUTBOX_BLOCKS      (MQTT_OUTBOX_BYTES / MQTT_OUTBOX_BLOCK)
+#define MQTT_OUTBOX_BURST       8           // messages sent per network_loop()
+#define MQTT_OUTBOX_SOCKBUF     2048        // stop sending while this much is unsent on the socket (mongoose)
+                                            // or waiting in the esp-mqtt outbox
+
+// Bounded publish queue, drained from network_loop(). A message replaces a queued message
+// for the same topic (latest value wins). Retained and QoS>0 messages (state, discovery,
+// command results) are sent before plain measurements, and when the queue is full the
+// oldest measurement is dropped first. Messages live in a fixed arena of MQTT_OUTBOX_BLOCK
+// sized blocks, so queueing never touches the heap.
+class MQTToutbox_t {
+public:
+    struct Stats {
+        uint16_t depth, maxDepth;
+        uint32_t bytes, sent, dropped, coalesced;
+        uint32_t latencyAvgMs, latencyMaxMs;                // time from publish() until handed to the client
+    };
+    MQTToutbox_t() { lock = xSemaphoreCreateMutex(); }
+    bool push(const char *topic, const char *payload, size_t len, bool retained, int qos);
+    // hands up to MQTT_OUTBOX_BURST messages to send(), stops when it returns false (backpressure)
+    template<typename F> void flush(F send);
+    Stats stats(void);
+private:
+    struct Msg {
+        uint32_t seq, queued;
+        uint16_t len;
+        bool retained;
+        uint8_t qos;
+        uint8_t blocks;                                     // arena blocks taken
+        char *topic() { return (char *)(this + 1); }
+        char *payload() { return topic() + strlen(topic()) + 1; }
+    };
+    Msg *slot[MQTT_OUTBOX_MAX] = {};
+    uint32_t seq = 0, bytes = 0;
+    uint16_t depth = 0, maxDepth = 0;
+    uint32_t sent = 0, dropped = 0, coalesced = 0, latencyMax = 0;
+    uint64_t latencySum = 0;
+    SemaphoreHandle_t lock;
+    uint8_t arena[MQTT_OUTBOX_BYTES] __attribute__((aligned(4)));
+    uint32_t used[(MQTT_OUTBOX_BLOCKS + 31) / 32] = {};     // one bit per arena block
+    Msg *alloc(size_t len);                                 // call with lock held
+    void release(Msg *m);                                   // call with lock held
+    static size_t size(Msg *m) { return strlen(m->topic()) + m->len; }
+    static bool urgent(Msg *m) { return m->retained || m->qos; }
+    int find(const char *topic);
+    int next(void);
+    void remove(int i);
+};
+
+template<typename F> void MQTToutbox_t::flush(F send) {
+    for (int n = 0; n < MQTT_OUTBOX_BURST; n++) {
+        // detach the message, so send() is called without holding the lock
+        xSemaphoreTake(lock, portMAX_DELAY);
+        int i = next();
+        Msg *m = i < 0 ? nullptr : slot[i];
+        if (m) { slot[i] = nullptr; depth--; bytes -= size(m); }
+        xSemaphoreGive(lock);
+        if (!m) return;
+
+        bool ok = send(m->topic(), m->payload(), m->len, m->retained, m->qos);
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (ok) {
+            uint32_t latency = millis() - m->queued;
+            sent++;
+            latencySum += latency;
+            if (latency > latencyMax) latencyMax = latency;
+        } else if (find(m->topic()) < 0) {                      // put it back, unless a newer value was queued meanwhile
+            for (i = 0; i < MQTT_OUTBOX_MAX && slot[i]; i++);
+            if (i < MQTT_OUTBOX_MAX) { slot[i] = m; depth++; bytes += size(m); m = nullptr; }
+            else dropped++;
+        }
+        if (m) release(m);
+        xSemaphoreGive(lock);
+        if (!ok) return;
+    }
+}
+
+#define MQTT_DISCOVERY_MAX      96          // entities whose discovery config hash is remembered
+#define MQTT_DISCOVERY_BURST    4           // discovery configs published per network_loop(), whole sections are run
+
 class MQTTclient_t {
 #if MQTT_ESP == 0
 private:
@@ -96,16 +184,41 @@ public:
     String jsna(const String& key, T value) { return ", " + jsn(key, value); }
     void publish(const String &topic, const int32_t &payload, bool retained, int qos) { publish(topic, String(payload), retained, qos); };
     void publish(const String &topic, const String &payload, bool retained, int qos);
-    void publish(const char *topic, const char *payload, size_t payload_len, bool retained, int qos);
+    bool publish(const char *topic, const char *payload, size_t payload_len, bool retained, int qos);   // false if dropped
     void subscribe(const String &topic, int qos);
+    void unsubscribe(const String &topic);
     void announce(const String& entity_name, const String& domain, const String& optional_payload);
     void announce(const char *entity_name, const char *domain, const char *optional_payload);
+    void discoveryStart(bool (*announcer)(uint8_t section), bool force = false);
+    void discoveryLoop(void);
+    void flush(void);                               // send queued messages, called from network_loop()
+    MQTToutbox_t outbox;
     bool connected;
+private:
+    bool send(const char *topic, const char *payload, size_t payload_len, bool retained, int qos);
+    // Home Assistant discovery: hashes of the last published config per entity, kept in NVS,
+    // so a reconnect only republishes new or changed entities, MQTT_DISCOVERY_BURST per loop.
+    struct DiscoveryHash { uint32_t topic; uint32_t config; };
+    DiscoveryHash discHash[MQTT_DISCOVERY_MAX];
+    uint8_t discCount = 0;
+    bool discLoaded = false, discDirty = false;
+    uint32_t discContext = 0;                       // hash of the broker address the hashes belong to
+    bool (*discAnnouncer)(uint8_t) = nullptr;       // set while a discovery pass is running
+    uint8_t discSection = 0;                        // next announcer section to run
+    uint16_t discEntities = 0;                      // entities handled in this pass
+    // discoveryStart() is called from the MQTT task; the pass itself only runs in network_loop()
+    portMUX_TYPE discMux = portMUX_INITIALIZER_UNLOCKED;
+    bool (*discRequest)(uint8_t) = nullptr;
+    bool discRequestForce = false;
+    void discoveryBegin(bool (*announcer)(uint8_t), bool force);
+    bool discoveryChanged(const char *topic, const char *payload, size_t len);
+    void discoverySent(const char *topic, const char *payload, size_t len);
 };
 
 extern MQTTclient_t MQTTclient;
 extern void SetupMQTTClient();
-extern void mqtt_receive_callback(const String topic, const String payload);
+extern void mqttCacheInvalidate();
+extern void mqtt_receive_callback(struct mg_str topic, struct mg_str payload);
 extern String readMqttCaCert();
 extern void writeMqttCaCert(const String& cert);
 extern const char* root_ca_letsencrypt;
@@ -116,7 +229,10 @@ public:
     void connect(void);
     void disconnect(void);
     void publish(const String &topic, const String &payload, bool retained, int qos);
+    bool publish(const char *topic, const char *payload, size_t payload_len, bool retained, int qos);   // false if dropped
     void subscribe(const String &topic, int qos);
+    void flush(void);                               // send queued messages, called from network_loop()
+    MQTToutbox_t outbox;
     bool connected = false;
 #if MQTT_ESP == 1
     esp_mqtt_client_handle_t client = nullptr;
@@ -126,7 +242,7 @@ private:
 };
 extern MQTTclientSmartEVSE_t MQTTclientSmartEVSE;
 extern String MQTTSmartEVSEprefix;              // Shared prefix for all SmartEVSE MQTT operations
-extern void mqttSmartEVSEPublishData();
+extern void mqttSmartEVSEPublishData(bool full = false);
 extern void SetupMQTTClientSmartEVSE();
 #endif //MQTT
 
@@ -161,27 +277,31 @@ extern bool getLatestVersion(String owner_repo, String asset_name, char *version
 extern bool NetworkConnected(void);                                             // true if WiFi or Ethernet has IP
 extern void onGotIP(const char *dns_ip);                                        // shared IP-acquired handler
 #ifndef SENSORBOX_VERSION
+#define MDNS_SERVICES 8                                                         // Allow discovery of up to 8 mDNS services for now
+                                                                                // if there is a use case for more we can always increase this
 struct mDNSServiceEntry {
     int ServiceType;
-    String HostName;
+    char HostName[32];                                                          // "p1meter-123456.local", ":port" appended when not 80
+    uint32_t IP;                                                                // IPv4 address, network order, 0 = unknown
+    uint16_t Port;
+    unsigned long Expires;                                                      // millis() the TTL of the record runs out
+    unsigned long Refresh;                                                      // millis() the record should be queried again
 };
-
-extern std::pair<int8_t, std::array<std::int32_t, 6>> getDataFromHomeWizard(const char *hostname);
-extern std::array<mDNSServiceEntry, 8> mDNSServices;                            // Allow discovery of up to 8 mDNS services for now
-                                                                                // if there is a use case for more we can always increase this
 #endif
 
 extern bool isMDNSDiscoveryInProgress(void);
 extern void discoverNetworkMeters();
 extern void compileServiceName(int type, const char *hostname, char *output, size_t outputSize);
-extern void clearmDNSServices();
+extern void refreshmDNSServices(bool foreground = true);
 extern uint8_t getmDNSServiceCount(int type);
 extern uint8_t getmDNSServiceCount();
 extern uint8_t getCompatiblemDNSServiceCount(uint8_t meterType);
-extern const mDNSServiceEntry *getmDNSServiceByIndex(int type, uint8_t index);
-extern const mDNSServiceEntry *getmDNSServiceByIndex(int type, const String &hostnamePattern, uint8_t index, bool strict = false);
-extern const mDNSServiceEntry *getCompatiblemDNSServiceByIndex(uint8_t meterType, uint8_t index);
+// The lookups copy the entry into service: the directory is double buffered, and a later
+// refresh overwrites the table the entry came from. They return false when there is no such entry.
+extern bool getmDNSServiceByIndex(int type, const String &hostnamePattern, uint8_t index, mDNSServiceEntry &service, bool strict = false);
+extern bool getCompatiblemDNSServiceByIndex(uint8_t meterType, uint8_t index, mDNSServiceEntry &service);
 extern int getmDNSServiceType(const String &hostname);
+extern bool getmDNSServiceAddress(const char *host, uint32_t &ip);
 
 #define FW_DOWNLOAD_PATH "http://smartevse-3.s3.eu-west-2.amazonaws.com"
 
@@ -0,0 +1,132 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#include "site.h"
+
+#ifdef ESP32
+#include "freertos/FreeRTOS.h"
+static portMUX_TYPE siteMux = portMUX_INITIALIZER_UNLOCKED;
+#define SITE_LOCK()     portENTER_CRITICAL(&siteMux)
+#define SITE_UNLOCK()   portEXIT_CRITICAL(&siteMux)
+#else
+#define SITE_LOCK()
+#define SITE_UNLOCK()
+#endif
+
+SiteCoordinator SiteGroups;
+SiteAllotment SiteAllotted;
+
+/**
+ * Store the demand of a group, a new group is added at the end
+ *
+ * @param uint32_t Id: serial number of the group Master
+ * @param uint16_t Min: dA per phase to keep its charging EVs at MinCurrent
+ * @param uint16_t Max: dA per phase it can use
+ * @param uint32_t Now: ms
+ */
+void SiteCoordinator::demand(uint32_t Id, uint16_t Min, uint16_t Max, uint32_t Now) {
+    uint8_t i;
+
+    SITE_LOCK();
+    for (i = 0; i < Groups && List[i].Id != Id; i++);
+    if (i == Groups) {
+        if (Groups == SITE_GROUPS_MAX) {
+            SITE_UNLOCK();
+            return;
+        }
+        Groups++;
+        List[i].Id = Id;
+        List[i].Allotment = 0;
+    }
+    List[i].Min = Min;
+    List[i].Max = Max < Min ? Min : Max;
+    List[i].LastSeen = Now;
+    SITE_UNLOCK();
+}
+
+/**
+ * Divide the site current over the groups
+ *
+ * @param uint16_t Budget: site current (dA per phase)
+ * @param uint32_t Now: ms
+ */
+void SiteCoordinator::divide(uint16_t Budget, uint32_t Now) {
+    uint8_t i, n = 0, Open;
+    int Left = Budget;
+
+    SITE_LOCK();
+    for (i = 0; i < Groups; i++) {                                          // drop the groups we no longer hear from
+        if (Now - List[i].LastSeen < SITE_TIMEOUT) List[n++] = List[i];
+    }
+    Groups = n;
+
+    for (i = 0; i < Groups; i++) {
+        List[i].Allotment = Left < List[i].Min ? Left : List[i].Min;
+        Left -= List[i].Allotment;
+    }
+
+    // Share the rest equally, groups that reach their Max leave the rest to the others
+    do {
+        Open = 0;
+        for (i = 0; i < Groups; i++) if (List[i].Allotment < List[i].Max) Open++;
+        if (!Open || Left < Open) break;
+        int Share = Left / Open;
+        for (i = 0; i < Groups; i++) if (List[i].Allotment < List[i].Max) {
+            int Add = List[i].Max - List[i].Allotment;
+            if (Add > Share) Add = Share;
+            List[i].Allotment += Add;
+            Left -= Add;
+        }
+    } while (Left > 0);
+    SITE_UNLOCK();
+}
+
+uint8_t SiteCoordinator::copy(Group *Out) const {
+    SITE_LOCK();
+    uint8_t n = Groups;
+    for (uint8_t i = 0; i < n; i++) Out[i] = List[i];
+    SITE_UNLOCK();
+    return n;
+}
+
+void SiteAllotment::set(uint16_t Allotment, uint32_t Now) {
+    SITE_LOCK();
+    Current = Allotment;
+    Received = Now;
+    Valid = true;
+    SITE_UNLOCK();
+}
+
+bool SiteAllotment::active(uint32_t Now) const {
+    SITE_LOCK();
+    bool ret = Valid && Now - Received < SITE_TIMEOUT;
+    SITE_UNLOCK();
+    return ret;
+}
+
+uint16_t SiteAllotment::limit(uint16_t Fallback, uint32_t Now) const {
+    SITE_LOCK();
+    uint16_t ret = Valid && Now - Received < SITE_TIMEOUT ? Current : Fallback;
+    SITE_UNLOCK();
+    return ret;
+}
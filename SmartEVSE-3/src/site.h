@@ -0,0 +1,78 @@
+/*
+;    Project: Smart EVSE v3
+;
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in
+; all copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+; THE SOFTWARE.
+ */
+
+#ifndef __EVSE_SITE
+
+#define __EVSE_SITE
+
+#include <stdint.h>
+
+// Site balancing: several Masters (groups) behind one grid connection share the site current.
+// Every group sends its demand to the coordinator, which divides the site current and sends back the allotments.
+#define SITE_TOPIC                  "SmartEVSE/Site"                        // MQTT topics: SITE_TOPIC/Demand/<serialnr> and SITE_TOPIC/Allotment/<serialnr>
+#define SITE_GROUPS_MAX             16
+#define SITE_TIMEOUT                10000                                   // ms without demand before a group is dropped, or without allotment before the fallback is used
+
+enum SiteRole_t { SITE_OFF, SITE_GROUP, SITE_COORDINATOR };
+
+// Divides the site current (dA per phase) over the groups: every group first gets its Min, the current
+// its charging EVs need at MinCurrent, then the rest is shared equally, up to the Max of each group.
+// Groups that do not fit their Min get what is left, they will stop charging.
+// demand() is called from the MQTT task and divide() from Timer1S, so the list is only used under the site lock.
+class SiteCoordinator {
+  public:
+    struct Group {
+        uint32_t Id;                                                        // serial number of the group Master
+        uint16_t Min, Max;                                                  // dA per phase
+        uint16_t Allotment;                                                 // dA per phase
+        uint32_t LastSeen;
+    };
+
+    SiteCoordinator() : Groups(0) {}
+    void demand(uint32_t Id, uint16_t Min, uint16_t Max, uint32_t Now);
+    void divide(uint16_t Budget, uint32_t Now);                             // drops silent groups, sets all Allotments
+    uint8_t copy(Group *Out) const;                                         // Out holds SITE_GROUPS_MAX, returns the number of groups
+
+  private:
+    Group List[SITE_GROUPS_MAX];                                            // in order of arrival, older groups get their Min first
+    uint8_t Groups;
+};
+
+// The allotment of this group, the fallback is used when the coordinator is silent
+class SiteAllotment {
+  public:
+    SiteAllotment() : Current(0), Received(0), Valid(false) {}
+    void set(uint16_t Allotment, uint32_t Now);                             // MQTT task
+    bool active(uint32_t Now) const;
+    uint16_t limit(uint16_t Fallback, uint32_t Now) const;                  // dA
+
+  private:
+    uint16_t Current;
+    uint32_t Received;
+    bool Valid;
+};
+
+extern SiteCoordinator SiteGroups;
+extern SiteAllotment SiteAllotted;
+
+#endif
@@ -42,6 +42,16 @@ uint8_t crc8(uint8_t *buf, uint8_t len) {
     return crc;
 }
 
+/* fnv1a: 32 bit FNV-1a hash, used to detect changed MQTT payloads.
+           Pass the previous result as hash to continue over more data.
+ */
+uint32_t fnv1a(const void *buf, size_t len, uint32_t hash) {
+    const uint8_t *p = (const uint8_t *)buf;
+
+    while (len--) hash = (hash ^ *p++) * 16777619u;
+    return hash;
+}
+
 
 
 /* triwave8: triangle (sawtooth) wave generator.  Useful for
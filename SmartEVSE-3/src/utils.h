@@ -29,6 +29,7 @@
 
 extern unsigned long pow_10[10];
 unsigned char crc8(unsigned char *buf, unsigned char len);
+uint32_t fnv1a(const void *buf, size_t len, uint32_t hash = 2166136261u);
 uint8_t triwave8(uint8_t in);
 uint8_t scale8(uint8_t i, uint8_t scale);
 uint8_t ease8InOutQuad(uint8_t i);
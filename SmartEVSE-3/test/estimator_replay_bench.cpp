@@ -0,0 +1,151 @@
+/*
+ * Host replay benchmark of the mains current prediction (src/estimator.cpp)
+ *
+ * Replays baseload steps against one 3-phase EVSE and runs the Smart and Solar
+ * mode corrections of CalcBalancedCurrent() on either the measured mains current
+ * (the old behaviour) or the MainsPrediction estimate, the latter also with an
+ * EV meter that measures the charge current. For every load step it
+ * reports the time until the EV draws the charge current the balancer settles on,
+ * and the worst overshoot of the mains current above MaxMains (Smart) or of the
+ * grid import above ImportCurrent (Solar).
+ *
+ * From the SmartEVSE-3/test directory:
+ *
+ *   g++ -std=gnu++11 -O2 -Wall -I../src -o /tmp/estimator_replay_bench estimator_replay_bench.cpp ../src/estimator.cpp
+ *   /tmp/estimator_replay_bench
+ *
+ * Set V=1 in the environment to print every control cycle.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <deque>
+#include <initializer_list>
+#include <random>
+#include <utility>
+
+#include "estimator.h"
+
+#define MODE_SMART      1
+#define MODE_SOLAR      2
+
+#define CYCLE           2000                                                    // ms between meter readings and CalcBalancedCurrent()
+#define EV_DELAY        3000                                                    // ms before the EV draws a new charge current
+#define SEGMENT         120000                                                  // ms of every baseload step
+#define MAX_MAINS       250                                                     // dA
+#define IMPORT_CURRENT  0                                                       // dA
+#define MIN_CURRENT     60                                                      // dA
+#define MAX_CURRENT     320                                                     // dA
+
+struct Result {
+    double Settle;                                                              // s, worst over the load steps
+    double Overshoot;                                                           // A
+};
+
+// Charge current the EV draws, it follows every command after EV_DELAY
+struct EV {
+    std::deque<std::pair<uint32_t, int>> Pending;                               // time the EV follows, charge current
+    int Draw = MIN_CURRENT;
+
+    void command(int Current, uint32_t Now) {
+        Pending.push_back(std::make_pair(Now + EV_DELAY, Current));
+    }
+    int current(uint32_t Now) {
+        while (!Pending.empty() && Pending.front().first <= Now) {
+            Draw = Pending.front().second;
+            Pending.pop_front();
+        }
+        return Draw;
+    }
+};
+
+static Result run(uint8_t Mode, bool Prediction, bool Metered, int Noise) {
+    // Smart: household load per phase. Solar: solar surplus is negative
+    static const int SmartBase[] = {50, 150, 30, 180, 80};
+    static const int SolarBase[] = {-120, -200, -90, -250, -150};
+    const int *Base = Mode == MODE_SMART ? SmartBase : SolarBase;
+    std::mt19937 rng(1);
+    std::normal_distribution<double> nd(0, Noise ? Noise : 1);
+    MainsEstimator Estimator;
+    EV Car;
+    int IsetBalanced = MIN_CURRENT;
+    Result result = {0, 0};
+
+    for (int seg = 0; seg < 5; seg++) {
+        double settled = -1;
+        int target;
+        if (Mode == MODE_SMART) target = std::min(MAX_CURRENT, MAX_MAINS - Base[seg]);
+        else target = std::min(MAX_CURRENT, std::max(MIN_CURRENT, (3 * IMPORT_CURRENT - 3 * Base[seg]) / 3));
+
+        for (uint32_t t = 0; t < SEGMENT; t += CYCLE) {
+            uint32_t now = seg * SEGMENT + t + 1;
+            int draw = Car.current(now);
+            int16_t Irms[3];
+            for (int x = 0; x < 3; x++) Irms[x] = Base[seg] + draw + (Noise ? (int)nd(rng) : 0);
+            int Imax = std::max({Irms[0], Irms[1], Irms[2]});
+            int Isum = Irms[0] + Irms[1] + Irms[2];
+
+            if (t >= 3 * CYCLE) {                                               // the first cycles after a step are out of our hands
+                double over = Mode == MODE_SMART ? (Imax - MAX_MAINS) / 10.0 : (Isum - 10 * IMPORT_CURRENT) / 10.0;
+                result.Overshoot = std::max(result.Overshoot, over);
+            }
+
+            int16_t EVCurrent[3] = {(int16_t)draw, (int16_t)draw, (int16_t)draw};
+            Estimator.sample(Irms, now, Metered ? EVCurrent : NULL);
+            bool Predicted = Prediction && Estimator.ready(now);
+            int MainsImax = Predicted ? Estimator.predictMax(now) : Imax;
+            int MainsIsum = Predicted ? Estimator.predictSum(now) : Isum;
+
+            // CalcBalancedCurrent(), one EVSE charging on 3 phases
+            int Idifference = MAX_MAINS - MainsImax;
+            if (Idifference > 0) {
+                if (Mode == MODE_SMART) {
+                    if (Predicted) IsetBalanced += Idifference;
+                    else IsetBalanced += Idifference / 4;
+                }
+            } else IsetBalanced += Idifference;
+            if (Mode == MODE_SOLAR && Idifference > 0) {
+                int IsumImport = MainsIsum - 10 * IMPORT_CURRENT;
+                if (Predicted) {
+                    if (IsumImport < -3 || IsumImport > 3)
+                        IsetBalanced = IsetBalanced - std::max(IsumImport / 3, -Idifference);
+                } else if (IsumImport < 0) {
+                    if (IsumImport < -10 && Idifference > 10) IsetBalanced += 5;
+                    else IsetBalanced += 1;
+                } else {
+                    if (IsumImport > 20) IsetBalanced -= IsumImport / 2;
+                    else if (IsumImport > 10) IsetBalanced -= 5;
+                    else if (IsumImport > 3) IsetBalanced -= 1;
+                }
+            }
+            IsetBalanced = std::max(MIN_CURRENT, std::min(MAX_CURRENT, IsetBalanced));
+
+            int16_t PhaseCurrent[3] = {(int16_t)IsetBalanced, (int16_t)IsetBalanced, (int16_t)IsetBalanced};
+            Estimator.command(PhaseCurrent, now);
+            Car.command(IsetBalanced, now);
+
+            if (getenv("V")) printf("  t=%6u Imax=%4d Isum=%4d predicted=%d Iset=%3d EV=%3d\n", now, Imax, Isum, Predicted, IsetBalanced, draw);
+            if (abs(Car.current(now) - target) <= std::max(10, 3 * Noise)) {
+                if (settled < 0) settled = t / 1000.0;
+            } else settled = -1;
+        }
+        if (seg) result.Settle = std::max(result.Settle, settled < 0 ? SEGMENT / 1000.0 : settled);
+    }
+    return result;
+}
+
+int main() {
+    for (uint8_t Mode : {MODE_SMART, MODE_SOLAR}) {
+        for (int Noise : {0, 3, 8}) {                                            // dA of meter noise
+            Result measured = run(Mode, false, false, Noise);
+            Result predicted = run(Mode, true, false, Noise);
+            Result metered = run(Mode, true, true, Noise);
+            printf("%s noise %.1f A: settling %5.1f s -> %5.1f s (EV meter %5.1f s), overshoot %4.1f A -> %4.1f A (EV meter %4.1f A)\n",
+                   Mode == MODE_SMART ? "Smart" : "Solar", Noise / 10.0, measured.Settle, predicted.Settle, metered.Settle,
+                   measured.Overshoot, predicted.Overshoot, metered.Overshoot);
+        }
+    }
+    return 0;
+}
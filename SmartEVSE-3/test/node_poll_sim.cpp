@@ -0,0 +1,90 @@
+/*
+ * Host simulation of the Master's Node status schedule (selectNodeBatch() in src/main.cpp)
+ *
+ * For one NR_EVSES it prints the Modbus cycle time at 9600 baud when every Node is
+ * read each cycle and with the batched schedule, and the longest interval between two
+ * status reads of a Node. It also checks that no kWh meter address the menus allow
+ * (MIN_METER_ADDRESS - MAX_METER_ADDRESS) is the address of a Node.
+ *
+ * selectNodeBatch() and the address settings are taken from the sources. From the
+ * SmartEVSE-3/test directory:
+ *
+ *   { sed -n -e '/^#define MIN_METER_ADDRESS/,/^#define MAX_METER_ADDRESS/p' \
+ *            -e '/^#define NODE_ADDRESS_EXT/,/^#define NODE_POLL_BATCH/p' ../src/main.h;
+ *     sed -n '/^inline uint8_t NodeAddress/,/^}/p;/^inline uint8_t AddressNode/,/^}/p' ../src/modbus.h;
+ *     sed -n '/^static uint8_t selectNodeBatch/,/^}/p' ../src/main.cpp;
+ *   } > /tmp/node_poll.inc
+ *   for n in 8 16 24 32 64; do
+ *     g++ -std=gnu++11 -O2 -Wall -I/tmp -DNR_EVSES=$n -o /tmp/node_poll_sim node_poll_sim.cpp && /tmp/node_poll_sim
+ *   done
+ */
+
+#include <cstdint>
+#include <cstdio>
+
+#define _LOG_D(...)
+
+struct Node_t {
+    bool Online;
+};
+static Node_t Node[NR_EVSES];
+
+#include "node_poll.inc"
+
+#define BAUD            9600
+#define QUIET_TIME      50                                                      // ms of silence after every frame
+#define CYCLE           2000                                                    // ms, Timer1S restarts ModbusRequestLoop()
+#define CYCLES          200
+
+static double tx(int bytes) { return bytes * 11000.0 / BAUD; }                 // ms, 8N1 plus a stop bit margin
+static double request(int req, int resp) { return tx(req) + QUIET_TIME + tx(resp) + QUIET_TIME; }
+
+int main() {
+    int errors = 0;
+
+    for (int a = MIN_METER_ADDRESS; a <= MAX_METER_ADDRESS; a++) {
+        if (AddressNode(a)) {
+            printf("NR_EVSES %d: meter address %d is Node %d\n", NR_EVSES, a, AddressNode(a));
+            errors++;
+        }
+    }
+    for (uint8_t n = 1; n < NR_EVSES; n++) {
+        if (AddressNode(NodeAddress(n)) != n) {
+            printf("NR_EVSES %d: Node %u address 0x%02x maps back to Node %u\n", NR_EVSES, n, NodeAddress(n), AddressNode(NodeAddress(n)));
+            errors++;
+        }
+    }
+
+    // Mains meter, EV meter energy and current, the current broadcasts, then the Node status reads
+    double fixed = request(8, 5 + 2 * 8) + request(8, 5 + 4) + request(8, 5 + 12)
+                   + tx(9 + 22) + QUIET_TIME + (NR_EVSES > 8 ? tx(9 + 2 * (NR_EVSES - 8)) + QUIET_TIME : 0);
+    double status = request(8, 5 + 18);
+    int polls = NR_EVSES - 1 < NODE_POLL_BATCH ? NR_EVSES - 1 : NODE_POLL_BATCH;
+    double all = fixed + (NR_EVSES - 1) * status;
+    double batched = fixed + polls * status;
+
+    int last[NR_EVSES], maxgap = 0;
+    for (int n = 0; n < NR_EVSES; n++) {
+        Node[n].Online = true;
+        last[n] = -1;
+    }
+    for (int c = 0; c < CYCLES; c++) {
+        uint8_t Batch[NODE_POLL_BATCH];
+        uint8_t count = selectNodeBatch(Batch);
+        for (int i = 0; i < count; i++) {
+            if (last[Batch[i]] >= 0 && c - last[Batch[i]] > maxgap) maxgap = c - last[Batch[i]];
+            last[Batch[i]] = c;
+        }
+    }
+    for (int n = 1; n < NR_EVSES; n++) {
+        if (last[n] < 0) {
+            printf("NR_EVSES %d: Node %d is never read\n", NR_EVSES, n);
+            errors++;
+        }
+    }
+
+    printf("%2d EVSEs: all Nodes %5.0f ms%s, batched %5.0f ms%s, max %2d s between status reads, meter addresses %d-%d\n",
+           NR_EVSES, all, all > CYCLE ? " (too slow)" : "", batched, batched > CYCLE ? " (too slow)" : "",
+           maxgap * CYCLE / 1000, MIN_METER_ADDRESS, MAX_METER_ADDRESS);
+    return errors ? 1 : 0;
+}
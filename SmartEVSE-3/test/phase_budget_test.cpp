@@ -0,0 +1,107 @@
+/*
+ * Host test of the per phase balancing against the summed limits (src/main.cpp)
+ *
+ * Single phase EVSEs on lightly loaded phases get the Extra headroom of their phase on top of
+ * IsetBalanced. MaxSumMains (capacity tariff) and the GridRelay limit (§14a) are sums over the
+ * phases, so LimitPhaseExtra() must keep the total within them. This runs the Smart mode loop
+ * of CalcBalancedCurrent() until it settles, with EVs that follow the charge current at once,
+ * and fails when a limit is exceeded.
+ *
+ * LimitPhaseExtra() and PhaseShare() are taken from the sources. From the SmartEVSE-3/test directory:
+ *
+ *   sed -n '/^static int PhaseShare/,/^}/p;/^static void LimitPhaseExtra/,/^}/p' ../src/main.cpp > /tmp/phase_budget.inc
+ *   g++ -std=gnu++11 -O2 -Wall -I/tmp -o /tmp/phase_budget_test phase_budget_test.cpp && /tmp/phase_budget_test
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#include "phase_budget.inc"
+
+#define CYCLES          30
+
+struct Case {
+    const char *Name;
+    int MaxMains, MaxSumMains, GridRelay;                                       // A, 0 = not set
+    int Base[3];                                                                // dA per phase
+    uint8_t Mask[2];                                                            // phases of the two EVs
+    int BalancedMax;                                                            // dA
+};
+
+static int run(const Case &c) {
+    int Balanced[2] = {60, 60}, IsetBalanced = 60, Isum = 0, Imax = 0, Draw = 0;
+    uint8_t n, p;
+
+    for (int cycle = 0; cycle < CYCLES; cycle++) {
+        int Irms[3], Extra[3], Headroom[3], MinHeadroom = INT_MAX, Baseload = 0;
+        uint8_t PhaseEVSE[3] = {0, 0, 0};
+
+        Isum = Imax = Draw = 0;
+        for (p = 0; p < 3; p++) {
+            Irms[p] = c.Base[p];
+            for (n = 0; n < 2; n++) if (c.Mask[n] & (1 << p)) {
+                Irms[p] += Balanced[n];
+                PhaseEVSE[p]++;
+            }
+            Isum += Irms[p];
+            Imax = max(Imax, Irms[p]);
+            Baseload = max(Baseload, c.Base[p]);
+        }
+        for (n = 0; n < 2; n++) Draw += Balanced[n];
+
+        // Headroom and Extra per phase, then the Smart mode correction and the guards
+        for (p = 0; p < 3; p++) {
+            Headroom[p] = c.MaxMains * 10 - c.Base[p];
+            MinHeadroom = min(MinHeadroom, Headroom[p]);
+        }
+        for (p = 0; p < 3; p++) Extra[p] = Headroom[p] - MinHeadroom;
+        int Idifference = c.MaxMains * 10 - Imax;
+        if (c.MaxSumMains) Idifference = min(Idifference, (c.MaxSumMains * 10 - Isum) / 3);
+        IsetBalanced += Idifference;
+        IsetBalanced = min(IsetBalanced, c.MaxMains * 10 - Baseload);
+        if (c.GridRelay) IsetBalanced = min(IsetBalanced, c.GridRelay * 10 / 3);
+        if (c.MaxSumMains || c.GridRelay) {
+            int Budget = INT_MAX;
+            if (c.MaxSumMains) Budget = c.MaxSumMains * 10 - (c.Base[0] + c.Base[1] + c.Base[2]);
+            if (c.GridRelay) Budget = min(Budget, c.GridRelay * 10);
+            LimitPhaseExtra(Extra, PhaseEVSE, IsetBalanced, Budget);
+        }
+
+        // Every EV gets what is left on the tightest of its phases
+        int Capacity[3];
+        uint16_t Weight[3];
+        for (p = 0; p < 3; p++) {
+            Capacity[p] = IsetBalanced + Extra[p];
+            Weight[p] = PhaseEVSE[p];
+        }
+        for (n = 0; n < 2; n++) Balanced[n] = max(60, min(c.BalancedMax, PhaseShare(Capacity, Weight, c.Mask[n], 1)));
+    }
+
+    int errors = 0;
+    if (Imax > c.MaxMains * 10) errors++;
+    if (c.MaxSumMains && Isum > c.MaxSumMains * 10) errors++;
+    if (c.GridRelay && Draw > c.GridRelay * 10) errors++;
+    printf("%-40s EVs %3d + %3d dA, Imax %3d dA, Isum %3d dA: %s\n", c.Name, Balanced[0], Balanced[1], Imax, Isum,
+           errors ? "FAILED" : "ok");
+    return errors;
+}
+
+int main() {
+    static const Case Cases[] = {
+        // The EVs on L2 and L3 could each take 16 A, that is 15 + 16 + 16 = 47 A on the sum
+        { "MaxSumMains 30 A, EVs on L2 and L3",       25, 30,  0, {150,   0,   0}, {0x02, 0x04}, 160 },
+        { "MaxSumMains 40 A, EVs on L2 and L3",       25, 40,  0, {150,  20,   0}, {0x02, 0x04}, 160 },
+        { "MaxSumMains 30 A, EVs on L1 and L2",       25, 30,  0, {150,   0,   0}, {0x01, 0x02}, 160 },
+        { "GridRelay 20 A, EVs on L2 and L3",         25,  0, 20, {150,   0,   0}, {0x02, 0x04}, 160 },
+        { "no sum limit, EVs on L2 and L3",           25,  0,  0, {150,   0,   0}, {0x02, 0x04}, 160 },
+    };
+    int errors = 0;
+
+    for (const Case &c : Cases) errors += run(c);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Stand-in site coordinator: divides the site current over the SmartEVSE groups (site_role=1)
+# the same way a SmartEVSE with site_role=2 does.
+
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 site-current-per-phase-in-A [mosquitto-host]"
+    echo ""
+    echo "Make sure the SmartEVSEs you are testing use this mosquitto server."
+    exit 1
+fi
+
+BUDGET=$(( $1 * 10 ))
+HOST=${2:-127.0.0.1}
+TOPIC="SmartEVSE/Site"
+TIMEOUT=10
+
+declare -A MIN MAX SEEN ALLOT
+ORDER=()
+
+divide() {
+    local now=$(date +%s) left=$BUDGET id open share add keep=()
+    for id in "${ORDER[@]}"; do
+        if (( now - SEEN[$id] < TIMEOUT )); then keep+=("$id"); else unset MIN[$id] MAX[$id] SEEN[$id]; fi
+    done
+    ORDER=("${keep[@]}")
+    for id in "${ORDER[@]}"; do
+        ALLOT[$id]=$(( left < MIN[$id] ? left : MIN[$id] ))
+        left=$(( left - ALLOT[$id] ))
+    done
+    while (( left > 0 )); do
+        open=0
+        for id in "${ORDER[@]}"; do (( ALLOT[$id] < MAX[$id] )) && open=$(( open + 1 )); done
+        (( open == 0 || left < open )) && break
+        share=$(( left / open ))
+        for id in "${ORDER[@]}"; do
+            if (( ALLOT[$id] < MAX[$id] )); then
+                add=$(( MAX[$id] - ALLOT[$id] ))
+                (( add > share )) && add=$share
+                ALLOT[$id]=$(( ALLOT[$id] + add ))
+                left=$(( left - add ))
+            fi
+        done
+    done
+    for id in "${ORDER[@]}"; do
+        mosquitto_pub -h "$HOST" -t "$TOPIC/Allotment/$id" -m "${ALLOT[$id]}"
+        echo "Group $id: demand ${MIN[$id]}-${MAX[$id]} dA, allotment ${ALLOT[$id]} dA"
+    done
+}
+
+mosquitto_sub -h "$HOST" -v -t "$TOPIC/Demand/+" | while read -r topic demand; do
+    id=${topic##*/}
+    [ -z "${SEEN[$id]}" ] && ORDER+=("$id")
+    MIN[$id]=${demand%%:*}
+    MAX[$id]=${demand##*:}
+    (( MAX[$id] < MIN[$id] )) && MAX[$id]=${MIN[$id]}
+    SEEN[$id]=$(date +%s)
+    divide
+done